@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+/*
+    Public API of libriscvemu.
+
+    A Machine is one isolated RV32 guest: its own memory, registers and syscall table.
+    Machines share nothing, so independent instances may run on different threads.
+*/
+namespace riscvemu
+{
+
+struct MachineConfig
+{
+    uint32_t memory_size = 100 * 1024 * 1024;
+    uint32_t stack_size = 2 * 1024 * 1024;
+    std::vector<std::string> argv; // argv[0] defaults to the path of the executable
+    std::vector<std::string> envp;  // KEY=VALUE strings, the host environment is not passed on
+    bool decode_cache = true; // false forces the reference interpreter
+    bool fusion = true;       // execute common instruction pairs as one superinstruction
+    bool host_libc = false;   // run memcpy, memmove, memset, strlen and memcmp found in the ELF symbols on the host
+    std::string aot_cache;    // directory caching predecoded executables across runs, empty disables it
+    std::string sysroot;      // guest root directory for the dynamic linker and files the guest opens, empty allows none
+    uint32_t load_base = 0x10000; // where position independent executables are loaded
+    bool virtual_time = false;    // guest clocks follow retired instructions and getrandom is seeded, runs repeat exactly
+    int stdin_fd = 0;             // host fds behind the guest's standard streams
+    int stdout_fd = 1;
+    int stderr_fd = 2;
+    bool cooperative = false;     // syscalls that would block stop run with StopReason::blocked, see Scheduler
+    uint32_t vlen = 128;          // bits per vector register, a power of two from 32 to 4096
+};
+
+struct SyscallRequest
+{
+    uint32_t number; // a7
+    uint32_t args[6]; // a0 - a5
+};
+
+struct SyscallResult
+{
+    uint32_t value; // written to a0, or the exit code when exit is set
+    bool exit;
+};
+
+class Machine;
+
+using SyscallHandler = std::function<SyscallResult(Machine &machine, const SyscallRequest &request)>;
+
+enum class StopReason
+{
+    exited,
+    budget_exhausted,
+    faulted, // illegal instruction, access outside guest memory, EBREAK or an unsupported syscall
+    blocked  // cooperative only, the guest waits for get_blocked_on and the next run retries the syscall
+};
+
+// What a blocked guest waits for
+struct BlockedOn
+{
+    int fd = -1;           // host fd, -1 when only the deadline matters
+    bool writable = false; // waits for room to write instead of data to read
+    int64_t deadline_ns = -1; // host CLOCK_MONOTONIC, -1 for none
+};
+
+// Memory of one machine beyond the pages it shares, see Machine::compress_memory
+struct MemoryStats
+{
+    uint32_t private_pages = 0;    // resident pages only this machine references
+    uint32_t compressed_pages = 0; // pages held compressed right now
+    uint64_t compressed_bytes = 0; // their compressed size
+    double compression_ratio = 0;  // uncompressed to compressed size of all pages compressed so far, 0 for none
+    uint64_t page_faults = 0;      // compressed pages decompressed on their first access
+    uint64_t page_fault_ns = 0;    // total time spent in them
+    uint64_t max_page_fault_ns = 0;
+};
+
+class Machine
+{
+  public:
+    explicit Machine(const MachineConfig &config = {});
+    ~Machine();
+
+    Machine(Machine &&other) noexcept;
+    Machine &operator=(Machine &&other) noexcept;
+
+    // Loads an executable and points the pc at its entry, throws std::invalid_argument if it is not an RV32 ELF
+    void load_elf(const std::string &file_path);
+    void load_elf(std::span<const uint8_t> image);
+
+    // Continues from a checkpoint instead of an executable. memory_size must be the saving machine's,
+    // files the guest had open are reopened below sysroot. Throws std::runtime_error when path is no
+    // checkpoint, std::logic_error when a guest is loaded already.
+    void load_checkpoint(const std::string &path);
+
+    // Writes the complete guest state to path: registers, memory, break, open files and a syscall that
+    // blocked. Untouched and all zero pages are left out and a loading machine reads the others from the
+    // file on their first access, so starting from a checkpoint is cheap. Throws std::runtime_error
+    // when path cannot be written.
+    void save_checkpoint(const std::string &path);
+
+    // Replaces the built-in Linux handling of one syscall number
+    void register_syscall(uint32_t number, SyscallHandler handler);
+
+    // Folds pages identical to those of other machines in this process onto shared copy on write
+    // frames, and all zero pages onto one zero page. load_elf already does this for the loaded image,
+    // long running guests may call it again once they are idle. Returns the pages given back to the host.
+    uint32_t share_memory();
+
+    // Compresses the pages only this machine references and gives their memory back to the host, a
+    // page is decompressed on the next access to it. Meant for guests that are suspended or idle for a
+    // while, the Scheduler does this for guests blocked longer than its threshold. Returns the pages
+    // given back to the host.
+    uint32_t compress_memory();
+
+    MemoryStats get_memory_stats() const;
+
+    // Takes the children a guest starts with clone, fork or posix_spawn, to run them e.g. on a
+    // Scheduler. They are copies of the machine and inherit the spawner, pipes between them stay in
+    // this process. Without a spawner those syscalls fail with ENOSYS. execve needs none, the machine
+    // replaces its own guest with an executable below sysroot.
+    using Spawner = std::function<void(Machine child)>;
+    void set_spawner(Spawner spawner);
+
+    // Returns a child continuing from the current state, with the same syscall handlers.
+    // Memory is shared copy on write, so forking costs page table bookkeeping only,
+    // and the two machines may then run on different threads.
+    Machine fork();
+
+    // Executes until the guest exits or max_instructions have retired
+    StopReason run(uint64_t max_instructions = UINT64_MAX);
+    StopReason step();
+
+    bool has_exited() const;
+
+    // Valid after run returned StopReason::blocked
+    BlockedOn get_blocked_on() const;
+    uint32_t get_exit_code() const;
+
+    // Describes why the last run faulted, empty if it did not
+    const std::string &get_fault() const;
+    uint64_t get_instructions_retired() const;
+
+    // Register 0 reads as zero, writes to it are ignored
+    uint32_t get_register(uint8_t index) const;
+    void set_register(uint8_t index, uint32_t value);
+    uint32_t get_pc() const;
+
+    // Also makes a machine without a loaded executable runnable, e.g. for code written with write_memory
+    void set_pc(uint32_t pc);
+
+    // Both throw std::out_of_range if the range is outside guest memory or touches its first page,
+    // which stays unmapped to catch null pointers
+    void read_memory(uint32_t addr, std::span<uint8_t> out) const;
+    void write_memory(uint32_t addr, std::span<const uint8_t> data);
+
+  private:
+    struct Impl;
+
+    explicit Machine(std::unique_ptr<Impl> impl);
+
+    std::unique_ptr<Impl> impl;
+};
+
+} // namespace riscvemu
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "machine.hpp"
+#include <chrono>
+#include <functional>
+#include <memory>
+
+namespace riscvemu
+{
+
+/*
+    Runs many guests on a few host threads.
+
+    Every spawned Machine becomes a coroutine on one of the worker threads. It runs for a time slice
+    and is suspended when the slice is used up or when the guest blocks, e.g. on a read of an empty
+    pipe. A blocked guest waits in the worker's epoll set, or for its timer when it sleeps, and costs
+    nothing but its memory until its fd is ready. Machines must be configured cooperative, otherwise a
+    blocking syscall blocks the whole worker.
+
+    Guests may start others with clone and execve, the children are spawned here as well, and pipes
+    between them are ring buffers in this process. A guest blocked on one of those waits on an
+    eventfd the other side signals, so a whole pipeline of guests runs on the workers without a
+    host pipe.
+
+    With a compression threshold, a guest that stays blocked for longer gets its memory compressed,
+    see Machine::compress_memory, so a host can hold far more idle guests than its RAM would allow.
+*/
+class Scheduler
+{
+  public:
+    // Called on a worker thread when the guest exited or faulted
+    using ExitHandler = std::function<void(Machine &machine, StopReason reason)>;
+
+    // Guests blocked for longer than compress_after get their memory compressed, zero never does
+    explicit Scheduler(unsigned threads = 1, std::chrono::milliseconds compress_after = std::chrono::milliseconds::zero());
+    ~Scheduler();
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    // Thread safe, exit handlers may spawn while run is going. The machine must have an executable loaded.
+    void spawn(Machine machine, ExitHandler on_exit = {});
+
+    // Runs the guests until all of them finished, the calling thread is one of the workers.
+    // Rethrows the first exception a guest's run threw once the others finished.
+    void run();
+
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+} // namespace riscvemu
@@ -0,0 +1,159 @@
+#include "aot-image.hpp"
+#include "../libc-intercepts/libc-intercepts.hpp"
+#include "../riscv-emulator/decoder.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+static_assert(std::is_trivially_copyable_v<DecodeCache::Entry>, "translations are stored as raw bytes");
+
+static constexpr char magic[8] = {'R', 'V', 'E', 'M', 'U', 'A', 'O', 'T'};
+static constexpr uint32_t format_version = 2; // bump whenever Op or DecodedInstruction change
+
+std::shared_ptr<const AotImage> AotImage::load(Mmu &mmu, const ElfLoader &elf_loader, const SymbolTable &symbols,
+                                               const std::string &cache_dir)
+{
+    const TextRange &text = elf_loader.get_text();
+    if (text.begin == text.end)
+    {
+        return nullptr;
+    }
+
+    std::ostringstream name;
+    name << std::hex << elf_loader.get_image_hash() << ".rvaot";
+    const std::string path = (std::filesystem::path(cache_dir) / name.str()).string();
+
+    std::unique_ptr<AotImage> image = map(path, elf_loader.get_image_hash(), text);
+    if (image != nullptr)
+    {
+        image->cached = true;
+        return image;
+    }
+
+    std::vector<DecodeCache::Entry> entries = translate(mmu, text, symbols);
+
+    // written under a private name and renamed, concurrent runs of the same executable never see half a file
+    std::error_code error;
+    std::filesystem::create_directories(cache_dir, error);
+    const std::string temporary = path + '.' + std::to_string(getpid()) + ".tmp";
+    {
+        Header header{
+            .magic = {},
+            .version = format_version,
+            .entry_size = sizeof(DecodeCache::Entry),
+            .image_hash = elf_loader.get_image_hash(),
+            .text_begin = text.begin,
+            .entry_count = (uint32_t)entries.size()};
+        memcpy(header.magic, magic, sizeof(magic));
+
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)entries.data(), entries.size() * sizeof(DecodeCache::Entry));
+        if (file.good())
+        {
+            file.close();
+            std::filesystem::rename(temporary, path, error);
+        }
+        else
+        {
+            std::filesystem::remove(temporary, error);
+        }
+    }
+
+    image = map(path, elf_loader.get_image_hash(), text);
+    if (image == nullptr)
+    {
+        // an unwritable cache only costs the next run its warm start
+        image.reset(new AotImage());
+        image->text_begin = text.begin;
+        image->entry_count = entries.size();
+        image->owned = std::move(entries);
+        image->entries = image->owned.data();
+    }
+
+    return image;
+}
+
+AotImage::~AotImage()
+{
+    if (mapping != nullptr)
+    {
+        munmap(mapping, mapping_size);
+    }
+}
+
+std::vector<DecodeCache::Entry> AotImage::translate(Mmu &mmu, const TextRange &text, const SymbolTable &symbols)
+{
+    const LibcIntercepts intercepts(symbols, LibcIntercepts::Mode::host);
+
+    std::vector<DecodeCache::Entry> entries((text.end - text.begin) / sizeof(uint32_t));
+    for (uint32_t i = 0; i < entries.size(); ++i)
+    {
+        const uint32_t pc = text.begin + i * sizeof(uint32_t);
+        DecodeCache::Entry &entry = entries[i];
+        entry.pc = pc;
+        entry.inst = mmu.read<uint32_t>(pc);
+        entry.single = decode(entry.inst, pc);
+
+        // the emulator runs these on the host when intercepts are attached, on the interpreter otherwise
+        if (intercepts.find(pc) != nullptr)
+        {
+            entry.single.op = Op::host_call;
+        }
+        else if (i + 1 < entries.size())
+        {
+            entry.next_inst = mmu.read<uint32_t>(pc + sizeof(uint32_t));
+            entry.fused = fuse(entry.single, decode(entry.next_inst, pc + sizeof(uint32_t)));
+        }
+    }
+
+    return entries;
+}
+
+std::unique_ptr<AotImage> AotImage::map(const std::string &path, uint64_t image_hash, const TextRange &text)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat file_stat = {};
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 && (size_t)file_stat.st_size >= sizeof(Header))
+    {
+        mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<AotImage> image(new AotImage());
+    image->mapping = mapping;
+    image->mapping_size = file_stat.st_size;
+
+    // a mismatch is a file from another build or another executable, it gets translated again
+    const Header &header = *(const Header *)mapping;
+    const uint32_t expected_count = (text.end - text.begin) / sizeof(uint32_t);
+    if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != format_version ||
+        header.entry_size != sizeof(DecodeCache::Entry) || header.image_hash != image_hash ||
+        header.text_begin != text.begin || header.entry_count != expected_count ||
+        image->mapping_size != sizeof(Header) + (size_t)header.entry_count * sizeof(DecodeCache::Entry))
+    {
+        return nullptr;
+    }
+
+    image->text_begin = header.text_begin;
+    image->entry_count = header.entry_count;
+    image->entries = (const DecodeCache::Entry *)((const uint8_t *)mapping + sizeof(Header));
+    return image;
+}
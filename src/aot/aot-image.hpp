@@ -0,0 +1,83 @@
+#pragma once
+
+#include "../elf-loader/elf-loader.hpp"
+#include "../elf-loader/symbol-table.hpp"
+#include "../mmu/mmu.hpp"
+#include "../riscv-emulator/decode-cache.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+    Ahead of time translation of an executable's text.
+
+    There is no native code generator behind the fast path, so translating means doing the decode
+    cache's work once for the whole program: every word of the executable segments is decoded, fused
+    with its successor where possible, and libc entry points are marked for host calls. The table is
+    stored in a file named after the hash of the ELF image and mapped read only by later runs, which
+    then start with every instruction already decoded.
+
+    The fast path looks pcs inside the text up directly and leaves everything else, e.g. JALR targets
+    outside it, to the decode cache. Entries carry the instruction words they were decoded from, so
+    code patched at run time never executes from a stale translation.
+*/
+class AotImage
+{
+  public:
+    // Maps the translation of the executable elf_loader just loaded from cache_dir, translating and
+    // storing it first when the cache has none. Returns nullptr for an executable without text.
+    static std::shared_ptr<const AotImage> load(Mmu &mmu, const ElfLoader &elf_loader, const SymbolTable &symbols,
+                                                const std::string &cache_dir);
+
+    ~AotImage();
+
+    AotImage(const AotImage &) = delete;
+    AotImage &operator=(const AotImage &) = delete;
+
+    // Returns the entry decoded for pc, or nullptr outside the text
+    const DecodeCache::Entry *find(uint32_t pc) const
+    {
+        const uint32_t index = (pc - text_begin) / sizeof(uint32_t);
+        return pc % sizeof(uint32_t) == 0 && index < entry_count ? entries + index : nullptr;
+    }
+
+    // True when the table came from the cache instead of being translated in this run
+    bool is_cached() const
+    {
+        return cached;
+    }
+
+    uint32_t size() const
+    {
+        return entry_count;
+    }
+
+  private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+        uint64_t image_hash;
+        uint32_t text_begin;
+        uint32_t entry_count;
+    };
+
+    AotImage() = default;
+
+    static std::vector<DecodeCache::Entry> translate(Mmu &mmu, const TextRange &text, const SymbolTable &symbols);
+
+    // Maps path when it holds a valid translation of the image, returns nullptr otherwise
+    static std::unique_ptr<AotImage> map(const std::string &path, uint64_t image_hash, const TextRange &text);
+
+  private:
+    uint32_t text_begin = 0;
+    uint32_t entry_count = 0;
+    const DecodeCache::Entry *entries = nullptr;
+    bool cached = false;
+
+    void *mapping = nullptr; // the whole file, when the table is mapped
+    size_t mapping_size = 0;
+    std::vector<DecodeCache::Entry> owned; // the table, when the cache could not be written
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+    The machine state inside a checkpoint.
+
+    Every component appends its state to a CheckpointWriter and reads it back in the same order from a
+    CheckpointReader, the format is the order of the calls. Values are stored in host byte order,
+    checkpoints move between little endian hosts. Guest pages do not go through the byte stream, the
+    writer only collects their frames, so they reach the file straight from guest memory.
+*/
+class CheckpointWriter
+{
+  public:
+    template <typename T>
+    void write(const T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "values are stored as raw bytes");
+        const size_t offset = state.size();
+        state.resize(offset + sizeof(T));
+        memcpy(state.data() + offset, &value, sizeof(T));
+    }
+
+    void write_string(const std::string &text)
+    {
+        write((uint32_t)text.size());
+        state.insert(state.end(), text.begin(), text.end());
+    }
+
+    void write_bytes(std::span<const uint8_t> bytes)
+    {
+        write((uint32_t)bytes.size());
+        state.insert(state.end(), bytes.begin(), bytes.end());
+    }
+
+    // The frame must stay unchanged until the checkpoint is written
+    void add_page(uint32_t page, const uint8_t *frame)
+    {
+        pages.emplace_back(page, frame);
+    }
+
+    const std::vector<uint8_t> &get_state() const
+    {
+        return state;
+    }
+
+    const std::vector<std::pair<uint32_t, const uint8_t *>> &get_pages() const
+    {
+        return pages;
+    }
+
+  private:
+    std::vector<uint8_t> state;
+    std::vector<std::pair<uint32_t, const uint8_t *>> pages; // page number, frame
+};
+
+class CheckpointReader
+{
+  public:
+    explicit CheckpointReader(std::span<const uint8_t> state) : state(state) {}
+
+    // Throws std::runtime_error past the end of the state
+    template <typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "values are stored as raw bytes");
+        T value;
+        memcpy(&value, take(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    std::string read_string()
+    {
+        const std::span<const uint8_t> bytes = take(read<uint32_t>());
+        return std::string(bytes.begin(), bytes.end());
+    }
+
+    std::vector<uint8_t> read_bytes()
+    {
+        const std::span<const uint8_t> bytes = take(read<uint32_t>());
+        return std::vector<uint8_t>(bytes.begin(), bytes.end());
+    }
+
+  private:
+    std::span<const uint8_t> take(size_t size)
+    {
+        if (size > state.size())
+        {
+            throw std::runtime_error("Checkpoint state is truncated");
+        }
+
+        const std::span<const uint8_t> bytes = state.first(size);
+        state = state.subspan(size);
+        return bytes;
+    }
+
+  private:
+    std::span<const uint8_t> state;
+};
@@ -0,0 +1,203 @@
+#include "checkpoint.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+static constexpr char magic[8] = {'R', 'V', 'E', 'M', 'U', 'C', 'K', 'P'};
+static constexpr uint32_t format_version = 6; // bump whenever a save_state changes
+
+// Writes all of buffers, writev stops short on pipes and sockets and takes at most IOV_MAX at once
+static void write_all(int fd, std::vector<iovec> &buffers)
+{
+    size_t first = 0;
+    while (first < buffers.size())
+    {
+        const int count = std::min<size_t>(buffers.size() - first, IOV_MAX);
+        const ssize_t written = writev(fd, buffers.data() + first, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::runtime_error(std::string("Cannot write checkpoint: ") + strerror(errno));
+        }
+
+        size_t left = written;
+        while (first < buffers.size() && buffers[first].iov_len <= left)
+        {
+            left -= buffers[first].iov_len;
+            ++first;
+        }
+        if (left != 0)
+        {
+            buffers[first].iov_base = (uint8_t *)buffers[first].iov_base + left;
+            buffers[first].iov_len -= left;
+        }
+    }
+}
+
+void Checkpoint::save(const std::string &path, RiscvEmulator &emulator, Mmu &mmu)
+{
+    // written under a private name and renamed, a reader never maps half a checkpoint
+    const std::string temporary = path + '.' + std::to_string(getpid()) + ".tmp";
+    const int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot create " + temporary + ": " + strerror(errno));
+    }
+
+    try
+    {
+        write(fd, emulator, mmu);
+    }
+    catch (...)
+    {
+        close(fd);
+        unlink(temporary.c_str());
+        throw;
+    }
+
+    if (close(fd) != 0 || std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        const std::string error = strerror(errno);
+        unlink(temporary.c_str());
+        throw std::runtime_error("Cannot write " + path + ": " + error);
+    }
+}
+
+void Checkpoint::write(int fd, RiscvEmulator &emulator, Mmu &mmu)
+{
+    CheckpointWriter writer;
+    emulator.save_state(writer);
+    mmu.save_state(writer);
+
+    const std::vector<uint8_t> &state = writer.get_state();
+    const auto &pages = writer.get_pages();
+    std::vector<uint32_t> index;
+    index.reserve(pages.size());
+    for (const auto &[page, frame] : pages)
+    {
+        index.push_back(page);
+    }
+
+    const uint64_t unaligned = sizeof(Header) + state.size() + index.size() * sizeof(uint32_t);
+    const uint64_t pages_offset = (unaligned + Mmu::page_size - 1) & ~(uint64_t)(Mmu::page_size - 1);
+    if (pages_offset + (uint64_t)pages.size() * Mmu::page_size > UINT32_MAX)
+    {
+        throw std::runtime_error("Checkpoint would exceed 4 GiB");
+    }
+
+    Header header{
+        .magic = {},
+        .version = format_version,
+        .page_size = Mmu::page_size,
+        .memory_size = mmu.size(),
+        .page_count = (uint32_t)pages.size(),
+        .state_size = (uint32_t)state.size(),
+        .pages_offset = (uint32_t)pages_offset};
+    memcpy(header.magic, magic, sizeof(magic));
+    const std::vector<uint8_t> padding(pages_offset - unaligned);
+
+    std::vector<iovec> buffers;
+    buffers.reserve(4 + pages.size());
+    buffers.push_back(iovec{&header, sizeof(header)});
+    buffers.push_back(iovec{(void *)state.data(), state.size()});
+    buffers.push_back(iovec{index.data(), index.size() * sizeof(uint32_t)});
+    buffers.push_back(iovec{(void *)padding.data(), padding.size()});
+    for (const auto &[page, frame] : pages)
+    {
+        buffers.push_back(iovec{(void *)frame, Mmu::page_size});
+    }
+
+    write_all(fd, buffers);
+}
+
+void Checkpoint::load(const std::string &path, RiscvEmulator &emulator, Mmu &mmu)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    }
+
+    struct stat file_stat = {};
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || (uint64_t)file_stat.st_size < sizeof(Header) ||
+        (uint64_t)file_stat.st_size > UINT32_MAX)
+    {
+        close(fd);
+        throw std::runtime_error(path + " is not a checkpoint");
+    }
+
+    // the mapping keeps the file alive, the fd is not needed any more
+    std::shared_ptr<GuestMemory> image;
+    try
+    {
+        image = std::make_shared<GuestMemory>(fd, (uint32_t)file_stat.st_size);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    Header header;
+    memcpy(&header, image->data(), sizeof(header));
+    const uint64_t index_offset = sizeof(Header) + (uint64_t)header.state_size;
+    if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != format_version ||
+        header.page_size != Mmu::page_size || header.pages_offset % Mmu::page_size != 0 ||
+        index_offset + (uint64_t)header.page_count * sizeof(uint32_t) > header.pages_offset ||
+        header.pages_offset + (uint64_t)header.page_count * Mmu::page_size != image->size())
+    {
+        throw std::runtime_error(path + " is not a checkpoint of this version");
+    }
+    if (header.memory_size != mmu.size())
+    {
+        throw std::invalid_argument(path + " needs " + std::to_string(header.memory_size) + " bytes of guest memory");
+    }
+
+    CheckpointReader reader(std::span(image->data() + sizeof(Header), header.state_size));
+    emulator.load_state(reader);
+    mmu.load_state(reader);
+
+    // runs of consecutive pages are mapped in one go
+    const uint8_t *index = image->data() + index_offset;
+    uint32_t previous = 0;
+    uint32_t run_begin = 0;
+    for (uint32_t i = 0; i <= header.page_count; ++i)
+    {
+        uint32_t page = 0;
+        if (i < header.page_count)
+        {
+            memcpy(&page, index + i * sizeof(uint32_t), sizeof(page));
+            if ((i != 0 && page <= previous) || page == 0 || page >= mmu.size() / Mmu::page_size)
+            {
+                throw std::runtime_error(path + " has a corrupt page index");
+            }
+            if (i != 0 && page == previous + 1)
+            {
+                previous = page;
+                continue;
+            }
+        }
+
+        if (i != 0)
+        {
+            uint32_t first_page;
+            memcpy(&first_page, index + run_begin * sizeof(uint32_t), sizeof(first_page));
+            mmu.map_region(first_page * Mmu::page_size, image, header.pages_offset + run_begin * Mmu::page_size,
+                           (i - run_begin) * Mmu::page_size);
+        }
+        run_begin = i;
+        previous = page;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "../mmu/mmu.hpp"
+#include "../riscv-emulator/riscv-emulator.hpp"
+#include <string>
+
+/*
+    Complete machine state in a file, to move a guest to another process or host, or to start many
+    instances from one that already ran its expensive initialization.
+
+    File layout, version 6:
+
+        header       "RVEMUCKP" magic, version, page size, memory size, page count, state size, pages offset
+        state        the CheckpointWriter stream: registers, pc and instruction count, vector registers,
+                     the fd table with the contents of its pipes, clock and a syscall that blocked, the
+                     SIGPIPE handler, then the break, the mapping floor and the unmapped ranges
+        page index   u32 number of every stored page, ascending
+        padding      zeros up to pages offset, a multiple of the page size
+        pages        the stored pages, page size bytes each
+
+    Pages that are all zero are left out. The file is written front to back with writev and guest
+    pages go straight from their frames, so nothing is buffered and the output may as well be a
+    pipe. The loader maps the pages area read only and hands it to the Mmu as copy on write frames:
+    a page is read from the file when the guest first touches it, and every instance started from
+    the same checkpoint shares the untouched ones through the host page cache.
+
+    Decoded instructions, AOT images, libc intercepts and syscall handlers are not saved, they belong
+    to the host process.
+*/
+class Checkpoint
+{
+  public:
+    // Written to a temporary name and renamed, throws std::runtime_error when path cannot be written
+    static void save(const std::string &path, RiscvEmulator &emulator, Mmu &mmu);
+
+    // Streams the checkpoint to fd, e.g. a pipe or socket, throws std::runtime_error when a write fails
+    static void write(int fd, RiscvEmulator &emulator, Mmu &mmu);
+
+    // Continues from path on a fresh emulator and its Mmu, which must be of the checkpoint's memory size.
+    // Throws std::runtime_error when path is no readable checkpoint of this version, std::invalid_argument
+    // when the memory size differs.
+    static void load(const std::string &path, RiscvEmulator &emulator, Mmu &mmu);
+
+  private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t page_size;
+        uint32_t memory_size;
+        uint32_t page_count;
+        uint32_t state_size;
+        uint32_t pages_offset;
+    };
+};
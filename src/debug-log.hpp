@@ -0,0 +1,30 @@
+#pragma once
+
+#include <iostream>
+
+/*
+    Verbose per-instruction and per-access logging to stderr.
+    It is only emitted in builds with RISCV_EMULATOR_DEBUG_LOG, otherwise every
+    debug_log << ... statement is an empty inline call and compiles to nothing.
+*/
+struct DebugLog
+{
+    template <typename T>
+    const DebugLog &operator<<(const T &value) const
+    {
+#ifdef RISCV_EMULATOR_DEBUG_LOG
+        std::cerr << value;
+#endif
+        return *this;
+    }
+
+    const DebugLog &operator<<(std::ostream &(*manipulator)(std::ostream &)) const
+    {
+#ifdef RISCV_EMULATOR_DEBUG_LOG
+        std::cerr << manipulator;
+#endif
+        return *this;
+    }
+};
+
+inline constexpr DebugLog debug_log;
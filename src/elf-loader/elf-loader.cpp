@@ -1,16 +1,44 @@
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 
+#include "../debug-log.hpp"
 #include "elf-loader.hpp"
+#include <cstring>
 
-uint32_t ElfLoader::load(const std::string &file_path)
+static constexpr uint32_t page_mask = Mmu::page_size - 1;
+
+static uint32_t page_round_up(uint32_t addr)
+{
+    return (addr + page_mask) & ~page_mask;
+}
+
+uint32_t ElfLoader::load(const std::string &file_path, uint32_t load_base)
+{
+    const SharedObjectCache::File file = SharedObjectCache::instance().get(file_path);
+    return load_image(std::span(file.memory->data(), file.size), load_base, file.memory);
+}
+
+uint32_t ElfLoader::load(std::span<const uint8_t> file_data, uint32_t load_base)
+{
+    return load_image(file_data, load_base, nullptr);
+}
+
+uint32_t ElfLoader::load_image(std::span<const uint8_t> file_data, uint32_t load_base, std::shared_ptr<GuestMemory> shared)
 {
-    auto file_data = load_file(file_path);
+    if (file_data.size() < sizeof(Elf32_Ehdr) || memcmp(file_data.data(), ELFMAG, SELFMAG) != 0 ||
+        file_data[EI_CLASS] != ELFCLASS32)
+    {
+        return 0;
+    }
+
     ElfParser elf_parser(file_data);
 
     auto elf_header = elf_parser.parse_elf_header();
-    std::cout << "Elf Header\n"
+    debug_log << "Elf Header\n"
               << elf_header << '\n';
 
     if (elf_header.architecture != EM_RISCV)
@@ -18,40 +46,210 @@ uint32_t ElfLoader::load(const std::string &file_path)
         return 0;
     }
 
-    std::cout << "Loading segments\n";
+    image_hash = 0xcbf29ce484222325;
+    for (uint8_t byte : file_data)
+    {
+        image_hash = (image_hash ^ byte) * 0x100000001b3;
+    }
+
     auto segments = elf_parser.parse_segments();
+
+    // a position independent image moves as a whole, its lowest page goes to load_base
+    position_independent = elf_header.type == ET_DYN;
+    uint32_t bias = 0;
+    if (position_independent)
+    {
+        uint32_t lowest = UINT32_MAX;
+        for (const Segment &segment : segments)
+        {
+            if (segment.type == PT_LOAD)
+            {
+                lowest = std::min(lowest, segment.virtual_address & ~page_mask);
+            }
+        }
+        bias = lowest == UINT32_MAX ? 0 : (load_base & ~page_mask) - lowest;
+    }
+
+    debug_log << "Loading segments\n";
+    load_segments(file_data, segments, bias, shared);
+
+    program_headers = ProgramHeaders{.count = elf_header.num_program_headers};
+    for (const Segment &segment : segments)
+    {
+        const uint32_t offset = elf_header.program_header_offset;
+        if (segment.type == PT_PHDR)
+        {
+            program_headers.addr = segment.virtual_address + bias;
+            break;
+        }
+        if (segment.type == PT_LOAD && offset >= segment.file_offset && offset - segment.file_offset < segment.file_size)
+        {
+            program_headers.addr = segment.virtual_address + bias + offset - segment.file_offset;
+        }
+    }
+
+    symbols = elf_parser.parse_symbols();
+    for (Symbol &symbol : symbols)
+    {
+        if (symbol.value != 0 && !symbol.absolute)
+        {
+            symbol.value += bias;
+        }
+    }
+
+    program_entry = elf_header.entry_point + bias;
+    interpreter_base = 0;
+
+    for (const Segment &segment : segments)
+    {
+        if (segment.type == PT_INTERP)
+        {
+            if ((uint64_t)segment.file_offset + segment.file_size > file_data.size() || segment.file_size == 0)
+            {
+                throw std::invalid_argument("PT_INTERP exceeds the ELF image");
+            }
+            const char *name = (const char *)file_data.data() + segment.file_offset;
+            return load_interpreter(std::string(name, strnlen(name, segment.file_size)));
+        }
+    }
+
+    if (bias != 0)
+    {
+        relocate(segments, bias);
+    }
+
+    return program_entry;
+}
+
+void ElfLoader::load_segments(std::span<const uint8_t> file_data, const std::vector<Segment> &segments, uint32_t bias,
+                              const std::shared_ptr<GuestMemory> &shared)
+{
+    text = TextRange{};
+    uint32_t loaded_end = 0;
     for (const Segment &segment : segments)
     {
-        if (segment.type == PT_LOAD)
+        if (segment.type != PT_LOAD)
         {
-            std::cout << segment << '\n';
+            continue;
+        }
 
-            const uint8_t *segment_begin = file_data.data() + segment.file_offset;
-            const uint8_t *segment_end = segment_begin + segment.file_size;
-            uint32_t remainder = segment.mem_size % segment.align;
-            uint32_t aligned_size = segment.mem_size + segment.align - remainder;
+        debug_log << segment << '\n';
 
-            mmu.allocate(aligned_size, segment.virtual_address);
-            mmu.write_from(segment.virtual_address, segment_begin, segment_end);
+        if ((uint64_t)segment.file_offset + segment.file_size > file_data.size() || segment.file_size > segment.mem_size)
+        {
+            throw std::invalid_argument("Segment exceeds the ELF image");
+        }
+
+        const uint32_t address = segment.virtual_address + bias;
+        if ((uint64_t)address + segment.mem_size > mmu.size())
+        {
+            throw std::invalid_argument("Segment does not fit into guest memory");
         }
+
+        // whole pages, a segment starting in the last page of the previous one only takes the rest
+        const uint32_t begin = std::max(address & ~page_mask, mmu.get_brk_alloc());
+        const uint32_t end = page_round_up(address + segment.mem_size);
+        if (end > begin)
+        {
+            mmu.allocate(end - begin, begin);
+        }
+
+        // pages no earlier segment touched can map the file when the segment lies page aligned in it
+        const uint32_t file_end = page_round_up(address + segment.file_size);
+        const uint32_t map_begin = std::max(address & ~page_mask, page_round_up(loaded_end));
+        if (shared != nullptr && (address & page_mask) == (segment.file_offset & page_mask) && map_begin < file_end)
+        {
+            if (map_begin > address)
+            {
+                mmu.copy_from_host(address, file_data.subspan(segment.file_offset, map_begin - address));
+            }
+            mmu.map_region(map_begin, shared, segment.file_offset - address + map_begin, file_end - map_begin);
+        }
+        else
+        {
+            mmu.copy_from_host(address, file_data.subspan(segment.file_offset, segment.file_size));
+        }
+
+        if (segment.mem_size > segment.file_size)
+        {
+            // .bss, the memory may have held a previous image or the rest of a mapped page
+            mmu.fill(address + segment.file_size, 0, segment.mem_size - segment.file_size);
+        }
+
+        if ((segment.flags & PF_X) != 0 && segment.file_size != 0)
+        {
+            text.begin = text.begin == text.end ? address : std::min(text.begin, address);
+            text.end = std::max(text.end, address + segment.file_size);
+        }
+        loaded_end = std::max(loaded_end, address + segment.mem_size);
     }
+}
+
+void ElfLoader::relocate(const std::vector<Segment> &segments, uint32_t bias)
+{
+    for (const Segment &segment : segments)
+    {
+        if (segment.type != PT_DYNAMIC)
+        {
+            continue;
+        }
+
+        uint32_t rela = 0;
+        uint32_t rela_size = 0;
+        uint32_t rela_entry_size = sizeof(Elf32_Rela);
+        for (uint32_t offset = 0; offset + sizeof(Elf32_Dyn) <= segment.mem_size; offset += sizeof(Elf32_Dyn))
+        {
+            const uint32_t address = segment.virtual_address + bias + offset;
+            const int32_t tag = mmu.read<int32_t>(address);
+            const uint32_t value = mmu.read<uint32_t>(address + sizeof(int32_t));
+            if (tag == DT_NULL)
+            {
+                break;
+            }
+            rela = tag == DT_RELA ? value + bias : rela;
+            rela_size = tag == DT_RELASZ ? value : rela_size;
+            rela_entry_size = tag == DT_RELAENT ? value : rela_entry_size;
+        }
 
-    return elf_header.entry_point;
+        if (rela_entry_size < sizeof(Elf32_Rela))
+        {
+            throw std::invalid_argument("Unsupported DT_RELAENT");
+        }
+
+        // RELA relocations store base + addend, so startup code relocating itself again changes nothing.
+        // A static-pie has no others, anything needing symbols is left to the guest.
+        for (uint32_t offset = 0; rela != 0 && offset + sizeof(Elf32_Rela) <= rela_size; offset += rela_entry_size)
+        {
+            const uint32_t info = mmu.read<uint32_t>(rela + offset + offsetof(Elf32_Rela, r_info));
+            if (ELF32_R_TYPE(info) == R_RISCV_RELATIVE)
+            {
+                const uint32_t target = mmu.read<uint32_t>(rela + offset + offsetof(Elf32_Rela, r_offset));
+                const int32_t addend = mmu.read<int32_t>(rela + offset + offsetof(Elf32_Rela, r_addend));
+                mmu.write<uint32_t>(target + bias, bias + addend);
+            }
+        }
+    }
 }
 
-std::vector<uint8_t> ElfLoader::load_file(const std::string &file_path)
+uint32_t ElfLoader::load_interpreter(const std::string &interpreter)
 {
-    std::vector<uint8_t> bytes;
-    std::ifstream file;
+    if (sysroot.empty())
+    {
+        throw std::invalid_argument("The executable needs the dynamic linker " + interpreter + ", which needs a sysroot");
+    }
 
-    file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    file.open(file_path, std::ios::binary);
-    file.seekg(0, std::ios_base::end);
-    std::streampos file_size = file.tellg();
-    bytes.resize(file_size);
-    file.seekg(0, std::ios_base::beg);
+    const std::string path = SharedObjectCache::resolve(sysroot, interpreter);
+    const SharedObjectCache::File file = SharedObjectCache::instance().get(path);
 
-    file.read((char *)&bytes[0], file_size);
+    // right above the executable, the break starts after it
+    ElfLoader interpreter_loader(mmu);
+    const uint32_t base = page_round_up(mmu.get_brk_alloc());
+    const uint32_t entry = interpreter_loader.load_image(std::span(file.memory->data(), file.size), base, file.memory);
+    if (entry == 0 || !interpreter_loader.position_independent)
+    {
+        throw std::invalid_argument(path + " is not a position independent RISC-V dynamic linker");
+    }
 
-    return bytes;
-}
\ No newline at end of file
+    interpreter_base = base;
+    return entry;
+}
@@ -1,22 +1,106 @@
 #pragma once
 
 #include <cstdint>
+#include <span>
 #include <string>
 #include <vector>
 
 #include "../mmu/mmu.hpp"
 #include "elf-parser/elf-parser.hpp"
+#include "shared-object-cache.hpp"
 
+// Where the program headers ended up in guest memory, passed to the guest in its auxiliary vector
+struct ProgramHeaders
+{
+    uint32_t addr = 0; // 0 when no loaded segment covers them
+    uint32_t entry_size = sizeof(Elf32_Phdr);
+    uint32_t count = 0;
+};
+
+// Guest addresses [begin, end) covered by executable segments
+struct TextRange
+{
+    uint32_t begin = 0;
+    uint32_t end = 0;
+};
+
+/*
+    Loads static and position independent (ET_DYN) executables.
+
+    Position independent images are moved to load_base. Without a PT_INTERP that is a static-pie or
+    a dynamic linker, which get their R_RISCV_RELATIVE relocations applied here. With one, the dynamic linker named by it
+    is loaded from the sysroot above the executable and the run starts in it; it finds the program
+    through the auxiliary vector and maps the shared libraries itself with openat and mmap.
+
+    Files are read through the SharedObjectCache and their pages mapped copy on write wherever a
+    segment lies page aligned in the file, so instances in one host process share the code.
+*/
 class ElfLoader
 {
   public:
-    ElfLoader(Mmu &mmu) : mmu(mmu) {}
+    static constexpr uint32_t default_load_base = 0x10000;
+
+    ElfLoader(Mmu &mmu, std::string sysroot = {}) : mmu(mmu), sysroot(std::move(sysroot)) {}
+
+    uint32_t load(const std::string &file_path, uint32_t load_base = default_load_base);
+
+    // Loads an ELF image that is already in memory, returns the entry point to start at or 0 if it is not a RISC-V ELF.
+    // Throws std::invalid_argument when the image needs a dynamic linker but there is no sysroot.
+    uint32_t load(std::span<const uint8_t> file_data, uint32_t load_base = default_load_base);
 
-    uint32_t load(const std::string &file_path);
+    // Entry point of the executable itself, load returns the dynamic linker's when there is one
+    uint32_t get_program_entry() const
+    {
+        return program_entry;
+    }
+
+    // Where the dynamic linker was loaded, 0 without one
+    uint32_t get_interpreter_base() const
+    {
+        return interpreter_base;
+    }
+
+    const std::vector<Symbol> &get_symbols() const
+    {
+        return symbols;
+    }
+
+    const ProgramHeaders &get_program_headers() const
+    {
+        return program_headers;
+    }
+
+    // Smallest range holding every executable PT_LOAD segment, empty without one
+    const TextRange &get_text() const
+    {
+        return text;
+    }
+
+    // FNV-1a hash of the whole ELF image, identifies the executable in on-disk caches
+    uint64_t get_image_hash() const
+    {
+        return image_hash;
+    }
 
   private:
-    std::vector<uint8_t> load_file(const std::string &file_path);
+    uint32_t load_image(std::span<const uint8_t> file_data, uint32_t load_base, std::shared_ptr<GuestMemory> shared);
+
+    void load_segments(std::span<const uint8_t> file_data, const std::vector<Segment> &segments, uint32_t bias,
+                       const std::shared_ptr<GuestMemory> &shared);
+
+    // Applies the R_RISCV_RELATIVE relocations of a static-pie moved by bias
+    void relocate(const std::vector<Segment> &segments, uint32_t bias);
+
+    uint32_t load_interpreter(const std::string &interpreter);
 
   private:
     Mmu &mmu;
+    std::string sysroot;
+    uint32_t program_entry = 0;
+    uint32_t interpreter_base = 0;
+    bool position_independent = false;
+    std::vector<Symbol> symbols;
+    ProgramHeaders program_headers;
+    TextRange text;
+    uint64_t image_hash = 0;
 };
\ No newline at end of file
@@ -4,17 +4,23 @@
 
 struct ElfHeader
 {
+    uint32_t type; // ET_EXEC or ET_DYN
     uint32_t entry_point;
     uint32_t architecture;
     uint32_t num_program_headers;
     uint32_t program_header_offset;
+    uint32_t num_section_headers;
+    uint32_t section_header_offset;
 
     friend std::ostream &operator<<(std::ostream &out, const ElfHeader &elf_header)
     {
+        out << "Type " << std::dec << elf_header.type << '\n';
         out << "Entry Point 0x" << std::hex << elf_header.entry_point << '\n';
         out << "Architecture " << std::dec << elf_header.architecture << '\n';
         out << "Number of program headers " << std::dec << elf_header.num_program_headers << '\n';
         out << "Program header offset " << std::dec << elf_header.program_header_offset << '\n';
+        out << "Number of section headers " << std::dec << elf_header.num_section_headers << '\n';
+        out << "Section header offset " << std::dec << elf_header.section_header_offset << '\n';
 
         return out;
     }
@@ -4,6 +4,7 @@
 #include <fstream>
 #include <ios>
 #include <iostream>
+#include <stdexcept>
 
 #include "elf-parser.hpp"
 
@@ -25,20 +26,81 @@ std::vector<Segment> ElfParser::parse_segments()
             .file_size = program_header->p_filesz,
             .virtual_address = program_header->p_vaddr,
             .mem_size = program_header->p_memsz,
-            .align = program_header->p_align});
+            .align = program_header->p_align,
+            .flags = program_header->p_flags});
     }
 
     return segments;
 }
 
+std::vector<Symbol> ElfParser::parse_symbols()
+{
+    const uint8_t *file_begin = file_data.data();
+
+    ElfHeader elf_header = parse_elf_header();
+
+    std::vector<Symbol> symbols;
+    if (elf_header.section_header_offset == 0 ||
+        elf_header.section_header_offset + elf_header.num_section_headers * sizeof(Elf32_Shdr) > file_data.size())
+    {
+        return symbols;
+    }
+
+    const Elf32_Shdr *section_header_table = (Elf32_Shdr *)(file_begin + elf_header.section_header_offset);
+    for (uint16_t i = 0; i < elf_header.num_section_headers; ++i)
+    {
+        const Elf32_Shdr *section = section_header_table + i;
+        if (section->sh_type != SHT_SYMTAB || section->sh_link >= elf_header.num_section_headers)
+        {
+            continue;
+        }
+
+        const Elf32_Shdr *string_table = section_header_table + section->sh_link;
+        if ((uint64_t)section->sh_offset + section->sh_size > file_data.size() ||
+            (uint64_t)string_table->sh_offset + string_table->sh_size > file_data.size())
+        {
+            throw std::invalid_argument("Symbol table exceeds the ELF image");
+        }
+
+        // a NUL at the end keeps every name inside the string table
+        const char *names = (const char *)(file_begin + string_table->sh_offset);
+        if (string_table->sh_size == 0 || names[string_table->sh_size - 1] != '\0')
+        {
+            throw std::invalid_argument("Symbol string table is not NUL terminated");
+        }
+
+        const Elf32_Sym *symbol_table = (Elf32_Sym *)(file_begin + section->sh_offset);
+        for (uint32_t j = 0; j < section->sh_size / sizeof(Elf32_Sym); ++j)
+        {
+            const Elf32_Sym *symbol = symbol_table + j;
+            if (symbol->st_name >= string_table->sh_size)
+            {
+                throw std::invalid_argument("Symbol name exceeds its string table");
+            }
+
+            symbols.push_back(Symbol{
+                .name = names + symbol->st_name,
+                .value = symbol->st_value,
+                .size = symbol->st_size,
+                .type = (uint8_t)ELF32_ST_TYPE(symbol->st_info),
+                .absolute = symbol->st_shndx == SHN_ABS});
+        }
+    }
+
+    return symbols;
+}
+
 ElfHeader ElfParser::parse_elf_header()
 {
     const uint8_t *file_begin = file_data.data();
     const Elf32_Ehdr *elf_header = (Elf32_Ehdr *)file_begin;
 
     return ElfHeader{
+        .type = elf_header->e_type,
         .entry_point = elf_header->e_entry,
         .architecture = elf_header->e_machine,
         .num_program_headers = elf_header->e_phnum,
-        .program_header_offset = elf_header->e_phoff};
+        .program_header_offset = elf_header->e_phoff,
+        .num_section_headers = elf_header->e_shnum,
+        .section_header_offset = elf_header->e_shoff};
 }
\ No newline at end of file
@@ -1,21 +1,24 @@
 #pragma once
 
 #include <elf.h>
+#include <span>
 #include <string>
 #include <vector>
 
 #include "elf-header.hpp"
 #include "segment.hpp"
+#include "symbol.hpp"
 
 class ElfParser
 {
   public:
-    ElfParser(const std::vector<uint8_t> &file_data) : file_data(file_data) {}
+    ElfParser(std::span<const uint8_t> file_data) : file_data(file_data) {}
     bool load_file();
 
     ElfHeader parse_elf_header();
     std::vector<Segment> parse_segments();
+    std::vector<Symbol> parse_symbols();
 
   private:
-    std::vector<uint8_t> file_data;
+    std::span<const uint8_t> file_data;
 };
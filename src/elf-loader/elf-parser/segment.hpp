@@ -10,6 +10,7 @@ struct Segment
     uint32_t virtual_address;
     uint32_t mem_size;
     uint32_t align;
+    uint32_t flags; // PF_R, PF_W, PF_X
 
     friend std::ostream &operator<<(std::ostream &out, const Segment &segment)
     {
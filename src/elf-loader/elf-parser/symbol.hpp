@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+struct Symbol
+{
+    std::string name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t type;
+    bool absolute; // SHN_ABS, the value is no address and does not move with the image
+
+    friend std::ostream &operator<<(std::ostream &out, const Symbol &symbol)
+    {
+        out << "Symbol " << symbol.name << ' '
+            << "Value = 0x" << std::hex << symbol.value << ' '
+            << "Size = 0x" << std::hex << symbol.size << ' '
+            << "Type = " << std::dec << (uint16_t)symbol.type;
+
+        return out;
+    }
+};
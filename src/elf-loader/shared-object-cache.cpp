@@ -0,0 +1,84 @@
+#include "shared-object-cache.hpp"
+#include "../mmu/mmu.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SharedObjectCache &SharedObjectCache::instance()
+{
+    static SharedObjectCache cache;
+    return cache;
+}
+
+SharedObjectCache::File SharedObjectCache::get(const std::string &path)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat file_stat = {};
+    if (fd < 0 || fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size > UINT32_MAX - Mmu::page_size)
+    {
+        const std::string error = fd < 0 ? strerror(errno) : "not a regular file below 4 GiB";
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        throw std::runtime_error("Cannot load " + path + ": " + error);
+    }
+
+    const int64_t modified_ns = file_stat.st_mtim.tv_sec * 1000000000ll + file_stat.st_mtim.tv_nsec;
+
+    std::lock_guard lock(mutex);
+    auto cached = files.find(path);
+    if (cached != files.end() && cached->second.device == file_stat.st_dev && cached->second.inode == file_stat.st_ino &&
+        cached->second.modified_ns == modified_ns && cached->second.file.size == (uint64_t)file_stat.st_size)
+    {
+        close(fd);
+        return cached->second.file;
+    }
+
+    // at least one page, an empty file still maps
+    const uint32_t size = file_stat.st_size;
+    const uint32_t aligned_size = std::max<uint32_t>((size + Mmu::page_size - 1) & ~(Mmu::page_size - 1), Mmu::page_size);
+    auto memory = std::make_shared<GuestMemory>(aligned_size);
+
+    uint32_t offset = 0;
+    while (offset < size)
+    {
+        const ssize_t count = read(fd, memory->data() + offset, size - offset);
+        if (count <= 0)
+        {
+            close(fd);
+            throw std::runtime_error("Cannot read " + path);
+        }
+        offset += count;
+    }
+    close(fd);
+
+    Entry &entry = files[path];
+    entry = Entry{
+        .file = File{.memory = std::move(memory), .size = size},
+        .device = file_stat.st_dev,
+        .inode = file_stat.st_ino,
+        .modified_ns = modified_ns};
+    return entry.file;
+}
+
+std::string SharedObjectCache::resolve(const std::string &sysroot, const std::string &guest_path)
+{
+    // confined lexically, symlinks inside the sysroot are followed by the host and may lead out of it
+    const std::filesystem::path normal = (std::filesystem::path("/") / guest_path).lexically_normal();
+    std::filesystem::path inside;
+    for (const auto &part : normal.relative_path())
+    {
+        if (part != "..")
+        {
+            inside /= part;
+        }
+    }
+
+    return (std::filesystem::path(sysroot) / inside).string();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "../mmu/guest-memory.hpp"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+    Process wide cache of the files guests load and map code from, e.g. the dynamic linker and the
+    shared libraries of a sysroot.
+
+    Every file is read once into page aligned memory and handed out as a GuestMemory region, which
+    Mmu::map_region shares copy on write between all guests mapping it, so a hundred instances running
+    against the same libc hold one copy of it. An entry is read again when the size or modification
+    time of its file changes.
+*/
+class SharedObjectCache
+{
+  public:
+    struct File
+    {
+        std::shared_ptr<GuestMemory> memory; // the contents, zero padded to whole pages
+        uint32_t size = 0;
+    };
+
+    static SharedObjectCache &instance();
+
+    // Throws std::runtime_error when path cannot be read
+    File get(const std::string &path);
+
+    // Host path of guest_path inside sysroot. ".." never leaves the sysroot, like it never leaves /.
+    static std::string resolve(const std::string &sysroot, const std::string &guest_path);
+
+  private:
+    struct Entry
+    {
+        File file;
+        uint64_t device = 0;
+        uint64_t inode = 0;
+        int64_t modified_ns = 0;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> files;
+};
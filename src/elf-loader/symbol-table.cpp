@@ -0,0 +1,40 @@
+#include "symbol-table.hpp"
+#include <algorithm>
+#include <elf.h>
+
+SymbolTable::SymbolTable(const std::vector<Symbol> &symbols)
+{
+    for (const Symbol &symbol : symbols)
+    {
+        if (symbol.type == STT_FUNC && symbol.value != 0)
+        {
+            functions.push_back(symbol);
+        }
+    }
+
+    std::sort(functions.begin(), functions.end(), [](const Symbol &a, const Symbol &b) { return a.value < b.value; });
+}
+
+const Symbol *SymbolTable::find_function(uint32_t addr) const
+{
+    auto it = std::upper_bound(functions.begin(), functions.end(), addr,
+                               [](uint32_t addr, const Symbol &symbol) { return addr < symbol.value; });
+    if (it == functions.begin())
+    {
+        return nullptr;
+    }
+
+    --it;
+    if (it->size != 0 && addr >= it->value + it->size)
+    {
+        return nullptr;
+    }
+
+    return &*it;
+}
+
+const Symbol *SymbolTable::find_function(const std::string &name) const
+{
+    auto it = std::find_if(functions.begin(), functions.end(), [&name](const Symbol &symbol) { return symbol.name == name; });
+    return it == functions.end() ? nullptr : &*it;
+}
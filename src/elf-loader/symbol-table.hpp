@@ -0,0 +1,23 @@
+#pragma once
+
+#include "elf-parser/symbol.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+    Address and name lookups over the function symbols of a loaded executable.
+*/
+class SymbolTable
+{
+  public:
+    SymbolTable(const std::vector<Symbol> &symbols);
+
+    // Returns the function containing addr, or nullptr when addr is not covered by any function symbol
+    const Symbol *find_function(uint32_t addr) const;
+
+    const Symbol *find_function(const std::string &name) const;
+
+  private:
+    std::vector<Symbol> functions;
+};
@@ -0,0 +1,38 @@
+#include "coverage-map.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/shm.h>
+
+CoverageMap::CoverageMap() : local(map_size), bits(local.data()) {}
+
+CoverageMap::CoverageMap(int shm_id) : shared(true)
+{
+    void *segment = shmat(shm_id, nullptr, 0);
+    if (segment == (void *)-1)
+    {
+        throw std::runtime_error("Cannot attach coverage shared memory " + std::to_string(shm_id));
+    }
+
+    bits = (uint8_t *)segment;
+}
+
+CoverageMap::~CoverageMap()
+{
+    if (shared)
+    {
+        shmdt(bits);
+    }
+}
+
+void CoverageMap::reset()
+{
+    memset(bits, 0, map_size);
+    previous = 0;
+}
+
+uint32_t CoverageMap::count_edges() const
+{
+    return map_size - std::count(bits, bits + map_size, 0);
+}
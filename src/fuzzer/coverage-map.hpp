@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/*
+    AFL compatible edge coverage bitmap.
+
+    Every control transfer hashes its target into a block id and bumps the counter of
+    (previous id >> 1) ^ id, the same scheme afl-fuzz instruments native code with. The map is
+    either owned by this object or attached to the System V shared memory segment afl-fuzz
+    passes in __AFL_SHM_ID, so an unmodified afl-fuzz can read the coverage of a guest.
+*/
+class CoverageMap
+{
+  public:
+    static constexpr uint32_t map_size = 1 << 16;
+
+    CoverageMap();
+
+    // Attaches to an existing shared memory segment of at least map_size bytes
+    explicit CoverageMap(int shm_id);
+
+    ~CoverageMap();
+
+    CoverageMap(const CoverageMap &) = delete;
+    CoverageMap &operator=(const CoverageMap &) = delete;
+
+    void edge(uint32_t target_pc)
+    {
+        const uint32_t location = (target_pc >> 2) * 0x9e3779b1u >> 16;
+        ++bits[(location ^ previous) & (map_size - 1)];
+        previous = location >> 1;
+    }
+
+    // Clears the counters and the previous block, called before every execution
+    void reset();
+
+    const uint8_t *data() const
+    {
+        return bits;
+    }
+
+    uint32_t count_edges() const;
+
+  private:
+    std::vector<uint8_t> local;
+    uint8_t *bits = nullptr;
+    bool shared = false;
+    uint32_t previous = 0;
+};
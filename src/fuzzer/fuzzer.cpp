@@ -0,0 +1,421 @@
+#include "fuzzer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+FuzzerConfig FuzzerConfig::parse(const std::string &description)
+{
+    FuzzerConfig config;
+    size_t begin = 0;
+
+    while (begin < description.size())
+    {
+        size_t end = description.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = description.size();
+        }
+
+        const std::string field = description.substr(begin, end - begin);
+        const size_t equals = field.find('=');
+        if (equals == std::string::npos)
+        {
+            throw std::invalid_argument("Fuzzer option must be key=value: " + field);
+        }
+
+        const std::string key = field.substr(0, equals);
+        const std::string value = field.substr(equals + 1);
+        if (key == "entry")
+        {
+            config.entry = value;
+        }
+        else if (key == "runs")
+        {
+            config.runs = std::stoull(value);
+        }
+        else if (key == "timeout")
+        {
+            config.timeout = std::stoull(value);
+        }
+        else if (key == "max_len")
+        {
+            config.max_length = std::stoul(value);
+        }
+        else if (key == "persistent")
+        {
+            config.persistent = std::max<uint32_t>(std::stoul(value), 1);
+        }
+        else if (key == "seed")
+        {
+            config.seed = std::stoul(value);
+        }
+        else
+        {
+            throw std::invalid_argument("Unknown fuzzer option " + key);
+        }
+
+        begin = end + 1;
+    }
+
+    return config;
+}
+
+static uint64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// AFL hit count buckets, so loops only count as new coverage when their trip count changes magnitude
+static uint8_t classify(uint8_t count)
+{
+    if (count <= 3)
+    {
+        return count == 3 ? 4 : count;
+    }
+    if (count <= 7)
+    {
+        return 8;
+    }
+    if (count <= 15)
+    {
+        return 16;
+    }
+    if (count <= 31)
+    {
+        return 32;
+    }
+    return count <= 127 ? 64 : 128;
+}
+
+Fuzzer::Fuzzer(Mmu &mmu, RiscvEmulator &emulator, const SymbolTable &symbols, const std::string &corpus_dir,
+               const FuzzerConfig &config)
+    : mmu(mmu), emulator(emulator), symbols(symbols), corpus_dir(corpus_dir), config(config),
+      rng(config.seed != 0 ? config.seed : std::random_device()()), virgin(CoverageMap::map_size, 0xff),
+      crash_virgin(CoverageMap::map_size, 0xff)
+{
+}
+
+uint64_t Fuzzer::run(std::ostream &log)
+{
+    std::filesystem::create_directories(corpus_dir + "/crashes");
+    for (const auto &file : std::filesystem::directory_iterator(corpus_dir))
+    {
+        if (file.is_regular_file())
+        {
+            std::ifstream in(file.path(), std::ios::binary);
+            std::vector<uint8_t> input((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            input.resize(std::min<size_t>(input.size(), config.max_length));
+            corpus.push_back(std::move(input));
+        }
+    }
+
+    take_snapshot();
+    start_time_ms = now_ms();
+
+    // seeds are kept whether or not they add coverage, they only contribute to the virgin map here
+    std::vector<std::vector<uint8_t>> seeds = corpus.empty() ? std::vector<std::vector<uint8_t>>{{}} : corpus;
+    corpus.clear();
+    for (const std::vector<uint8_t> &seed : seeds)
+    {
+        const Outcome outcome = execute(seed);
+        merge_coverage(outcome == Outcome::crash ? crash_virgin : virgin);
+        corpus.push_back(seed);
+    }
+    report(log, "INITED");
+
+    uint64_t last_report_ms = now_ms();
+    while (config.runs == 0 || execs < config.runs)
+    {
+        const std::vector<uint8_t> input = mutate(corpus[rng() % corpus.size()]);
+        const Outcome outcome = execute(input);
+
+        if (outcome == Outcome::ok && merge_coverage(virgin))
+        {
+            corpus.push_back(input);
+            save(corpus_dir, "", input);
+            report(log, "NEW");
+        }
+        else if (outcome == Outcome::crash && merge_coverage(crash_virgin))
+        {
+            ++crashes;
+            save(corpus_dir + "/crashes", "crash-", input);
+            report(log, "CRASH");
+            log << "  " << last_fault << '\n';
+        }
+
+        if (now_ms() - last_report_ms >= 1000)
+        {
+            last_report_ms = now_ms();
+            report(log, "PULSE");
+        }
+    }
+
+    report(log, "DONE");
+    return crashes;
+}
+
+void Fuzzer::take_snapshot()
+{
+    if (config.entry.empty())
+    {
+        // stop in front of the first read from stdin, the ecall is executed again by every fork
+        emulator.get_linux_emulator().register_handler(63, [this](const Syscall &syscall) {
+            if (syscall.arg1 == 0)
+            {
+                returned = true;
+                return std::pair<uint32_t, bool>(0, true);
+            }
+            const int32_t ret = emulator.get_linux_emulator().handle_read(syscall.arg1, syscall.arg2, syscall.arg3);
+            return std::pair<uint32_t, bool>(ret, false);
+        });
+
+        emulator.run_for(UINT64_MAX);
+        if (!returned)
+        {
+            throw std::runtime_error("Guest exited before reading its input");
+        }
+    }
+    else
+    {
+        const Symbol *entry = symbols.find_function(config.entry);
+        if (entry == nullptr)
+        {
+            throw std::invalid_argument("No function symbol " + config.entry);
+        }
+        entry_addr = entry->value;
+
+        // let the C runtime initialize, the snapshot is taken on entry to main
+        const Symbol *main = symbols.find_function("main");
+        while (main != nullptr && emulator.is_running() && emulator.get_pc() != main->value)
+        {
+            emulator.run_for(1);
+        }
+        if (!emulator.is_running())
+        {
+            throw std::runtime_error("Guest exited before main");
+        }
+
+        input_addr = mmu.allocate(config.max_length);
+        stub_addr = mmu.allocate(2 * sizeof(uint32_t));
+        if (input_addr == 0 || stub_addr == 0)
+        {
+            throw std::runtime_error("No guest memory left for the fuzzer input buffer");
+        }
+
+        // addi a7, zero, stop_syscall; ecall
+        mmu.write<uint32_t>(stub_addr, stop_syscall << 20 | (uint32_t)RiscvEmulator::RegisterName::a7 << 7 | 0b0010011);
+        mmu.write<uint32_t>(stub_addr + sizeof(uint32_t), 0b1110011);
+    }
+
+    child_mmu = std::make_unique<Mmu>(mmu.fork());
+    child = std::make_unique<RiscvEmulator>(emulator, *child_mmu);
+    child->set_coverage_map(&coverage);
+    install_handlers();
+}
+
+void Fuzzer::install_handlers()
+{
+    LinuxEmulator &linux_emulator = child->get_linux_emulator();
+
+    linux_emulator.register_handler(63, [this](const Syscall &syscall) {
+        if (syscall.arg1 != 0 || current_input == nullptr)
+        {
+            return std::pair<uint32_t, bool>(-1, false);
+        }
+        if (!child_mmu->contains(syscall.arg2, syscall.arg3))
+        {
+            return std::pair<uint32_t, bool>(-14, false);
+        }
+
+        const uint32_t size = std::min<uint32_t>(syscall.arg3, current_input->size() - input_offset);
+        child_mmu->copy_from_host(syscall.arg2, std::span(*current_input).subspan(input_offset, size));
+        input_offset += size;
+        return std::pair<uint32_t, bool>(size, false);
+    });
+
+    // guest output is dropped, printing at thousands of executions per second helps nobody
+    linux_emulator.register_handler(64, [this](const Syscall &syscall) {
+        if (syscall.arg1 != 1 && syscall.arg1 != 2)
+        {
+            return std::pair<uint32_t, bool>(-1, false);
+        }
+        return std::pair<uint32_t, bool>(child_mmu->contains(syscall.arg2, syscall.arg3) ? syscall.arg3 : -14, false);
+    });
+
+    linux_emulator.register_handler(stop_syscall, [this](const Syscall &) {
+        returned = true;
+        return std::pair<uint32_t, bool>(0, true);
+    });
+}
+
+Fuzzer::Outcome Fuzzer::execute(const std::vector<uint8_t> &input)
+{
+    if (needs_restore)
+    {
+        child_mmu->restore(mmu);
+        child->restore(emulator);
+        calls_since_restore = 0;
+        needs_restore = false;
+    }
+
+    ++execs;
+    coverage.reset();
+
+    if (entry_addr == 0)
+    {
+        current_input = &input;
+        input_offset = 0;
+        child->resume(child->get_pc());
+        needs_restore = true;
+    }
+    else
+    {
+        child_mmu->copy_from_host(input_addr, input);
+        child->set_register(RiscvEmulator::RegisterName::a0, input_addr);
+        child->set_register(RiscvEmulator::RegisterName::a1, input.size());
+        child->set_register(RiscvEmulator::RegisterName::ra, stub_addr);
+        child->set_register(RiscvEmulator::RegisterName::sp, emulator.get_register(RiscvEmulator::RegisterName::sp));
+        child->resume(entry_addr);
+        returned = false;
+    }
+
+    try
+    {
+        child->run_for(config.timeout);
+    }
+    catch (const GuestFault &fault)
+    {
+        std::ostringstream message;
+        message << fault.what() << " at pc 0x" << std::hex << fault.get_pc();
+        last_fault = message.str();
+        needs_restore = true;
+        return Outcome::crash;
+    }
+
+    if (child->is_running())
+    {
+        ++hangs;
+        needs_restore = true;
+        return Outcome::hang;
+    }
+
+    if (entry_addr != 0 && (!returned || ++calls_since_restore >= config.persistent))
+    {
+        needs_restore = true;
+    }
+    return Outcome::ok;
+}
+
+std::vector<uint8_t> Fuzzer::mutate(const std::vector<uint8_t> &base)
+{
+    static constexpr int8_t interesting[] = {-128, -1, 0, 1, 16, 32, 64, 100, 127};
+    std::vector<uint8_t> input = base;
+    const uint32_t stacked = 1u << (rng() % 4);
+
+    for (uint32_t i = 0; i < stacked; ++i)
+    {
+        const uint32_t kind = input.empty() ? 5 : rng() % 7;
+        const uint32_t pos = input.empty() ? 0 : rng() % input.size();
+        switch (kind)
+        {
+            case 0: // flip a bit
+                input[pos] ^= 1u << (rng() % 8);
+                break;
+            case 1: // random byte
+                input[pos] = rng();
+                break;
+            case 2: // interesting value
+                input[pos] = interesting[rng() % std::size(interesting)];
+                break;
+            case 3: // small arithmetic
+                input[pos] += (int8_t)(rng() % 35) - 17;
+                break;
+            case 4: // delete a block
+            {
+                const uint32_t length = 1 + rng() % std::min<size_t>(input.size() - pos, 16);
+                input.erase(input.begin() + pos, input.begin() + pos + length);
+                break;
+            }
+            case 5: // insert random bytes
+            {
+                const uint32_t length = std::min<uint32_t>(1 + rng() % 16, config.max_length - input.size());
+                for (uint32_t j = 0; j < length; ++j)
+                {
+                    input.insert(input.begin() + pos, (uint8_t)rng());
+                }
+                break;
+            }
+            case 6: // overwrite with a piece of another corpus entry
+            {
+                const std::vector<uint8_t> &other = corpus[rng() % corpus.size()];
+                if (!other.empty())
+                {
+                    const uint32_t from = rng() % other.size();
+                    const uint32_t length = std::min<size_t>({1 + rng() % 32, other.size() - from, input.size() - pos});
+                    std::copy_n(other.begin() + from, length, input.begin() + pos);
+                }
+                break;
+            }
+        }
+    }
+
+    return input;
+}
+
+bool Fuzzer::merge_coverage(std::vector<uint8_t> &virgin_map)
+{
+    const uint8_t *bits = coverage.data();
+    bool found_new = false;
+
+    for (uint32_t i = 0; i < CoverageMap::map_size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bits + i, sizeof(word));
+        if (word == 0)
+        {
+            continue;
+        }
+
+        for (uint32_t j = i; j < i + sizeof(uint64_t); ++j)
+        {
+            const uint8_t bucket = classify(bits[j]);
+            if ((bucket & virgin_map[j]) != 0)
+            {
+                virgin_map[j] &= ~bucket;
+                found_new = true;
+            }
+        }
+    }
+
+    return found_new;
+}
+
+void Fuzzer::save(const std::string &dir, const std::string &prefix, const std::vector<uint8_t> &input) const
+{
+    // FNV-1a names make reruns with the same findings idempotent
+    uint64_t hash = 0xcbf29ce484222325;
+    for (uint8_t byte : input)
+    {
+        hash = (hash ^ byte) * 0x100000001b3;
+    }
+
+    std::ostringstream name;
+    name << dir << '/' << prefix << std::hex << hash;
+    std::ofstream out(name.str(), std::ios::binary | std::ios::trunc);
+    out.write((const char *)input.data(), input.size());
+}
+
+void Fuzzer::report(std::ostream &log, const char *event) const
+{
+    const uint64_t elapsed_ms = std::max<uint64_t>(now_ms() - start_time_ms, 1);
+    const uint32_t edges = std::count_if(virgin.begin(), virgin.end(), [](uint8_t bits) { return bits != 0xff; });
+
+    log << '#' << std::dec << execs << '\t' << event << " edges: " << edges << " corpus: " << corpus.size()
+        << " crashes: " << crashes << " hangs: " << hangs << " exec/s: " << execs * 1000 / elapsed_ms << '\n';
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "../elf-loader/symbol-table.hpp"
+#include "../mmu/mmu.hpp"
+#include "../riscv-emulator/riscv-emulator.hpp"
+#include "coverage-map.hpp"
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+struct FuzzerConfig
+{
+    std::string entry;          // guest function called as entry(data, size), empty feeds inputs through read(0, ...)
+    uint64_t runs = 0;          // executions before stopping, 0 runs until interrupted
+    uint64_t timeout = 10000000; // instructions per execution before it counts as a hang
+    uint32_t max_length = 4096;
+    uint32_t persistent = 1000; // calls of entry between snapshot restores
+    uint32_t seed = 0;          // 0 picks a random seed
+
+    // Parses comma separated key=value pairs, e.g. "entry=parse_packet,runs=100000,timeout=100000"
+    static FuzzerConfig parse(const std::string &description);
+};
+
+/*
+    Coverage guided fuzzer running the guest in process.
+
+    The guest first runs up to a snapshot point: its first read from stdin, or main when inputs are
+    passed to an entry function. Every execution then works on a copy on write fork of that state and
+    is rolled back by restoring only the pages it wrote. In entry mode the fork is kept across up to
+    `persistent` calls, libFuzzer style, and only restored after that many calls, a fault or an exit.
+
+    Inputs that reach new edges (AFL hit count buckets) join the corpus directory, inputs that
+    fault the guest in a new way are written to its crashes subdirectory.
+*/
+class Fuzzer
+{
+  public:
+    Fuzzer(Mmu &mmu, RiscvEmulator &emulator, const SymbolTable &symbols, const std::string &corpus_dir,
+           const FuzzerConfig &config);
+
+    // Runs the guest to the snapshot point, then fuzzes, returns the number of distinct crashes
+    uint64_t run(std::ostream &log);
+
+  private:
+    enum class Outcome
+    {
+        ok,
+        crash,
+        hang
+    };
+
+    void take_snapshot();
+
+    void install_handlers();
+
+    Outcome execute(const std::vector<uint8_t> &input);
+
+    std::vector<uint8_t> mutate(const std::vector<uint8_t> &base);
+
+    // Merges the classified hit counts of the last execution into virgin, returns true when a bit was new
+    bool merge_coverage(std::vector<uint8_t> &virgin);
+
+    void save(const std::string &dir, const std::string &prefix, const std::vector<uint8_t> &input) const;
+
+    void report(std::ostream &log, const char *event) const;
+
+  private:
+    static constexpr uint32_t stop_syscall = 2047; // issued by the return stub of entry mode
+
+    Mmu &mmu;
+    RiscvEmulator &emulator;
+    const SymbolTable &symbols;
+    std::string corpus_dir;
+    FuzzerConfig config;
+    std::mt19937 rng;
+
+    std::unique_ptr<Mmu> child_mmu;
+    std::unique_ptr<RiscvEmulator> child;
+    CoverageMap coverage;
+    bool needs_restore = false;
+
+    // entry mode
+    uint32_t entry_addr = 0;
+    uint32_t input_addr = 0;
+    uint32_t stub_addr = 0;
+    uint32_t calls_since_restore = 0;
+
+    bool returned = false; // the guest stopped through the stub, or at its first read while snapshotting
+
+    // read mode
+    const std::vector<uint8_t> *current_input = nullptr;
+    uint32_t input_offset = 0;
+
+    std::vector<std::vector<uint8_t>> corpus;
+    std::vector<uint8_t> virgin;
+    std::vector<uint8_t> crash_virgin;
+    std::string last_fault;
+
+    uint64_t execs = 0;
+    uint64_t crashes = 0;
+    uint64_t hangs = 0;
+    uint64_t start_time_ms = 0;
+};
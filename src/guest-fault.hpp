@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+/*
+    Raised when the guest does something a real hart would trap on: touching memory outside
+    the guest, fetching from a misaligned pc, executing an illegal instruction or EBREAK, or
+    issuing a syscall the emulator does not implement.
+    The emulator stops, the pc is filled in by RiscvEmulator before the fault leaves run_for.
+*/
+class GuestFault : public std::runtime_error
+{
+  public:
+    enum class Kind
+    {
+        memory_access,
+        misaligned_fetch,
+        illegal_instruction,
+        breakpoint,
+        unsupported_syscall
+    };
+
+    GuestFault(Kind kind, uint32_t value) : std::runtime_error(describe(kind, value)), kind(kind), value(value) {}
+
+    Kind get_kind() const
+    {
+        return kind;
+    }
+
+    // The faulting address, instruction word or syscall number, depending on the kind
+    uint32_t get_value() const
+    {
+        return value;
+    }
+
+    uint32_t get_pc() const
+    {
+        return pc;
+    }
+
+    void set_pc(uint32_t fault_pc)
+    {
+        pc = fault_pc;
+    }
+
+  private:
+    static std::string describe(Kind kind, uint32_t value)
+    {
+        char hex[11];
+        snprintf(hex, sizeof(hex), "0x%x", value);
+
+        switch (kind)
+        {
+            case Kind::memory_access:
+                return std::string("memory access fault at ") + hex;
+            case Kind::misaligned_fetch:
+                return std::string("misaligned instruction fetch from ") + hex;
+            case Kind::illegal_instruction:
+                return std::string("illegal instruction ") + hex;
+            case Kind::breakpoint:
+                return "breakpoint";
+            case Kind::unsupported_syscall:
+                return "unsupported syscall " + std::to_string(value);
+        }
+
+        return "guest fault";
+    }
+
+  private:
+    Kind kind;
+    uint32_t value;
+    uint32_t pc = 0;
+};
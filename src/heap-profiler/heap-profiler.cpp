@@ -0,0 +1,307 @@
+#include "heap-profiler.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+static constexpr size_t reported_entries = 20;
+static constexpr size_t timeline_entries = 16;
+
+HeapProfiler::HeapProfiler(const SymbolTable &symbols) : symbols(symbols)
+{
+    struct Allocator
+    {
+        const char *reentrant;
+        const char *plain;
+        Kind kind;
+    };
+
+    static constexpr Allocator allocators[] = {
+        {"_malloc_r", "malloc", Kind::malloc},
+        {"_calloc_r", "calloc", Kind::calloc},
+        {"_realloc_r", "realloc", Kind::realloc},
+        {"_free_r", "free", Kind::free},
+    };
+
+    for (const Allocator &allocator : allocators)
+    {
+        const Symbol *reentrant = symbols.find_function(allocator.reentrant);
+        const Symbol *plain = symbols.find_function(allocator.plain);
+        if (reentrant != nullptr)
+        {
+            hooks.emplace(reentrant->value, Hook{allocator.kind, 1});
+        }
+        if (plain != nullptr)
+        {
+            // with a reentrant core the plain function only forwards to it
+            hooks.emplace(plain->value, Hook{reentrant != nullptr ? Kind::wrapper : allocator.kind, 0});
+        }
+    }
+
+    // operator new[], operator delete[] and the sized deletes of a 32 bit target
+    for (const char *name : {"_Znwj", "_Znaj", "_ZdlPv", "_ZdaPv", "_ZdlPvj", "_ZdaPvj"})
+    {
+        const Symbol *symbol = symbols.find_function(name);
+        if (symbol != nullptr)
+        {
+            hooks.emplace(symbol->value, Hook{Kind::wrapper, 0});
+        }
+    }
+}
+
+void HeapProfiler::track_call(const CallState &state)
+{
+    while (!frames.empty() && frames.back().return_addr == state.pc && frames.back().sp == state.sp)
+    {
+        const Frame frame = frames.back();
+        frames.pop_back();
+        if (frame.kind != Kind::wrapper)
+        {
+            --allocator_depth;
+            finish(frame, state.a0);
+        }
+    }
+
+    const auto hook = hooks.find(state.pc);
+    if (hook == hooks.end())
+    {
+        return;
+    }
+
+    // frames above the current stack pointer were unwound without returning, by longjmp or an exception
+    while (!frames.empty() && frames.back().sp < state.sp)
+    {
+        if (frames.back().kind != Kind::wrapper)
+        {
+            --allocator_depth;
+        }
+        frames.pop_back();
+    }
+
+    if (allocator_depth != 0)
+    {
+        return;
+    }
+
+    const uint32_t args[] = {state.a0, state.a1, state.a2};
+    const uint32_t *arg = args + hook->second.first_arg;
+    const uint32_t callsite = frames.empty() ? state.ra : frames.front().callsite;
+    switch (hook->second.kind)
+    {
+        case Kind::wrapper:
+            frames.push_back(Frame{Kind::wrapper, state.ra, state.sp, callsite, 0, 0});
+            break;
+        case Kind::free:
+            if (arg[0] != 0 && !remove_block(arg[0], callsite))
+            {
+                ++unknown_frees;
+            }
+            break;
+        case Kind::malloc:
+            frames.push_back(Frame{Kind::malloc, state.ra, state.sp, callsite, 0, arg[0]});
+            ++allocator_depth;
+            break;
+        case Kind::calloc:
+            frames.push_back(Frame{Kind::calloc, state.ra, state.sp, callsite, 0, arg[0] * arg[1]});
+            ++allocator_depth;
+            break;
+        case Kind::realloc:
+            frames.push_back(Frame{Kind::realloc, state.ra, state.sp, callsite, arg[0], arg[1]});
+            ++allocator_depth;
+            break;
+    }
+}
+
+void HeapProfiler::finish(const Frame &frame, uint32_t result)
+{
+    SiteStats &site = sites[frame.callsite];
+    if (frame.kind == Kind::realloc)
+    {
+        ++site.reallocs;
+
+        // a failed realloc leaves the old block alone, realloc(ptr, 0) frees it
+        if (frame.ptr != 0 && (result != 0 || frame.size == 0))
+        {
+            const auto block = live.find(frame.ptr);
+            if (block != live.end())
+            {
+                live_bytes -= block->second.size;
+                live.erase(block);
+            }
+            else
+            {
+                ++unknown_frees;
+            }
+        }
+    }
+    else
+    {
+        ++site.allocs;
+    }
+
+    if (result != 0)
+    {
+        add_block(result, frame.size, frame.callsite);
+    }
+}
+
+void HeapProfiler::add_block(uint32_t ptr, uint32_t size, uint32_t callsite)
+{
+    // the allocator handing out a live block again means its free was missed, forget the old one
+    const auto previous = live.find(ptr);
+    if (previous != live.end())
+    {
+        live_bytes -= previous->second.size;
+    }
+
+    live[ptr] = Block{size, callsite};
+    live_bytes += size;
+    sites[callsite].bytes_allocated += size;
+
+    peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+    peak_live_blocks = std::max<uint64_t>(peak_live_blocks, live.size());
+}
+
+bool HeapProfiler::remove_block(uint32_t ptr, uint32_t callsite)
+{
+    const auto block = live.find(ptr);
+    if (block == live.end())
+    {
+        return false;
+    }
+
+    SiteStats &site = sites[callsite];
+    ++site.frees;
+    site.bytes_freed += block->second.size;
+
+    live_bytes -= block->second.size;
+    live.erase(block);
+    return true;
+}
+
+void HeapProfiler::on_brk(uint64_t instructions_retired, uint32_t brk)
+{
+    if (brk_timeline.empty() || brk_timeline.back().second != brk)
+    {
+        brk_timeline.emplace_back(instructions_retired, brk);
+        peak_brk = std::max(peak_brk, brk);
+    }
+}
+
+void HeapProfiler::on_mmap(uint64_t instructions_retired, uint32_t mapping_floor, uint32_t memory_size)
+{
+    ++mmap_calls;
+    this->memory_size = memory_size;
+    if (lowest_mapping == 0 || mapping_floor < lowest_mapping)
+    {
+        lowest_mapping = mapping_floor;
+        lowest_mapping_at = instructions_retired;
+    }
+}
+
+static std::string describe(uint32_t addr, const SymbolTable &symbols)
+{
+    const Symbol *function = symbols.find_function(addr);
+    std::ostringstream out;
+    if (function == nullptr)
+    {
+        out << "0x" << std::hex << addr;
+    }
+    else
+    {
+        out << function->name << "+0x" << std::hex << addr - function->value;
+    }
+
+    return out.str();
+}
+
+void HeapProfiler::report(std::ostream &out) const
+{
+    out << "Heap profile\n";
+    if (!brk_timeline.empty())
+    {
+        const uint32_t start = brk_timeline.front().second;
+        out << "  brk 0x" << std::hex << start << " peak 0x" << peak_brk << std::dec << " (+" << peak_brk - start
+            << " bytes) over " << brk_timeline.size() - 1 << " changes\n";
+
+        const size_t stride = (brk_timeline.size() + timeline_entries - 1) / timeline_entries;
+        for (size_t i = 0; i < brk_timeline.size(); ++i)
+        {
+            if (i % stride == 0 || i + 1 == brk_timeline.size())
+            {
+                out << "    at " << std::setw(12) << brk_timeline[i].first << " instructions brk 0x" << std::hex
+                    << brk_timeline[i].second << std::dec << '\n';
+            }
+        }
+
+    }
+
+    // mappings are handed out top down, so the space between the lowest one and the end of memory was in use
+    const uint64_t mapped_bytes = lowest_mapping != 0 ? memory_size - lowest_mapping : 0;
+    if (lowest_mapping != 0)
+    {
+        out << "  mmap lowest 0x" << std::hex << lowest_mapping << std::dec << " (" << mapped_bytes
+            << " bytes mapped) reached at " << lowest_mapping_at << " instructions over " << mmap_calls
+            << " calls\n";
+    }
+
+    // the stack and the image sit below the break, so the peak break and the mappings are the memory
+    // the guest touched
+    if (!brk_timeline.empty() || lowest_mapping != 0)
+    {
+        const uint64_t mib = 1024 * 1024;
+        out << "  Guest memory needed " << (peak_brk + mapped_bytes + mib - 1) / mib << " MiB\n";
+    }
+
+    uint64_t allocs = 0;
+    uint64_t reallocs = 0;
+    uint64_t frees = 0;
+    for (const auto &[callsite, site] : sites)
+    {
+        allocs += site.allocs;
+        reallocs += site.reallocs;
+        frees += site.frees;
+    }
+
+    out << "  Allocations " << std::dec << allocs << " reallocations " << reallocs << " frees " << frees
+        << " frees of unknown blocks " << unknown_frees << '\n';
+    out << "  Peak live heap " << peak_live_bytes << " bytes in " << peak_live_blocks << " blocks\n";
+
+    std::vector<std::pair<uint32_t, SiteStats>> sorted_sites(sites.begin(), sites.end());
+    std::sort(sorted_sites.begin(), sorted_sites.end(),
+              [](const auto &a, const auto &b) { return a.second.bytes_allocated > b.second.bytes_allocated; });
+
+    out << "  Call sites by bytes allocated:\n";
+    for (size_t i = 0; i < std::min(sorted_sites.size(), reported_entries); ++i)
+    {
+        const auto &[callsite, site] = sorted_sites[i];
+        out << "    " << std::setw(32) << std::left << describe(callsite, symbols) << std::right << std::dec
+            << " allocs " << site.allocs << " reallocs " << site.reallocs << " bytes " << site.bytes_allocated
+            << " frees " << site.frees << " bytes " << site.bytes_freed << '\n';
+    }
+
+    struct Leak
+    {
+        uint64_t blocks = 0;
+        uint64_t bytes = 0;
+    };
+
+    std::map<uint32_t, Leak> leaks;
+    for (const auto &[ptr, block] : live)
+    {
+        Leak &leak = leaks[block.callsite];
+        ++leak.blocks;
+        leak.bytes += block.size;
+    }
+
+    std::vector<std::pair<uint32_t, Leak>> sorted_leaks(leaks.begin(), leaks.end());
+    std::sort(sorted_leaks.begin(), sorted_leaks.end(),
+              [](const auto &a, const auto &b) { return a.second.bytes > b.second.bytes; });
+
+    out << "  Live at exit " << live_bytes << " bytes in " << live.size() << " blocks\n";
+    for (size_t i = 0; i < std::min(sorted_leaks.size(), reported_entries); ++i)
+    {
+        const auto &[callsite, leak] = sorted_leaks[i];
+        out << "    " << std::setw(32) << std::left << describe(callsite, symbols) << std::right << std::dec << ' '
+            << leak.bytes << " bytes in " << leak.blocks << " blocks\n";
+    }
+}
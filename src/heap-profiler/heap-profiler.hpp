@@ -0,0 +1,125 @@
+#pragma once
+
+#include "../elf-loader/symbol-table.hpp"
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+    Guest heap profiler.
+
+    The brk break is sampled after every brk syscall and the mapping floor after every mmap, giving
+    the heap growth over retired instructions and the peak amount of guest memory the program needed. Allocator calls are found through the ELF
+    symbols: newlib's reentrant _malloc_r, _calloc_r, _realloc_r and _free_r when present, the plain
+    C names otherwise. malloc and friends, operator new and operator delete are treated as wrappers,
+    an allocation is charged to the return address of the outermost call into the allocator, so
+    `new T` is reported at the line doing the new and not inside libstdc++.
+
+    Calls made by the allocator itself, such as _realloc_r moving a block with _malloc_r, are not counted.
+*/
+class HeapProfiler
+{
+  public:
+    // Register state in front of the instruction at pc
+    struct CallState
+    {
+        uint32_t pc;
+        uint32_t ra;
+        uint32_t sp;
+        uint32_t a0;
+        uint32_t a1;
+        uint32_t a2;
+    };
+
+    HeapProfiler(const SymbolTable &symbols);
+
+    // Called before every instruction, cheap unless pc enters the allocator or returns from it
+    void on_instruction(const CallState &state)
+    {
+        if (hooks.find(state.pc) != hooks.end() || (!frames.empty() && frames.back().return_addr == state.pc))
+        {
+            track_call(state);
+        }
+    }
+
+    void on_brk(uint64_t instructions_retired, uint32_t brk);
+
+    // mapping_floor is the lowest address mmap handed out so far, memory_size the end of guest memory
+    void on_mmap(uint64_t instructions_retired, uint32_t mapping_floor, uint32_t memory_size);
+
+    void report(std::ostream &out) const;
+
+  private:
+    enum class Kind : uint8_t
+    {
+        malloc,
+        calloc,
+        realloc,
+        free,
+        wrapper
+    };
+
+    struct Hook
+    {
+        Kind kind;
+        uint8_t first_arg; // 1 for the reentrant variants, their first argument is the reent pointer
+    };
+
+    struct Frame
+    {
+        Kind kind;
+        uint32_t return_addr;
+        uint32_t sp;
+        uint32_t callsite;
+        uint32_t ptr;
+        uint32_t size;
+    };
+
+    struct Block
+    {
+        uint32_t size;
+        uint32_t callsite;
+    };
+
+    struct SiteStats
+    {
+        uint64_t allocs = 0;
+        uint64_t reallocs = 0;
+        uint64_t frees = 0;
+        uint64_t bytes_allocated = 0;
+        uint64_t bytes_freed = 0;
+    };
+
+    void track_call(const CallState &state);
+
+    void finish(const Frame &frame, uint32_t result);
+
+    void add_block(uint32_t ptr, uint32_t size, uint32_t callsite);
+
+    // Returns false when ptr is not a live block
+    bool remove_block(uint32_t ptr, uint32_t callsite);
+
+  private:
+    const SymbolTable &symbols;
+    std::unordered_map<uint32_t, Hook> hooks;
+    std::vector<Frame> frames;
+    uint32_t allocator_depth = 0; // frames of allocator calls that are not wrappers
+
+    std::unordered_map<uint32_t, Block> live;
+    std::map<uint32_t, SiteStats> sites;
+    uint64_t live_bytes = 0;
+    uint64_t peak_live_bytes = 0;
+    uint64_t peak_live_blocks = 0;
+    uint64_t unknown_frees = 0;
+
+    std::vector<std::pair<uint64_t, uint32_t>> brk_timeline;
+    uint32_t peak_brk = 0;
+
+    uint64_t mmap_calls = 0;
+    uint64_t lowest_mapping_at = 0; // instructions retired when the floor last went down
+    uint32_t lowest_mapping = 0;    // 0 until the first mmap
+    uint32_t memory_size = 0;
+};
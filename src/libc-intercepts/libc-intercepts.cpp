@@ -0,0 +1,199 @@
+#include "libc-intercepts.hpp"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+const char *routine_name(LibcRoutine routine)
+{
+    switch (routine)
+    {
+        case LibcRoutine::memcpy:
+            return "memcpy";
+        case LibcRoutine::memmove:
+            return "memmove";
+        case LibcRoutine::memset:
+            return "memset";
+        case LibcRoutine::strlen:
+            return "strlen";
+        case LibcRoutine::memcmp:
+            return "memcmp";
+    }
+
+    return "unknown";
+}
+
+LibcIntercepts::LibcIntercepts(const SymbolTable &symbols, Mode mode) : mode(mode)
+{
+    for (size_t i = 0; i < stats.size(); ++i)
+    {
+        const LibcRoutine routine = (LibcRoutine)i;
+        const Symbol *symbol = symbols.find_function(routine_name(routine));
+        if (symbol != nullptr)
+        {
+            entry_points.emplace(symbol->value, routine);
+            present[i] = true;
+        }
+    }
+}
+
+bool LibcIntercepts::in_bounds(LibcRoutine routine, Mmu &mmu, const Arguments &args, uint32_t &length) const
+{
+    switch (routine)
+    {
+        case LibcRoutine::memcpy:
+        case LibcRoutine::memmove:
+        case LibcRoutine::memcmp:
+            length = args.a2;
+            return mmu.contains(args.a0, length) && mmu.contains(args.a1, length);
+        case LibcRoutine::memset:
+            length = args.a2;
+            return mmu.contains(args.a0, length);
+        case LibcRoutine::strlen:
+        {
+            if (!mmu.contains(args.a0, 0))
+            {
+                return false;
+            }
+
+            // a string running off the end of guest memory is left to the guest code to fault on
+            const uint32_t limit = mmu.size() - args.a0;
+            length = mmu.find_byte(args.a0, 0, limit);
+            return length != limit;
+        }
+    }
+
+    return false;
+}
+
+bool LibcIntercepts::call(LibcRoutine routine, Mmu &mmu, const Arguments &args, uint32_t &result)
+{
+    uint32_t length = 0;
+    if (!in_bounds(routine, mmu, args, length))
+    {
+        return false;
+    }
+
+    switch (routine)
+    {
+        case LibcRoutine::memcpy:
+        case LibcRoutine::memmove:
+            mmu.copy(args.a0, args.a1, length);
+            result = args.a0;
+            break;
+        case LibcRoutine::memset:
+            mmu.fill(args.a0, args.a1, length);
+            result = args.a0;
+            break;
+        case LibcRoutine::strlen:
+            result = length;
+            break;
+        case LibcRoutine::memcmp:
+            result = mmu.compare(args.a0, args.a1, length);
+            break;
+    }
+
+    Stats &routine_stats = stats[(size_t)routine];
+    ++routine_stats.calls;
+    routine_stats.bytes += length;
+    return true;
+}
+
+void LibcIntercepts::begin_verify(LibcRoutine routine, Mmu &mmu, const Arguments &args, uint32_t return_addr, uint32_t sp)
+{
+    uint32_t length = 0;
+    if (!in_bounds(routine, mmu, args, length))
+    {
+        return;
+    }
+
+    Expectation expectation{.routine = routine, .return_addr = return_addr, .sp = sp, .result = 0, .length = length, .dst_addr = args.a0};
+    switch (routine)
+    {
+        case LibcRoutine::memcpy:
+        case LibcRoutine::memmove:
+        {
+            const bool overlapping = args.a0 < args.a1 + length && args.a1 < args.a0 + length;
+            if (routine == LibcRoutine::memcpy && overlapping)
+            {
+                // undefined behaviour in the guest, there is no single correct result to compare against
+                return;
+            }
+
+            expectation.dst_bytes.resize(length);
+            mmu.copy_to_host(args.a1, expectation.dst_bytes);
+            expectation.result = args.a0;
+            break;
+        }
+        case LibcRoutine::memset:
+            expectation.dst_bytes.assign(length, (uint8_t)args.a1);
+            expectation.result = args.a0;
+            break;
+        case LibcRoutine::strlen:
+            expectation.result = length;
+            break;
+        case LibcRoutine::memcmp:
+            expectation.result = mmu.compare(args.a0, args.a1, length);
+            break;
+    }
+
+    pending.push_back(std::move(expectation));
+}
+
+static int32_t sign(int32_t value)
+{
+    return (value > 0) - (value < 0);
+}
+
+void LibcIntercepts::check_return(Mmu &mmu, uint32_t pc, uint32_t sp, uint32_t a0)
+{
+    if (pending.empty() || pending.back().return_addr != pc || pending.back().sp != sp)
+    {
+        return;
+    }
+
+    const Expectation expectation = std::move(pending.back());
+    pending.pop_back();
+
+    const char *name = routine_name(expectation.routine);
+    const bool result_matches = expectation.routine == LibcRoutine::memcmp
+                                    ? sign(a0) == sign(expectation.result)
+                                    : a0 == expectation.result;
+    if (!result_matches)
+    {
+        std::ostringstream message;
+        message << name << " returning to 0x" << std::hex << pc << " gave 0x" << a0 << ", host result is 0x"
+                << expectation.result;
+        throw std::runtime_error(message.str());
+    }
+
+    std::vector<uint8_t> written(expectation.dst_bytes.size());
+    mmu.copy_to_host(expectation.dst_addr, written);
+    if (written != expectation.dst_bytes)
+    {
+        const auto mismatch = std::mismatch(written.begin(), written.end(), expectation.dst_bytes.begin());
+        std::ostringstream message;
+        message << name << " returning to 0x" << std::hex << pc << " wrote 0x" << (uint32_t)*mismatch.first
+                << " at 0x" << expectation.dst_addr + (mismatch.first - written.begin()) << ", host wrote 0x"
+                << (uint32_t)*mismatch.second;
+        throw std::runtime_error(message.str());
+    }
+
+    Stats &routine_stats = stats[(size_t)expectation.routine];
+    ++routine_stats.calls;
+    routine_stats.bytes += expectation.length;
+}
+
+void LibcIntercepts::report(std::ostream &out) const
+{
+    out << "Libc intercepts (" << (mode == Mode::host ? "host" : "verified") << " calls)\n";
+    for (size_t i = 0; i < stats.size(); ++i)
+    {
+        if (!present[i])
+        {
+            continue;
+        }
+
+        out << "  " << routine_name((LibcRoutine)i) << ' ' << std::dec << stats[i].calls << " calls " << stats[i].bytes
+            << " bytes\n";
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "../elf-loader/symbol-table.hpp"
+#include "../mmu/mmu.hpp"
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+enum class LibcRoutine : uint8_t
+{
+    memcpy,
+    memmove,
+    memset,
+    strlen,
+    memcmp
+};
+
+const char *routine_name(LibcRoutine routine);
+
+/*
+    Host implementations of the libc string routines a guest spends most of its time in.
+
+    Entry points are found by name in the executable's symbol table. When the guest pc reaches one of
+    them the emulator calls into the host instead of interpreting the byte loop: arguments are taken
+    from a0 - a2, the result goes to a0 and execution resumes at ra, exactly like a return from the
+    guest routine. A call whose ranges do not fit inside guest memory is not intercepted, the guest
+    code then runs and faults the same way it would without interception.
+
+    In verify mode nothing is short-circuited. The host result is computed on entry, the guest routine
+    runs on the interpreter, and on return a0 and the written bytes are compared with the host result.
+*/
+class LibcIntercepts
+{
+  public:
+    enum class Mode
+    {
+        host,
+        verify
+    };
+
+    struct Arguments
+    {
+        uint32_t a0;
+        uint32_t a1;
+        uint32_t a2;
+    };
+
+    LibcIntercepts(const SymbolTable &symbols, Mode mode);
+
+    Mode get_mode() const
+    {
+        return mode;
+    }
+
+    bool empty() const
+    {
+        return entry_points.empty();
+    }
+
+    // Returns the routine starting at pc, or nullptr
+    const LibcRoutine *find(uint32_t pc) const
+    {
+        auto it = entry_points.find(pc);
+        return it == entry_points.end() ? nullptr : &it->second;
+    }
+
+    // Runs the routine on guest memory, returns false without touching memory when an argument range is out of bounds
+    bool call(LibcRoutine routine, Mmu &mmu, const Arguments &args, uint32_t &result);
+
+    // Verify mode, remembers the host result of a call entered with the given return address and stack pointer
+    void begin_verify(LibcRoutine routine, Mmu &mmu, const Arguments &args, uint32_t return_addr, uint32_t sp);
+
+    bool verify_pending() const
+    {
+        return !pending.empty();
+    }
+
+    // Verify mode, checks the innermost pending call once the guest is back at its return address,
+    // throws std::runtime_error when the guest and host results differ
+    void check_return(Mmu &mmu, uint32_t pc, uint32_t sp, uint32_t a0);
+
+    void report(std::ostream &out) const;
+
+  private:
+    struct Expectation
+    {
+        LibcRoutine routine;
+        uint32_t return_addr;
+        uint32_t sp;
+        uint32_t result;
+        uint32_t length;
+        uint32_t dst_addr;
+        std::vector<uint8_t> dst_bytes;
+    };
+
+    struct Stats
+    {
+        uint64_t calls = 0;
+        uint64_t bytes = 0;
+    };
+
+    // Checks every range the routine touches, length receives the number of bytes it processes
+    bool in_bounds(LibcRoutine routine, Mmu &mmu, const Arguments &args, uint32_t &length) const;
+
+  private:
+    Mode mode;
+    std::unordered_map<uint32_t, LibcRoutine> entry_points;
+    std::vector<Expectation> pending;
+    std::array<Stats, (size_t)LibcRoutine::memcmp + 1> stats = {};
+    std::array<bool, (size_t)LibcRoutine::memcmp + 1> present = {};
+};
@@ -0,0 +1,195 @@
+#include "guest-clock.hpp"
+#include <cerrno>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <sys/random.h>
+#include <thread>
+#include <time.h>
+
+// https://github.com/torvalds/linux/blob/master/include/uapi/linux/time.h
+static constexpr uint32_t clock_realtime = 0;
+static constexpr uint32_t clock_monotonic = 1;
+static constexpr uint32_t clock_process_cputime = 2;
+static constexpr uint32_t clock_thread_cputime = 3;
+static constexpr uint32_t clock_monotonic_raw = 4;
+static constexpr uint32_t clock_realtime_coarse = 5;
+static constexpr uint32_t clock_monotonic_coarse = 6;
+static constexpr uint32_t clock_boottime = 7;
+
+static constexpr int64_t ns_per_second = 1000000000;
+
+ClockConfig ClockConfig::parse(const std::string &description)
+{
+    ClockConfig config;
+    size_t begin = 0;
+
+    while (begin < description.size())
+    {
+        size_t end = description.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = description.size();
+        }
+
+        const std::string field = description.substr(begin, end - begin);
+        const size_t equals = field.find('=');
+        if (field == "real" || field == "virtual")
+        {
+            config.virtual_time = field == "virtual";
+            begin = end + 1;
+            continue;
+        }
+        if (equals == std::string::npos)
+        {
+            throw std::invalid_argument("Clock option must be real, virtual or key=value: " + field);
+        }
+
+        const std::string key = field.substr(0, equals);
+        const uint64_t value = std::stoull(field.substr(equals + 1));
+        if (key == "ns")
+        {
+            if (value == 0 || value > UINT32_MAX)
+            {
+                throw std::invalid_argument("Clock ns must be between 1 and 2^32 - 1");
+            }
+            config.ns_per_instruction = value;
+        }
+        else if (key == "epoch")
+        {
+            config.epoch = value;
+        }
+        else if (key == "seed")
+        {
+            config.seed = value;
+        }
+        else
+        {
+            throw std::invalid_argument("Unknown clock option " + key);
+        }
+
+        begin = end + 1;
+    }
+
+    return config;
+}
+
+bool GuestClock::get_time(uint32_t clock_id, int64_t &ns) const
+{
+    if (clock_id > clock_boottime)
+    {
+        return false;
+    }
+
+    if (!config.virtual_time)
+    {
+        timespec host_time = {};
+        if (clock_gettime(clock_id, &host_time) != 0)
+        {
+            return false;
+        }
+        ns = host_time.tv_sec * ns_per_second + host_time.tv_nsec;
+        return true;
+    }
+
+    const int64_t running_ns = (retired_base + instructions_retired) * config.ns_per_instruction;
+    switch (clock_id)
+    {
+        case clock_realtime:
+        case clock_realtime_coarse:
+            ns = config.epoch * ns_per_second + running_ns + slept_ns;
+            return true;
+        case clock_process_cputime:
+        case clock_thread_cputime:
+            ns = running_ns;
+            return true;
+        case clock_monotonic:
+        case clock_monotonic_raw:
+        case clock_monotonic_coarse:
+        case clock_boottime:
+        default:
+            ns = running_ns + slept_ns;
+            return true;
+    }
+}
+
+bool GuestClock::sleep_until(uint32_t clock_id, int64_t deadline_ns)
+{
+    int64_t now = 0;
+    if (clock_id == clock_process_cputime || clock_id == clock_thread_cputime || !get_time(clock_id, now))
+    {
+        return false;
+    }
+    if (deadline_ns <= now)
+    {
+        return true;
+    }
+
+    if (config.virtual_time)
+    {
+        slept_ns += deadline_ns - now;
+    }
+    else
+    {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(deadline_ns - now));
+    }
+    return true;
+}
+
+void GuestClock::fill_random(std::span<uint8_t> bytes)
+{
+    if (config.virtual_time)
+    {
+        for (uint8_t &byte : bytes)
+        {
+            byte = (uint8_t)generator();
+        }
+        return;
+    }
+
+    size_t filled = 0;
+    while (filled < bytes.size())
+    {
+        const ssize_t count = getrandom(bytes.data() + filled, bytes.size() - filled, 0);
+        if (count > 0)
+        {
+            filled += count;
+        }
+        else if (errno != EINTR)
+        {
+            throw std::runtime_error("Host getrandom failed");
+        }
+    }
+}
+
+void GuestClock::save_state(CheckpointWriter &writer) const
+{
+    writer.write(config.virtual_time);
+    writer.write(config.ns_per_instruction);
+    writer.write(config.epoch);
+    writer.write(config.seed);
+    writer.write(slept_ns);
+    writer.write(retired_base);
+
+    // the standard text form is the only portable way to get at the engine's state
+    std::ostringstream generator_state;
+    generator_state << generator;
+    writer.write_string(generator_state.str());
+}
+
+void GuestClock::load_state(CheckpointReader &reader)
+{
+    config.virtual_time = reader.read<bool>();
+    config.ns_per_instruction = reader.read<uint32_t>();
+    config.epoch = reader.read<uint64_t>();
+    config.seed = reader.read<uint64_t>();
+    slept_ns = reader.read<int64_t>();
+    retired_base = reader.read<uint64_t>();
+
+    std::istringstream generator_state(reader.read_string());
+    generator_state >> generator;
+    if (!generator_state)
+    {
+        throw std::runtime_error("Checkpoint holds a corrupt random generator state");
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "../checkpoint/checkpoint-stream.hpp"
+#include <cstdint>
+#include <random>
+#include <span>
+#include <string>
+
+struct ClockConfig
+{
+    bool virtual_time = false;
+    uint32_t ns_per_instruction = 1;    // virtual time only, 1 is a 1 GHz guest with an IPC of 1
+    uint64_t epoch = 1700000000;        // virtual CLOCK_REALTIME at the first instruction, in seconds
+    uint64_t seed = 0;                  // virtual time only, getrandom and AT_RANDOM bytes follow from it
+
+    // Parses "real" or "virtual" followed by comma separated key=value pairs, e.g. "virtual,ns=2,seed=7"
+    static ClockConfig parse(const std::string &description);
+};
+
+/*
+    The clocks and the entropy a guest sees.
+
+    In real time mode guest clocks are the host's. The ids are passed through to the host
+    clock_gettime, which the vDSO answers without entering the kernel for the realtime, monotonic
+    and boot clocks, so reading the time costs the guest no host syscall. Sleeping really sleeps and
+    getrandom returns host entropy.
+
+    In virtual time mode time is a function of the guest's progress alone: every retired instruction
+    advances the clocks by ns_per_instruction and getrandom is a generator with a fixed seed, so two
+    runs of a program see the same times and bytes, e.g. for reproducible benchmarks. Sleeping only
+    moves the clocks forward, a guest waiting for a timeout gets there immediately.
+*/
+class GuestClock
+{
+  public:
+    explicit GuestClock(const ClockConfig &config = {}) : config(config), generator(config.seed) {}
+
+    void set_instructions_retired(uint64_t retired)
+    {
+        instructions_retired = retired;
+    }
+
+    // After execve the clock goes on in an image whose instruction count starts again at 0
+    void start_new_image()
+    {
+        retired_base += instructions_retired;
+        instructions_retired = 0;
+    }
+
+    bool is_virtual() const
+    {
+        return config.virtual_time;
+    }
+
+    // Nanoseconds on clock_id, returns false for clocks the guest has no access to
+    bool get_time(uint32_t clock_id, int64_t &ns) const;
+
+    // Resolution of clock_id in nanoseconds
+    int64_t get_resolution() const
+    {
+        return config.virtual_time ? config.ns_per_instruction : 1;
+    }
+
+    // Waits until clock_id shows deadline_ns, returns false for clocks the guest cannot sleep on
+    bool sleep_until(uint32_t clock_id, int64_t deadline_ns);
+
+    void fill_random(std::span<uint8_t> bytes);
+
+    // The configuration, the virtual time slept, the instructions of replaced images and the generator,
+    // the retired instructions of the current image come from the emulator
+    void save_state(CheckpointWriter &writer) const;
+
+    void load_state(CheckpointReader &reader);
+
+  private:
+    ClockConfig config;
+    uint64_t instructions_retired = 0;
+    uint64_t retired_base = 0; // by the images execve replaced
+    int64_t slept_ns = 0; // virtual time spent sleeping
+    std::mt19937_64 generator;
+};
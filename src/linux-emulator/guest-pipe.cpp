@@ -0,0 +1,130 @@
+#include "guest-pipe.hpp"
+#include <algorithm>
+#include <cstring>
+
+GuestPipe::End::End(std::shared_ptr<GuestPipe> pipe, bool writer) : pipe(std::move(pipe)), writer(writer)
+{
+    this->pipe->add_end(writer);
+}
+
+GuestPipe::End::~End()
+{
+    pipe->remove_end(writer);
+}
+
+std::pair<std::shared_ptr<GuestPipe::End>, std::shared_ptr<GuestPipe::End>> GuestPipe::create(std::span<const uint8_t> contents)
+{
+    const std::shared_ptr<GuestPipe> pipe(new GuestPipe());
+    if (!contents.empty())
+    {
+        const size_t count = std::min<size_t>(contents.size(), capacity);
+        pipe->buffer.resize(capacity);
+        memcpy(pipe->buffer.data(), contents.data(), count);
+        pipe->used = count;
+    }
+
+    return {std::make_shared<End>(pipe, false), std::make_shared<End>(pipe, true)};
+}
+
+std::optional<uint32_t> GuestPipe::read(uint32_t size, const std::function<void(std::span<const uint8_t>)> &copy,
+                                        const std::shared_ptr<GuestWaker> &waker)
+{
+    std::lock_guard lock(mutex);
+    if (used == 0)
+    {
+        if (writers == 0 || size == 0)
+        {
+            return 0;
+        }
+        if (waker != nullptr)
+        {
+            waiting_readers.add(waker);
+        }
+        return std::nullopt;
+    }
+
+    const uint32_t count = std::min(size, used);
+    const uint32_t first = std::min(count, capacity - head);
+    copy(std::span(buffer.data() + head, first));
+    if (first < count)
+    {
+        copy(std::span(buffer.data(), count - first));
+    }
+
+    head = (head + count) % capacity;
+    used -= count;
+    waiting_writers.wake_all();
+    return count;
+}
+
+std::optional<int32_t> GuestPipe::write(uint32_t size, const std::function<void(std::span<uint8_t>)> &copy,
+                                        const std::shared_ptr<GuestWaker> &waker)
+{
+    std::lock_guard lock(mutex);
+    if (readers == 0)
+    {
+        return broken;
+    }
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    const uint32_t room = capacity - used;
+    if (room == 0 || (size <= atomic_size && room < size))
+    {
+        if (waker != nullptr)
+        {
+            waiting_writers.add(waker);
+        }
+        return std::nullopt;
+    }
+
+    if (buffer.empty())
+    {
+        buffer.resize(capacity);
+    }
+    const uint32_t count = std::min(size, room);
+    const uint32_t tail = (head + used) % capacity;
+    const uint32_t first = std::min(count, capacity - tail);
+    copy(std::span(buffer.data() + tail, first));
+    if (first < count)
+    {
+        copy(std::span(buffer.data(), count - first));
+    }
+
+    used += count;
+    waiting_readers.wake_all();
+    return (int32_t)count;
+}
+
+std::vector<uint8_t> GuestPipe::get_contents() const
+{
+    std::lock_guard lock(mutex);
+    std::vector<uint8_t> contents(used);
+    const uint32_t first = std::min(used, capacity - head);
+    std::copy_n(buffer.begin() + head, first, contents.begin());
+    std::copy_n(buffer.begin(), used - first, contents.begin() + first);
+    return contents;
+}
+
+void GuestPipe::add_end(bool writer)
+{
+    std::lock_guard lock(mutex);
+    ++(writer ? writers : readers);
+}
+
+void GuestPipe::remove_end(bool writer)
+{
+    std::lock_guard lock(mutex);
+    if (writer && --writers == 0)
+    {
+        // readers see end of file
+        waiting_readers.wake_all();
+    }
+    else if (!writer && --readers == 0)
+    {
+        // writers see a broken pipe
+        waiting_writers.wake_all();
+    }
+}
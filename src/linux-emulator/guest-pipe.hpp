@@ -0,0 +1,88 @@
+#pragma once
+
+#include "guest-waker.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+/*
+    A pipe between guests of this process, or within one guest: a ring buffer in host memory that
+    the writing guest's bytes are copied into straight from its guest memory and that the reader
+    copies out of straight into its own, without a host pipe, syscall or intermediate buffer.
+
+    Reads and writes that cannot go on return nullopt and register the caller's GuestWaker, which the
+    next transfer in the other direction or the close of the last end on the other side wakes. The
+    pipe is shared by the threads of all guests holding one of its ends, so every access locks.
+*/
+class GuestPipe
+{
+  public:
+    static constexpr uint32_t capacity = 64 * 1024; // the Linux default
+    static constexpr uint32_t atomic_size = 4096;   // PIPE_BUF, writes up to this size are never split
+    static constexpr int32_t broken = -1;           // returned by write when no read end is left
+
+    // What the fds of a guest refer to. Duplicated and inherited fds share the End, and when the
+    // last End of a side is destroyed, the other side sees end of file or a broken pipe.
+    class End
+    {
+      public:
+        End(std::shared_ptr<GuestPipe> pipe, bool writer);
+        ~End();
+
+        End(const End &) = delete;
+        End &operator=(const End &) = delete;
+
+        GuestPipe &get_pipe() const
+        {
+            return *pipe;
+        }
+
+        bool is_writer() const
+        {
+            return writer;
+        }
+
+      private:
+        std::shared_ptr<GuestPipe> pipe;
+        bool writer;
+    };
+
+    // Returns the read and the write end of a new pipe that already holds contents
+    static std::pair<std::shared_ptr<End>, std::shared_ptr<End>> create(std::span<const uint8_t> contents = {});
+
+    // Passes up to size buffered bytes to copy, in two chunks when they wrap around, and consumes
+    // them. Returns their count, 0 at end of file, nullopt while the pipe is empty and has writers.
+    std::optional<uint32_t> read(uint32_t size, const std::function<void(std::span<const uint8_t>)> &copy,
+                                 const std::shared_ptr<GuestWaker> &waker);
+
+    // Has copy fill up to size bytes of free space, in two chunks when they wrap around. Returns the
+    // count, broken when nobody can read them, nullopt while the pipe is too full. Writes beyond
+    // atomic_size may be split, the caller carries on with the rest when the fd blocks.
+    std::optional<int32_t> write(uint32_t size, const std::function<void(std::span<uint8_t>)> &copy,
+                                 const std::shared_ptr<GuestWaker> &waker);
+
+    // The bytes buffered right now, for checkpoints and copies of a guest
+    std::vector<uint8_t> get_contents() const;
+
+  private:
+    GuestPipe() = default;
+
+    void add_end(bool writer);
+
+    void remove_end(bool writer);
+
+  private:
+    mutable std::mutex mutex;
+    std::vector<uint8_t> buffer; // capacity bytes, allocated by the first write
+    uint32_t head = 0;           // offset of the oldest byte
+    uint32_t used = 0;
+    uint32_t readers = 0;
+    uint32_t writers = 0;
+    WaiterList waiting_readers;
+    WaiterList waiting_writers;
+};
@@ -0,0 +1,53 @@
+#include "guest-process.hpp"
+#include <atomic>
+#include <iterator>
+
+void ChildTable::add(uint32_t pid)
+{
+    std::lock_guard lock(mutex);
+    children[pid] = std::nullopt;
+}
+
+void ChildTable::report(uint32_t pid, uint32_t status)
+{
+    std::lock_guard lock(mutex);
+    auto child = children.find(pid);
+    if (child != children.end())
+    {
+        child->second = status;
+        waiting.wake_all();
+    }
+}
+
+std::optional<ChildTable::Reaped> ChildTable::reap(uint32_t pid, const std::shared_ptr<GuestWaker> &waker)
+{
+    std::lock_guard lock(mutex);
+    auto first = pid == 0 ? children.begin() : children.find(pid);
+    auto last = pid == 0 ? children.end() : first == children.end() ? first : std::next(first);
+    if (first == last)
+    {
+        return Reaped{.pid = 0, .status = 0};
+    }
+
+    for (auto child = first; child != last; ++child)
+    {
+        if (child->second.has_value())
+        {
+            const Reaped reaped{.pid = child->first, .status = *child->second};
+            children.erase(child);
+            return reaped;
+        }
+    }
+
+    if (waker != nullptr)
+    {
+        waiting.add(waker);
+    }
+    return std::nullopt;
+}
+
+uint32_t allocate_guest_pid()
+{
+    static std::atomic<uint32_t> next_pid = 1;
+    return next_pid++;
+}
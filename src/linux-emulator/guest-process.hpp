@@ -0,0 +1,68 @@
+#pragma once
+
+#include "guest-waker.hpp"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+class LinuxEmulator;
+
+/*
+    Guests that start other guests of this process with clone and execve.
+
+    LinuxEmulator handles the process side of those syscalls, pids, the fd table and the statuses
+    wait4 and waitid report, while a GuestProcessHost creates and runs the guests themselves.
+    riscvemu::Machine is one, it hands children to a spawner such as the Scheduler's.
+*/
+
+// Creates guests for clone and execve, without a host both fail with ENOSYS
+class GuestProcessHost
+{
+  public:
+    virtual ~GuestProcessHost() = default;
+
+    // Starts a copy of the calling guest that continues after the ECALL with a0 = 0, on child_stack
+    // unless it is 0. setup prepares the child's LinuxEmulator before the child runs. Returns false
+    // when there is nothing to run the child on.
+    virtual bool fork_guest(uint32_t child_stack, const std::function<void(LinuxEmulator &child)> &setup) = 0;
+
+    // Replaces the calling guest with one running image as soon as the ECALL returns, the new guest's
+    // LinuxEmulator takes the process over with take_process. Throws std::invalid_argument when image
+    // is no RV32 executable or does not fit into guest memory.
+    virtual void exec_guest(std::span<const uint8_t> image, const std::vector<std::string> &argv,
+                            const std::vector<std::string> &envp) = 0;
+};
+
+// The children of one guest and how they ended, shared between the parent and the children
+class ChildTable
+{
+  public:
+    struct Reaped
+    {
+        uint32_t pid;    // 0 when no child matches
+        uint32_t status; // in the format of wait4
+    };
+
+    void add(uint32_t pid);
+
+    // Records the status of an exiting child and wakes a parent waiting for it
+    void report(uint32_t pid, uint32_t status);
+
+    // Removes an ended child, any one when pid is 0, and returns its status. Returns nullopt while the
+    // matching children are still running and registers waker, if any, for their exit.
+    std::optional<Reaped> reap(uint32_t pid, const std::shared_ptr<GuestWaker> &waker);
+
+  private:
+    std::mutex mutex;
+    std::map<uint32_t, std::optional<uint32_t>> children; // status by pid, none while running
+    WaiterList waiting;
+};
+
+// Unique among all guests of this process
+uint32_t allocate_guest_pid();
@@ -0,0 +1,66 @@
+#include "guest-waker.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+GuestWaker::GuestWaker() : fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (fd < 0)
+    {
+        throw std::runtime_error(std::string("Cannot create an eventfd for a waiting guest: ") + strerror(errno));
+    }
+}
+
+GuestWaker::~GuestWaker()
+{
+    close(fd);
+}
+
+void GuestWaker::clear()
+{
+    uint64_t value = 0;
+    [[maybe_unused]] const ssize_t ignored = read(fd, &value, sizeof(value));
+}
+
+void GuestWaker::wake()
+{
+    const uint64_t one = 1;
+    [[maybe_unused]] const ssize_t ignored = write(fd, &one, sizeof(one));
+}
+
+void GuestWaker::wait()
+{
+    pollfd ready{.fd = fd, .events = POLLIN, .revents = 0};
+    while (poll(&ready, 1, -1) < 0 && errno == EINTR)
+    {
+    }
+}
+
+void WaiterList::add(const std::shared_ptr<GuestWaker> &waker)
+{
+    for (const std::weak_ptr<GuestWaker> &waiter : waiters)
+    {
+        if (waiter.lock() == waker)
+        {
+            return;
+        }
+    }
+    waiters.push_back(waker);
+}
+
+void WaiterList::wake_all()
+{
+    for (const std::weak_ptr<GuestWaker> &waiter : waiters)
+    {
+        if (const std::shared_ptr<GuestWaker> waker = waiter.lock())
+        {
+            waker->wake();
+        }
+    }
+    waiters.clear();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+/*
+    An eventfd a guest blocks on while it waits for another guest of this process, e.g. for data in
+    a GuestPipe or for a child to exit. The guest registers its waker with what it waits for and then
+    blocks on the fd, a cooperative guest in the Scheduler's epoll set like on any host fd, any other
+    in poll. Whoever changes the state wakes the registered wakers, so the kernel only gets involved
+    when a guest actually has to wait.
+*/
+class GuestWaker
+{
+  public:
+    // Throws std::runtime_error when the eventfd cannot be created
+    GuestWaker();
+    ~GuestWaker();
+
+    GuestWaker(const GuestWaker &) = delete;
+    GuestWaker &operator=(const GuestWaker &) = delete;
+
+    int get_fd() const
+    {
+        return fd;
+    }
+
+    // Forgets earlier wake ups, called before the state waited for is checked
+    void clear();
+
+    void wake();
+
+    // Blocks the host thread until the next wake
+    void wait();
+
+  private:
+    int fd;
+};
+
+// The wakers of the guests waiting for one thing, guarded by the lock of that thing
+class WaiterList
+{
+  public:
+    void add(const std::shared_ptr<GuestWaker> &waker);
+
+    // Wakes every guest still there and forgets them, a guest that still has to wait registers again
+    void wake_all();
+
+  private:
+    std::vector<std::weak_ptr<GuestWaker>> waiters;
+};
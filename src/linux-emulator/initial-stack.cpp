@@ -0,0 +1,79 @@
+#include "initial-stack.hpp"
+#include <elf.h>
+#include <stdexcept>
+#include <utility>
+
+static constexpr uint32_t stack_alignment = 16;
+static constexpr uint32_t clock_ticks_per_second = 100;
+
+uint32_t InitialStack::write(Mmu &mmu, uint32_t bottom, uint32_t top) const
+{
+    uint32_t sp = top;
+    const auto push_bytes = [&](const void *data, uint32_t size) {
+        if (sp < bottom || sp - bottom < size)
+        {
+            throw std::invalid_argument("Arguments and environment do not fit on the stack");
+        }
+
+        sp -= size;
+        mmu.copy_from_host(sp, std::span<const uint8_t>((const uint8_t *)data, size));
+        return sp;
+    };
+
+    std::vector<uint32_t> argv_addrs;
+    for (const std::string &arg : argv)
+    {
+        argv_addrs.push_back(push_bytes(arg.c_str(), arg.size() + 1));
+    }
+
+    std::vector<uint32_t> envp_addrs;
+    for (const std::string &env : envp)
+    {
+        envp_addrs.push_back(push_bytes(env.c_str(), env.size() + 1));
+    }
+
+    const uint32_t random_addr = push_bytes(random.data(), random.size());
+
+    std::vector<std::pair<uint32_t, uint32_t>> auxv;
+    if (program_headers != 0)
+    {
+        auxv.emplace_back(AT_PHDR, program_headers);
+        auxv.emplace_back(AT_PHENT, program_header_size);
+        auxv.emplace_back(AT_PHNUM, program_header_count);
+    }
+    auxv.emplace_back(AT_PAGESZ, Mmu::page_size);
+    if (interpreter_base != 0)
+    {
+        auxv.emplace_back(AT_BASE, interpreter_base);
+    }
+    auxv.emplace_back(AT_ENTRY, entry_point);
+    auxv.emplace_back(AT_UID, 0);
+    auxv.emplace_back(AT_EUID, 0);
+    auxv.emplace_back(AT_GID, 0);
+    auxv.emplace_back(AT_EGID, 0);
+    auxv.emplace_back(AT_CLKTCK, clock_ticks_per_second);
+    auxv.emplace_back(AT_SECURE, 0);
+    auxv.emplace_back(AT_RANDOM, random_addr);
+    if (!argv_addrs.empty())
+    {
+        auxv.emplace_back(AT_EXECFN, argv_addrs.front());
+    }
+    auxv.emplace_back(AT_NULL, 0);
+
+    std::vector<uint32_t> words;
+    words.push_back(argv.size());
+    words.insert(words.end(), argv_addrs.begin(), argv_addrs.end());
+    words.push_back(0);
+    words.insert(words.end(), envp_addrs.begin(), envp_addrs.end());
+    words.push_back(0);
+    for (const auto &[type, value] : auxv)
+    {
+        words.push_back(type);
+        words.push_back(value);
+    }
+
+    // pad so that argc ends up at the aligned stack pointer
+    const uint32_t vectors_size = words.size() * sizeof(uint32_t);
+    sp -= (sp - vectors_size) % stack_alignment;
+    return push_bytes(words.data(), vectors_size);
+}
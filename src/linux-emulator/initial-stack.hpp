@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../mmu/mmu.hpp"
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+    The stack a Linux process starts with.
+
+    From sp upwards: argc, the argv pointers and a null, the envp pointers and a null, then the
+    auxiliary vector of (type, value) pairs ending in AT_NULL. The strings and the AT_RANDOM bytes
+    sit above the vectors at the top of the stack. sp is 16 byte aligned, as the RISC-V psABI requires.
+*/
+struct InitialStack
+{
+    std::vector<std::string> argv;
+    std::vector<std::string> envp;
+
+    // auxiliary vector
+    uint32_t entry_point = 0;     // of the program, not of its dynamic linker
+    uint32_t interpreter_base = 0; // AT_BASE, left out when 0
+    uint32_t program_headers = 0; // AT_PHDR, left out when 0
+    uint32_t program_header_size = 0;
+    uint32_t program_header_count = 0;
+    std::array<uint8_t, 16> random = {}; // the bytes AT_RANDOM points at, libc seeds its stack protector from them
+
+    // Builds the stack below top, returns the initial sp. Throws std::invalid_argument when it
+    // would not fit above bottom.
+    uint32_t write(Mmu &mmu, uint32_t bottom, uint32_t top) const;
+};
@@ -1,8 +1,13 @@
 #include "linux-emulator.hpp"
-#include <cassert>
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
 #include <unistd.h>
 #include <utility>
 
@@ -31,24 +36,345 @@ struct stat
     unsigned int __unused5;
 };
 
+// https://github.com/torvalds/linux/blob/master/include/uapi/linux/stat.h, rv32 has only statx
+struct statx_timestamp
+{
+    int64_t tv_sec;
+    uint32_t tv_nsec;
+    int32_t __reserved;
+};
+
+struct statx
+{
+    uint32_t stx_mask;
+    uint32_t stx_blksize;
+    uint64_t stx_attributes;
+    uint32_t stx_nlink;
+    uint32_t stx_uid;
+    uint32_t stx_gid;
+    uint16_t stx_mode;
+    uint16_t __spare0;
+    uint64_t stx_ino;
+    uint64_t stx_size;
+    uint64_t stx_blocks;
+    uint64_t stx_attributes_mask;
+    statx_timestamp stx_atime;
+    statx_timestamp stx_btime;
+    statx_timestamp stx_ctime;
+    statx_timestamp stx_mtime;
+    uint32_t stx_rdev_major;
+    uint32_t stx_rdev_minor;
+    uint32_t stx_dev_major;
+    uint32_t stx_dev_minor;
+    uint64_t __spare2[14];
+};
+static_assert(sizeof(struct statx) == 256);
+
+/*
+    Time values of the *_time64 syscalls, which rv32 builds of musl and glibc use, are the kernel's
+    64 bit time: seconds and sub-seconds as two little endian 64 bit words. The older numbers
+    (nanosleep, clock_gettime, clock_getres, clock_nanosleep and gettimeofday) take the 32 bit
+    layout of two 32 bit words.
+*/
+struct guest_time
+{
+    int64_t seconds;
+    int64_t fraction; // nanoseconds or microseconds
+};
+
+struct guest_time32
+{
+    int32_t seconds;
+    int32_t fraction;
+};
+
+static uint32_t time_size(bool time64)
+{
+    return time64 ? sizeof(guest_time) : sizeof(guest_time32);
+}
+
+static constexpr int64_t ns_per_second = 1000000000;
+static constexpr uint32_t clock_monotonic = 1;
+static constexpr uint32_t timer_abstime = 1;
+
+static constexpr uint32_t mode_file = 0100444; // S_IFREG, read only
+static constexpr uint32_t mode_terminal = 020620; // S_IFCHR
+static constexpr uint32_t mode_pipe = 010600; // S_IFIFO
+static constexpr uint32_t at_empty_path = 0x1000;
+static constexpr uint32_t map_fixed = 0x10;
+static constexpr uint32_t map_anonymous = 0x20;
+
+static constexpr uint32_t o_wronly = 01;
+static constexpr uint32_t o_rdwr = 02;
+static constexpr uint32_t o_nonblock = 04000;
+static constexpr uint32_t o_cloexec = 02000000;
+static constexpr uint32_t fd_cloexec = 1;
+static constexpr uint32_t f_dupfd = 0;
+static constexpr uint32_t f_getfd = 1;
+static constexpr uint32_t f_setfd = 2;
+static constexpr uint32_t f_getfl = 3;
+static constexpr uint32_t f_setfl = 4;
+static constexpr uint32_t f_dupfd_cloexec = 1030;
+static constexpr uint32_t iov_max = 1024;
+
+static constexpr uint32_t clone_vm = 0x100;
+static constexpr uint32_t clone_vfork = 0x4000;
+static constexpr uint32_t clone_parent_settid = 0x00100000;
+static constexpr uint32_t clone_child_cleartid = 0x00200000;
+static constexpr uint32_t clone_child_settid = 0x01000000;
+static constexpr uint32_t sigkill = 9;
+static constexpr uint32_t sigpipe = 13;
+static constexpr uint32_t sigstop = 19;
+static constexpr uint32_t sig_dfl = 0;
+static constexpr uint32_t sig_ign = 1;
+static constexpr uint32_t signal_count = 64; // _NSIG
+static constexpr uint32_t sigset_size = 8;
+static constexpr uint32_t sig_setmask = 2; // the highest sigprocmask how
+static constexpr uint32_t sigchld = 17;
+static constexpr uint32_t wnohang = 1;
+static constexpr uint32_t wexited = 4;
+static constexpr uint32_t p_all = 0;
+static constexpr uint32_t p_pid = 1;
+static constexpr uint32_t cld_exited = 1;
+static constexpr uint32_t cld_killed = 2;
+
+// https://github.com/torvalds/linux/blob/master/include/uapi/asm-generic/siginfo.h, the SIGCHLD fields
+struct child_siginfo
+{
+    int32_t si_signo;
+    int32_t si_errno;
+    int32_t si_code;
+    int32_t si_pid;
+    uint32_t si_uid;
+    int32_t si_status;
+    uint8_t padding[104];
+};
+static_assert(sizeof(child_siginfo) == 128);
+
+static int64_t host_monotonic_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LinuxEmulator::LinuxEmulator(Mmu &mmu) : mmu(mmu), pid(allocate_guest_pid())
+{
+    for (uint32_t fd = 0; fd < standard_streams; ++fd)
+    {
+        open_files[fd] = OpenFile{.stream = (int)fd};
+    }
+}
+
+LinuxEmulator::LinuxEmulator(const LinuxEmulator &parent, Mmu &mmu)
+    : mmu(mmu), handlers(parent.handlers), sysroot(parent.sysroot), open_files(parent.open_files), clock(parent.clock),
+      host_fds(parent.host_fds), cooperative(parent.cooperative), blocked(parent.blocked), wait(parent.wait),
+      sleep_deadline_ns(parent.sleep_deadline_ns), pipe_write_done(parent.pipe_write_done), exit_code(parent.exit_code),
+      sigpipe_handler(parent.sigpipe_handler), pid(allocate_guest_pid())
+{
+    // the parent's waker is not this guest's, it retries at once and registers its own
+    if (parent.waker != nullptr && wait.fd == parent.waker->get_fd())
+    {
+        wait = Wait{.fd = -1, .writable = false, .deadline_ns = 0};
+    }
+}
+
+LinuxEmulator::~LinuxEmulator()
+{
+    report_signal(sigkill);
+}
+
 std::pair<uint32_t, bool> LinuxEmulator::handle_syscall(const Syscall &syscall)
 {
+    blocked = false;
+    if (metrics == nullptr)
+    {
+        return log_syscall(syscall);
+    }
+
+    const auto [ret, exit] = log_syscall(syscall);
+    if (blocked)
+    {
+        // counted when it is issued again and completes
+        return {ret, exit};
+    }
+
+    metrics->count_syscall(syscall.call_num);
+    if (syscall.call_num == 63 && (int32_t)ret > 0) // read
+    {
+        metrics->bytes_read.add(ret);
+    }
+    else if (syscall.call_num == 64 && (int32_t)ret > 0) // write
+    {
+        metrics->bytes_written.add(ret);
+    }
+    else if (syscall.call_num == 214) // brk
+    {
+        metrics->brk_high_water.raise(mmu.get_brk_alloc());
+    }
+
+    return {ret, exit};
+}
+
+std::pair<uint32_t, bool> LinuxEmulator::log_syscall(const Syscall &syscall)
+{
+    if (syscall_log == nullptr)
+    {
+        return dispatch_syscall(syscall);
+    }
+
+    if (syscall_log->get_mode() == SyscallLog::Mode::replay)
+    {
+        return replay_syscall(syscall);
+    }
+
+    recorded_writes.clear();
+    auto [ret, exit] = dispatch_syscall(syscall);
+    if (blocked)
+    {
+        return {ret, exit};
+    }
+    syscall_log->append(SyscallLog::Entry{
+        .call_num = syscall.call_num,
+        .ret = ret,
+        .exit = exit,
+        .writes = std::move(recorded_writes)});
+
+    return {ret, exit};
+}
+
+std::pair<uint32_t, bool> LinuxEmulator::replay_syscall(const Syscall &syscall)
+{
+    SyscallLog::Entry entry = syscall_log->next();
+    if (entry.call_num != syscall.call_num)
+    {
+        throw std::runtime_error("Replay diverged: guest issued syscall " + std::to_string(syscall.call_num) +
+                                 ", log has " + std::to_string(entry.call_num));
+    }
+
+    switch (syscall.call_num)
+    {
+        case 63:  // read
+        case 64:  // write
+        case 66:  // writev
+        case 67:  // pread64
+        case 101: // nanosleep
+        case 113: // clock_gettime
+        case 115: // clock_nanosleep
+        case 169: // gettimeofday
+        case 278: // getrandom
+        case 403: // clock_gettime64
+        case 407: // clock_nanosleep_time64
+        {
+            // Host I/O, time and entropy are never repeated, the guest only sees what was recorded
+            for (const SyscallLog::MemoryWrite &write : entry.writes)
+            {
+                mmu.copy_from_host(write.addr, write.bytes);
+            }
+
+            // files are emulator state, their position moves as recorded
+            auto open_file = open_files.find(syscall.arg1);
+            if (syscall.call_num == 63 && open_file != open_files.end() && open_file->second.is_file() && (int32_t)entry.ret > 0)
+            {
+                open_file->second.offset += entry.ret;
+            }
+
+            return {entry.ret, entry.exit};
+        }
+        default:
+        {
+            // Everything else only touches emulator state, so it is executed again and cross-checked
+            auto [ret, exit] = dispatch_syscall(syscall);
+            if (ret != entry.ret || exit != entry.exit)
+            {
+                throw std::runtime_error("Replay diverged: syscall " + std::to_string(syscall.call_num) +
+                                         " returned " + std::to_string(ret) + ", log has " + std::to_string(entry.ret));
+            }
+
+            return {ret, exit};
+        }
+    }
+}
+
+std::pair<uint32_t, bool> LinuxEmulator::dispatch_syscall(const Syscall &syscall)
+{
+    if (!handlers.empty())
+    {
+        auto handler = handlers.find(syscall.call_num);
+        if (handler != handlers.end())
+        {
+            return handler->second(syscall);
+        }
+    }
+
     // https://github.com/riscv-collab/riscv-gnu-toolchain/blob/master/linux-headers/include/asm-generic/unistd.h
     switch (syscall.call_num)
     {
-        case 57: // close
+        case 29: // ioctl
         {
-            uint32_t fd = syscall.arg1;
-            if (fd == 0 && fd == 1 && fd == 2)
+            // no terminal behind any fd, isatty is false
+            return {-enotty, false};
+        }
+        case 48: // faccessat
+        {
+            std::string path;
+            if (!read_path(syscall.arg2, path))
             {
-                return {0, false};
+                return {-efault, false};
             }
 
-            return {-1, false};
+            return {find_file(path) ? 0 : -enoent, false};
+        }
+        case 56: // openat
+        {
+            uint32_t path_addr = syscall.arg2;
+            uint32_t flags = syscall.arg3;
+
+            return {handle_openat(path_addr, flags), false};
+        }
+        case 23: // dup
+        {
+            uint32_t fd = syscall.arg1;
+            return {duplicate_fd(fd, 0, false), false};
+        }
+        case 24: // dup3
+        {
+            uint32_t old_fd = syscall.arg1;
+            uint32_t new_fd = syscall.arg2;
+            uint32_t flags = syscall.arg3;
+
+            return {handle_dup3(old_fd, new_fd, flags), false};
+        }
+        case 25: // fcntl64
+        {
+            uint32_t fd = syscall.arg1;
+            uint32_t command = syscall.arg2;
+            uint32_t arg = syscall.arg3;
+
+            return {handle_fcntl(fd, command, arg), false};
+        }
+        case 57: // close
+        {
+            // a pipe end closes with the last fd referring to it
+            uint32_t fd = syscall.arg1;
+            return {open_files.erase(fd) != 0 ? 0 : -ebadf, false};
+        }
+        case 59: // pipe2
+        {
+            uint32_t fds_out = syscall.arg1;
+            uint32_t flags = syscall.arg2;
+
+            return {handle_pipe2(fds_out, flags), false};
         }
         case 62: // llseek
         {
-            return {-1, false};
+            // Linux passes the offset split in two and a result pointer, the proxy kernel ABI of
+            // libgloss is lseek(fd, offset, whence) and leaves a4 zero
+            if (syscall.arg4 == 0)
+            {
+                return {handle_lseek(syscall.arg1, (int32_t)syscall.arg2, syscall.arg3, 0), false};
+            }
+
+            const int64_t offset = (int64_t)(((uint64_t)syscall.arg2 << 32) | syscall.arg3);
+            return {handle_lseek(syscall.arg1, offset, syscall.arg5, syscall.arg4), false};
         }
         case 63: // read
         {
@@ -64,7 +390,79 @@ std::pair<uint32_t, bool> LinuxEmulator::handle_syscall(const Syscall &syscall)
             uint32_t buff_addr = syscall.arg2;
             uint32_t size = syscall.arg3;
 
-            return {handle_write(fd, buff_addr, size), false};
+            const int32_t ret = handle_write(fd, buff_addr, size);
+            return ret == -epipe ? broken_pipe() : std::pair<uint32_t, bool>{ret, false};
+        }
+        case 66: // writev
+        {
+            uint32_t fd = syscall.arg1;
+            uint32_t iov_addr = syscall.arg2;
+            uint32_t iov_count = syscall.arg3;
+
+            if (iov_count > iov_max)
+            {
+                return {-einval, false};
+            }
+            if (iov_count != 0 && !mmu.contains(iov_addr, iov_count * 8))
+            {
+                return {-efault, false};
+            }
+
+            int32_t total = 0;
+            for (uint32_t i = 0; i < iov_count; ++i)
+            {
+                const uint32_t base = mmu.read<uint32_t>(iov_addr + i * 8);
+                const uint32_t length = mmu.read<uint32_t>(iov_addr + i * 8 + 4);
+                const int32_t written = length == 0 ? 0 : handle_write(fd, base, length);
+                if (blocked)
+                {
+                    // what was written so far completes the call, including the start of this buffer
+                    blocked = total == 0;
+                    if (!blocked)
+                    {
+                        total += pipe_write_done;
+                        pipe_write_done = 0;
+                    }
+                    return {total, false};
+                }
+                if (written == -epipe && total == 0)
+                {
+                    return broken_pipe();
+                }
+                if (written < 0)
+                {
+                    return {total > 0 ? total : written, false};
+                }
+                total += written;
+                if ((uint32_t)written < length)
+                {
+                    // the fd took what it could, the later buffers would leave a gap
+                    break;
+                }
+            }
+
+            return {total, false};
+        }
+        case 67: // pread64
+        {
+            uint32_t fd = syscall.arg1;
+            auto open_file = open_files.find(fd);
+            if (open_file == open_files.end())
+            {
+                return {-ebadf, false};
+            }
+            if (!open_file->second.is_file())
+            {
+                return {-espipe, false};
+            }
+
+            // read at the offset, the file position stays
+            const uint32_t position = open_file->second.offset;
+            const uint64_t offset = ((uint64_t)syscall.arg5 << 32) | syscall.arg4;
+            open_file->second.offset = (uint32_t)std::min<uint64_t>(offset, open_file->second.file.size);
+            const int32_t ret = handle_read(fd, syscall.arg2, syscall.arg3);
+            open_file->second.offset = position;
+            return {ret, false};
         }
         case 80: // fstat
         {
@@ -74,18 +472,175 @@ std::pair<uint32_t, bool> LinuxEmulator::handle_syscall(const Syscall &syscall)
             return {handle_fstat(fd, stat_out), false};
         }
         case 93: // exit
+        case 94: // exit_group
         {
-            uint32_t exit_code = syscall.arg1;
-            std::cout << "\nExit code = " << exit_code << '\n';
+            exit_code = syscall.arg1;
+            clear_tid();
+            report_exit((exit_code & 0xff) << 8);
             return {0, true};
         }
+        case 95: // waitid
+        {
+            uint32_t id_type = syscall.arg1;
+            uint32_t id = syscall.arg2;
+            uint32_t info_out = syscall.arg3;
+            uint32_t options = syscall.arg4;
+
+            return {handle_waitid(id_type, id, info_out, options), false};
+        }
+        case 96: // set_tid_address
+        {
+            clear_tid_addr = syscall.arg1;
+            return {pid, false};
+        }
+        case 99: // set_robust_list
+        {
+            return {0, false};
+        }
+        case 101: // nanosleep
+        {
+            uint32_t request_addr = syscall.arg1;
+            uint32_t remain_addr = syscall.arg2;
+
+            return {handle_nanosleep(clock_monotonic, 0, request_addr, remain_addr, false), false};
+        }
+        case 113: // clock_gettime
+        case 403: // clock_gettime64
+        case 114: // clock_getres
+        case 406: // clock_getres_time64
+        {
+            uint32_t clock_id = syscall.arg1;
+            uint32_t timespec_out = syscall.arg2;
+            const bool resolution = syscall.call_num == 114 || syscall.call_num == 406;
+            const bool time64 = syscall.call_num == 403 || syscall.call_num == 406;
+
+            return {handle_clock_gettime(clock_id, timespec_out, resolution, time64), false};
+        }
+        case 115: // clock_nanosleep
+        case 407: // clock_nanosleep_time64
+        {
+            uint32_t clock_id = syscall.arg1;
+            uint32_t flags = syscall.arg2;
+            uint32_t request_addr = syscall.arg3;
+            uint32_t remain_addr = syscall.arg4;
+
+            return {handle_nanosleep(clock_id, flags, request_addr, remain_addr, syscall.call_num == 407), false};
+        }
+        case 134: // rt_sigaction
+        {
+            uint32_t signal = syscall.arg1;
+            uint32_t action_addr = syscall.arg2;
+            uint32_t old_action_out = syscall.arg3;
+            uint32_t set_size = syscall.arg4;
+
+            return {handle_sigaction(signal, action_addr, old_action_out, set_size), false};
+        }
+        case 135: // rt_sigprocmask
+        {
+            uint32_t how = syscall.arg1;
+            uint32_t set_addr = syscall.arg2;
+            uint32_t old_set_out = syscall.arg3;
+            uint32_t set_size = syscall.arg4;
+
+            return {handle_sigprocmask(how, set_addr, old_set_out, set_size), false};
+        }
+        case 169: // gettimeofday
+        {
+            uint32_t timeval_out = syscall.arg1;
+            uint32_t timezone_out = syscall.arg2;
+
+            return {handle_gettimeofday(timeval_out, timezone_out), false};
+        }
+        case 172: // getpid
+        case 178: // gettid
+        {
+            return {pid, false};
+        }
+        case 173: // getppid
+        {
+            return {parent_pid, false};
+        }
         case 214: // brk
         {
             uint32_t addr = syscall.arg1;
             return {handle_brk(addr), false};
         }
+        case 215: // munmap
+        {
+            uint32_t addr = syscall.arg1;
+            uint32_t length = syscall.arg2;
+            if (addr % Mmu::page_size != 0 || length == 0)
+            {
+                return {-einval, false};
+            }
+
+            mmu.release_mapping(addr, length);
+            return {0, false};
+        }
+        case 226: // mprotect
+        case 233: // madvise
+        {
+            return {0, false};
+        }
+        case 220: // clone
+        {
+            uint32_t flags = syscall.arg1;
+            uint32_t child_stack = syscall.arg2;
+            uint32_t parent_tid_out = syscall.arg3;
+            uint32_t child_tid_out = syscall.arg4; // the tls in arg5 follows it without CLONE_BACKWARDS
+
+            return {handle_clone(flags, child_stack, parent_tid_out, child_tid_out), false};
+        }
+        case 221: // execve
+        {
+            uint32_t path_addr = syscall.arg1;
+            uint32_t argv_addr = syscall.arg2;
+            uint32_t envp_addr = syscall.arg3;
+
+            const auto [ret, replaced] = handle_execve(path_addr, argv_addr, envp_addr);
+            return {ret, replaced};
+        }
+        case 222: // mmap2
+        {
+            uint32_t addr = syscall.arg1;
+            uint32_t length = syscall.arg2;
+            uint32_t flags = syscall.arg4;
+            uint32_t fd = syscall.arg5;
+            uint32_t page_offset = syscall.arg6;
+
+            return {handle_mmap(addr, length, flags, fd, page_offset), false};
+        }
+        case 260: // wait4
+        {
+            int32_t child_pid = syscall.arg1;
+            uint32_t status_out = syscall.arg2;
+            uint32_t options = syscall.arg3;
+
+            return {handle_wait4(child_pid, status_out, options), false};
+        }
+        case 278: // getrandom
+        {
+            uint32_t buff_addr = syscall.arg1;
+            uint32_t size = syscall.arg2;
+
+            return {handle_getrandom(buff_addr, size), false};
+        }
+        case 291: // statx
+        {
+            uint32_t fd = syscall.arg1;
+            uint32_t path_addr = syscall.arg2;
+            uint32_t flags = syscall.arg3;
+            uint32_t statx_out = syscall.arg5;
+
+            return {handle_statx(fd, path_addr, flags, statx_out), false};
+        }
+        case 435: // clone3
+        {
+            // libc falls back to clone
+            return {-enosys, false};
+        }
         default:
-            assert(false);
+            throw GuestFault(GuestFault::Kind::unsupported_syscall, syscall.call_num);
     }
 
     return {0, 0};
@@ -93,59 +648,187 @@ std::pair<uint32_t, bool> LinuxEmulator::handle_syscall(const Syscall &syscall)
 
 int32_t LinuxEmulator::handle_read(uint32_t fd, uint32_t buff_addr, uint32_t size)
 {
-    if (fd != 0)
+    auto open_file = open_files.find(fd);
+    if (open_file == open_files.end())
     {
-        return -1;
+        return -ebadf;
+    }
+    if (!mmu.contains(buff_addr, size))
+    {
+        return -efault;
     }
 
-    uint8_t *buf = new uint8_t[size];
-    int32_t r = read(fd, buf, size);
-    mmu.write_from(buff_addr, buf, buf + size);
-    return r;
-
-    /*
-    for (uint32_t i = 0; i < size; ++i)
+    OpenFile &file = open_file->second;
+    if (file.pipe != nullptr)
     {
-        char c = getchar();
-        if (c == '\n')
+        if (file.pipe->is_writer())
+        {
+            return -ebadf;
+        }
+
+        while (true)
         {
-            mmu.write(buff_addr + i, c);
-            return i + 1;
+            const std::shared_ptr<GuestWaker> pipe_waker = file.nonblocking ? nullptr : get_waker();
+            if (pipe_waker != nullptr)
+            {
+                pipe_waker->clear();
+            }
+
+            // straight from the pipe's buffer into guest memory
+            uint32_t copied = 0;
+            const std::optional<uint32_t> count = file.pipe->get_pipe().read(
+                size,
+                [&](std::span<const uint8_t> bytes) {
+                    copy_to_guest(buff_addr + copied, bytes);
+                    copied += bytes.size();
+                },
+                pipe_waker);
+            if (count.has_value())
+            {
+                return *count;
+            }
+            if (file.nonblocking)
+            {
+                return -eagain;
+            }
+            if (wait_for_waker())
+            {
+                return 0;
+            }
         }
+    }
+
+    if (file.is_file())
+    {
+        const uint32_t count = std::min(size, file.file.size - file.offset);
+        copy_to_guest(buff_addr, std::span(file.file.memory->data() + file.offset, count));
+        file.offset += count;
+        return count;
+    }
 
-        mmu.write(buff_addr + i, c);
+    if (would_block(host_fds[file.stream], false))
+    {
+        return 0;
     }
 
-    return size;
-    */
+    std::vector<uint8_t> buf(size);
+    int32_t r = read(host_fds[file.stream], buf.data(), size);
+    if (r > 0)
+    {
+        copy_to_guest(buff_addr, std::span(buf).first(r));
+    }
+    return r;
 }
 
 int32_t LinuxEmulator::handle_write(uint32_t fd, uint32_t buff_addr, uint32_t size)
 {
-    if (fd != 1 && fd != 2)
+    auto open_file = open_files.find(fd);
+    if (open_file == open_files.end() || open_file->second.is_file())
+    {
+        return -ebadf;
+    }
+    if (!mmu.contains(buff_addr, size))
     {
-        return -1;
+        return -efault;
     }
 
-    
-    uint8_t *buf = new uint8_t[size];
-    mmu.read_bunch(buff_addr, buf, size);
-    int r = write(fd, buf, size);
-    return r;
+    const OpenFile &file = open_file->second;
+    if (file.pipe != nullptr)
+    {
+        if (!file.pipe->is_writer())
+        {
+            return -ebadf;
+        }
 
-/*
-    for (uint32_t i = 0; i < size; ++i)
+        // A blocking write goes on until all of it is in the pipe. pipe_write_done carries the part
+        // already written when a cooperative guest has to wait for room, the retry continues after it.
+        while (true)
+        {
+            const std::shared_ptr<GuestWaker> pipe_waker = file.nonblocking ? nullptr : get_waker();
+            if (pipe_waker != nullptr)
+            {
+                pipe_waker->clear();
+            }
+
+            // straight from guest memory into the pipe's buffer
+            uint32_t copied = pipe_write_done;
+            const std::optional<int32_t> count = file.pipe->get_pipe().write(
+                size - pipe_write_done,
+                [&](std::span<uint8_t> bytes) {
+                    mmu.copy_to_host(buff_addr + copied, bytes);
+                    copied += bytes.size();
+                },
+                pipe_waker);
+            if (count.has_value() && *count != GuestPipe::broken)
+            {
+                pipe_write_done += *count;
+                if (pipe_write_done < size && !file.nonblocking)
+                {
+                    continue;
+                }
+            }
+            if (count.has_value())
+            {
+                // Linux as well reports the bytes written before the readers went away
+                const int32_t written = pipe_write_done;
+                pipe_write_done = 0;
+                return written > 0 ? written : *count == GuestPipe::broken ? -epipe : 0;
+            }
+            if (file.nonblocking)
+            {
+                return -eagain;
+            }
+            if (wait_for_waker())
+            {
+                return 0;
+            }
+        }
+    }
+
+    if (would_block(host_fds[file.stream], true))
     {
-        char c = mmu.read<char>(buff_addr + i);
-        std::cout << c << std::flush;
+        return 0;
     }
-*/
-    return size;
+
+    std::vector<uint8_t> buf(size);
+    mmu.copy_to_host(buff_addr, buf);
+    int r = write(host_fds[file.stream], buf.data(), size);
+    return r;
 }
 
 int32_t LinuxEmulator::handle_fstat(uint32_t fd, uint32_t stat_out)
 {
     struct stat st = {};
+    if (!mmu.contains(stat_out, sizeof(st)))
+    {
+        return -efault;
+    }
+
+    auto open_file = open_files.find(fd);
+    if (open_file == open_files.end())
+    {
+        return -ebadf;
+    }
+    if (open_file->second.is_file())
+    {
+        st.st_ino = fd;
+        st.st_mode = mode_file;
+        st.st_nlink = 1;
+        st.st_size = open_file->second.file.size;
+        st.st_blksize = Mmu::page_size;
+        st.st_blocks = (open_file->second.file.size + 511) / 512;
+        copy_to_guest(stat_out, std::span((const uint8_t *)&st, sizeof(st)));
+        return 0;
+    }
+    if (open_file->second.pipe != nullptr)
+    {
+        st.st_ino = fd;
+        st.st_mode = mode_pipe;
+        st.st_nlink = 1;
+        st.st_blksize = Mmu::page_size;
+        copy_to_guest(stat_out, std::span((const uint8_t *)&st, sizeof(st)));
+        return 0;
+    }
 
     st.st_dev = 26;
     st.st_ino = 6;
@@ -163,7 +846,7 @@ int32_t LinuxEmulator::handle_fstat(uint32_t fd, uint32_t stat_out)
     st.st_mtime_nsec = 0;
     st.st_ctime = 0;
     st.st_ctime_nsec = 0;
-    mmu.write_from(stat_out, (uint8_t *)&st, (uint8_t *)&st + sizeof(st));
+    copy_to_guest(stat_out, std::span((const uint8_t *)&st, sizeof(st)));
 
     return 0;
 }
@@ -175,7 +858,976 @@ int32_t LinuxEmulator::handle_brk(uint32_t addr)
         return mmu.get_brk_alloc();
     }
     
-    const uint32_t alloc_size = addr - mmu.get_brk_alloc();
-    mmu.allocate(alloc_size);
+    // growing into the mappings fails the Linux way, the break stays where it was
+    const uint32_t brk = mmu.get_brk_alloc();
+    if (addr > brk && mmu.allocate(addr - brk) == 0)
+    {
+        return brk;
+    }
     return addr;
 }
+
+int32_t LinuxEmulator::handle_clock_gettime(uint32_t clock_id, uint32_t timespec_out, bool resolution, bool time64)
+{
+    int64_t ns = 0;
+    if (!clock.get_time(clock_id, ns))
+    {
+        return -einval;
+    }
+    if (timespec_out == 0)
+    {
+        return 0;
+    }
+    if (!mmu.contains(timespec_out, time_size(time64)))
+    {
+        return -efault;
+    }
+
+    if (resolution)
+    {
+        ns = clock.get_resolution();
+    }
+    write_time(timespec_out, ns / ns_per_second, ns % ns_per_second, time64);
+    return 0;
+}
+
+int32_t LinuxEmulator::handle_gettimeofday(uint32_t timeval_out, uint32_t timezone_out)
+{
+    if ((timeval_out != 0 && !mmu.contains(timeval_out, time_size(false))) ||
+        (timezone_out != 0 && !mmu.contains(timezone_out, 2 * sizeof(int32_t))))
+    {
+        return -efault;
+    }
+
+    int64_t ns = 0;
+    clock.get_time(0, ns);
+    if (timeval_out != 0)
+    {
+        write_time(timeval_out, ns / ns_per_second, ns % ns_per_second / 1000, false);
+    }
+    if (timezone_out != 0)
+    {
+        // UTC without daylight saving
+        const int32_t timezone[2] = {0, 0};
+        copy_to_guest(timezone_out, std::span((const uint8_t *)timezone, sizeof(timezone)));
+    }
+    return 0;
+}
+
+int32_t LinuxEmulator::handle_nanosleep(uint32_t clock_id, uint32_t flags, uint32_t request_addr, uint32_t remain_addr, bool time64)
+{
+    if (!mmu.contains(request_addr, time_size(time64)) || (remain_addr != 0 && !mmu.contains(remain_addr, time_size(time64))))
+    {
+        return -efault;
+    }
+
+    // only the low word of a 64 bit tv_nsec, rv32 user space leaves the high one as padding
+    const int64_t seconds = time64 ? mmu.read<int64_t>(request_addr) : mmu.read<int32_t>(request_addr);
+    const uint32_t nanoseconds = mmu.read<uint32_t>(request_addr + (time64 ? sizeof(int64_t) : sizeof(int32_t)));
+    if (seconds < 0 || nanoseconds >= ns_per_second || seconds > INT64_MAX / ns_per_second - 1)
+    {
+        return -einval;
+    }
+
+    int64_t deadline = seconds * ns_per_second + nanoseconds;
+    if ((flags & timer_abstime) == 0)
+    {
+        int64_t now = 0;
+        if (!clock.get_time(clock_id, now))
+        {
+            return -einval;
+        }
+        deadline += now;
+    }
+    if (cooperative && !clock.is_virtual())
+    {
+        // the host thread serves other guests meanwhile, the same call comes back to check the deadline
+        int64_t now = 0;
+        if (!clock.get_time(clock_id, now))
+        {
+            return -einval;
+        }
+        const int64_t host_now = host_monotonic_ns();
+        if (sleep_deadline_ns < 0)
+        {
+            sleep_deadline_ns = host_now + std::max<int64_t>(deadline - now, 0);
+        }
+        if (host_now < sleep_deadline_ns)
+        {
+            blocked = true;
+            wait = Wait{.fd = -1, .writable = false, .deadline_ns = sleep_deadline_ns};
+            return 0;
+        }
+        sleep_deadline_ns = -1;
+    }
+    else if (!clock.sleep_until(clock_id, deadline))
+    {
+        return -einval;
+    }
+
+    // never interrupted, nothing remains
+    if (remain_addr != 0 && (flags & timer_abstime) == 0)
+    {
+        write_time(remain_addr, 0, 0, time64);
+    }
+    return 0;
+}
+
+int32_t LinuxEmulator::handle_getrandom(uint32_t buff_addr, uint32_t size)
+{
+    if (!mmu.contains(buff_addr, size))
+    {
+        return -efault;
+    }
+
+    std::vector<uint8_t> bytes(size);
+    clock.fill_random(bytes);
+    copy_to_guest(buff_addr, bytes);
+    return size;
+}
+
+int32_t LinuxEmulator::handle_openat(uint32_t path_addr, uint32_t flags)
+{
+    std::string path;
+    if (!read_path(path_addr, path))
+    {
+        return -efault;
+    }
+    if ((flags & 3) != 0) // O_ACCMODE other than O_RDONLY
+    {
+        return -erofs;
+    }
+
+    std::optional<SharedObjectCache::File> file = find_file(path);
+    if (!file)
+    {
+        return -enoent;
+    }
+
+    const uint32_t fd = lowest_free_fd(0);
+    if (fd >= max_fds)
+    {
+        return -emfile;
+    }
+    open_files[fd] = OpenFile{.path = path, .file = std::move(*file), .offset = 0};
+    return fd;
+}
+
+int32_t LinuxEmulator::handle_lseek(uint32_t fd, int64_t offset, uint32_t whence, uint32_t result_addr)
+{
+    auto open_file = open_files.find(fd);
+    if (open_file == open_files.end())
+    {
+        return -ebadf;
+    }
+    if (!open_file->second.is_file())
+    {
+        return -espipe;
+    }
+
+    OpenFile &file = open_file->second;
+    const int64_t origin = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? file.offset : file.file.size;
+    if (whence > SEEK_END || origin + offset < 0 || origin + offset > UINT32_MAX)
+    {
+        return -einval;
+    }
+    if (result_addr != 0 && !mmu.contains(result_addr, sizeof(int64_t)))
+    {
+        return -efault;
+    }
+
+    // reads past the end return 0, so the offset needs no clamping
+    const uint32_t position = origin + offset;
+    file.offset = std::min(position, file.file.size);
+    if (result_addr != 0)
+    {
+        const int64_t result = position;
+        copy_to_guest(result_addr, std::span((const uint8_t *)&result, sizeof(result)));
+        return 0;
+    }
+    return position;
+}
+
+int32_t LinuxEmulator::handle_statx(uint32_t fd, uint32_t path_addr, uint32_t flags, uint32_t statx_out)
+{
+    struct statx stx = {};
+    std::string path;
+    if (!mmu.contains(statx_out, sizeof(stx)) || !read_path(path_addr, path))
+    {
+        return -efault;
+    }
+
+    uint32_t size = 0;
+    if (path.empty() && (flags & at_empty_path) != 0)
+    {
+        auto open_file = open_files.find(fd);
+        if (open_file == open_files.end())
+        {
+            return -ebadf;
+        }
+        const OpenFile &file = open_file->second;
+        stx.stx_mode = file.is_file() ? mode_file : file.pipe != nullptr ? mode_pipe : mode_terminal;
+        size = file.is_file() ? file.file.size : 0;
+    }
+    else
+    {
+        std::optional<SharedObjectCache::File> file = find_file(path);
+        if (!file)
+        {
+            return -enoent;
+        }
+        stx.stx_mode = mode_file;
+        size = file->size;
+    }
+
+    stx.stx_mask = 0x7ff; // STATX_BASIC_STATS
+    stx.stx_blksize = Mmu::page_size;
+    stx.stx_nlink = 1;
+    stx.stx_size = size;
+    stx.stx_blocks = (size + 511) / 512;
+    copy_to_guest(statx_out, std::span((const uint8_t *)&stx, sizeof(stx)));
+    return 0;
+}
+
+int32_t LinuxEmulator::handle_mmap(uint32_t addr, uint32_t length, uint32_t flags, uint32_t fd, uint32_t page_offset)
+{
+    const uint32_t size = (uint32_t)(((uint64_t)length + Mmu::page_size - 1) & ~(uint64_t)(Mmu::page_size - 1));
+    if (length == 0 || size == 0 || ((flags & map_fixed) != 0 && addr % Mmu::page_size != 0))
+    {
+        return -einval;
+    }
+
+    auto open_file = open_files.find(fd);
+    if ((flags & map_anonymous) == 0 && open_file == open_files.end())
+    {
+        return -ebadf;
+    }
+    if ((flags & map_anonymous) == 0 && !open_file->second.is_file())
+    {
+        return -enodev;
+    }
+
+    uint32_t target = addr;
+    if ((flags & map_fixed) == 0)
+    {
+        target = mmu.allocate_mapping(size);
+        if (target == 0)
+        {
+            return -enomem;
+        }
+    }
+    else if (!mmu.contains(target, size))
+    {
+        return -enomem;
+    }
+    else
+    {
+        mmu.reserve_mapping(target, size);
+    }
+
+    // file pages are shared with every other mapping of the file, past its end there are zeros
+    uint32_t mapped = 0;
+    if ((flags & map_anonymous) == 0)
+    {
+        const SharedObjectCache::File &file = open_file->second.file;
+        const uint64_t offset = (uint64_t)page_offset * Mmu::page_size;
+        if (offset < file.memory->size())
+        {
+            mapped = (uint32_t)std::min<uint64_t>(size, file.memory->size() - offset);
+            mmu.map_region(target, file.memory, offset, mapped);
+        }
+    }
+    if (mapped < size)
+    {
+        mmu.fill(target + mapped, 0, size - mapped);
+    }
+
+    return target;
+}
+
+int32_t LinuxEmulator::handle_pipe2(uint32_t fds_out, uint32_t flags)
+{
+    if ((flags & ~(o_nonblock | o_cloexec)) != 0)
+    {
+        return -einval;
+    }
+    if (!mmu.contains(fds_out, 2 * sizeof(int32_t)))
+    {
+        return -efault;
+    }
+
+    const uint32_t read_fd = lowest_free_fd(0);
+    const uint32_t write_fd = lowest_free_fd(read_fd + 1);
+    if (write_fd >= max_fds)
+    {
+        return -emfile;
+    }
+
+    auto [read_end, write_end] = GuestPipe::create();
+    const bool close_on_exec = (flags & o_cloexec) != 0;
+    const bool nonblocking = (flags & o_nonblock) != 0;
+    open_files[read_fd] = OpenFile{.pipe = std::move(read_end), .close_on_exec = close_on_exec, .nonblocking = nonblocking};
+    open_files[write_fd] = OpenFile{.pipe = std::move(write_end), .close_on_exec = close_on_exec, .nonblocking = nonblocking};
+
+    const int32_t fds[2] = {(int32_t)read_fd, (int32_t)write_fd};
+    copy_to_guest(fds_out, std::span((const uint8_t *)fds, sizeof(fds)));
+    return 0;
+}
+
+int32_t LinuxEmulator::handle_dup3(uint32_t old_fd, uint32_t new_fd, uint32_t flags)
+{
+    if ((flags & ~o_cloexec) != 0 || old_fd == new_fd)
+    {
+        return -einval;
+    }
+
+    auto open_file = open_files.find(old_fd);
+    if (open_file == open_files.end() || new_fd >= max_fds)
+    {
+        return -ebadf;
+    }
+
+    // whatever new_fd referred to is closed
+    OpenFile copy = open_file->second;
+    copy.close_on_exec = (flags & o_cloexec) != 0;
+    open_files[new_fd] = std::move(copy);
+    return new_fd;
+}
+
+int32_t LinuxEmulator::handle_fcntl(uint32_t fd, uint32_t command, uint32_t arg)
+{
+    auto open_file = open_files.find(fd);
+    if (open_file == open_files.end())
+    {
+        return -ebadf;
+    }
+
+    OpenFile &file = open_file->second;
+    switch (command)
+    {
+        case f_dupfd:
+        case f_dupfd_cloexec:
+            return duplicate_fd(fd, arg, command == f_dupfd_cloexec);
+        case f_getfd:
+            return file.close_on_exec ? fd_cloexec : 0;
+        case f_setfd:
+            file.close_on_exec = (arg & fd_cloexec) != 0;
+            return 0;
+        case f_getfl:
+        {
+            const uint32_t access = file.pipe != nullptr ? (file.pipe->is_writer() ? o_wronly : 0) : file.is_file() ? 0 : o_rdwr;
+            return access | (file.nonblocking ? o_nonblock : 0);
+        }
+        case f_setfl:
+            // the access mode stays, O_NONBLOCK only affects pipes
+            file.nonblocking = (arg & o_nonblock) != 0;
+            return 0;
+        default:
+            return -einval;
+    }
+}
+
+int32_t LinuxEmulator::duplicate_fd(uint32_t fd, uint32_t first, bool close_on_exec)
+{
+    auto open_file = open_files.find(fd);
+    if (open_file == open_files.end())
+    {
+        return -ebadf;
+    }
+    if (first >= max_fds)
+    {
+        return -einval;
+    }
+
+    const uint32_t new_fd = lowest_free_fd(first);
+    if (new_fd >= max_fds)
+    {
+        return -emfile;
+    }
+
+    OpenFile copy = open_file->second;
+    copy.close_on_exec = close_on_exec;
+    open_files[new_fd] = std::move(copy);
+    return new_fd;
+}
+
+int32_t LinuxEmulator::handle_clone(uint32_t flags, uint32_t child_stack, uint32_t parent_tid_out,
+                                    uint32_t child_tid_out)
+{
+    // fork, and the vfork posix_spawn does. The child always works on a copy of the memory, so it
+    // cannot pass anything back through it, and the parent goes on without waiting for an execve.
+    // The tid words a libc fork asks for are written like for a single threaded process.
+    const uint32_t exit_signal = flags & 0xff;
+    const uint32_t supported = 0xff | clone_vm | clone_vfork | clone_parent_settid | clone_child_cleartid |
+                               clone_child_settid;
+    if ((flags & ~supported) != 0 || (exit_signal != 0 && exit_signal != sigchld))
+    {
+        return -einval;
+    }
+    if ((flags & clone_parent_settid) != 0 && !mmu.contains(parent_tid_out, sizeof(uint32_t)))
+    {
+        return -efault;
+    }
+    if (process_host == nullptr)
+    {
+        return -enosys;
+    }
+
+    uint32_t child_pid = 0;
+    const bool started = process_host->fork_guest(child_stack, [&](LinuxEmulator &child) {
+        child_pid = child.pid;
+        child.parent_pid = pid;
+        child.parent = ParentLink{.children = children, .pid = child.pid};
+        children->add(child.pid);
+
+        // like Linux, a bad address only loses the write
+        if ((flags & clone_child_settid) != 0 && child.mmu.contains(child_tid_out, sizeof(uint32_t)))
+        {
+            child.copy_to_guest(child_tid_out, std::span((const uint8_t *)&child_pid, sizeof(child_pid)));
+        }
+        child.clear_tid_addr = (flags & clone_child_cleartid) != 0 ? child_tid_out : 0;
+    });
+    if (!started)
+    {
+        return -enosys;
+    }
+
+    if ((flags & clone_parent_settid) != 0)
+    {
+        copy_to_guest(parent_tid_out, std::span((const uint8_t *)&child_pid, sizeof(child_pid)));
+    }
+    return child_pid;
+}
+
+int32_t LinuxEmulator::handle_sigaction(uint32_t signal, uint32_t action_addr, uint32_t old_action_out,
+                                        uint32_t set_size)
+{
+    // handler, flags and mask, RISC-V has no sa_restorer
+    constexpr uint32_t action_size = 2 * sizeof(uint32_t) + sigset_size;
+    if (set_size != sigset_size || signal == 0 || signal > signal_count ||
+        (action_addr != 0 && (signal == sigkill || signal == sigstop)))
+    {
+        return -einval;
+    }
+    if ((action_addr != 0 && !mmu.contains(action_addr, action_size)) ||
+        (old_action_out != 0 && !mmu.contains(old_action_out, action_size)))
+    {
+        return -efault;
+    }
+
+    // Nothing is ever delivered, so every signal keeps reporting SIG_DFL with an empty mask. Only
+    // the handler of SIGPIPE is kept, whether a broken pipe kills the writer depends on it.
+    if (old_action_out != 0)
+    {
+        std::array<uint8_t, action_size> old_action = {};
+        if (signal == sigpipe)
+        {
+            memcpy(old_action.data(), &sigpipe_handler, sizeof(sigpipe_handler));
+        }
+        copy_to_guest(old_action_out, old_action);
+    }
+    if (action_addr != 0 && signal == sigpipe)
+    {
+        sigpipe_handler = mmu.read<uint32_t>(action_addr);
+    }
+    return 0;
+}
+
+int32_t LinuxEmulator::handle_sigprocmask(uint32_t how, uint32_t set_addr, uint32_t old_set_out, uint32_t set_size)
+{
+    if (set_size != sigset_size || (set_addr != 0 && how > sig_setmask))
+    {
+        return -einval;
+    }
+    if ((set_addr != 0 && !mmu.contains(set_addr, sigset_size)) ||
+        (old_set_out != 0 && !mmu.contains(old_set_out, sigset_size)))
+    {
+        return -efault;
+    }
+
+    // the mask is not kept, nothing is delivered that it could hold back
+    if (old_set_out != 0)
+    {
+        const std::array<uint8_t, sigset_size> old_set = {};
+        copy_to_guest(old_set_out, old_set);
+    }
+    return 0;
+}
+
+std::pair<int32_t, bool> LinuxEmulator::handle_execve(uint32_t path_addr, uint32_t argv_addr, uint32_t envp_addr)
+{
+    std::string path;
+    std::vector<std::string> argv;
+    std::vector<std::string> envp;
+    if (!read_path(path_addr, path))
+    {
+        return {-efault, false};
+    }
+    if (const int32_t error = read_string_array(argv_addr, argv); error != 0)
+    {
+        return {error, false};
+    }
+    if (const int32_t error = read_string_array(envp_addr, envp); error != 0)
+    {
+        return {error, false};
+    }
+    if (process_host == nullptr)
+    {
+        return {-enosys, false};
+    }
+
+    std::optional<SharedObjectCache::File> file = find_file(path);
+    if (!file)
+    {
+        return {-enoent, false};
+    }
+
+    try
+    {
+        process_host->exec_guest(std::span(file->memory->data(), file->size), argv, envp);
+    }
+    catch (const std::invalid_argument &)
+    {
+        return {-enoexec, false};
+    }
+    return {0, true};
+}
+
+int32_t LinuxEmulator::handle_wait4(int32_t pid, uint32_t status_out, uint32_t options)
+{
+    if (status_out != 0 && !mmu.contains(status_out, sizeof(int32_t)))
+    {
+        return -efault;
+    }
+
+    // there are no process groups, every child is in the caller's
+    uint32_t child_pid = pid > 0 ? pid : 0;
+    const int32_t status = reap_child(child_pid, options);
+    if (status < 0 || child_pid == 0)
+    {
+        return status;
+    }
+
+    if (status_out != 0)
+    {
+        copy_to_guest(status_out, std::span((const uint8_t *)&status, sizeof(status)));
+    }
+    return child_pid;
+}
+
+int32_t LinuxEmulator::handle_waitid(uint32_t id_type, uint32_t id, uint32_t info_out, uint32_t options)
+{
+    if ((id_type != p_all && id_type != p_pid) || (options & wexited) == 0)
+    {
+        return -einval;
+    }
+    if (info_out != 0 && !mmu.contains(info_out, sizeof(child_siginfo)))
+    {
+        return -efault;
+    }
+
+    uint32_t child_pid = id_type == p_pid ? id : 0;
+    const int32_t status = reap_child(child_pid, options);
+    if (status < 0 || blocked)
+    {
+        return status;
+    }
+
+    // all zeros when WNOHANG found no child that ended
+    if (info_out != 0)
+    {
+        child_siginfo info = {};
+        if (child_pid != 0)
+        {
+            const bool killed = (status & 0x7f) != 0;
+            info.si_signo = sigchld;
+            info.si_code = killed ? cld_killed : cld_exited;
+            info.si_pid = child_pid;
+            info.si_status = killed ? status & 0x7f : (status >> 8) & 0xff;
+        }
+        copy_to_guest(info_out, std::span((const uint8_t *)&info, sizeof(info)));
+    }
+    return 0;
+}
+
+void LinuxEmulator::take_process(LinuxEmulator &previous)
+{
+    open_files.clear();
+    for (auto &[fd, file] : previous.open_files)
+    {
+        if (!file.close_on_exec)
+        {
+            open_files[fd] = std::move(file);
+        }
+    }
+    previous.open_files.clear();
+
+    host_fds = previous.host_fds;
+    pid = previous.pid;
+    parent_pid = previous.parent_pid;
+    parent = std::move(previous.parent);
+    previous.parent.reset();
+    children = previous.children;
+
+    // time goes on, and so does the random generator of virtual time
+    clock = previous.clock;
+    clock.start_new_image();
+
+    // execve resets caught signals, ignored ones stay ignored
+    sigpipe_handler = previous.sigpipe_handler == sig_ign ? sig_ign : sig_dfl;
+}
+
+std::pair<uint32_t, bool> LinuxEmulator::broken_pipe()
+{
+    if (sigpipe_handler != sig_dfl)
+    {
+        return {-epipe, false};
+    }
+
+    // SIGPIPE kills the writer, the host sees the exit code a shell reports for it
+    exit_code = 128 + sigpipe;
+    clear_tid();
+    report_signal(sigpipe);
+    return {exit_code, true};
+}
+
+void LinuxEmulator::clear_tid()
+{
+    if (clear_tid_addr != 0 && mmu.contains(clear_tid_addr, sizeof(uint32_t)))
+    {
+        const uint32_t zero = 0;
+        copy_to_guest(clear_tid_addr, std::span((const uint8_t *)&zero, sizeof(zero)));
+    }
+    clear_tid_addr = 0;
+}
+
+void LinuxEmulator::report_signal(uint32_t signal)
+{
+    report_exit(signal & 0x7f);
+}
+
+void LinuxEmulator::report_exit(uint32_t status)
+{
+    if (parent.has_value())
+    {
+        parent->children->report(parent->pid, status);
+        parent.reset();
+    }
+}
+
+int32_t LinuxEmulator::reap_child(uint32_t &pid, uint32_t options)
+{
+    const uint32_t wanted = pid;
+    pid = 0;
+    while (true)
+    {
+        const std::shared_ptr<GuestWaker> child_waker = (options & wnohang) != 0 ? nullptr : get_waker();
+        if (child_waker != nullptr)
+        {
+            child_waker->clear();
+        }
+
+        const std::optional<ChildTable::Reaped> reaped = children->reap(wanted, child_waker);
+        if (reaped.has_value())
+        {
+            if (reaped->pid == 0)
+            {
+                return -echild;
+            }
+            pid = reaped->pid;
+            return reaped->status;
+        }
+        if ((options & wnohang) != 0 || wait_for_waker())
+        {
+            return 0;
+        }
+    }
+}
+
+bool LinuxEmulator::would_block(int host_fd, bool writable)
+{
+    if (!cooperative)
+    {
+        return false;
+    }
+
+    // errors and hang ups count as ready, the call itself reports them
+    pollfd ready{.fd = host_fd, .events = (short)(writable ? POLLOUT : POLLIN), .revents = 0};
+    if (poll(&ready, 1, 0) != 0)
+    {
+        return false;
+    }
+
+    blocked = true;
+    wait = Wait{.fd = host_fd, .writable = writable, .deadline_ns = -1};
+    return true;
+}
+
+const std::shared_ptr<GuestWaker> &LinuxEmulator::get_waker()
+{
+    if (waker == nullptr)
+    {
+        waker = std::make_shared<GuestWaker>();
+    }
+    return waker;
+}
+
+bool LinuxEmulator::wait_for_waker()
+{
+    if (cooperative)
+    {
+        blocked = true;
+        wait = Wait{.fd = waker->get_fd(), .writable = false, .deadline_ns = -1};
+        return true;
+    }
+
+    waker->wait();
+    return false;
+}
+
+uint32_t LinuxEmulator::lowest_free_fd(uint32_t first) const
+{
+    uint32_t fd = first;
+    for (auto open_file = open_files.lower_bound(first); open_file != open_files.end() && open_file->first == fd; ++open_file)
+    {
+        ++fd;
+    }
+    return fd;
+}
+
+bool LinuxEmulator::read_path(uint32_t virt_addr, std::string &path)
+{
+    path.clear();
+    for (uint32_t addr = virt_addr; path.size() < 4096; ++addr)
+    {
+        if (!mmu.contains(addr, 1))
+        {
+            return false;
+        }
+
+        const char c = mmu.read<char>(addr);
+        if (c == '\0')
+        {
+            return true;
+        }
+        path += c;
+    }
+
+    return false;
+}
+
+int32_t LinuxEmulator::read_string_array(uint32_t virt_addr, std::vector<std::string> &strings)
+{
+    static constexpr size_t max_strings = 4096;
+
+    strings.clear();
+    for (uint32_t addr = virt_addr; virt_addr != 0; addr += sizeof(uint32_t))
+    {
+        if (!mmu.contains(addr, sizeof(uint32_t)))
+        {
+            return -efault;
+        }
+
+        const uint32_t string_addr = mmu.read<uint32_t>(addr);
+        if (string_addr == 0)
+        {
+            break;
+        }
+        if (strings.size() == max_strings)
+        {
+            return -e2big;
+        }
+        if (!read_path(string_addr, strings.emplace_back()))
+        {
+            return -efault;
+        }
+    }
+
+    return 0;
+}
+
+std::optional<SharedObjectCache::File> LinuxEmulator::find_file(const std::string &path) const
+{
+    if (sysroot.empty() || path.empty())
+    {
+        return std::nullopt;
+    }
+
+    try
+    {
+        return SharedObjectCache::instance().get(SharedObjectCache::resolve(sysroot, path));
+    }
+    catch (const std::runtime_error &)
+    {
+        return std::nullopt;
+    }
+}
+
+void LinuxEmulator::write_time(uint32_t virt_addr, int64_t seconds, int64_t fraction, bool time64)
+{
+    if (time64)
+    {
+        const guest_time time{.seconds = seconds, .fraction = fraction};
+        copy_to_guest(virt_addr, std::span((const uint8_t *)&time, sizeof(time)));
+    }
+    else
+    {
+        // wraps in 2038 like the syscall it answers
+        const guest_time32 time{.seconds = (int32_t)seconds, .fraction = (int32_t)fraction};
+        copy_to_guest(virt_addr, std::span((const uint8_t *)&time, sizeof(time)));
+    }
+}
+
+std::map<uint32_t, LinuxEmulator::OpenFile> LinuxEmulator::copy_files(const std::map<uint32_t, OpenFile> &files)
+{
+    std::map<const GuestPipe *, std::pair<std::shared_ptr<GuestPipe::End>, std::shared_ptr<GuestPipe::End>>> pipes;
+    std::map<uint32_t, OpenFile> copies = files;
+    for (auto &[fd, copy] : copies)
+    {
+        if (copy.pipe != nullptr)
+        {
+            GuestPipe &pipe = copy.pipe->get_pipe();
+            auto ends = pipes.find(&pipe);
+            if (ends == pipes.end())
+            {
+                ends = pipes.emplace(&pipe, GuestPipe::create(pipe.get_contents())).first;
+            }
+            copy.pipe = copy.pipe->is_writer() ? ends->second.second : ends->second.first;
+        }
+    }
+    return copies;
+}
+
+void LinuxEmulator::copy_to_guest(uint32_t virt_addr, std::span<const uint8_t> bytes)
+{
+    mmu.copy_from_host(virt_addr, bytes);
+
+    if (syscall_log != nullptr && syscall_log->get_mode() == SyscallLog::Mode::record)
+    {
+        recorded_writes.push_back(SyscallLog::MemoryWrite{
+            .addr = virt_addr,
+            .bytes = std::vector<uint8_t>(bytes.begin(), bytes.end())});
+    }
+}
+
+void LinuxEmulator::save_state(CheckpointWriter &writer) const
+{
+    std::map<const GuestPipe *, uint32_t> pipes; // index by pipe, the first fd of a pipe saves its contents
+    writer.write((uint32_t)open_files.size());
+    for (const auto &[fd, open_file] : open_files)
+    {
+        const FileKind kind = open_file.pipe != nullptr ? FileKind::pipe : open_file.is_file() ? FileKind::file : FileKind::stream;
+        writer.write(fd);
+        writer.write(kind);
+        writer.write(open_file.close_on_exec);
+        writer.write(open_file.nonblocking);
+        switch (kind)
+        {
+            case FileKind::file:
+                writer.write_string(open_file.path);
+                writer.write(open_file.offset);
+                break;
+            case FileKind::stream:
+                writer.write(open_file.stream);
+                break;
+            case FileKind::pipe:
+            {
+                GuestPipe &pipe = open_file.pipe->get_pipe();
+                auto [index, first] = pipes.try_emplace(&pipe, (uint32_t)pipes.size());
+                writer.write(index->second);
+                if (first)
+                {
+                    writer.write_bytes(pipe.get_contents());
+                }
+                writer.write(open_file.pipe->is_writer());
+                break;
+            }
+        }
+    }
+
+    clock.save_state(writer);
+
+    const int64_t now = host_monotonic_ns();
+    writer.write(blocked);
+    writer.write(wait.fd >= 0);
+    writer.write(wait.writable);
+    writer.write(wait.deadline_ns < 0 ? (int64_t)-1 : std::max<int64_t>(wait.deadline_ns - now, 0));
+    writer.write(sleep_deadline_ns < 0 ? (int64_t)-1 : std::max<int64_t>(sleep_deadline_ns - now, 0));
+    writer.write(exit_code);
+    writer.write(pipe_write_done);
+    writer.write(sigpipe_handler);
+    writer.write(clear_tid_addr);
+}
+
+void LinuxEmulator::load_state(CheckpointReader &reader)
+{
+    // both ends of every pipe, the ones no fd takes are closed at the end
+    std::vector<std::pair<std::shared_ptr<GuestPipe::End>, std::shared_ptr<GuestPipe::End>>> pipes;
+
+    open_files.clear();
+    const uint32_t count = reader.read<uint32_t>();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const uint32_t fd = reader.read<uint32_t>();
+        const FileKind kind = reader.read<FileKind>();
+        OpenFile open_file{.close_on_exec = reader.read<bool>(), .nonblocking = reader.read<bool>()};
+        switch (kind)
+        {
+            case FileKind::file:
+            {
+                open_file.path = reader.read_string();
+                open_file.offset = reader.read<uint32_t>();
+                std::optional<SharedObjectCache::File> file = find_file(open_file.path);
+                if (!file)
+                {
+                    throw std::runtime_error("Checkpoint has " + open_file.path + " open, which is not below the sysroot");
+                }
+                open_file.file = std::move(*file);
+                break;
+            }
+            case FileKind::stream:
+                open_file.stream = reader.read<int>();
+                if (open_file.stream < 0 || open_file.stream >= (int)host_fds.size())
+                {
+                    throw std::runtime_error("Checkpoint has an invalid standard stream");
+                }
+                break;
+            case FileKind::pipe:
+            {
+                const uint32_t index = reader.read<uint32_t>();
+                if (index == pipes.size())
+                {
+                    const std::vector<uint8_t> contents = reader.read_bytes();
+                    pipes.push_back(GuestPipe::create(contents));
+                }
+                else if (index > pipes.size())
+                {
+                    throw std::runtime_error("Checkpoint has an invalid pipe");
+                }
+                open_file.pipe = reader.read<bool>() ? pipes[index].second : pipes[index].first;
+                break;
+            }
+            default:
+                throw std::runtime_error("Checkpoint has an fd of unknown kind");
+        }
+        open_files[fd] = std::move(open_file);
+    }
+
+    clock.load_state(reader);
+
+    const int64_t now = host_monotonic_ns();
+    blocked = reader.read<bool>();
+    const bool waits_for_fd = reader.read<bool>();
+    wait.writable = reader.read<bool>();
+    const int64_t wait_remaining_ns = reader.read<int64_t>();
+    const int64_t sleep_remaining_ns = reader.read<int64_t>();
+    exit_code = reader.read<uint32_t>();
+    pipe_write_done = reader.read<uint32_t>();
+    sigpipe_handler = reader.read<uint32_t>();
+    clear_tid_addr = reader.read<uint32_t>();
+
+    // the host fd belongs to the saving process, a retry due now finds this process's one
+    wait.fd = -1;
+    wait.deadline_ns = waits_for_fd ? now : wait_remaining_ns < 0 ? -1 : now + wait_remaining_ns;
+    sleep_deadline_ns = sleep_remaining_ns < 0 ? -1 : now + sleep_remaining_ns;
+}
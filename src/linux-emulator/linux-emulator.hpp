@@ -1,16 +1,174 @@
 #pragma once
 
+#include "../elf-loader/shared-object-cache.hpp"
+#include "../guest-fault.hpp"
+#include "../metrics/metrics.hpp"
+#include "guest-clock.hpp"
+#include "guest-pipe.hpp"
+#include "guest-process.hpp"
 #include "../mmu/mmu.hpp"
+#include "syscall-log.hpp"
 #include "syscall.hpp"
+#include <array>
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+/*
+    The Linux syscalls a guest sees.
+
+    Besides the standard streams, guests can open files read only below a sysroot directory, which
+    stands in for the root of the file system. That is what a dynamic linker needs to find and map
+    the shared libraries of a dynamically linked program. File mappings share the pages of the
+    SharedObjectCache copy on write, anonymous ones are carved out of guest memory top down. munmap
+    gives the pages back for later mappings, mprotect and madvise succeed without effect as there
+    is no protection.
+
+    The fd table holds the standard streams, those files and the ends of GuestPipes, and dup, dup3,
+    fcntl and pipe2 rearrange it like under Linux. With a GuestProcessHost, clone starts a copy of
+    the guest that inherits the table, execve replaces the guest by another executable from the
+    sysroot, and wait4 and waitid collect the children. So a guest can connect children through
+    pipes into a pipeline that runs entirely within this process.
+
+    There are no signals. rt_sigaction and rt_sigprocmask succeed and report the defaults, clone3
+    fails with ENOSYS so that libc falls back to clone, and clone takes the flags of fork, vfork and
+    posix_spawn, including the tid words of CLONE_PARENT_SETTID, CLONE_CHILD_SETTID and
+    CLONE_CHILD_CLEARTID. The one signal raised is SIGPIPE: writing to a pipe without readers ends
+    the guest with exit code 141, and its parent's wait sees it killed by SIGPIPE, unless the guest
+    installed a handler or SIG_IGN for it. Then the write fails with EPIPE, the handler never runs.
+    Blocking writes to pipes return once everything is written, also beyond PIPE_BUF.
+*/
 class LinuxEmulator
 {
   public:
-    LinuxEmulator(Mmu &mmu) : mmu(mmu) {}
-  
+    // What a cooperative guest waits for after a syscall that would have blocked
+    struct Wait
+    {
+        int fd = -1;           // host fd, -1 when only the deadline matters
+        bool writable = false; // waits for room to write instead of data to read
+        int64_t deadline_ns = -1; // CLOCK_MONOTONIC of the host, -1 for none
+    };
+
+    // Returns the value for a0 and whether the guest exits
+    using SyscallHandler = std::function<std::pair<uint32_t, bool>(const Syscall &syscall)>;
+
+    LinuxEmulator(Mmu &mmu);
+
+    // Continues from the state of parent on mmu as a new process that shares the pipes of parent.
+    // The syscall log, the process host and the children are not inherited.
+    LinuxEmulator(const LinuxEmulator &parent, Mmu &mmu);
+
+    // A parent waiting for this guest sees it killed unless it exited
+    ~LinuxEmulator();
+
     std::pair<uint32_t, bool> handle_syscall(const Syscall &syscall);
 
+    void set_syscall_log(SyscallLog *log)
+    {
+        syscall_log = log;
+    }
+
+    void set_metrics(MetricsSlot *slot)
+    {
+        metrics = slot;
+    }
+
+    // Custom handlers take precedence over the built-in Linux syscalls
+    void register_handler(uint32_t call_num, SyscallHandler handler)
+    {
+        handlers[call_num] = std::move(handler);
+    }
+
+    // Directory guest paths are looked up in, without one the guest cannot open files
+    void set_sysroot(std::string path)
+    {
+        sysroot = std::move(path);
+    }
+
+    void set_clock(const GuestClock &guest_clock)
+    {
+        clock = guest_clock;
+    }
+
+    GuestClock &get_clock()
+    {
+        return clock;
+    }
+
+    // Host fds behind the guest's stdin, stdout and stderr
+    void set_host_fds(const std::array<int, 3> &fds)
+    {
+        host_fds = fds;
+    }
+
+    // In cooperative mode a syscall that would block the host thread returns at once and leaves
+    // is_blocked set instead. The caller waits for get_wait and issues the same syscall again.
+    void set_cooperative(bool enabled)
+    {
+        cooperative = enabled;
+    }
+
+    bool is_blocked() const
+    {
+        return blocked;
+    }
+
+    const Wait &get_wait() const
+    {
+        return wait;
+    }
+
+    uint32_t get_exit_code() const
+    {
+        return exit_code;
+    }
+
+    // Runs the guests clone and execve create, without a host they fail with ENOSYS
+    void set_process_host(GuestProcessHost *host)
+    {
+        process_host = host;
+    }
+
+    uint32_t get_pid() const
+    {
+        return pid;
+    }
+
+    // Continues the process of previous, which called execve: the pid, the children, the clock and
+    // the fds without close on exec move over
+    void take_process(LinuxEmulator &previous);
+
+    // Reports to a waiting parent that the guest ended through signal, e.g. SIGSEGV after a fault
+    void report_signal(uint32_t signal);
+
+    // The fd table, the clock, the exit code and a syscall that blocked. Deadlines are stored relative
+    // to the host clock, so a sleep continues where it was on another host. Pipes are saved with their
+    // contents, and only the ends this guest has open come back.
+    void save_state(CheckpointWriter &writer) const;
+
+    // Reopens the files below the current sysroot, throws std::runtime_error when one is missing.
+    // A syscall that blocked on an fd is retried at once and waits for the fds of this process.
+    void load_state(CheckpointReader &reader);
+
+    // Takes over the guest visible state of snapshot, handlers and the syscall log stay. Pipes are
+    // copied, the snapshot keeps its own.
+    void restore(const LinuxEmulator &snapshot)
+    {
+        open_files = copy_files(snapshot.open_files);
+        clock = snapshot.clock;
+        blocked = snapshot.blocked;
+        wait = snapshot.wait;
+        sleep_deadline_ns = snapshot.sleep_deadline_ns;
+        exit_code = snapshot.exit_code;
+    }
+
     int32_t handle_read(uint32_t fd, uint32_t buff_addr, uint32_t size);
 
     int32_t handle_write(uint32_t fd, uint32_t buff_addr, uint32_t size);
@@ -19,6 +177,172 @@ class LinuxEmulator
 
     int32_t handle_brk(uint32_t addr);
 
+    int32_t handle_openat(uint32_t path_addr, uint32_t flags);
+
+    int32_t handle_lseek(uint32_t fd, int64_t offset, uint32_t whence, uint32_t result_addr);
+
+    int32_t handle_statx(uint32_t fd, uint32_t path_addr, uint32_t flags, uint32_t statx_out);
+
+    // time64 selects the 64 bit timespec of the *_time64 syscalls over the 32 bit one of the old numbers
+    int32_t handle_clock_gettime(uint32_t clock_id, uint32_t timespec_out, bool resolution, bool time64);
+
+    int32_t handle_gettimeofday(uint32_t timeval_out, uint32_t timezone_out);
+
+    int32_t handle_nanosleep(uint32_t clock_id, uint32_t flags, uint32_t request_addr, uint32_t remain_addr, bool time64);
+
+    int32_t handle_getrandom(uint32_t buff_addr, uint32_t size);
+
+    int32_t handle_mmap(uint32_t addr, uint32_t length, uint32_t flags, uint32_t fd, uint32_t page_offset);
+
+    int32_t handle_pipe2(uint32_t fds_out, uint32_t flags);
+
+    int32_t handle_dup3(uint32_t old_fd, uint32_t new_fd, uint32_t flags);
+
+    int32_t handle_fcntl(uint32_t fd, uint32_t command, uint32_t arg);
+
+    int32_t handle_clone(uint32_t flags, uint32_t child_stack, uint32_t parent_tid_out, uint32_t child_tid_out);
+
+    int32_t handle_sigaction(uint32_t signal, uint32_t action_addr, uint32_t old_action_out, uint32_t set_size);
+
+    int32_t handle_sigprocmask(uint32_t how, uint32_t set_addr, uint32_t old_set_out, uint32_t set_size);
+
+    // Returns true in the second member when the guest was replaced
+    std::pair<int32_t, bool> handle_execve(uint32_t path_addr, uint32_t argv_addr, uint32_t envp_addr);
+
+    int32_t handle_wait4(int32_t pid, uint32_t status_out, uint32_t options);
+
+    int32_t handle_waitid(uint32_t id_type, uint32_t id, uint32_t info_out, uint32_t options);
+
+  private:
+    // What an fd refers to: a standard stream, a file below the sysroot or a pipe end
+    struct OpenFile
+    {
+        std::string path; // as the guest opened it
+        SharedObjectCache::File file;
+        uint32_t offset = 0;
+        int stream = -1;                      // index into host_fds, for the standard streams and their duplicates
+        std::shared_ptr<GuestPipe::End> pipe; // shared by the duplicates of the fd
+        bool close_on_exec = false;
+        bool nonblocking = false;
+
+        bool is_file() const
+        {
+            return stream < 0 && pipe == nullptr;
+        }
+    };
+
+    // How checkpoints tell the kinds of OpenFile apart
+    enum class FileKind : uint8_t
+    {
+        file,
+        stream,
+        pipe
+    };
+
+    // The exit status of this guest goes to its parent's children
+    struct ParentLink
+    {
+        std::shared_ptr<ChildTable> children;
+        uint32_t pid;
+    };
+
+    // Copies of files with new pipes of the same contents, the fds sharing an end share it in the copy
+    static std::map<uint32_t, OpenFile> copy_files(const std::map<uint32_t, OpenFile> &files);
+
+    std::pair<uint32_t, bool> log_syscall(const Syscall &syscall);
+
+    std::pair<uint32_t, bool> dispatch_syscall(const Syscall &syscall);
+
+    std::pair<uint32_t, bool> replay_syscall(const Syscall &syscall);
+
+    void copy_to_guest(uint32_t virt_addr, std::span<const uint8_t> bytes);
+
+    // Writes a timespec or timeval, fraction is in nanoseconds or microseconds
+    void write_time(uint32_t virt_addr, int64_t seconds, int64_t fraction, bool time64);
+
+    // In cooperative mode, checks whether the host fd is ready and records the wait when it is not
+    bool would_block(int host_fd, bool writable);
+
+    // The waker pipes and children register when this guest has to wait for another one
+    const std::shared_ptr<GuestWaker> &get_waker();
+
+    // Waits for the waker after a pipe or the children registered it. In cooperative mode it only
+    // records the wait and returns true, the syscall is issued again when the waker fires. Otherwise
+    // the host thread sleeps until the wake up and false means the caller tries again.
+    bool wait_for_waker();
+
+    // Lowest fd from first on that is not open
+    uint32_t lowest_free_fd(uint32_t first) const;
+
+    // dup and F_DUPFD: the copy refers to the same stream or pipe end, a file gets its own offset
+    int32_t duplicate_fd(uint32_t fd, uint32_t first, bool close_on_exec);
+
+    // The status a wait4 for pid, any child when it is 0, finds, or a negative errno. Returns 0 in
+    // pid when options have WNOHANG and no child ended yet, and when the guest blocked.
+    int32_t reap_child(uint32_t &pid, uint32_t options);
+
+    void report_exit(uint32_t status);
+
+    // Zeroes the word set_tid_address or CLONE_CHILD_CLEARTID named, on exit
+    void clear_tid();
+
+    // What a write to a pipe without readers returns: EPIPE when the guest handles or ignores
+    // SIGPIPE, otherwise the guest is killed by it
+    std::pair<uint32_t, bool> broken_pipe();
+
+    // Reads a NULL terminated array of string pointers like argv, a null array is empty. Returns 0 or
+    // a negative errno.
+    int32_t read_string_array(uint32_t virt_addr, std::vector<std::string> &strings);
+
+    // Reads a NUL terminated path, returns false when it is not in guest memory
+    bool read_path(uint32_t virt_addr, std::string &path);
+
+    // Looks path up below the sysroot, empty when there is no such file
+    std::optional<SharedObjectCache::File> find_file(const std::string &path) const;
+
   private:
+    static constexpr uint32_t standard_streams = 3;
+    static constexpr uint32_t max_fds = 1024; // RLIMIT_NOFILE
+
+    static constexpr int32_t enoent = 2;   // no such file or directory
+    static constexpr int32_t e2big = 7;    // argument list too long
+    static constexpr int32_t enoexec = 8;  // exec format error
+    static constexpr int32_t ebadf = 9;    // bad file descriptor
+    static constexpr int32_t echild = 10;  // no child processes
+    static constexpr int32_t eagain = 11;  // try again
+    static constexpr int32_t enomem = 12;  // out of memory
+    static constexpr int32_t efault = 14;  // bad address
+    static constexpr int32_t enodev = 19;  // no such device
+    static constexpr int32_t einval = 22;  // invalid argument
+    static constexpr int32_t emfile = 24;  // too many open files
+    static constexpr int32_t enotty = 25;  // not a terminal
+    static constexpr int32_t espipe = 29;  // illegal seek
+    static constexpr int32_t erofs = 30;   // read only file system
+    static constexpr int32_t epipe = 32;   // broken pipe
+    static constexpr int32_t enosys = 38;  // function not implemented
+
     Mmu &mmu;
+    SyscallLog *syscall_log = nullptr;
+    MetricsSlot *metrics = nullptr;
+    std::vector<SyscallLog::MemoryWrite> recorded_writes;
+    std::unordered_map<uint32_t, SyscallHandler> handlers;
+    std::string sysroot;
+    std::map<uint32_t, OpenFile> open_files; // by fd
+    GuestClock clock;
+    std::array<int, 3> host_fds = {0, 1, 2};
+    bool cooperative = false;
+    bool blocked = false;
+    Wait wait;
+    int64_t sleep_deadline_ns = -1; // of a cooperative sleep that is still waited for
+    uint32_t pipe_write_done = 0;   // bytes of a blocking pipe write already in the pipe while it waits for room
+    uint32_t exit_code = 0;
+    uint32_t sigpipe_handler = 0;   // SIG_DFL, set by rt_sigaction
+
+    GuestProcessHost *process_host = nullptr;
+    uint32_t pid;
+    uint32_t parent_pid = 0;
+    uint32_t clear_tid_addr = 0;
+    std::optional<ParentLink> parent;
+    std::shared_ptr<ChildTable> children = std::make_shared<ChildTable>();
+    std::shared_ptr<GuestWaker> waker; // created when the guest first waits for another one
 };
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "syscall-log.hpp"
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+static uint32_t zigzag_encode(uint32_t value)
+{
+    return (value << 1) ^ (uint32_t)((int32_t)value >> 31);
+}
+
+static uint32_t zigzag_decode(uint32_t value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+SyscallLog::SyscallLog(const std::string &file_path, Mode mode) : mode(mode)
+{
+    if (mode == Mode::record)
+    {
+        out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+        out.open(file_path, std::ios::binary | std::ios::trunc);
+        out.write((const char *)&magic, sizeof(magic));
+        out.write((const char *)&version, sizeof(version));
+        return;
+    }
+
+    std::ifstream file;
+    file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    file.open(file_path, std::ios::binary);
+    in.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    uint32_t file_magic = 0;
+    uint32_t file_version = 0;
+    if (in.size() < sizeof(magic) + sizeof(version))
+    {
+        throw std::invalid_argument("Syscall log is truncated");
+    }
+    memcpy(&file_magic, in.data(), sizeof(file_magic));
+    memcpy(&file_version, in.data() + sizeof(file_magic), sizeof(file_version));
+    if (file_magic != magic || file_version != version)
+    {
+        throw std::invalid_argument("Unsupported syscall log format");
+    }
+    in_pos = sizeof(magic) + sizeof(version);
+}
+
+void SyscallLog::append(const Entry &entry)
+{
+    write_varint(entry.call_num);
+    write_varint(zigzag_encode(entry.ret));
+    write_varint(entry.exit);
+    write_varint(entry.writes.size());
+    for (const MemoryWrite &write : entry.writes)
+    {
+        write_varint(write.addr);
+        write_varint(write.bytes.size());
+        out.write((const char *)write.bytes.data(), write.bytes.size());
+    }
+
+    if (entry.exit)
+    {
+        out.flush();
+    }
+}
+
+SyscallLog::Entry SyscallLog::next()
+{
+    Entry entry;
+    entry.call_num = read_varint();
+    entry.ret = zigzag_decode(read_varint());
+    entry.exit = read_varint() != 0;
+
+    const uint32_t write_count = read_varint();
+    entry.writes.resize(write_count);
+    for (MemoryWrite &write : entry.writes)
+    {
+        write.addr = read_varint();
+        const uint32_t size = read_varint();
+        if (in.size() - in_pos < size)
+        {
+            throw std::invalid_argument("Syscall log is truncated");
+        }
+        write.bytes.assign(in.begin() + in_pos, in.begin() + in_pos + size);
+        in_pos += size;
+    }
+
+    return entry;
+}
+
+void SyscallLog::write_varint(uint32_t value)
+{
+    uint8_t bytes[5];
+    uint8_t count = 0;
+    do
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+        {
+            byte |= 0x80;
+        }
+        bytes[count++] = byte;
+    } while (value != 0);
+
+    out.write((const char *)bytes, count);
+}
+
+uint32_t SyscallLog::read_varint()
+{
+    uint32_t value = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7)
+    {
+        if (in_pos >= in.size())
+        {
+            throw std::invalid_argument("Syscall log is truncated");
+        }
+
+        const uint8_t byte = in[in_pos++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+
+    throw std::invalid_argument("Malformed varint in syscall log");
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/*
+    Binary log of everything the guest observes through syscalls.
+
+    In record mode every syscall result and every byte LinuxEmulator copies into guest memory is
+    appended to the log. In replay mode the same entries are fed back in order, so a run can be
+    reproduced bit-exactly without touching host file descriptors.
+
+    File layout: "RVSL" magic, u32 version, then one entry per syscall. Integers are LEB128 varints,
+    return values are zigzag encoded so -1 costs a single byte.
+
+        entry = call_num, ret, exit, write_count, write_count * (addr, size, size bytes)
+*/
+class SyscallLog
+{
+  public:
+    struct MemoryWrite
+    {
+        uint32_t addr;
+        std::vector<uint8_t> bytes;
+    };
+
+    struct Entry
+    {
+        uint32_t call_num;
+        uint32_t ret;
+        bool exit;
+        std::vector<MemoryWrite> writes;
+    };
+
+    enum class Mode
+    {
+        record,
+        replay
+    };
+
+    SyscallLog(const std::string &file_path, Mode mode);
+
+    Mode get_mode() const
+    {
+        return mode;
+    }
+
+    void append(const Entry &entry);
+
+    Entry next();
+
+  private:
+    void write_varint(uint32_t value);
+
+    uint32_t read_varint();
+
+  private:
+    static constexpr uint32_t magic = 0x4c535652; // "RVSL"
+    static constexpr uint32_t version = 1;
+
+    Mode mode;
+    std::ofstream out;
+    std::vector<uint8_t> in;
+    size_t in_pos = 0;
+};
@@ -0,0 +1,420 @@
+#include "riscvemu/machine.hpp"
+#include "../checkpoint/checkpoint.hpp"
+#include "../elf-loader/elf-loader.hpp"
+#include "../elf-loader/symbol-table.hpp"
+#include "../mmu/mmu.hpp"
+#include "../riscv-emulator/riscv-emulator.hpp"
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+#include <stdexcept>
+
+namespace riscvemu
+{
+
+// The signal Linux would kill a guest with for fault, as its parent's wait4 sees it
+static uint32_t signal_for(GuestFault::Kind kind)
+{
+    switch (kind)
+    {
+        case GuestFault::Kind::memory_access:
+            return 11; // SIGSEGV
+        case GuestFault::Kind::misaligned_fetch:
+            return 7; // SIGBUS
+        case GuestFault::Kind::illegal_instruction:
+            return 4; // SIGILL
+        case GuestFault::Kind::breakpoint:
+            return 5; // SIGTRAP
+        case GuestFault::Kind::unsupported_syscall:
+            return 31; // SIGSYS
+    }
+    return 6; // SIGABRT
+}
+
+struct Machine::Impl : GuestProcessHost
+{
+    Impl(const MachineConfig &config, Machine *owner)
+        : mmu(config.memory_size), emulator(mmu), owner(owner), config(config), host_libc(config.host_libc), aot_cache(config.decode_cache ? config.aot_cache : ""),
+          stack_size(config.stack_size),
+          argv(config.argv), envp(config.envp), sysroot(config.sysroot), load_base(config.load_base)
+    {
+        emulator.get_linux_emulator().set_sysroot(config.sysroot);
+        emulator.get_linux_emulator().set_clock(GuestClock(ClockConfig{.virtual_time = config.virtual_time}));
+        emulator.get_linux_emulator().set_host_fds({config.stdin_fd, config.stdout_fd, config.stderr_fd});
+        emulator.get_linux_emulator().set_cooperative(config.cooperative);
+        emulator.set_decode_cache_enabled(config.decode_cache);
+        emulator.set_fusion_enabled(config.fusion);
+        emulator.set_vlen(config.vlen);
+        emulator.get_linux_emulator().set_process_host(this);
+    }
+
+    Impl(Impl &parent, Machine *owner)
+        : mmu(parent.mmu.fork()), emulator(parent.emulator, mmu), owner(owner), config(parent.config), spawner(parent.spawner),
+          custom_exit_code(parent.custom_exit_code),
+          started(parent.started), host_libc(parent.host_libc), aot_cache(parent.aot_cache), stack_size(parent.stack_size), argv(parent.argv),
+          envp(parent.envp), sysroot(parent.sysroot), load_base(parent.load_base)
+    {
+        if (parent.libc_intercepts != nullptr)
+        {
+            libc_intercepts = std::make_unique<LibcIntercepts>(*parent.libc_intercepts);
+            emulator.set_libc_intercepts(libc_intercepts.get());
+        }
+
+        for (const auto &[number, handler] : parent.syscall_handlers)
+        {
+            install_syscall(number, handler);
+        }
+        emulator.get_linux_emulator().set_process_host(this);
+    }
+
+    Mmu mmu;
+    RiscvEmulator emulator;
+    Machine *owner;
+    MachineConfig config; // for the guests execve starts
+    Spawner spawner;
+    std::unique_ptr<Impl> exec_image; // replaces this one when the ECALL of an execve returned
+    std::optional<uint32_t> custom_exit_code;
+    bool started = false;
+    std::string fault;
+    bool host_libc;
+    std::string aot_cache;
+    uint32_t stack_size;
+    std::vector<std::string> argv;
+    std::vector<std::string> envp;
+    std::string sysroot;
+    uint32_t load_base;
+    std::unique_ptr<LibcIntercepts> libc_intercepts;
+    std::unordered_map<uint32_t, SyscallHandler> syscall_handlers;
+
+    void install_syscall(uint32_t number, SyscallHandler handler)
+    {
+        syscall_handlers[number] = handler;
+        emulator.get_linux_emulator().register_handler(
+            number, [this, handler = std::move(handler)](const Syscall &syscall) -> std::pair<uint32_t, bool> {
+                const SyscallRequest request{
+                    .number = syscall.call_num,
+                    .args = {syscall.arg1, syscall.arg2, syscall.arg3, syscall.arg4, syscall.arg5, syscall.arg6}};
+
+                const SyscallResult result = handler(*owner, request);
+                if (result.exit)
+                {
+                    custom_exit_code = result.value;
+                }
+
+                return {result.value, result.exit};
+            });
+    }
+
+    bool fork_guest(uint32_t child_stack, const std::function<void(LinuxEmulator &child)> &setup) override
+    {
+        if (!spawner)
+        {
+            return false;
+        }
+
+        Machine child(std::make_unique<Impl>(*this, nullptr));
+        child.impl->owner = &child;
+        setup(child.impl->emulator.get_linux_emulator());
+
+        // the child returns 0 from the ECALL the parent is in
+        RiscvEmulator &child_emulator = child.impl->emulator;
+        child_emulator.set_pc(emulator.get_pc() + 4);
+        child_emulator.set_register(RiscvEmulator::RegisterName::a0, 0);
+        if (child_stack != 0)
+        {
+            child_emulator.set_register(RiscvEmulator::RegisterName::sp, child_stack);
+        }
+
+        spawner(std::move(child));
+        return true;
+    }
+
+    void exec_guest(std::span<const uint8_t> image, const std::vector<std::string> &exec_argv,
+                    const std::vector<std::string> &exec_envp) override
+    {
+        MachineConfig exec_config = config;
+        exec_config.argv = exec_argv;
+        exec_config.envp = exec_envp;
+
+        auto next = std::make_unique<Impl>(exec_config, owner);
+        next->spawner = spawner;
+        for (const auto &[number, handler] : syscall_handlers)
+        {
+            next->install_syscall(number, handler);
+        }
+
+        ElfLoader elf_loader(next->mmu, next->sysroot);
+        const uint32_t entry_point = elf_loader.load(image, next->load_base);
+        if (entry_point == 0)
+        {
+            throw std::invalid_argument("Image is not a RISC-V executable");
+        }
+
+        next->emulator.get_linux_emulator().take_process(emulator.get_linux_emulator());
+        next->start(entry_point, elf_loader, "");
+        exec_image = std::move(next);
+    }
+
+    void start(uint32_t entry_point, const ElfLoader &elf_loader, const std::string &executable_path)
+    {
+        const SymbolTable symbols(elf_loader.get_symbols());
+        if (host_libc)
+        {
+            libc_intercepts = std::make_unique<LibcIntercepts>(symbols, LibcIntercepts::Mode::host);
+            emulator.set_libc_intercepts(libc_intercepts.get());
+        }
+        if (!aot_cache.empty())
+        {
+            emulator.set_aot_image(AotImage::load(mmu, elf_loader, symbols, aot_cache));
+        }
+
+        InitialStack initial_stack{
+            .argv = argv,
+            .envp = envp,
+            .entry_point = elf_loader.get_program_entry(),
+            .interpreter_base = elf_loader.get_interpreter_base()};
+        if (initial_stack.argv.empty() && !executable_path.empty())
+        {
+            initial_stack.argv.push_back(executable_path);
+        }
+
+        const ProgramHeaders &program_headers = elf_loader.get_program_headers();
+        initial_stack.program_headers = program_headers.addr;
+        initial_stack.program_header_size = program_headers.entry_size;
+        initial_stack.program_header_count = program_headers.count;
+
+        emulator.get_linux_emulator().get_clock().fill_random(initial_stack.random);
+
+        emulator.start(entry_point, initial_stack, stack_size);
+        mmu.share_pages();
+        started = true;
+    }
+};
+
+Machine::Machine(const MachineConfig &config) : impl(std::make_unique<Impl>(config, this)) {}
+
+Machine::Machine(std::unique_ptr<Impl> impl) : impl(std::move(impl)) {}
+
+Machine::~Machine() = default;
+
+Machine::Machine(Machine &&other) noexcept : impl(std::move(other.impl))
+{
+    impl->owner = this;
+}
+
+Machine &Machine::operator=(Machine &&other) noexcept
+{
+    impl = std::move(other.impl);
+    impl->owner = this;
+    return *this;
+}
+
+void Machine::load_elf(const std::string &file_path)
+{
+    ElfLoader elf_loader(impl->mmu, impl->sysroot);
+    const uint32_t entry_point = elf_loader.load(file_path, impl->load_base);
+    if (entry_point == 0)
+    {
+        throw std::invalid_argument(file_path + " is not a RISC-V executable");
+    }
+
+    impl->start(entry_point, elf_loader, file_path);
+}
+
+void Machine::load_elf(std::span<const uint8_t> image)
+{
+    ElfLoader elf_loader(impl->mmu, impl->sysroot);
+    const uint32_t entry_point = elf_loader.load(image, impl->load_base);
+    if (entry_point == 0)
+    {
+        throw std::invalid_argument("Image is not a RISC-V executable");
+    }
+
+    impl->start(entry_point, elf_loader, "");
+}
+
+void Machine::load_checkpoint(const std::string &path)
+{
+    if (impl->started)
+    {
+        throw std::logic_error("A checkpoint needs a machine without a guest");
+    }
+
+    Checkpoint::load(path, impl->emulator, impl->mmu);
+    impl->started = true;
+}
+
+void Machine::save_checkpoint(const std::string &path)
+{
+    Checkpoint::save(path, impl->emulator, impl->mmu);
+}
+
+void Machine::register_syscall(uint32_t number, SyscallHandler handler)
+{
+    impl->install_syscall(number, std::move(handler));
+}
+
+uint32_t Machine::share_memory()
+{
+    return impl->mmu.share_pages();
+}
+
+uint32_t Machine::compress_memory()
+{
+    return impl->mmu.compress_pages();
+}
+
+MemoryStats Machine::get_memory_stats() const
+{
+    const Mmu::CompressionStats &stats = impl->mmu.get_compression_stats();
+    return MemoryStats{
+        .private_pages = impl->mmu.count_private_pages(),
+        .compressed_pages = stats.stored_pages,
+        .compressed_bytes = stats.stored_bytes,
+        .compression_ratio = stats.compressed_bytes == 0 ? 0 : (double)(stats.compressed_pages * Mmu::page_size) / stats.compressed_bytes,
+        .page_faults = stats.faults,
+        .page_fault_ns = stats.fault_ns,
+        .max_page_fault_ns = stats.max_fault_ns};
+}
+
+void Machine::set_spawner(Spawner spawner)
+{
+    impl->spawner = std::move(spawner);
+}
+
+Machine Machine::fork()
+{
+    Machine child(std::make_unique<Impl>(*impl, nullptr));
+    child.impl->owner = &child;
+    return child;
+}
+
+StopReason Machine::run(uint64_t max_instructions)
+{
+    if (!impl->started)
+    {
+        throw std::logic_error("No executable loaded and no pc set");
+    }
+
+    impl->fault.clear();
+    try
+    {
+        uint64_t used = impl->emulator.run_for(max_instructions);
+        while (impl->exec_image != nullptr)
+        {
+            // the budget spans every image execve replaced this run, each counts from its own start
+            std::unique_ptr<Impl> next = std::move(impl->exec_image);
+            impl = std::move(next);
+            if (used < max_instructions)
+            {
+                used += impl->emulator.run_for(max_instructions - used);
+            }
+        }
+    }
+    catch (const GuestFault &fault)
+    {
+        std::ostringstream description;
+        description << fault.what() << " at pc 0x" << std::hex << fault.get_pc();
+        impl->fault = description.str();
+        impl->emulator.get_linux_emulator().report_signal(signal_for(fault.get_kind()));
+        return StopReason::faulted;
+    }
+
+    if (impl->emulator.get_linux_emulator().is_blocked())
+    {
+        return StopReason::blocked;
+    }
+    return impl->emulator.is_running() ? StopReason::budget_exhausted : StopReason::exited;
+}
+
+StopReason Machine::step()
+{
+    return run(1);
+}
+
+bool Machine::has_exited() const
+{
+    return impl->started && !impl->emulator.is_running() && !impl->emulator.get_linux_emulator().is_blocked();
+}
+
+BlockedOn Machine::get_blocked_on() const
+{
+    const LinuxEmulator::Wait &wait = impl->emulator.get_linux_emulator().get_wait();
+    return BlockedOn{.fd = wait.fd, .writable = wait.writable, .deadline_ns = wait.deadline_ns};
+}
+
+uint32_t Machine::get_exit_code() const
+{
+    return impl->custom_exit_code.value_or(impl->emulator.get_linux_emulator().get_exit_code());
+}
+
+const std::string &Machine::get_fault() const
+{
+    return impl->fault;
+}
+
+uint64_t Machine::get_instructions_retired() const
+{
+    return impl->emulator.get_instructions_retired();
+}
+
+uint32_t Machine::get_register(uint8_t index) const
+{
+    if (index >= 32)
+    {
+        throw std::out_of_range("Register index out of range");
+    }
+
+    return impl->emulator.get_register(index);
+}
+
+void Machine::set_register(uint8_t index, uint32_t value)
+{
+    if (index >= 32)
+    {
+        throw std::out_of_range("Register index out of range");
+    }
+
+    if (index != 0)
+    {
+        impl->emulator.set_register(index, value);
+    }
+}
+
+uint32_t Machine::get_pc() const
+{
+    return impl->emulator.get_pc();
+}
+
+void Machine::set_pc(uint32_t pc)
+{
+    if (pc >= impl->mmu.size())
+    {
+        throw std::out_of_range("pc outside guest memory");
+    }
+
+    impl->emulator.set_pc(pc);
+    impl->started = true;
+}
+
+void Machine::read_memory(uint32_t addr, std::span<uint8_t> out) const
+{
+    if (out.size() > UINT32_MAX || !impl->mmu.contains(addr, out.size()))
+    {
+        throw std::out_of_range("Read outside guest memory");
+    }
+
+    impl->mmu.copy_to_host(addr, out);
+}
+
+void Machine::write_memory(uint32_t addr, std::span<const uint8_t> data)
+{
+    if (data.size() > UINT32_MAX || !impl->mmu.contains(addr, data.size()))
+    {
+        throw std::out_of_range("Write outside guest memory");
+    }
+
+    impl->mmu.copy_from_host(addr, data);
+}
+
+} // namespace riscvemu
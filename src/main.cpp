@@ -1,6 +1,20 @@
+#include "aot/aot-image.hpp"
+#include "checkpoint/checkpoint.hpp"
 #include "elf-loader/elf-loader.hpp"
+#include "elf-loader/symbol-table.hpp"
+#include "fuzzer/fuzzer.hpp"
+#include "heap-profiler/heap-profiler.hpp"
+#include "metrics/metrics-exporter.hpp"
+#include "metrics/metrics.hpp"
 #include "mmu/mmu.hpp"
 #include "riscv-emulator/riscv-emulator.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 /*
 0001008c <_start>:
@@ -24,20 +38,376 @@
    100d0:       06c000ef                jal     x1,1013c <main>
    100d4:       09c0006f                jal     x0,10170 <exit>
 */
+static uint32_t parse_size(const std::string &value)
+{
+    size_t end = 0;
+    const uint64_t size = std::stoull(value, &end);
+    uint64_t unit = 1;
+    if (end + 1 == value.size() && (value[end] == 'k' || value[end] == 'K'))
+    {
+        unit = 1024;
+    }
+    else if (end + 1 == value.size() && (value[end] == 'm' || value[end] == 'M'))
+    {
+        unit = 1024 * 1024;
+    }
+    else if (end != value.size())
+    {
+        throw std::invalid_argument("Invalid size " + value);
+    }
+
+    if (size * unit > UINT32_MAX)
+    {
+        throw std::invalid_argument("Size " + value + " exceeds the 32 bit address space");
+    }
+
+    return size * unit;
+}
+
+static void print_usage(const char *program)
+{
+    std::cerr << "usage: " << program << " [--record <log> | --replay <log>] [--trace <file>] [--timing [--timing-config <options>]]"
+              << " [--interpreter] [--aot-cache <dir>] [--no-fusion] [--fusion-stats] [--jump-stats] [--host-libc | --verify-libc]"
+              << " [--coverage] [--heap-profile] [--metrics <file> | --metrics unix:<socket>] [--metrics-json <file>] [--fuzz <corpus> [--fuzz-config <fuzz options>]]"
+#ifdef RISCV_EMULATOR_PERF_MODEL
+              << " [--l1i <cache>] [--l1d <cache>] [--l2 <cache>] [--branch-predictor gshare|tage]"
+#endif
+              << " [--memory <size>] [--stack <size>] [--sysroot <dir>] [--load-base <addr>] [--vlen <bits>] [--clock <clock options>] [--env KEY=VALUE]..."
+              << " [--checkpoint <file> --checkpoint-at <instructions>] <executable> [arguments]... | --restore <file>\n";
+    std::cerr << "  <size> is in bytes, or with a k or m suffix, e.g. 16m\n";
+    std::cerr << "  <options> are comma separated load_use|branch|jal|jalr|mul|div=<cycles>\n";
+    std::cerr << "  <clock options> are real or virtual, then comma separated ns|epoch|seed=<value>, e.g. virtual,ns=2\n";
+    std::cerr << "  --vlen is the width of the vector registers, a power of two from 32 to 4096, 128 by default\n";
+    std::cerr << "  --checkpoint-at saves the guest after that many instructions and stops, --restore continues it\n";
+    std::cerr << "  <fuzz options> are comma separated entry=<function>|runs|timeout|max_len|persistent|seed=<value>\n";
+#ifdef RISCV_EMULATOR_PERF_MODEL
+    std::cerr << "  <cache> is size:associativity:line_size:lru|fifo|random, e.g. 32k:8:64:lru\n";
+#endif
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    const char *executable_path = nullptr;
+    std::unique_ptr<SyscallLog> syscall_log;
+    std::unique_ptr<TraceWriter> trace_writer;
+    std::unique_ptr<TimingModel> timing_model;
+    TimingConfig timing_config;
+    bool decode_cache = true;
+    const char *aot_cache = nullptr;
+    bool fusion = true;
+    bool fusion_stats = false;
+    bool jump_stats = false;
+    std::optional<LibcIntercepts::Mode> libc_mode;
+    bool coverage = false;
+    bool heap_profile = false;
+    const char *metrics_target = nullptr;
+    const char *metrics_json = nullptr;
+    uint32_t memory_size = 1024 * 1024 * 100;
+    uint32_t stack_size = RiscvEmulator::default_stack_size;
+    std::string sysroot;
+    ClockConfig clock_config;
+    uint32_t load_base = ElfLoader::default_load_base;
+    uint32_t vlen = VectorUnit::default_vlen;
+    InitialStack initial_stack;
+    const char *corpus_dir = nullptr;
+    const char *checkpoint_path = nullptr;
+    uint64_t checkpoint_at = 0;
+    const char *restore_path = nullptr;
+    FuzzerConfig fuzzer_config;
+#ifdef RISCV_EMULATOR_PERF_MODEL
+    PerfModelConfig perf_model_config;
+#endif
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (executable_path != nullptr)
+        {
+            // everything after the executable belongs to the guest
+            initial_stack.argv.push_back(arg);
+        }
+        else if ((arg == "--record" || arg == "--replay") && i + 1 < argc && syscall_log == nullptr)
+        {
+            const auto mode = arg == "--record" ? SyscallLog::Mode::record : SyscallLog::Mode::replay;
+            syscall_log = std::make_unique<SyscallLog>(argv[++i], mode);
+        }
+        else if (arg == "--trace" && i + 1 < argc && trace_writer == nullptr)
+        {
+            trace_writer = std::make_unique<TraceWriter>(argv[++i]);
+        }
+        else if (arg == "--interpreter")
+        {
+            decode_cache = false;
+        }
+        else if (arg == "--aot-cache" && i + 1 < argc)
+        {
+            aot_cache = argv[++i];
+        }
+        else if (arg == "--no-fusion")
+        {
+            fusion = false;
+        }
+        else if (arg == "--fusion-stats")
+        {
+            fusion_stats = true;
+        }
+        else if (arg == "--jump-stats")
+        {
+            jump_stats = true;
+        }
+        else if ((arg == "--host-libc" || arg == "--verify-libc") && !libc_mode.has_value())
+        {
+            libc_mode = arg == "--host-libc" ? LibcIntercepts::Mode::host : LibcIntercepts::Mode::verify;
+        }
+        else if (arg == "--coverage")
+        {
+            coverage = true;
+        }
+        else if (arg == "--memory" && i + 1 < argc)
+        {
+            memory_size = parse_size(argv[++i]);
+        }
+        else if (arg == "--sysroot" && i + 1 < argc)
+        {
+            sysroot = argv[++i];
+        }
+        else if (arg == "--load-base" && i + 1 < argc)
+        {
+            load_base = std::stoul(argv[++i], nullptr, 0);
+        }
+        else if (arg == "--vlen" && i + 1 < argc)
+        {
+            vlen = std::stoul(argv[++i]);
+        }
+        else if (arg == "--stack" && i + 1 < argc)
+        {
+            stack_size = parse_size(argv[++i]);
+        }
+        else if (arg == "--env" && i + 1 < argc)
+        {
+            initial_stack.envp.push_back(argv[++i]);
+        }
+        else if (arg == "--metrics" && i + 1 < argc)
+        {
+            metrics_target = argv[++i];
+        }
+        else if (arg == "--metrics-json" && i + 1 < argc)
+        {
+            metrics_json = argv[++i];
+        }
+        else if (arg == "--heap-profile")
+        {
+            heap_profile = true;
+        }
+        else if (arg == "--fuzz" && i + 1 < argc)
+        {
+            corpus_dir = argv[++i];
+        }
+        else if (arg == "--fuzz-config" && i + 1 < argc)
+        {
+            fuzzer_config = FuzzerConfig::parse(argv[++i]);
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc)
+        {
+            checkpoint_path = argv[++i];
+        }
+        else if (arg == "--checkpoint-at" && i + 1 < argc)
+        {
+            checkpoint_at = std::stoull(argv[++i]);
+        }
+        else if (arg == "--restore" && i + 1 < argc)
+        {
+            restore_path = argv[++i];
+        }
+        else if (arg == "--timing" && timing_model == nullptr)
+        {
+            timing_model = std::make_unique<TimingModel>(timing_config);
+        }
+        else if (arg == "--clock" && i + 1 < argc)
+        {
+            clock_config = ClockConfig::parse(argv[++i]);
+        }
+        else if (arg == "--timing-config" && i + 1 < argc)
+        {
+            timing_config = TimingConfig::parse(argv[++i]);
+            if (timing_model != nullptr)
+            {
+                timing_model = std::make_unique<TimingModel>(timing_config);
+            }
+        }
+#ifdef RISCV_EMULATOR_PERF_MODEL
+        else if ((arg == "--l1i" || arg == "--l1d" || arg == "--l2") && i + 1 < argc)
+        {
+            CacheConfig &cache = arg == "--l1i" ? perf_model_config.l1i : arg == "--l1d" ? perf_model_config.l1d : perf_model_config.l2;
+            cache = CacheConfig::parse(argv[++i]);
+        }
+        else if (arg == "--branch-predictor" && i + 1 < argc)
+        {
+            perf_model_config.branch_predictor = parse_branch_predictor_kind(argv[++i]);
+        }
+#endif
+        else if (arg[0] != '-')
+        {
+            executable_path = argv[i];
+            initial_stack.argv.push_back(arg);
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((executable_path == nullptr) == (restore_path == nullptr) || (checkpoint_path == nullptr) != (checkpoint_at == 0) ||
+        (restore_path != nullptr && corpus_dir != nullptr))
     {
+        print_usage(argv[0]);
         return 1;
     }
 
-    const char *executable_path = argv[1];
+    Mmu mmu(memory_size);
+    ElfLoader elf_loader(mmu, sysroot);
 
-    Mmu mmu(1024 * 1024 * 100);
-    ElfLoader elf_loader(mmu);
+    // a restored guest brings its memory along, there is no executable to load
+    uint32_t entry_point = 0;
+    if (executable_path != nullptr)
+    {
+        entry_point = elf_loader.load(executable_path, load_base);
+        initial_stack.entry_point = elf_loader.get_program_entry();
+        initial_stack.interpreter_base = elf_loader.get_interpreter_base();
+        initial_stack.program_headers = elf_loader.get_program_headers().addr;
+        initial_stack.program_header_size = elf_loader.get_program_headers().entry_size;
+        initial_stack.program_header_count = elf_loader.get_program_headers().count;
+    }
+
+    // a recorded run must see the same AT_RANDOM bytes when it is replayed
+    GuestClock clock(clock_config);
+    if (syscall_log == nullptr)
+    {
+        clock.fill_random(initial_stack.random);
+    }
 
-    uint32_t entry_point = elf_loader.load(executable_path);
+    const SymbolTable symbols(elf_loader.get_symbols());
     RiscvEmulator emulator(mmu);
-    emulator.run(entry_point);
+    emulator.get_linux_emulator().set_syscall_log(syscall_log.get());
+    emulator.get_linux_emulator().set_sysroot(sysroot);
+    emulator.get_linux_emulator().set_clock(clock);
+    emulator.set_trace_writer(trace_writer.get());
+    emulator.set_timing_model(timing_model.get());
+    emulator.set_decode_cache_enabled(decode_cache);
+    emulator.set_fusion_enabled(fusion);
+    emulator.set_vlen(vlen);
+    if (aot_cache != nullptr && decode_cache && executable_path != nullptr)
+    {
+        emulator.set_aot_image(AotImage::load(mmu, elf_loader, symbols, aot_cache));
+    }
+    Metrics metrics;
+    std::unique_ptr<MetricsExporter> metrics_exporter;
+    if (metrics_target != nullptr || metrics_json != nullptr)
+    {
+        emulator.set_metrics(&metrics.add_slot());
+    }
+    if (metrics_target != nullptr)
+    {
+        metrics_exporter = std::make_unique<MetricsExporter>(metrics, metrics_target);
+    }
+    std::unique_ptr<LibcIntercepts> libc_intercepts;
+    if (libc_mode.has_value())
+    {
+        libc_intercepts = std::make_unique<LibcIntercepts>(symbols, *libc_mode);
+        emulator.set_libc_intercepts(libc_intercepts.get());
+    }
+#ifdef RISCV_EMULATOR_PERF_MODEL
+    PerfModel perf_model(perf_model_config);
+    emulator.set_perf_model(&perf_model);
+#endif
+
+    if (corpus_dir != nullptr)
+    {
+        emulator.start(entry_point, initial_stack, stack_size);
+        Fuzzer fuzzer(mmu, emulator, symbols, corpus_dir, fuzzer_config);
+        return fuzzer.run(std::cerr) == 0 ? 0 : 1;
+    }
+
+    // under afl-fuzz the edges go to the shared map it passes in the environment
+    std::unique_ptr<CoverageMap> coverage_map;
+    if (coverage)
+    {
+        const char *shm_id = getenv("__AFL_SHM_ID");
+        coverage_map = shm_id != nullptr ? std::make_unique<CoverageMap>(atoi(shm_id)) : std::make_unique<CoverageMap>();
+        emulator.set_coverage_map(coverage_map.get());
+    }
+
+    std::unique_ptr<HeapProfiler> heap_profiler;
+    if (heap_profile)
+    {
+        heap_profiler = std::make_unique<HeapProfiler>(symbols);
+        emulator.set_heap_profiler(heap_profiler.get());
+    }
+
+    try
+    {
+        if (restore_path != nullptr)
+        {
+            Checkpoint::load(restore_path, emulator, mmu);
+        }
+        else
+        {
+            emulator.start(entry_point, initial_stack, stack_size);
+        }
+
+        if (checkpoint_path != nullptr)
+        {
+            emulator.run_for(checkpoint_at);
+            if (emulator.is_running() || emulator.get_linux_emulator().is_blocked())
+            {
+                Checkpoint::save(checkpoint_path, emulator, mmu);
+                std::cout << "\nCheckpoint written to " << checkpoint_path << " after " << emulator.get_instructions_retired()
+                          << " instructions\n";
+                return 0;
+            }
+        }
+        emulator.run_for(UINT64_MAX);
+    }
+    catch (const GuestFault &fault)
+    {
+        // abort like a crashing native program would, so external harnesses see the crash
+        std::cerr << "\nGuest fault: " << fault.what() << " at pc 0x" << std::hex << fault.get_pc() << '\n';
+        std::abort();
+    }
+
+    std::cout << "\nExit code = " << emulator.get_linux_emulator().get_exit_code() << '\n';
+    if (coverage_map != nullptr)
+    {
+        std::cout << "Edges " << coverage_map->count_edges() << '\n';
+    }
+    if (fusion_stats)
+    {
+        emulator.report_fusion_stats(std::cout);
+    }
+    if (jump_stats)
+    {
+        emulator.report_jump_stats(std::cout);
+    }
+    if (libc_intercepts != nullptr)
+    {
+        libc_intercepts->report(std::cout);
+    }
+    if (heap_profiler != nullptr)
+    {
+        heap_profiler->report(std::cout);
+    }
+    if (timing_model != nullptr)
+    {
+        timing_model->report(std::cout, symbols);
+    }
+#ifdef RISCV_EMULATOR_PERF_MODEL
+    perf_model.report(std::cout);
+#endif
+    if (metrics_json != nullptr)
+    {
+        std::ofstream json(metrics_json);
+        metrics.write_json(json);
+    }
     return 0;
 }
@@ -0,0 +1,144 @@
+#include "metrics-exporter.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static constexpr const char *socket_prefix = "unix:";
+static constexpr std::chrono::milliseconds poll_interval(100);
+
+MetricsExporter::MetricsExporter(const Metrics &metrics, const std::string &target, std::chrono::milliseconds interval)
+    : metrics(metrics), socket_target(target.starts_with(socket_prefix)), interval(interval)
+{
+    path = socket_target ? target.substr(strlen(socket_prefix)) : target;
+    if (!socket_target)
+    {
+        write_file();
+        thread = std::thread([this] {
+            auto next_write = std::chrono::steady_clock::now() + this->interval;
+            while (!stopping)
+            {
+                // short naps so the destructor does not wait for a whole interval
+                std::this_thread::sleep_for(std::min(this->interval, poll_interval));
+                if (std::chrono::steady_clock::now() >= next_write)
+                {
+                    write_file();
+                    next_write += this->interval;
+                }
+            }
+        });
+        return;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        throw std::invalid_argument("Socket path too long: " + path);
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (const sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0)
+    {
+        const std::string error = strerror(errno);
+        if (listen_fd >= 0)
+        {
+            close(listen_fd);
+        }
+        throw std::runtime_error("Cannot listen on " + path + ": " + error);
+    }
+
+    thread = std::thread([this] { serve_socket(); });
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    stopping = true;
+    thread.join();
+
+    if (socket_target)
+    {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+    else
+    {
+        write_file();
+    }
+}
+
+void MetricsExporter::write_file() const
+{
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        metrics.write_prometheus(file);
+        if (!file)
+        {
+            return;
+        }
+    }
+
+    std::rename(temporary.c_str(), path.c_str());
+}
+
+void MetricsExporter::serve_socket()
+{
+    while (!stopping)
+    {
+        // wake up regularly to notice the destructor
+        pollfd listener{.fd = listen_fd, .events = POLLIN, .revents = 0};
+        if (poll(&listener, 1, poll_interval.count()) <= 0)
+        {
+            continue;
+        }
+
+        const int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            continue;
+        }
+
+        // the request itself does not matter, every path gets the metrics
+        pollfd request{.fd = client, .events = POLLIN, .revents = 0};
+        if (poll(&request, 1, poll_interval.count()) > 0)
+        {
+            char buffer[1024];
+            [[maybe_unused]] const ssize_t ignored = recv(client, buffer, sizeof(buffer), MSG_DONTWAIT);
+        }
+
+        std::ostringstream body;
+        metrics.write_prometheus(body);
+        const std::string text = body.str();
+
+        std::ostringstream response;
+        response << "HTTP/1.0 200 OK\r\n"
+                 << "Content-Type: text/plain; version=0.0.4\r\n"
+                 << "Content-Length: " << text.size() << "\r\n"
+                 << "Connection: close\r\n\r\n"
+                 << text;
+
+        const std::string bytes = response.str();
+        size_t sent = 0;
+        while (sent < bytes.size())
+        {
+            const ssize_t written = send(client, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0)
+            {
+                break;
+            }
+            sent += written;
+        }
+
+        close(client);
+    }
+}
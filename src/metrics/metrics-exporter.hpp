@@ -0,0 +1,42 @@
+#pragma once
+
+#include "metrics.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+/*
+    Publishes Metrics in the Prometheus text format from a background thread.
+
+    A target of the form unix:<path> listens on a unix domain socket and answers every connection
+    with an HTTP response holding the current values, e.g. for
+    `curl --unix-socket <path> http://localhost/metrics`. Any other target is a file that is
+    rewritten every interval through a rename, so a textfile collector never reads half a file.
+*/
+class MetricsExporter
+{
+  public:
+    MetricsExporter(const Metrics &metrics, const std::string &target,
+                    std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+    // Stops the thread, a file target gets the final values
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter &) = delete;
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+  private:
+    void write_file() const;
+
+    void serve_socket();
+
+  private:
+    const Metrics &metrics;
+    std::string path;
+    bool socket_target;
+    std::chrono::milliseconds interval;
+    int listen_fd = -1;
+    std::atomic<bool> stopping = false;
+    std::thread thread;
+};
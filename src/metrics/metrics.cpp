@@ -0,0 +1,173 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <map>
+#include <string>
+
+// Class of every major opcode, indexed by bits 6:2 of the instruction
+static const char *opcode_class(uint32_t opcode)
+{
+    switch (opcode)
+    {
+        case 0b00000: // LOAD
+        case 0b00001: // LOAD-FP
+            return "load";
+        case 0b01000: // STORE
+        case 0b01001: // STORE-FP
+            return "store";
+        case 0b00100: // OP-IMM
+        case 0b00101: // AUIPC
+        case 0b01100: // OP
+        case 0b01101: // LUI
+            return "alu";
+        case 0b01011: // AMO
+            return "atomic";
+        case 0b10000: // MADD
+        case 0b10001: // MSUB
+        case 0b10010: // NMSUB
+        case 0b10011: // NMADD
+        case 0b10100: // OP-FP
+            return "float";
+        case 0b10101: // OP-V
+            return "vector";
+        case 0b11000: // BRANCH
+            return "branch";
+        case 0b11001: // JALR
+        case 0b11011: // JAL
+            return "jump";
+        case 0b00011: // MISC-MEM
+        case 0b11100: // SYSTEM
+            return "system";
+        default:
+            return "other";
+    }
+}
+
+static std::map<std::string, uint64_t> opcode_classes(const std::array<uint64_t, 32> &opcodes)
+{
+    std::map<std::string, uint64_t> classes;
+    for (uint32_t opcode = 0; opcode < opcodes.size(); ++opcode)
+    {
+        classes[opcode_class(opcode)] += opcodes[opcode];
+    }
+
+    return classes;
+}
+
+MetricsSlot &Metrics::add_slot()
+{
+    std::lock_guard lock(mutex);
+    return slots.emplace_back();
+}
+
+Metrics::Totals Metrics::aggregate() const
+{
+    std::lock_guard lock(mutex);
+
+    Totals totals;
+    totals.instances = slots.size();
+    for (const MetricsSlot &slot : slots)
+    {
+        totals.instructions_retired += slot.instructions_retired.get();
+        for (size_t i = 0; i < totals.opcodes.size(); ++i)
+        {
+            totals.opcodes[i] += slot.opcodes[i].get();
+        }
+        for (size_t i = 0; i < totals.syscalls.size(); ++i)
+        {
+            totals.syscalls[i] += slot.syscalls[i].get();
+        }
+        totals.bytes_read += slot.bytes_read.get();
+        totals.bytes_written += slot.bytes_written.get();
+        totals.decode_cache_hits += slot.decode_cache_hits.get();
+        totals.decode_cache_misses += slot.decode_cache_misses.get();
+        totals.fused_pairs += slot.fused_pairs.get();
+        totals.brk_high_water = std::max(totals.brk_high_water, slot.brk_high_water.get());
+    }
+
+    return totals;
+}
+
+static void write_metric(std::ostream &out, const char *name, const char *type, const char *help, uint64_t value)
+{
+    out << "# HELP " << name << ' ' << help << '\n'
+        << "# TYPE " << name << ' ' << type << '\n'
+        << name << ' ' << value << '\n';
+}
+
+void Metrics::write_prometheus(std::ostream &out) const
+{
+    const Totals totals = aggregate();
+    out << std::dec;
+
+    write_metric(out, "riscvemu_instances", "gauge", "Emulator instances reporting", totals.instances);
+    write_metric(out, "riscvemu_instructions_retired_total", "counter", "Guest instructions retired",
+                 totals.instructions_retired);
+
+    out << "# HELP riscvemu_instructions_total Guest instructions executed by opcode class\n"
+        << "# TYPE riscvemu_instructions_total counter\n";
+    for (const auto &[name, count] : opcode_classes(totals.opcodes))
+    {
+        out << "riscvemu_instructions_total{class=\"" << name << "\"} " << count << '\n';
+    }
+
+    out << "# HELP riscvemu_syscalls_total Guest syscalls by number\n"
+        << "# TYPE riscvemu_syscalls_total counter\n";
+    for (uint32_t number = 0; number < totals.syscalls.size(); ++number)
+    {
+        if (totals.syscalls[number] != 0)
+        {
+            out << "riscvemu_syscalls_total{number=\""
+                << (number < MetricsSlot::syscall_count ? std::to_string(number) : "other") << "\"} "
+                << totals.syscalls[number] << '\n';
+        }
+    }
+
+    write_metric(out, "riscvemu_syscall_read_bytes_total", "counter", "Bytes read by guest syscalls", totals.bytes_read);
+    write_metric(out, "riscvemu_syscall_written_bytes_total", "counter", "Bytes written by guest syscalls",
+                 totals.bytes_written);
+    write_metric(out, "riscvemu_decode_cache_hits_total", "counter", "Decode cache lookups that hit",
+                 totals.decode_cache_hits);
+    write_metric(out, "riscvemu_decode_cache_misses_total", "counter", "Decode cache lookups that missed",
+                 totals.decode_cache_misses);
+    write_metric(out, "riscvemu_fused_pairs_total", "counter", "Instruction pairs executed as one superinstruction",
+                 totals.fused_pairs);
+    write_metric(out, "riscvemu_brk_high_water_bytes", "gauge", "Highest guest program break of any instance",
+                 totals.brk_high_water);
+}
+
+void Metrics::write_json(std::ostream &out) const
+{
+    const Totals totals = aggregate();
+    out << std::dec << "{\n"
+        << "  \"instances\": " << totals.instances << ",\n"
+        << "  \"instructions_retired\": " << totals.instructions_retired << ",\n"
+        << "  \"instructions\": {";
+
+    const char *separator = "";
+    for (const auto &[name, count] : opcode_classes(totals.opcodes))
+    {
+        out << separator << "\"" << name << "\": " << count;
+        separator = ", ";
+    }
+
+    out << "},\n  \"syscalls\": {";
+    separator = "";
+    for (uint32_t number = 0; number < totals.syscalls.size(); ++number)
+    {
+        if (totals.syscalls[number] != 0)
+        {
+            out << separator << "\"" << (number < MetricsSlot::syscall_count ? std::to_string(number) : "other")
+                << "\": " << totals.syscalls[number];
+            separator = ", ";
+        }
+    }
+
+    out << "},\n"
+        << "  \"syscall_read_bytes\": " << totals.bytes_read << ",\n"
+        << "  \"syscall_written_bytes\": " << totals.bytes_written << ",\n"
+        << "  \"decode_cache_hits\": " << totals.decode_cache_hits << ",\n"
+        << "  \"decode_cache_misses\": " << totals.decode_cache_misses << ",\n"
+        << "  \"fused_pairs\": " << totals.fused_pairs << ",\n"
+        << "  \"brk_high_water\": " << totals.brk_high_water << "\n"
+        << "}\n";
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+
+/*
+    Low overhead emulator statistics.
+
+    Every emulator instance owns one MetricsSlot and is the only thread writing to it, so counters
+    are bumped with relaxed loads and stores instead of locked read-modify-writes. Slots are cache
+    line aligned, instances on different threads never share a line. Readers add the slots up on
+    demand, values may be a few increments behind but are never torn.
+*/
+class Counter
+{
+  public:
+    void add(uint64_t amount = 1)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    // Keeps the largest value seen, for high-water marks
+    void raise(uint64_t candidate)
+    {
+        if (candidate > value.load(std::memory_order_relaxed))
+        {
+            value.store(candidate, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> value = 0;
+};
+
+struct alignas(64) MetricsSlot
+{
+    static constexpr uint32_t syscall_count = 512; // larger numbers share the last counter
+
+    // Bumps the counter of the major opcode, bits 6:2 of the instruction
+    void count_instruction(uint32_t inst)
+    {
+        opcodes[(inst >> 2) & 0b11111].add();
+    }
+
+    void count_syscall(uint32_t number)
+    {
+        syscalls[number < syscall_count ? number : syscall_count].add();
+    }
+
+    Counter instructions_retired;
+    std::array<Counter, 32> opcodes;
+    std::array<Counter, syscall_count + 1> syscalls;
+    Counter bytes_read;
+    Counter bytes_written;
+    Counter decode_cache_hits;
+    Counter decode_cache_misses;
+    Counter fused_pairs;
+    Counter brk_high_water;
+};
+
+class Metrics
+{
+  public:
+    // Slots stay valid for the lifetime of the registry, may be called from any thread
+    MetricsSlot &add_slot();
+
+    // Prometheus text exposition format, version 0.0.4
+    void write_prometheus(std::ostream &out) const;
+
+    void write_json(std::ostream &out) const;
+
+  private:
+    struct Totals
+    {
+        uint64_t instances = 0;
+        uint64_t instructions_retired = 0;
+        std::array<uint64_t, 32> opcodes = {};
+        std::array<uint64_t, MetricsSlot::syscall_count + 1> syscalls = {};
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t decode_cache_hits = 0;
+        uint64_t decode_cache_misses = 0;
+        uint64_t fused_pairs = 0;
+        uint64_t brk_high_water = 0;
+    };
+
+    Totals aggregate() const;
+
+  private:
+    mutable std::mutex mutex;
+    std::deque<MetricsSlot> slots; // a deque never moves its elements when it grows
+};
@@ -0,0 +1,42 @@
+#include "guest-memory.hpp"
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+
+GuestMemory::GuestMemory(uint32_t size) : byte_count(size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+
+    bytes = (uint8_t *)mapping;
+}
+
+GuestMemory::GuestMemory(int fd, uint32_t size) : byte_count(size)
+{
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error(std::string("Cannot map file: ") + strerror(errno));
+    }
+
+    bytes = (uint8_t *)mapping;
+}
+
+GuestMemory::~GuestMemory()
+{
+    if (bytes != nullptr)
+    {
+        munmap(bytes, byte_count);
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+    Backing store for guest physical memory.
+    It is an anonymous private mapping, so creating even a large guest is constant time and the
+    host only commits the pages the guest actually touches. A file mapping instead is read only and
+    reads the file's pages in as they are touched, the Mmu only references it copy on write.
+*/
+class GuestMemory
+{
+  public:
+    GuestMemory(uint32_t size);
+
+    // Maps the first size bytes of fd, throws std::runtime_error when it cannot be mapped
+    GuestMemory(int fd, uint32_t size);
+    ~GuestMemory();
+
+    GuestMemory(const GuestMemory &) = delete;
+    GuestMemory &operator=(const GuestMemory &) = delete;
+
+    uint8_t *data()
+    {
+        return bytes;
+    }
+
+    const uint8_t *data() const
+    {
+        return bytes;
+    }
+
+    uint32_t size() const
+    {
+        return byte_count;
+    }
+
+  private:
+    uint8_t *bytes = nullptr;
+    uint32_t byte_count = 0;
+};
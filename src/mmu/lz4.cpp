@@ -0,0 +1,190 @@
+#include "lz4.hpp"
+#include <algorithm>
+#include <cstring>
+
+static constexpr uint32_t min_match = 4;
+static constexpr uint32_t last_literals = 5; // a block always ends in at least this many literals
+static constexpr uint32_t match_limit = 12;  // and no match starts closer to its end
+static constexpr uint32_t max_offset = 65535;
+static constexpr uint32_t hash_bits = 12;
+
+static uint32_t read32(const uint8_t *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t hash_sequence(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - hash_bits);
+}
+
+// Writes the part of a length that does not fit the token's nibble
+static uint8_t *write_length(uint8_t *out, uint32_t length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+// Appends literals and, unless match_length is 0, the match after them. Returns nullptr when the
+// sequence does not fit.
+static uint8_t *write_sequence(uint8_t *out, const uint8_t *out_end, const uint8_t *literals, uint32_t literal_count,
+                               uint32_t offset, uint32_t match_length)
+{
+    const uint64_t needed = 1 + (literal_count / 255 + 1) + literal_count + 2 + (match_length / 255 + 1);
+    if (needed > (uint64_t)(out_end - out))
+    {
+        return nullptr;
+    }
+
+    uint8_t *token = out++;
+    *token = (uint8_t)(std::min<uint32_t>(literal_count, 15) << 4);
+    if (literal_count >= 15)
+    {
+        out = write_length(out, literal_count);
+    }
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+
+    if (match_length == 0)
+    {
+        return out;
+    }
+
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    const uint32_t length_code = match_length - min_match;
+    *token |= (uint8_t)std::min<uint32_t>(length_code, 15);
+    if (length_code >= 15)
+    {
+        out = write_length(out, length_code);
+    }
+    return out;
+}
+
+uint32_t lz4_compress(std::span<const uint8_t> source, std::span<uint8_t> destination)
+{
+    const uint8_t *in = source.data();
+    const uint32_t size = source.size();
+    uint8_t *out = destination.data();
+    const uint8_t *out_end = out + destination.size();
+
+    uint32_t table[1 << hash_bits] = {}; // last position of each hashed sequence, stale ones fail the compare
+    uint32_t anchor = 0;
+    uint32_t position = 0;
+    while (size >= match_limit && position + match_limit <= size)
+    {
+        const uint32_t sequence = read32(in + position);
+        uint32_t &slot = table[hash_sequence(sequence)];
+        const uint32_t candidate = slot;
+        slot = position;
+        if (candidate >= position || position - candidate > max_offset || read32(in + candidate) != sequence)
+        {
+            ++position;
+            continue;
+        }
+
+        uint32_t length = min_match;
+        while (position + length < size - last_literals && in[candidate + length] == in[position + length])
+        {
+            ++length;
+        }
+
+        out = write_sequence(out, out_end, in + anchor, position - anchor, position - candidate, length);
+        if (out == nullptr)
+        {
+            return 0;
+        }
+        position += length;
+        anchor = position;
+    }
+
+    out = write_sequence(out, out_end, in + anchor, size - anchor, 0, 0);
+    return out == nullptr ? 0 : out - destination.data();
+}
+
+// Reads the rest of a length whose nibble was 15, returns false when the block ends first
+static bool read_length(const uint8_t *&in, const uint8_t *in_end, uint32_t &length)
+{
+    uint8_t byte;
+    do
+    {
+        if (in == in_end)
+        {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lz4_decompress(std::span<const uint8_t> source, std::span<uint8_t> destination)
+{
+    const uint8_t *in = source.data();
+    const uint8_t *in_end = in + source.size();
+    uint8_t *out = destination.data();
+    uint8_t *out_end = out + destination.size();
+
+    while (in != in_end)
+    {
+        const uint8_t token = *in++;
+        uint32_t literal_count = token >> 4;
+        if (literal_count == 15 && !read_length(in, in_end, literal_count))
+        {
+            return false;
+        }
+        if (literal_count > (size_t)(in_end - in) || literal_count > (size_t)(out_end - out))
+        {
+            return false;
+        }
+        memcpy(out, in, literal_count);
+        in += literal_count;
+        out += literal_count;
+
+        // the last sequence has no match
+        if (in == in_end)
+        {
+            break;
+        }
+
+        if (in_end - in < 2)
+        {
+            return false;
+        }
+        const uint32_t offset = in[0] | (uint32_t)in[1] << 8;
+        in += 2;
+        uint32_t length = token & 15;
+        if (length == 15 && !read_length(in, in_end, length))
+        {
+            return false;
+        }
+        length += min_match;
+        if (offset == 0 || offset > (size_t)(out - destination.data()) || length > (size_t)(out_end - out))
+        {
+            return false;
+        }
+
+        // matches may overlap their own output, e.g. a run of one byte has offset 1
+        const uint8_t *match = out - offset;
+        if (offset >= length)
+        {
+            memcpy(out, match, length);
+            out += length;
+        }
+        else
+        {
+            for (uint32_t i = 0; i < length; ++i)
+            {
+                *out++ = match[i];
+            }
+        }
+    }
+
+    return out == out_end;
+}
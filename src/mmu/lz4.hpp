@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+/*
+    LZ4 block format, the part of it guest pages need.
+
+    A block is a sequence of literal runs each followed by a back reference of at least 4 bytes into
+    the last 64 KiB of output, see lz4_Block_format.md of the LZ4 project. The compressor is the
+    greedy single probe variant of the reference implementation: one hash table lookup per position,
+    no lazy matching. Pages compress to a few hundred bytes in about a microsecond that way, which
+    matters more for faulting them back in than the last few percent of ratio.
+
+    Blocks are compatible with the reference LZ4_decompress_safe, but nothing outside this emulator
+    reads them.
+*/
+
+// Upper bound of the compressed size of size bytes
+constexpr uint32_t lz4_compress_bound(uint32_t size)
+{
+    return size + size / 255 + 16;
+}
+
+// Compresses source into destination, returns the compressed size or 0 when it does not fit
+uint32_t lz4_compress(std::span<const uint8_t> source, std::span<uint8_t> destination);
+
+// Decompresses a block, returns false unless it is well formed and fills destination exactly
+bool lz4_decompress(std::span<const uint8_t> source, std::span<uint8_t> destination);
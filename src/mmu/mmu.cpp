@@ -1,26 +1,588 @@
 #include "mmu.hpp"
+#include "lz4.hpp"
+#include "page-store.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <stdexcept>
 #include <iostream>
+#include <sys/mman.h>
 
-void Mmu::write_from(uint32_t virt_addr, const uint8_t *begin, const uint8_t *end)
+Mmu::Mmu(uint32_t size)
+    : byte_count(size), page_count((size + page_size - 1) / page_size),
+      zero_frame((uintptr_t)PageStore::zero_page()),
+      page_table(std::make_unique<GuestMemory>(std::max(page_count, 1u) * sizeof(uintptr_t))),
+      pages((uintptr_t *)page_table->data()), mapping_floor(size & ~(page_size - 1))
 {
-    auto write_size = end - begin;
-    std::cerr << "write [" << virt_addr << "; " << virt_addr + write_size << ')' << std::endl;
-    assert(virt_addr + write_size < memory.size());
-    memcpy(memory.data() + virt_addr, begin, write_size);
 }
 
-void Mmu::read_bunch(uint32_t virt_addr, uint8_t *out_buf, uint32_t size)
+Mmu::Mmu(const Mmu &other)
+    : byte_count(other.byte_count), page_count(other.page_count), zero_frame(other.zero_frame),
+      page_table(std::make_unique<GuestMemory>(other.page_table->size())), pages((uintptr_t *)page_table->data()),
+      regions(other.regions), free_frames(other.free_frames), free_frame_count(other.free_frame_count),
+      copied_pages(other.copied_pages), written_pages(other.written_pages), recycled_frames(other.recycled_frames),
+      compressed_blocks(other.compressed_blocks), compression_stats(other.compression_stats), first_alloc(other.first_alloc), brk_alloc(other.brk_alloc), mapping_floor(other.mapping_floor),
+      free_mappings(other.free_mappings)
 {
-    assert(virt_addr + size < memory.size());
-    std::cerr << "read [" << virt_addr << "; " << virt_addr + size << ')' << std::endl;
-    memcpy(out_buf, memory.data() + virt_addr, size);
+    // only the table pages that map something, so a child commits no more of the table than its parent
+    static constexpr uint32_t entries_per_page = page_size / sizeof(uintptr_t);
+    for (uint32_t first = 0; first < page_count; first += entries_per_page)
+    {
+        const uintptr_t *begin = other.pages + first;
+        const uintptr_t *end = other.pages + std::min(first + entries_per_page, page_count);
+        if (std::any_of(begin, end, [](uintptr_t entry) { return entry != 0; }))
+        {
+            std::copy(begin, end, pages + first);
+        }
+    }
+}
+
+Mmu Mmu::fork()
+{
+    for (uint32_t page = 0; page < page_count; ++page)
+    {
+        // a store to an untouched part of the table would commit it
+        if ((pages[page] & private_page) != 0)
+        {
+            pages[page] &= ~private_page;
+        }
+    }
+
+    // the rest of the newest region is reachable from both sides now, neither may hand it out
+    free_frames = nullptr;
+    free_frame_count = 0;
+    copied_pages = 0;
+    written_pages.clear();
+    recycled_frames.clear();
+
+    return Mmu(*this);
+}
+
+void Mmu::restore(const Mmu &snapshot)
+{
+    if (snapshot.page_count != page_count)
+    {
+        throw std::invalid_argument("Snapshot has a different memory size");
+    }
+
+    // every write to a page shared since the fork copies it first
+    if (snapshot.copied_pages != 0)
+    {
+        throw std::logic_error("Snapshot was written after it was forked");
+    }
+
+    std::vector<uint32_t> still_private;
+    for (uint32_t page : written_pages)
+    {
+        release_page(page);
+
+        const uintptr_t entry = snapshot.pages[page];
+        if ((entry & compressed_page) != 0)
+        {
+            const auto &block = snapshot.compressed_blocks.at(page);
+            compressed_blocks[page] = block;
+            ++compression_stats.stored_pages;
+            compression_stats.stored_bytes += block->size();
+            pages[page] = entry;
+        }
+        else if ((entry & private_page) != 0)
+        {
+            // decompressed by the snapshot since the fork, its frame is not ours to share
+            uint8_t *frame = take_frame();
+            memcpy(frame, snapshot.to_frame(entry), page_size);
+            pages[page] = to_entry(frame) | private_page;
+            still_private.push_back(page);
+        }
+        else
+        {
+            pages[page] = entry;
+        }
+    }
+
+    written_pages = std::move(still_private);
+    first_alloc = snapshot.first_alloc;
+    brk_alloc = snapshot.brk_alloc;
+    mapping_floor = snapshot.mapping_floor;
+    free_mappings = snapshot.free_mappings;
+}
+
+uint32_t Mmu::allocate_mapping(uint32_t size)
+{
+    const uint64_t aligned_size = ((uint64_t)size + page_size - 1) & ~(uint64_t)(page_size - 1);
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    // first fit, what is left of the range stays free
+    for (auto free = free_mappings.begin(); free != free_mappings.end(); ++free)
+    {
+        if (free->second >= aligned_size)
+        {
+            const uint32_t start = free->first;
+            const uint32_t rest = free->second - (uint32_t)aligned_size;
+            free_mappings.erase(free);
+            if (rest != 0)
+            {
+                free_mappings.emplace(start + (uint32_t)aligned_size, rest);
+            }
+            return start;
+        }
+    }
+
+    if (aligned_size > mapping_floor || mapping_floor - aligned_size < brk_alloc)
+    {
+        return 0;
+    }
+
+    mapping_floor -= aligned_size;
+    return mapping_floor;
+}
+
+void Mmu::release_mapping(uint32_t virt_addr, uint32_t size)
+{
+    uint64_t start = std::max<uint64_t>(virt_addr & ~(page_size - 1), mapping_floor);
+    uint64_t end = std::min<uint64_t>(((uint64_t)virt_addr + size + page_size - 1) & ~(uint64_t)(page_size - 1),
+                                      byte_count & ~(page_size - 1));
+    if (start >= end)
+    {
+        return;
+    }
+
+    for (uint64_t addr = start; addr < end; addr += page_size)
+    {
+        const uint32_t page = addr / page_size;
+        if (pages[page] != 0)
+        {
+            release_page(page);
+            pages[page] = 0;
+            written_pages.push_back(page);
+        }
+    }
+
+    // merge with the free ranges it overlaps or touches
+    auto next = free_mappings.upper_bound((uint32_t)start);
+    if (next != free_mappings.begin())
+    {
+        auto previous = std::prev(next);
+        if ((uint64_t)previous->first + previous->second >= start)
+        {
+            start = previous->first;
+            end = std::max<uint64_t>(end, (uint64_t)previous->first + previous->second);
+            free_mappings.erase(previous);
+        }
+    }
+    while (next != free_mappings.end() && next->first <= end)
+    {
+        end = std::max<uint64_t>(end, (uint64_t)next->first + next->second);
+        next = free_mappings.erase(next);
+    }
+
+    if (start == mapping_floor)
+    {
+        mapping_floor = (uint32_t)end;
+    }
+    else
+    {
+        free_mappings.emplace((uint32_t)start, (uint32_t)(end - start));
+    }
+}
+
+void Mmu::reserve_mapping(uint32_t virt_addr, uint32_t size)
+{
+    const uint64_t start = virt_addr & ~(page_size - 1);
+    const uint64_t end = ((uint64_t)virt_addr + size + page_size - 1) & ~(uint64_t)(page_size - 1);
+
+    auto free = free_mappings.upper_bound((uint32_t)start);
+    if (free != free_mappings.begin())
+    {
+        --free;
+    }
+    while (free != free_mappings.end() && free->first < end)
+    {
+        const uint64_t free_start = free->first;
+        const uint64_t free_end = free_start + free->second;
+        if (free_end <= start)
+        {
+            ++free;
+            continue;
+        }
+
+        free = free_mappings.erase(free);
+        if (free_start < start)
+        {
+            free_mappings.emplace((uint32_t)free_start, (uint32_t)(start - free_start));
+        }
+        if (free_end > end)
+        {
+            free_mappings.emplace((uint32_t)end, (uint32_t)(free_end - end));
+        }
+    }
+}
+
+void Mmu::map_region(uint32_t virt_addr, std::shared_ptr<GuestMemory> region, uint32_t offset, uint32_t size)
+{
+    check_access(virt_addr, size);
+    if (virt_addr % page_size != 0 || offset % page_size != 0 || (uint64_t)offset + size > region->size())
+    {
+        throw std::invalid_argument("Mapping is not page aligned or exceeds its region");
+    }
+
+    for (uint32_t mapped = 0; mapped < size; mapped += page_size)
+    {
+        const uint32_t page = (virt_addr + mapped) / page_size;
+        release_page(page);
+
+        // never private, a write copies the page first and leaves the region untouched
+        pages[page] = to_entry(region->data() + offset + mapped);
+        written_pages.push_back(page);
+    }
+
+    if (std::find(regions.begin(), regions.end(), region) == regions.end())
+    {
+        regions.push_back(std::move(region));
+    }
+}
+
+uint32_t Mmu::share_pages()
+{
+    PageStore &store = PageStore::instance();
+    const uint8_t *zero_page = PageStore::zero_page();
+
+    uint32_t released = 0;
+    for (uint32_t page = 0; page < page_count; ++page)
+    {
+        if ((pages[page] & private_page) == 0)
+        {
+            continue;
+        }
+
+        uint8_t *frame = to_frame(pages[page]);
+        if (memcmp(frame, zero_page, page_size) == 0)
+        {
+            pages[page] = to_entry(zero_page);
+        }
+        else
+        {
+            auto [shared, chunk] = store.intern(frame);
+            pages[page] = to_entry(shared);
+            if (regions.empty() || regions.back() != chunk)
+            {
+                if (std::find(regions.begin(), regions.end(), chunk) == regions.end())
+                {
+                    regions.push_back(std::move(chunk));
+                }
+            }
+        }
+
+        // the host takes the memory back, a reuse by copy_page faults in a fresh page
+        madvise(frame, page_size, MADV_DONTNEED);
+        recycled_frames.push_back(frame);
+        ++released;
+    }
+
+    return released;
+}
+
+uint32_t Mmu::count_private_pages() const
+{
+    return std::count_if(pages, pages + page_count, [](uintptr_t entry) { return (entry & private_page) != 0; });
+}
+
+uint32_t Mmu::compress_pages()
+{
+    const uint8_t *zero_page = PageStore::zero_page();
+    std::vector<uint8_t> buffer(lz4_compress_bound(page_size));
+
+    uint32_t released = 0;
+    for (uint32_t page = 0; page < page_count; ++page)
+    {
+        if ((pages[page] & private_page) == 0)
+        {
+            continue;
+        }
+
+        uint8_t *frame = to_frame(pages[page]);
+        if (memcmp(frame, zero_page, page_size) == 0)
+        {
+            pages[page] = to_entry(zero_page);
+        }
+        else
+        {
+            const uint32_t size = lz4_compress(std::span(frame, page_size), buffer);
+            if (size == 0 || size > page_size * min_ratio_percent / 100)
+            {
+                continue;
+            }
+
+            compressed_blocks[page] = std::make_shared<const std::vector<uint8_t>>(buffer.begin(), buffer.begin() + size);
+            pages[page] = compressed_page;
+            ++compression_stats.stored_pages;
+            compression_stats.stored_bytes += size;
+            ++compression_stats.compressed_pages;
+            compression_stats.compressed_bytes += size;
+        }
+
+        madvise(frame, page_size, MADV_DONTNEED);
+        recycled_frames.push_back(frame);
+        ++released;
+    }
+
+    return released;
+}
+
+void Mmu::save_state(CheckpointWriter &writer)
+{
+    writer.write(first_alloc);
+    writer.write(brk_alloc);
+    writer.write(mapping_floor);
+    writer.write((uint32_t)free_mappings.size());
+    for (const auto &[start, size] : free_mappings)
+    {
+        writer.write(start);
+        writer.write(size);
+    }
+
+    const uint8_t *zero_page = PageStore::zero_page();
+    for (uint32_t page = 0; page < page_count; ++page)
+    {
+        if (pages[page] == 0)
+        {
+            continue;
+        }
+
+        const uint8_t *frame = read_pointer(page * page_size);
+        if (memcmp(frame, zero_page, page_size) != 0)
+        {
+            writer.add_page(page, frame);
+        }
+    }
+}
+
+void Mmu::load_state(CheckpointReader &reader)
+{
+    first_alloc = reader.read<uint32_t>();
+    brk_alloc = reader.read<uint32_t>();
+    mapping_floor = reader.read<uint32_t>();
+    if (first_alloc > brk_alloc || brk_alloc > mapping_floor || mapping_floor > byte_count)
+    {
+        throw std::runtime_error("Checkpoint holds an inconsistent break");
+    }
+
+    free_mappings.clear();
+    const uint32_t free_count = reader.read<uint32_t>();
+    uint64_t previous_end = mapping_floor;
+    for (uint32_t index = 0; index < free_count; ++index)
+    {
+        const uint32_t start = reader.read<uint32_t>();
+        const uint32_t size = reader.read<uint32_t>();
+        if (start < previous_end || size == 0 || (uint64_t)start + size > byte_count)
+        {
+            throw std::runtime_error("Checkpoint holds an inconsistent unmapped range");
+        }
+        free_mappings.emplace(start, size);
+        previous_end = (uint64_t)start + size;
+    }
+}
+
+uintptr_t Mmu::decompress_page(uint32_t page)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    auto found = compressed_blocks.find(page);
+    uint8_t *frame = take_frame();
+    if (!lz4_decompress(*found->second, std::span(frame, page_size)))
+    {
+        throw std::logic_error("Compressed guest page is corrupt");
+    }
+
+    --compression_stats.stored_pages;
+    compression_stats.stored_bytes -= found->second->size();
+    compressed_blocks.erase(found);
+
+    // restore has to know the page differs from the snapshot's frame
+    written_pages.push_back(page);
+    pages[page] = to_entry(frame) | private_page;
+
+    const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    ++compression_stats.faults;
+    compression_stats.fault_ns += elapsed;
+    compression_stats.max_fault_ns = std::max(compression_stats.max_fault_ns, elapsed);
+    return pages[page];
+}
+
+void Mmu::release_page(uint32_t page)
+{
+    // mapped and restored pages point at shared frames, which are not ours to reuse
+    if ((pages[page] & private_page) != 0)
+    {
+        recycled_frames.push_back(to_frame(pages[page]));
+    }
+    else if ((pages[page] & compressed_page) != 0)
+    {
+        auto found = compressed_blocks.find(page);
+        --compression_stats.stored_pages;
+        compression_stats.stored_bytes -= found->second->size();
+        compressed_blocks.erase(found);
+    }
+}
+
+uint8_t *Mmu::take_frame()
+{
+    if (recycled_frames.empty())
+    {
+        return allocate_frame();
+    }
+
+    uint8_t *frame = recycled_frames.back();
+    recycled_frames.pop_back();
+    return frame;
+}
+
+uintptr_t Mmu::copy_page(uint32_t page)
+{
+    if ((pages[page] & compressed_page) != 0)
+    {
+        return decompress_page(page);
+    }
+
+    uint8_t *frame = take_frame();
+    ++copied_pages;
+    written_pages.push_back(page);
+
+    memcpy(frame, to_frame(pages[page]), page_size);
+    pages[page] = to_entry(frame) | private_page;
+    return pages[page];
+}
+
+uint8_t *Mmu::allocate_frame()
+{
+    if (free_frame_count == 0)
+    {
+        auto region = std::make_shared<GuestMemory>(frames_per_region * page_size);
+        free_frames = region->data();
+        free_frame_count = frames_per_region;
+        regions.push_back(std::move(region));
+    }
+
+    uint8_t *frame = free_frames;
+    free_frames += page_size;
+    --free_frame_count;
+    return frame;
+}
+
+void Mmu::fill(uint32_t virt_addr, uint8_t value, uint32_t size)
+{
+    check_access(virt_addr, size);
+    while (size != 0)
+    {
+        const uint32_t chunk = std::min(size, page_remainder(virt_addr));
+
+        // zeroing the zero page, e.g. .bss, would only copy it
+        if (value != 0 || pages[virt_addr / page_size] != 0)
+        {
+            memset(write_pointer(virt_addr), value, chunk);
+        }
+        virt_addr += chunk;
+        size -= chunk;
+    }
+}
+
+void Mmu::copy(uint32_t dst_addr, uint32_t src_addr, uint32_t size)
+{
+    check_access(dst_addr, size);
+    check_access(src_addr, size);
+    if (dst_addr <= src_addr || dst_addr >= src_addr + size)
+    {
+        while (size != 0)
+        {
+            const uint32_t chunk = std::min({size, page_remainder(src_addr), page_remainder(dst_addr)});
+            memmove(write_pointer(dst_addr), read_pointer(src_addr), chunk);
+            dst_addr += chunk;
+            src_addr += chunk;
+            size -= chunk;
+        }
+        return;
+    }
+
+    // the destination overlaps the tail of the source, copy backwards so no byte is overwritten before it is read
+    while (size != 0)
+    {
+        const uint32_t src_in_page = ((src_addr + size - 1) & (page_size - 1)) + 1;
+        const uint32_t dst_in_page = ((dst_addr + size - 1) & (page_size - 1)) + 1;
+        const uint32_t chunk = std::min({size, src_in_page, dst_in_page});
+        size -= chunk;
+        memmove(write_pointer(dst_addr + size), read_pointer(src_addr + size), chunk);
+    }
+}
+
+void Mmu::copy_from_host(uint32_t virt_addr, std::span<const uint8_t> bytes)
+{
+    debug_log << "write [" << virt_addr << "; " << virt_addr + bytes.size() << ')' << std::endl;
+    check_access(virt_addr, bytes.size());
+    while (!bytes.empty())
+    {
+        const uint32_t chunk = std::min<size_t>(bytes.size(), page_remainder(virt_addr));
+        memcpy(write_pointer(virt_addr), bytes.data(), chunk);
+        virt_addr += chunk;
+        bytes = bytes.subspan(chunk);
+    }
+}
+
+void Mmu::copy_to_host(uint32_t virt_addr, std::span<uint8_t> bytes)
+{
+    debug_log << "read [" << virt_addr << "; " << virt_addr + bytes.size() << ')' << std::endl;
+    check_access(virt_addr, bytes.size());
+    while (!bytes.empty())
+    {
+        const uint32_t chunk = std::min<size_t>(bytes.size(), page_remainder(virt_addr));
+        memcpy(bytes.data(), read_pointer(virt_addr), chunk);
+        virt_addr += chunk;
+        bytes = bytes.subspan(chunk);
+    }
 }
 
-void Mmu::set(uint32_t virt_addr, uint8_t value, uint32_t size)
+int32_t Mmu::compare(uint32_t lhs_addr, uint32_t rhs_addr, uint32_t size)
 {
-    assert(virt_addr + size < memory.size());
-    memory.insert(memory.begin() + virt_addr, value, size);
+    check_access(lhs_addr, size);
+    check_access(rhs_addr, size);
+    while (size != 0)
+    {
+        const uint32_t chunk = std::min({size, page_remainder(lhs_addr), page_remainder(rhs_addr)});
+        const uint8_t *lhs = read_pointer(lhs_addr);
+        const uint8_t *rhs = read_pointer(rhs_addr);
+        if (memcmp(lhs, rhs, chunk) != 0)
+        {
+            const auto mismatch = std::mismatch(lhs, lhs + chunk, rhs);
+            return (int32_t)*mismatch.first - (int32_t)*mismatch.second;
+        }
+
+        lhs_addr += chunk;
+        rhs_addr += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+uint32_t Mmu::find_byte(uint32_t virt_addr, uint8_t value, uint32_t size)
+{
+    check_access(virt_addr, size);
+    uint32_t offset = 0;
+    while (offset != size)
+    {
+        const uint32_t chunk = std::min(size - offset, page_remainder(virt_addr + offset));
+        const uint8_t *begin = read_pointer(virt_addr + offset);
+        const void *found = memchr(begin, value, chunk);
+        if (found != nullptr)
+        {
+            return offset + ((const uint8_t *)found - begin);
+        }
+
+        offset += chunk;
+    }
+
+    return size;
 }
 
 uint32_t Mmu::allocate(uint32_t size, uint32_t alloc_addr)
@@ -35,7 +597,7 @@ uint32_t Mmu::allocate(uint32_t size, uint32_t alloc_addr)
         return 0;
     }
 
-    if (alloc_addr + size > memory.size())
+    if ((uint64_t)alloc_addr + size > mapping_floor)
     {
         return 0;
     }
@@ -47,6 +609,6 @@ uint32_t Mmu::allocate(uint32_t size, uint32_t alloc_addr)
 
     brk_alloc = alloc_addr + size;
 
-    std::cerr << "allocation addr " << std::hex << alloc_addr << " size " << std::hex << size << std::endl;
+    debug_log << "allocation addr " << std::hex << alloc_addr << " size " << std::hex << size << std::endl;
     return alloc_addr;
 }
\ No newline at end of file
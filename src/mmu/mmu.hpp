@@ -1,43 +1,170 @@
 #pragma once
 
-#include <assert.h>
+#include "../checkpoint/checkpoint-stream.hpp"
+#include "../debug-log.hpp"
+#include "../guest-fault.hpp"
+#include "guest-memory.hpp"
 #include <cstdint>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <span>
+#include <unordered_map>
 #include <vector>
 
+/*
+    Guest memory is addressed through a page table of host pointers.
+
+    A fresh Mmu maps every page onto one shared zero page, a page gets a private frame on its first
+    write. fork() gives a child the same page table: both sides then treat every page as shared and
+    copy it into a private frame on their first write to it, so forking costs page table bookkeeping
+    only. Shared frames are never written, which is what lets a parent and its children run on
+    different threads, and what lets share_pages fold identical pages of unrelated instances.
+
+    compress_pages moves the private frames of an idle instance into a store of LZ4 blocks. Their
+    entries are marked compressed, and the first access to such a page, read or write, decompresses
+    it into a private frame again. Blocks are immutable, a fork shares them with its parent.
+*/
 class Mmu
 {
   public:
-    Mmu(uint32_t size) : memory(size, 0) {}
+    struct CompressionStats
+    {
+        uint32_t stored_pages = 0;     // pages held compressed right now
+        uint64_t stored_bytes = 0;     // their compressed size
+        uint64_t compressed_pages = 0; // pages compressed so far
+        uint64_t compressed_bytes = 0; // their total compressed size, the ratio is compressed_pages * page_size to this
+        uint64_t faults = 0;           // pages decompressed on their first access
+        uint64_t fault_ns = 0;         // total time spent decompressing them
+        uint64_t max_fault_ns = 0;
+    };
+
+    Mmu(uint32_t size);
+
+    Mmu(Mmu &&other) = default;
+    Mmu &operator=(Mmu &&other) = default;
+
+    // Returns a copy on write child, this Mmu turns copy on write as well
+    Mmu fork();
+
+    // Rolls a fork back to the contents of the Mmu it was forked from, which must not be written in the meantime.
+    // Only the pages written since the fork or the last restore are touched, their frames are reused.
+    void restore(const Mmu &snapshot);
 
     template <typename T>
     void write(uint32_t virt_addr, T value)
     {
-        assert(virt_addr + sizeof(T) < memory.size());
-        std::cerr << "write " << virt_addr << " = " << (int)value << '\n';
-        *(T *)(memory.data() + virt_addr) = value;
+        check_access(virt_addr, sizeof(T));
+        debug_log << "write " << virt_addr << " = " << (int)value << '\n';
+        if (page_remainder(virt_addr) < sizeof(T))
+        {
+            copy_from_host(virt_addr, std::span((const uint8_t *)&value, sizeof(T)));
+            return;
+        }
+
+        *(T *)write_pointer(virt_addr) = value;
     }
 
     template <typename T>
     T read(uint32_t virt_addr)
     {
-        assert(virt_addr + sizeof(T) < memory.size());
-        T value = *(T *)(memory.data() + virt_addr);
-        std::cerr << "read " << virt_addr << " = " << (int)value << '\n';
+        check_access(virt_addr, sizeof(T));
+        T value;
+        if (page_remainder(virt_addr) < sizeof(T))
+        {
+            copy_to_host(virt_addr, std::span((uint8_t *)&value, sizeof(T)));
+        }
+        else
+        {
+            value = *(const T *)read_pointer(virt_addr);
+        }
+        debug_log << "read " << virt_addr << " = " << (int)value << '\n';
         return value;
     }
 
-    void write_from(uint32_t virt_addr, const uint8_t *begin, const uint8_t *end);
+    /*
+        Bulk operations. They walk the range one page at a time through read_pointer/write_pointer,
+        so copy on write is handled in one place for all of them. Within a page
+        the work is done by the host libc string routines, which are already vectorized.
+        All of them raise GuestFault when the range is not entirely inside guest memory.
+    */
 
-    void read_bunch(uint32_t virt_addr, uint8_t *out_buf, uint32_t size);
+    void fill(uint32_t virt_addr, uint8_t value, uint32_t size);
 
-    void set(uint32_t virt_addr, uint8_t value, uint32_t size);
+    // memmove semantics, the ranges may overlap
+    void copy(uint32_t dst_addr, uint32_t src_addr, uint32_t size);
 
+    void copy_from_host(uint32_t virt_addr, std::span<const uint8_t> bytes);
+
+    void copy_to_host(uint32_t virt_addr, std::span<uint8_t> bytes);
+
+    // Returns the difference of the first differing bytes as unsigned chars, 0 when the ranges are equal
+    int32_t compare(uint32_t lhs_addr, uint32_t rhs_addr, uint32_t size);
+
+    // Returns the offset of the first byte equal to value, or size when there is none
+    uint32_t find_byte(uint32_t virt_addr, uint8_t value, uint32_t size);
+
+    // True when [virt_addr; virt_addr + size) lies inside guest memory. The first page is never
+    // accessible, so null pointer dereferences fault like they do under Linux.
+    bool contains(uint32_t virt_addr, uint32_t size) const
+    {
+        return virt_addr >= page_size && virt_addr <= byte_count && size <= byte_count - virt_addr;
+    }
+
+    // Extends the break, which grows upwards from the loaded image, returns 0 when it would run into the mappings
     uint32_t allocate(uint32_t size, uint32_t alloc_addr = 0);
 
+    // Reserves size bytes, rounded up to whole pages, for mmap. Unmapped ranges are reused first,
+    // otherwise mappings grow downwards from the end of guest memory. Returns 0 when they would run
+    // into the break.
+    uint32_t allocate_mapping(uint32_t size);
+
+    // Gives the pages of [virt_addr; virt_addr + size) back for allocate_mapping and drops their
+    // frames, they read as zero afterwards. Pages below the mapping floor are left alone. Unmapping
+    // the lowest mapping raises the floor, so the break can grow into it again.
+    void release_mapping(uint32_t virt_addr, uint32_t size);
+
+    // Takes [virt_addr; virt_addr + size) out of the unmapped ranges, for mmap at a fixed address
+    void reserve_mapping(uint32_t virt_addr, uint32_t size);
+
+    // Backs the pages of [virt_addr; virt_addr + size) with the bytes of region from offset on, all
+    // page aligned. The frames are shared copy on write, so one file can back many guests.
+    void map_region(uint32_t virt_addr, std::shared_ptr<GuestMemory> region, uint32_t offset, uint32_t size);
+
+    // Moves every private page onto a frame shared through the PageStore, all zero pages onto the
+    // zero page, and gives the private frames back to the host. Instances of one executable then hold
+    // their common pages once. Returns the number of frames released.
+    uint32_t share_pages();
+
+    // Pages backed by a frame of this Mmu alone, i.e. the memory it costs beyond the shared pages
+    uint32_t count_private_pages() const;
+
+    // Compresses every private page and gives its frame back to the host, all zero pages go to the
+    // zero page. Pages that do not shrink by a quarter stay as they are. Returns the number of
+    // frames released.
+    uint32_t compress_pages();
+
+    // The break, the mapping floor and the unmapped ranges, and every page that is not all zero. Compressed pages are
+    // decompressed, the writer takes pointers to the frames.
+    void save_state(CheckpointWriter &writer);
+
+    // Takes over the break, the mapping floor and the unmapped ranges, the pages are mapped with map_region
+    void load_state(CheckpointReader &reader);
+
+    const CompressionStats &get_compression_stats() const
+    {
+        return compression_stats;
+    }
+
     uint32_t size() const
     {
-        return memory.size();
+        return byte_count;
+    }
+
+    // Pages this Mmu copied on write since it was created or forked
+    uint32_t get_copied_pages() const
+    {
+        return copied_pages;
     }
 
     uint32_t get_first_alloc() const
@@ -50,8 +177,104 @@ class Mmu
         return brk_alloc;
     }
 
+    uint32_t get_mapping_floor() const
+    {
+        return mapping_floor;
+    }
+
+    static constexpr uint32_t page_size = 4096;
+
   private:
-    std::vector<uint8_t> memory;
+    Mmu(const Mmu &other);
+
+    void check_access(uint32_t virt_addr, uint32_t size) const
+    {
+        if (!contains(virt_addr, size)) [[unlikely]]
+        {
+            throw GuestFault(GuestFault::Kind::memory_access, virt_addr);
+        }
+    }
+
+    // Bytes from virt_addr to the end of its page
+    static uint32_t page_remainder(uint32_t virt_addr)
+    {
+        return page_size - (virt_addr & (page_size - 1));
+    }
+
+    const uint8_t *read_pointer(uint32_t virt_addr)
+    {
+        uintptr_t entry = pages[virt_addr / page_size];
+        if ((entry & compressed_page) != 0) [[unlikely]]
+        {
+            entry = decompress_page(virt_addr / page_size);
+        }
+        return to_frame(entry) + (virt_addr & (page_size - 1));
+    }
+
+    uint8_t *write_pointer(uint32_t virt_addr)
+    {
+        uintptr_t entry = pages[virt_addr / page_size];
+        if ((entry & private_page) == 0)
+        {
+            entry = copy_page(virt_addr / page_size);
+        }
+        return to_frame(entry) + (virt_addr & (page_size - 1));
+    }
+
+    uintptr_t to_entry(const uint8_t *frame) const
+    {
+        return (uintptr_t)frame ^ zero_frame;
+    }
+
+    uint8_t *to_frame(uintptr_t entry) const
+    {
+        return (uint8_t *)((entry & ~(private_page | compressed_page)) ^ zero_frame);
+    }
+
+    // Gives the page a private frame holding the same bytes, returns its new page table entry
+    uintptr_t copy_page(uint32_t page);
+
+    // Gives a compressed page a private frame again, returns its new page table entry
+    uintptr_t decompress_page(uint32_t page);
+
+    // Drops what only this Mmu holds for the page, a private frame or a compressed block
+    void release_page(uint32_t page);
+
+    // A recycled frame if there is one, a fresh one otherwise
+    uint8_t *take_frame();
+
+    uint8_t *allocate_frame();
+
+  private:
+    // Page table entries are page aligned host addresses xor the zero page, the low bit marks frames
+    // only this Mmu references. The zero page is entry 0, so the table lives in an anonymous mapping
+    // and the parts describing untouched memory cost the host nothing.
+    static constexpr uintptr_t private_page = 1;
+
+    // The entry of a compressed page is this bit alone, its bytes are in compressed_blocks
+    static constexpr uintptr_t compressed_page = 2;
+
+    // Compressed pages must save at least a quarter of their frame
+    static constexpr uint32_t min_ratio_percent = 75;
+
+    // Private frames are carved out of regions of this many pages
+    static constexpr uint32_t frames_per_region = 64;
+
+    uint32_t byte_count;
+    uint32_t page_count;
+    uintptr_t zero_frame;
+    std::unique_ptr<GuestMemory> page_table;
+    uintptr_t *pages; // points into page_table
+    std::vector<std::shared_ptr<GuestMemory>> regions;
+    uint8_t *free_frames = nullptr; // unused tail of the newest region
+    uint32_t free_frame_count = 0;
+    uint32_t copied_pages = 0;
+    std::vector<uint32_t> written_pages;   // pages copied or mapped since the last fork or restore
+    std::vector<uint8_t *> recycled_frames; // private frames released by restore
+    std::unordered_map<uint32_t, std::shared_ptr<const std::vector<uint8_t>>> compressed_blocks; // by page
+    CompressionStats compression_stats;
     uint32_t first_alloc = 0;
     uint32_t brk_alloc = 0;
+    uint32_t mapping_floor; // lowest address handed out by allocate_mapping
+    std::map<uint32_t, uint32_t> free_mappings; // start to size of the unmapped ranges above mapping_floor
 };
\ No newline at end of file
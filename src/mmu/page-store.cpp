@@ -0,0 +1,119 @@
+#include "page-store.hpp"
+#include "mmu.hpp"
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+PageStore &PageStore::instance()
+{
+    // never destroyed, Mmus in other static objects may free chunks after it would have been
+    static PageStore *const store = new PageStore();
+    return *store;
+}
+
+const uint8_t *PageStore::zero_page()
+{
+    // mapped read only, a write that bypasses copy on write crashes instead of corrupting every guest
+    static const uint8_t *const page = [] {
+        void *mapping = mmap(nullptr, Mmu::page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+        return (const uint8_t *)mapping;
+    }();
+    return page;
+}
+
+// 64 bit words mixed with a multiply, far faster than a byte wise hash and good enough to key a table
+static uint64_t hash_page(const uint8_t *page)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15;
+    for (uint32_t offset = 0; offset < Mmu::page_size; offset += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, page + offset, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccd;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+std::pair<const uint8_t *, std::shared_ptr<GuestMemory>> PageStore::intern(const uint8_t *page)
+{
+    const uint64_t hash = hash_page(page);
+
+    std::lock_guard lock(mutex);
+    ++stats.lookups;
+    std::vector<Entry> &candidates = entries[hash];
+    for (const Entry &entry : candidates)
+    {
+        // the frame of an expired chunk stays readable until forget_chunk, which waits for the lock
+        if (memcmp(entry.frame, page, Mmu::page_size) != 0)
+        {
+            continue;
+        }
+        if (std::shared_ptr<GuestMemory> chunk = entry.chunk.lock())
+        {
+            ++stats.hits;
+            return {entry.frame, std::move(chunk)};
+        }
+    }
+
+    std::shared_ptr<GuestMemory> chunk = free_in_chunk == 0 ? nullptr : filling.lock();
+    if (chunk == nullptr)
+    {
+        chunk = create_chunk();
+        filling = chunk;
+        free_in_chunk = pages_per_chunk;
+    }
+
+    uint8_t *frame = chunk->data() + (pages_per_chunk - free_in_chunk) * Mmu::page_size;
+    --free_in_chunk;
+    memcpy(frame, page, Mmu::page_size);
+    candidates.push_back(Entry{.frame = frame, .chunk = chunk});
+    hashes[chunk->data()].push_back(hash);
+    ++stats.pages;
+    return {frame, std::move(chunk)};
+}
+
+std::shared_ptr<GuestMemory> PageStore::create_chunk()
+{
+    return std::shared_ptr<GuestMemory>(new GuestMemory(pages_per_chunk * Mmu::page_size), [this](GuestMemory *chunk) {
+        forget_chunk(chunk->data());
+        delete chunk;
+    });
+}
+
+void PageStore::forget_chunk(const uint8_t *chunk)
+{
+    std::lock_guard lock(mutex);
+    auto found = hashes.find(chunk);
+    if (found == hashes.end())
+    {
+        return;
+    }
+
+    const uint8_t *end = chunk + pages_per_chunk * Mmu::page_size;
+    for (uint64_t hash : found->second)
+    {
+        auto candidates = entries.find(hash);
+        if (candidates == entries.end())
+        {
+            continue;
+        }
+
+        stats.pages -= std::erase_if(candidates->second, [&](const Entry &entry) { return entry.frame >= chunk && entry.frame < end; });
+        if (candidates->second.empty())
+        {
+            entries.erase(candidates);
+        }
+    }
+    hashes.erase(found);
+}
+
+PageStore::Stats PageStore::get_stats()
+{
+    std::lock_guard lock(mutex);
+    return stats;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "guest-memory.hpp"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+    Process wide store of guest pages, keyed by their content.
+
+    Mmu::share_pages hands its private pages in and gets back a frame with the same bytes, so identical
+    pages of all instances in the process, e.g. the text and rodata of one executable, end up on a
+    single frame that every Mmu references copy on write. The frames live in chunks, which the Mmus
+    referencing them keep alive through their region lists. The store only holds them weakly: when
+    the last Mmu sharing a chunk is gone, the chunk is freed and its entries leave the store, so
+    pages unique to guests that ended, e.g. their stacks, do not pile up in a long running host.
+    Chunks are small so that a few live pages pin little of them.
+*/
+class PageStore
+{
+  public:
+    struct Stats
+    {
+        uint64_t pages = 0;   // distinct pages stored right now
+        uint64_t lookups = 0; // pages handed in
+        uint64_t hits = 0;    // pages that matched a stored one
+    };
+
+    static PageStore &instance();
+
+    // A read only page of zeros, the initial content of every guest page
+    static const uint8_t *zero_page();
+
+    // Returns a shared frame with the same bytes as page and the chunk holding it
+    std::pair<const uint8_t *, std::shared_ptr<GuestMemory>> intern(const uint8_t *page);
+
+    Stats get_stats();
+
+  private:
+    struct Entry
+    {
+        const uint8_t *frame;
+        std::weak_ptr<GuestMemory> chunk;
+    };
+
+    static constexpr uint32_t pages_per_chunk = 64;
+
+    // A chunk that drops its entries from the store before it is freed
+    std::shared_ptr<GuestMemory> create_chunk();
+
+    void forget_chunk(const uint8_t *chunk);
+
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::vector<Entry>> entries;           // by content hash
+    std::unordered_map<const uint8_t *, std::vector<uint64_t>> hashes; // of the entries of each chunk
+    std::weak_ptr<GuestMemory> filling;                                 // the chunk new pages go to
+    uint32_t free_in_chunk = 0;
+    Stats stats;
+};
@@ -0,0 +1,157 @@
+#include "branch-predictor.hpp"
+#include <stdexcept>
+
+BranchPredictorKind parse_branch_predictor_kind(const std::string &name)
+{
+    if (name == "gshare")
+    {
+        return BranchPredictorKind::gshare;
+    }
+    if (name == "tage")
+    {
+        return BranchPredictorKind::tage;
+    }
+
+    throw std::invalid_argument("Unknown branch predictor " + name);
+}
+
+BranchPredictor::BranchPredictor(BranchPredictorKind kind) : kind(kind), counters(1 << counter_table_bits, 1)
+{
+    if (kind == BranchPredictorKind::tage)
+    {
+        for (auto &table : tagged_tables)
+        {
+            table.resize(1 << tagged_table_bits, TaggedEntry{.tag = 0, .counter = 0, .useful = 0});
+        }
+    }
+}
+
+bool BranchPredictor::predict_and_update(uint32_t pc, bool taken)
+{
+    const bool correct = kind == BranchPredictorKind::gshare ? update_gshare(pc, taken) : update_tage(pc, taken);
+
+    ++branches;
+    if (!correct)
+    {
+        ++mispredictions;
+    }
+
+    history = (history << 1) | taken;
+    return correct;
+}
+
+static void train_counter(uint8_t &counter, bool taken)
+{
+    if (taken && counter < 3)
+    {
+        ++counter;
+    }
+    else if (!taken && counter > 0)
+    {
+        --counter;
+    }
+}
+
+bool BranchPredictor::update_gshare(uint32_t pc, bool taken)
+{
+    const uint32_t mask = (1 << counter_table_bits) - 1;
+    uint8_t &counter = counters[((pc >> 2) ^ history) & mask];
+    const bool prediction = counter >= 2;
+
+    train_counter(counter, taken);
+    return prediction == taken;
+}
+
+uint32_t BranchPredictor::folded_history(uint8_t length, uint8_t bits) const
+{
+    uint64_t remaining = length < 64 ? history & ((1ull << length) - 1) : history;
+    uint32_t folded = 0;
+    while (remaining != 0)
+    {
+        folded ^= remaining & ((1 << bits) - 1);
+        remaining >>= bits;
+    }
+
+    return folded;
+}
+
+bool BranchPredictor::update_tage(uint32_t pc, bool taken)
+{
+    const uint32_t index_mask = (1 << tagged_table_bits) - 1;
+    const uint32_t pc_bits = pc >> 2;
+
+    uint8_t &base = counters[pc_bits & ((1 << counter_table_bits) - 1)];
+    uint32_t indices[tagged_table_count];
+    uint8_t tags[tagged_table_count];
+    int provider = -1;
+
+    for (uint8_t i = 0; i < tagged_table_count; ++i)
+    {
+        indices[i] = (pc_bits ^ folded_history(history_lengths[i], tagged_table_bits)) & index_mask;
+        tags[i] = (pc_bits ^ (folded_history(history_lengths[i], 8) << 1) ^ i) & 0xff;
+        if (tagged_tables[i][indices[i]].tag == tags[i])
+        {
+            provider = i;
+        }
+    }
+
+    if (provider < 0)
+    {
+        const bool prediction = base >= 2;
+        train_counter(base, taken);
+        if (prediction != taken)
+        {
+            // allocate in the shortest history table with a free slot
+            for (uint8_t i = 0; i < tagged_table_count; ++i)
+            {
+                TaggedEntry &entry = tagged_tables[i][indices[i]];
+                if (entry.useful == 0)
+                {
+                    entry = TaggedEntry{.tag = tags[i], .counter = (int8_t)(taken ? 0 : -1), .useful = 0};
+                    break;
+                }
+            }
+        }
+        return prediction == taken;
+    }
+
+    TaggedEntry &entry = tagged_tables[provider][indices[provider]];
+    const bool prediction = entry.counter >= 0;
+
+    if (taken && entry.counter < 3)
+    {
+        ++entry.counter;
+    }
+    else if (!taken && entry.counter > -4)
+    {
+        --entry.counter;
+    }
+
+    if (prediction == taken)
+    {
+        if (entry.useful < 3)
+        {
+            ++entry.useful;
+        }
+        return true;
+    }
+
+    if (entry.useful > 0)
+    {
+        --entry.useful;
+    }
+
+    // on a misprediction try to allocate an entry with a longer history
+    for (uint8_t i = provider + 1; i < tagged_table_count; ++i)
+    {
+        TaggedEntry &longer = tagged_tables[i][indices[i]];
+        if (longer.useful == 0)
+        {
+            longer = TaggedEntry{.tag = tags[i], .counter = (int8_t)(taken ? 0 : -1), .useful = 0};
+            break;
+        }
+        --longer.useful;
+    }
+
+    return false;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class BranchPredictorKind
+{
+    gshare,
+    tage
+};
+
+BranchPredictorKind parse_branch_predictor_kind(const std::string &name);
+
+/*
+    Conditional branch direction predictor.
+
+    gshare indexes a table of 2-bit counters with pc xor global history.
+    TAGE-lite uses a bimodal base table plus tagged tables indexed with geometrically
+    growing history lengths, the longest matching table provides the prediction.
+*/
+class BranchPredictor
+{
+  public:
+    BranchPredictor(BranchPredictorKind kind);
+
+    // Predicts the branch at pc, trains the predictor with the real outcome and returns whether the prediction was right
+    bool predict_and_update(uint32_t pc, bool taken);
+
+    uint64_t get_branches() const
+    {
+        return branches;
+    }
+
+    uint64_t get_mispredictions() const
+    {
+        return mispredictions;
+    }
+
+  private:
+    bool update_gshare(uint32_t pc, bool taken);
+
+    bool update_tage(uint32_t pc, bool taken);
+
+    uint32_t folded_history(uint8_t length, uint8_t bits) const;
+
+  private:
+    struct TaggedEntry
+    {
+        uint8_t tag;
+        int8_t counter;
+        uint8_t useful;
+    };
+
+    static constexpr uint8_t counter_table_bits = 12;
+    static constexpr uint8_t tagged_table_bits = 10;
+    static constexpr uint8_t tagged_table_count = 4;
+    static constexpr uint8_t history_lengths[tagged_table_count] = {4, 8, 16, 32};
+
+    BranchPredictorKind kind;
+    uint64_t history = 0;
+    std::vector<uint8_t> counters;
+    std::vector<TaggedEntry> tagged_tables[tagged_table_count];
+    uint64_t branches = 0;
+    uint64_t mispredictions = 0;
+};
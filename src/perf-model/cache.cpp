@@ -0,0 +1,142 @@
+#include "cache.hpp"
+#include <bit>
+#include <stdexcept>
+
+static uint32_t parse_size(const std::string &value)
+{
+    size_t end = 0;
+    uint32_t size = std::stoul(value, &end);
+    if (end < value.size())
+    {
+        switch (value[end])
+        {
+            case 'k':
+            case 'K':
+                size *= 1024;
+                break;
+            case 'm':
+            case 'M':
+                size *= 1024 * 1024;
+                break;
+            default:
+                throw std::invalid_argument("Invalid size " + value);
+        }
+    }
+
+    return size;
+}
+
+CacheConfig CacheConfig::parse(const std::string &description)
+{
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    while (true)
+    {
+        const size_t end = description.find(':', begin);
+        fields.push_back(description.substr(begin, end - begin));
+        if (end == std::string::npos)
+        {
+            break;
+        }
+        begin = end + 1;
+    }
+
+    if (fields.size() != 4)
+    {
+        throw std::invalid_argument("Cache description must be size:associativity:line_size:policy");
+    }
+
+    CacheConfig config{
+        .size = parse_size(fields[0]),
+        .associativity = (uint32_t)std::stoul(fields[1]),
+        .line_size = parse_size(fields[2]),
+        .replacement = ReplacementPolicy::lru};
+
+    if (fields[3] == "fifo")
+    {
+        config.replacement = ReplacementPolicy::fifo;
+    }
+    else if (fields[3] == "random")
+    {
+        config.replacement = ReplacementPolicy::random;
+    }
+    else if (fields[3] != "lru")
+    {
+        throw std::invalid_argument("Unknown replacement policy " + fields[3]);
+    }
+
+    return config;
+}
+
+Cache::Cache(const CacheConfig &config) : config(config)
+{
+    if (!std::has_single_bit(config.line_size) || config.associativity == 0 ||
+        config.size % (config.line_size * config.associativity) != 0)
+    {
+        throw std::invalid_argument("Invalid cache geometry");
+    }
+
+    const uint32_t sets = config.size / (config.line_size * config.associativity);
+    if (!std::has_single_bit(sets))
+    {
+        throw std::invalid_argument("Number of cache sets must be a power of two");
+    }
+
+    lines.resize(config.size / config.line_size, Line{.tag = 0, .stamp = 0, .valid = false});
+    line_shift = std::countr_zero(config.line_size);
+    set_mask = sets - 1;
+}
+
+bool Cache::access(uint32_t addr)
+{
+    const uint32_t line_addr = addr >> line_shift;
+    const uint32_t set_begin = (line_addr & set_mask) * config.associativity;
+    ++tick;
+    ++accesses;
+
+    for (uint32_t way = 0; way < config.associativity; ++way)
+    {
+        Line &line = lines[set_begin + way];
+        if (line.valid && line.tag == line_addr)
+        {
+            if (config.replacement == ReplacementPolicy::lru)
+            {
+                line.stamp = tick;
+            }
+            return true;
+        }
+    }
+
+    ++misses;
+    Line &victim = lines[choose_victim(set_begin)];
+    victim = Line{.tag = line_addr, .stamp = tick, .valid = true};
+    return false;
+}
+
+uint32_t Cache::choose_victim(uint32_t set_begin)
+{
+    uint32_t victim = set_begin;
+    for (uint32_t way = 0; way < config.associativity; ++way)
+    {
+        const Line &line = lines[set_begin + way];
+        if (!line.valid)
+        {
+            return set_begin + way;
+        }
+        if (line.stamp < lines[victim].stamp)
+        {
+            victim = set_begin + way;
+        }
+    }
+
+    if (config.replacement == ReplacementPolicy::random)
+    {
+        // xorshift64
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        victim = set_begin + random_state % config.associativity;
+    }
+
+    return victim;
+}
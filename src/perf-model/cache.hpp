@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class ReplacementPolicy
+{
+    lru,
+    fifo,
+    random
+};
+
+struct CacheConfig
+{
+    uint32_t size;
+    uint32_t associativity;
+    uint32_t line_size;
+    ReplacementPolicy replacement;
+
+    // Parses "size:associativity:line_size:policy", size accepts k/m suffixes, e.g. "32k:8:64:lru"
+    static CacheConfig parse(const std::string &description);
+};
+
+/*
+    Set associative cache model. Only tags are tracked, data always lives in the Mmu.
+*/
+class Cache
+{
+  public:
+    Cache(const CacheConfig &config);
+
+    // Returns true on hit, on miss the line is filled evicting a victim chosen by the replacement policy
+    bool access(uint32_t addr);
+
+    uint64_t get_accesses() const
+    {
+        return accesses;
+    }
+
+    uint64_t get_misses() const
+    {
+        return misses;
+    }
+
+  private:
+    struct Line
+    {
+        uint32_t tag;
+        uint64_t stamp;
+        bool valid;
+    };
+
+    uint32_t choose_victim(uint32_t set_begin);
+
+  private:
+    CacheConfig config;
+    std::vector<Line> lines;
+    uint32_t line_shift;
+    uint32_t set_mask;
+    uint64_t tick = 0;
+    uint64_t random_state = 0x9e3779b97f4a7c15;
+    uint64_t accesses = 0;
+    uint64_t misses = 0;
+};
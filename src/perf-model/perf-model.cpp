@@ -0,0 +1,96 @@
+#include "perf-model.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+PerfModel::PerfModel(const PerfModelConfig &config)
+    : l1i(config.l1i), l1d(config.l1d), l2(config.l2), branch_predictor(config.branch_predictor)
+{
+}
+
+void PerfModel::fetch(uint32_t pc)
+{
+    access(l1i, fetch_stats[pc], pc);
+}
+
+void PerfModel::data_access(uint32_t pc, uint32_t addr)
+{
+    access(l1d, data_stats[pc], addr);
+}
+
+void PerfModel::access(Cache &l1, AccessStats &stats, uint32_t addr)
+{
+    ++stats.accesses;
+    if (l1.access(addr))
+    {
+        return;
+    }
+
+    ++stats.l1_misses;
+    if (!l2.access(addr))
+    {
+        ++stats.l2_misses;
+    }
+}
+
+void PerfModel::branch(uint32_t pc, bool taken)
+{
+    BranchStats &stats = branch_stats[pc];
+    ++stats.branches;
+    if (!branch_predictor.predict_and_update(pc, taken))
+    {
+        ++stats.mispredictions;
+    }
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0.0 : 100.0 * part / total;
+}
+
+void PerfModel::report_cache(std::ostream &out, const char *name, const Cache &cache)
+{
+    out << name << ": " << std::dec << cache.get_accesses() << " accesses, " << cache.get_misses() << " misses ("
+        << std::fixed << std::setprecision(2) << percent(cache.get_misses(), cache.get_accesses()) << "%)\n";
+}
+
+void PerfModel::report_top_pcs(std::ostream &out, const char *name, const std::unordered_map<uint32_t, AccessStats> &stats)
+{
+    std::vector<std::pair<uint32_t, AccessStats>> sorted(stats.begin(), stats.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto &a, const auto &b) { return a.second.l1_misses > b.second.l1_misses; });
+
+    out << name << " misses by pc:\n";
+    for (size_t i = 0; i < std::min(sorted.size(), reported_pcs) && sorted[i].second.l1_misses != 0; ++i)
+    {
+        const auto &[pc, pc_stats] = sorted[i];
+        out << "  0x" << std::hex << pc << std::dec << " accesses " << pc_stats.accesses << " L1 misses "
+            << pc_stats.l1_misses << " (" << percent(pc_stats.l1_misses, pc_stats.accesses) << "%) L2 misses "
+            << pc_stats.l2_misses << '\n';
+    }
+}
+
+void PerfModel::report(std::ostream &out) const
+{
+    out << "Performance model\n";
+    report_cache(out, "L1I", l1i);
+    report_cache(out, "L1D", l1d);
+    report_cache(out, "L2", l2);
+    out << "Branches: " << branch_predictor.get_branches() << ", mispredicted " << branch_predictor.get_mispredictions()
+        << " (" << percent(branch_predictor.get_mispredictions(), branch_predictor.get_branches()) << "%)\n";
+
+    report_top_pcs(out, "L1I", fetch_stats);
+    report_top_pcs(out, "L1D", data_stats);
+
+    std::vector<std::pair<uint32_t, BranchStats>> branches(branch_stats.begin(), branch_stats.end());
+    std::sort(branches.begin(), branches.end(),
+              [](const auto &a, const auto &b) { return a.second.mispredictions > b.second.mispredictions; });
+
+    out << "Branch mispredictions by pc:\n";
+    for (size_t i = 0; i < std::min(branches.size(), reported_pcs) && branches[i].second.mispredictions != 0; ++i)
+    {
+        const auto &[pc, stats] = branches[i];
+        out << "  0x" << std::hex << pc << std::dec << " branches " << stats.branches << " mispredicted "
+            << stats.mispredictions << " (" << percent(stats.mispredictions, stats.branches) << "%)\n";
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "branch-predictor.hpp"
+#include "cache.hpp"
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+struct PerfModelConfig
+{
+    CacheConfig l1i = {.size = 32 * 1024, .associativity = 4, .line_size = 64, .replacement = ReplacementPolicy::lru};
+    CacheConfig l1d = {.size = 32 * 1024, .associativity = 8, .line_size = 64, .replacement = ReplacementPolicy::lru};
+    CacheConfig l2 = {.size = 256 * 1024, .associativity = 8, .line_size = 64, .replacement = ReplacementPolicy::lru};
+    BranchPredictorKind branch_predictor = BranchPredictorKind::gshare;
+};
+
+/*
+    Micro-architectural model fed from the instruction engine: split L1I/L1D backed by a unified L2
+    and a conditional branch predictor. Only compiled into the emulator with RISCV_EMULATOR_PERF_MODEL.
+*/
+class PerfModel
+{
+  public:
+    PerfModel(const PerfModelConfig &config);
+
+    void fetch(uint32_t pc);
+
+    void data_access(uint32_t pc, uint32_t addr);
+
+    void branch(uint32_t pc, bool taken);
+
+    void report(std::ostream &out) const;
+
+  private:
+    struct AccessStats
+    {
+        uint64_t accesses = 0;
+        uint64_t l1_misses = 0;
+        uint64_t l2_misses = 0;
+    };
+
+    struct BranchStats
+    {
+        uint64_t branches = 0;
+        uint64_t mispredictions = 0;
+    };
+
+    void access(Cache &l1, AccessStats &stats, uint32_t addr);
+
+    static void report_cache(std::ostream &out, const char *name, const Cache &cache);
+
+    static void report_top_pcs(std::ostream &out, const char *name, const std::unordered_map<uint32_t, AccessStats> &stats);
+
+  private:
+    static constexpr size_t reported_pcs = 10;
+
+    Cache l1i;
+    Cache l1d;
+    Cache l2;
+    BranchPredictor branch_predictor;
+    std::unordered_map<uint32_t, AccessStats> fetch_stats;
+    std::unordered_map<uint32_t, AccessStats> data_stats;
+    std::unordered_map<uint32_t, BranchStats> branch_stats;
+};
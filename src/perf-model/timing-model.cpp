@@ -0,0 +1,150 @@
+#include "timing-model.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+TimingConfig TimingConfig::parse(const std::string &description)
+{
+    TimingConfig config;
+    size_t begin = 0;
+
+    while (begin < description.size())
+    {
+        size_t end = description.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = description.size();
+        }
+
+        const std::string field = description.substr(begin, end - begin);
+        const size_t equals = field.find('=');
+        if (equals == std::string::npos)
+        {
+            throw std::invalid_argument("Timing option must be key=value: " + field);
+        }
+
+        const std::string key = field.substr(0, equals);
+        const uint32_t value = std::stoul(field.substr(equals + 1));
+        if (key == "load_use")
+        {
+            config.load_use_penalty = value;
+        }
+        else if (key == "branch")
+        {
+            config.branch_taken_penalty = value;
+        }
+        else if (key == "jal")
+        {
+            config.jal_penalty = value;
+        }
+        else if (key == "jalr")
+        {
+            config.jalr_penalty = value;
+        }
+        else if (key == "mul")
+        {
+            config.mul_latency = value;
+        }
+        else if (key == "div")
+        {
+            config.div_latency = value;
+        }
+        else
+        {
+            throw std::invalid_argument("Unknown timing option " + key);
+        }
+
+        begin = end + 1;
+    }
+
+    return config;
+}
+
+void TimingModel::end_block()
+{
+    BlockStats &stats = blocks[block_start];
+    ++stats.executions;
+    stats.instructions += block_instructions;
+    stats.cycles += block_cycles;
+
+    block_cycles = 0;
+    block_instructions = 0;
+}
+
+static double cpi(uint64_t cycles, uint64_t instructions)
+{
+    return instructions == 0 ? 0.0 : (double)cycles / instructions;
+}
+
+static std::string describe(uint32_t addr, const SymbolTable &symbols)
+{
+    const Symbol *function = symbols.find_function(addr);
+    if (function == nullptr)
+    {
+        return "?";
+    }
+
+    std::ostringstream out;
+    out << function->name << "+0x" << std::hex << addr - function->value;
+    return out.str();
+}
+
+void TimingModel::report(std::ostream &out, const SymbolTable &symbols)
+{
+    if (block_instructions != 0)
+    {
+        end_block();
+    }
+
+    struct FunctionStats
+    {
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+    };
+
+    uint64_t total_instructions = 0;
+    uint64_t total_cycles = 0;
+    std::map<std::string, FunctionStats> functions;
+    for (const auto &[start, stats] : blocks)
+    {
+        total_instructions += stats.instructions;
+        total_cycles += stats.cycles;
+
+        const Symbol *function = symbols.find_function(start);
+        FunctionStats &function_stats = functions[function != nullptr ? function->name : "?"];
+        function_stats.instructions += stats.instructions;
+        function_stats.cycles += stats.cycles;
+    }
+
+    out << "Timing model\n"
+        << "Instructions " << std::dec << total_instructions << " cycles " << total_cycles << " CPI " << std::fixed
+        << std::setprecision(3) << cpi(total_cycles, total_instructions) << '\n';
+
+    std::vector<std::pair<std::string, FunctionStats>> sorted_functions(functions.begin(), functions.end());
+    std::sort(sorted_functions.begin(), sorted_functions.end(),
+              [](const auto &a, const auto &b) { return a.second.cycles > b.second.cycles; });
+
+    out << "Functions by cycles:\n";
+    for (size_t i = 0; i < std::min(sorted_functions.size(), reported_entries); ++i)
+    {
+        const auto &[name, stats] = sorted_functions[i];
+        out << "  " << std::setw(24) << std::left << name << std::right << " instructions " << stats.instructions
+            << " cycles " << stats.cycles << " CPI " << cpi(stats.cycles, stats.instructions) << '\n';
+    }
+
+    std::vector<std::pair<uint32_t, BlockStats>> sorted_blocks(blocks.begin(), blocks.end());
+    std::sort(sorted_blocks.begin(), sorted_blocks.end(),
+              [](const auto &a, const auto &b) { return a.second.cycles > b.second.cycles; });
+
+    out << "Basic blocks by cycles:\n";
+    for (size_t i = 0; i < std::min(sorted_blocks.size(), reported_entries); ++i)
+    {
+        const auto &[start, stats] = sorted_blocks[i];
+        out << "  0x" << std::hex << start << std::dec << " " << std::setw(32) << std::left << describe(start, symbols)
+            << std::right << " executions " << stats.executions << " instructions " << stats.instructions << " cycles "
+            << stats.cycles << " CPI " << cpi(stats.cycles, stats.instructions) << '\n';
+    }
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "../elf-loader/symbol-table.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+struct TimingConfig
+{
+    uint32_t load_use_penalty = 1;     // bubble when an instruction consumes the result of the load right before it
+    uint32_t branch_taken_penalty = 2; // branches are resolved in EX, fall-through is predicted
+    uint32_t jal_penalty = 1;          // JAL target is known in ID
+    uint32_t jalr_penalty = 2;         // JALR target is known in EX
+    uint32_t mul_latency = 3;
+    uint32_t div_latency = 34;
+
+    // Parses comma separated key=value pairs, e.g. "load_use=1,branch=2,mul=4"
+    static TimingConfig parse(const std::string &description);
+};
+
+/*
+    Cycle-approximate model of an in-order 5-stage (IF ID EX MEM WB) RV32 pipeline with full forwarding.
+    Every retired instruction costs one cycle plus the stalls its dependencies and control flow cause.
+    Cycles are accumulated per dynamic basic block and attributed to functions when reporting.
+*/
+class TimingModel
+{
+  public:
+    TimingModel(const TimingConfig &config) : config(config)
+    {
+        // an instruction occupies EX for at least one cycle, the stall is the latency beyond that
+        this->config.mul_latency = std::max(config.mul_latency, 1u);
+        this->config.div_latency = std::max(config.div_latency, 1u);
+    }
+
+    void retire(uint32_t pc, uint32_t inst, uint32_t next_pc)
+    {
+        const uint8_t opcode = inst & 0b1111111;
+        const uint8_t rd = (inst >> 7) & 0b11111;
+        const uint8_t rs1 = (inst >> 15) & 0b11111;
+        const uint8_t rs2 = (inst >> 20) & 0b11111;
+        uint32_t cycles = 1;
+        bool ends_block = false;
+
+        if (block_instructions == 0)
+        {
+            block_start = pc;
+        }
+
+        bool reads_rs1 = false;
+        bool reads_rs2 = false;
+        switch (opcode)
+        {
+            case 0b1100011: // BRANCH
+            case 0b0100011: // STORE
+            case 0b0110011: // OP
+            {
+                reads_rs1 = true;
+                reads_rs2 = true;
+                break;
+            }
+            case 0b1100111: // JALR
+            case 0b0000011: // LOAD
+            case 0b0010011: // OP-IMM
+            {
+                reads_rs1 = true;
+                break;
+            }
+        }
+
+        if (pending_load_rd != 0 && ((reads_rs1 && rs1 == pending_load_rd) || (reads_rs2 && rs2 == pending_load_rd)))
+        {
+            cycles += config.load_use_penalty;
+        }
+        pending_load_rd = opcode == 0b0000011 ? rd : 0;
+
+        switch (opcode)
+        {
+            case 0b1100011: // BRANCH
+            {
+                if (next_pc != pc + sizeof(uint32_t))
+                {
+                    cycles += config.branch_taken_penalty;
+                }
+                ends_block = true;
+                break;
+            }
+            case 0b1101111: // JAL
+            {
+                cycles += config.jal_penalty;
+                ends_block = true;
+                break;
+            }
+            case 0b1100111: // JALR
+            {
+                cycles += config.jalr_penalty;
+                ends_block = true;
+                break;
+            }
+            case 0b1110011: // SYSTEM
+            {
+                ends_block = true;
+                break;
+            }
+            case 0b0110011: // OP
+            {
+                if ((inst >> 25) == 0b0000001)
+                {
+                    // M extension, func3 bit 2 selects DIV/DIVU/REM/REMU, EX is occupied for the whole latency
+                    cycles += (((inst >> 12) & 0b100) ? config.div_latency : config.mul_latency) - 1;
+                }
+                break;
+            }
+        }
+
+        block_cycles += cycles;
+        ++block_instructions;
+        if (ends_block)
+        {
+            end_block();
+        }
+    }
+
+    void report(std::ostream &out, const SymbolTable &symbols);
+
+  private:
+    struct BlockStats
+    {
+        uint64_t executions = 0;
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+    };
+
+    void end_block();
+
+  private:
+    static constexpr size_t reported_entries = 15;
+
+    TimingConfig config;
+    uint8_t pending_load_rd = 0;
+    uint32_t block_start = 0;
+    uint64_t block_cycles = 0;
+    uint64_t block_instructions = 0;
+    std::unordered_map<uint32_t, BlockStats> blocks;
+};
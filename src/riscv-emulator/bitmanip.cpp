@@ -0,0 +1,17 @@
+#include "bitmanip.hpp"
+
+std::optional<uint32_t> execute_bitmanip(uint32_t inst, uint32_t rs1, uint32_t rs2)
+{
+    const uint8_t opcode = inst & 0b1111111;
+    if (opcode != 0b0110011 && opcode != 0b0010011) // OP, OP-IMM
+    {
+        return std::nullopt;
+    }
+
+    const DecodedInstruction decoded = decode(inst, 0);
+    if (!is_bitmanip(decoded.op))
+    {
+        return std::nullopt;
+    }
+    return execute_bitmanip(decoded.op, rs1, opcode == 0b0010011 ? decoded.imm : rs2);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "decoder.hpp"
+#include <bit>
+#include <cstdint>
+#include <optional>
+
+/*
+    Zba, Zbb and Zbs, the bit manipulation extensions as far as RV32 has them: shifted adds for
+    address arithmetic, count leading/trailing zeros, population count, min/max, sign and zero
+    extension, rotations, orc.b, rev8, and single bit clear, extract, invert and set.
+
+    The decoded fast path and the reference interpreter both compute them here. The <bit> functions
+    become lzcnt, tzcnt, popcnt, ror and bswap where the build targets a CPU that has them, and
+    portable sequences otherwise.
+*/
+
+inline bool is_bitmanip(Op op)
+{
+    return op >= Op::sh1add && op <= Op::bseti;
+}
+
+// The value a Zba, Zbb or Zbs op writes to rd. operand is rs2 for the register forms and the shift
+// amount or bit index for the immediate ones, the unary ops ignore it.
+inline uint32_t execute_bitmanip(Op op, uint32_t rs1, uint32_t operand)
+{
+    const uint32_t shamt = operand & 0b11111;
+    switch (op)
+    {
+        case Op::sh1add:
+            return (rs1 << 1) + operand;
+        case Op::sh2add:
+            return (rs1 << 2) + operand;
+        case Op::sh3add:
+            return (rs1 << 3) + operand;
+        case Op::andn:
+            return rs1 & ~operand;
+        case Op::orn:
+            return rs1 | ~operand;
+        case Op::xnor:
+            return ~(rs1 ^ operand);
+        case Op::clz:
+            return std::countl_zero(rs1);
+        case Op::ctz:
+            return std::countr_zero(rs1);
+        case Op::cpop:
+            return std::popcount(rs1);
+        case Op::max:
+            return (int32_t)rs1 > (int32_t)operand ? rs1 : operand;
+        case Op::maxu:
+            return rs1 > operand ? rs1 : operand;
+        case Op::min:
+            return (int32_t)rs1 < (int32_t)operand ? rs1 : operand;
+        case Op::minu:
+            return rs1 < operand ? rs1 : operand;
+        case Op::sext_b:
+            return (uint32_t)(int32_t)(int8_t)rs1;
+        case Op::sext_h:
+            return (uint32_t)(int32_t)(int16_t)rs1;
+        case Op::zext_h:
+            return rs1 & 0xffff;
+        case Op::rol:
+            return std::rotl(rs1, shamt);
+        case Op::ror:
+        case Op::rori:
+            return std::rotr(rs1, shamt);
+        case Op::orc_b:
+        {
+            // every byte becomes 0xff when any of its bits is set, 0 otherwise
+            const uint32_t high_bits = (((rs1 & 0x7f7f7f7f) + 0x7f7f7f7f) | rs1) & 0x80808080;
+            return (high_bits >> 7) * 0xff;
+        }
+        case Op::rev8:
+            return __builtin_bswap32(rs1);
+        case Op::bclr:
+        case Op::bclri:
+            return rs1 & ~(1u << shamt);
+        case Op::bext:
+        case Op::bexti:
+            return (rs1 >> shamt) & 1;
+        case Op::binv:
+        case Op::binvi:
+            return rs1 ^ (1u << shamt);
+        case Op::bset:
+        case Op::bseti:
+            return rs1 | (1u << shamt);
+        default:
+            return 0;
+    }
+}
+
+// For the reference interpreter: the value a Zba, Zbb or Zbs instruction of the OP or OP-IMM opcode
+// writes to rd, nullopt for any other instruction. rs2 is ignored by the OP-IMM ones.
+std::optional<uint32_t> execute_bitmanip(uint32_t inst, uint32_t rs1, uint32_t rs2);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "decoder.hpp"
+#include <cstdint>
+#include <vector>
+
+/*
+    Direct mapped cache of decoded instructions indexed by pc.
+    Entries remember the raw instruction words they were decoded from, a hit is only used when
+    guest memory still holds the same words, so self-modifying code never runs stale decodes.
+*/
+class DecodeCache
+{
+  public:
+    struct Entry
+    {
+        uint32_t pc = invalid_pc;
+        uint32_t inst = 0;
+        uint32_t next_inst = 0;
+        DecodedInstruction single;
+        DecodedInstruction fused; // pair starting at pc, Op::none when the two instructions do not fuse
+    };
+
+    Entry &lookup(uint32_t pc)
+    {
+        if (entries.empty())
+        {
+            // allocated on first use, machines that never take the fast path do not pay for it
+            entries.resize(entry_count);
+        }
+
+        return entries[(pc >> 2) & (entry_count - 1)];
+    }
+
+    void clear()
+    {
+        entries.clear();
+    }
+
+  private:
+    static constexpr uint32_t invalid_pc = 1; // instructions are 4 byte aligned, so this never matches
+    static constexpr uint32_t entry_count = 8192;
+
+    std::vector<Entry> entries;
+};
@@ -0,0 +1,297 @@
+#include "decoder.hpp"
+
+#include "instruction-formats/bType.hpp"
+#include "instruction-formats/iType.hpp"
+#include "instruction-formats/jType.hpp"
+#include "instruction-formats/rType.hpp"
+#include "instruction-formats/sType.hpp"
+#include "instruction-formats/uType.hpp"
+
+#include <iterator>
+
+const char *op_name(Op op)
+{
+    switch (op)
+    {
+        case Op::lui_addi:
+            return "lui+addi";
+        case Op::auipc_addi:
+            return "auipc+addi";
+        case Op::auipc_lw:
+            return "auipc+lw";
+        case Op::auipc_jalr:
+            return "auipc+jalr";
+        case Op::slli_srli:
+            return "slli+srli";
+        case Op::addi_branch:
+            return "addi+branch";
+        default:
+            return "single";
+    }
+}
+
+// The Zbb and Zbs ops among the OP-IMM shifts, shamt is the rs2 field
+static Op decode_bitmanip_imm(uint8_t func7, uint8_t func3, uint8_t shamt)
+{
+    if (func3 == 0b001)
+    {
+        switch (func7)
+        {
+            case 0b0110000:
+            {
+                static const Op unary[] = {Op::clz, Op::ctz, Op::cpop, Op::fallback, Op::sext_b, Op::sext_h};
+                return shamt < std::size(unary) ? unary[shamt] : Op::fallback;
+            }
+            case 0b0100100:
+                return Op::bclri;
+            case 0b0110100:
+                return Op::binvi;
+            case 0b0010100:
+                return Op::bseti;
+        }
+    }
+    else
+    {
+        switch (func7)
+        {
+            case 0b0110000:
+                return Op::rori;
+            case 0b0100100:
+                return Op::bexti;
+            case 0b0010100:
+                return shamt == 0b00111 ? Op::orc_b : Op::fallback;
+            case 0b0110100:
+                return shamt == 0b11000 ? Op::rev8 : Op::fallback;
+        }
+    }
+    return Op::fallback;
+}
+
+// The Zba, Zbb and Zbs ops of the OP opcode
+static Op decode_bitmanip(const Rtype &r_type)
+{
+    switch (r_type.func7)
+    {
+        case 0b0010000:
+        {
+            static const Op ops[] = {Op::fallback, Op::fallback, Op::sh1add, Op::fallback,
+                                     Op::sh2add,   Op::fallback, Op::sh3add, Op::fallback};
+            return ops[r_type.func3];
+        }
+        case 0b0100000:
+        {
+            static const Op ops[] = {Op::sub, Op::fallback, Op::fallback, Op::fallback,
+                                     Op::xnor, Op::sra,     Op::orn,      Op::andn};
+            return ops[r_type.func3];
+        }
+        case 0b0000101:
+        {
+            static const Op ops[] = {Op::fallback, Op::fallback, Op::fallback, Op::fallback,
+                                     Op::min,      Op::minu,     Op::max,      Op::maxu};
+            return ops[r_type.func3];
+        }
+        case 0b0110000:
+            return r_type.func3 == 0b001 ? Op::rol : r_type.func3 == 0b101 ? Op::ror : Op::fallback;
+        case 0b0000100:
+            return r_type.func3 == 0b100 && r_type.rs2 == 0 ? Op::zext_h : Op::fallback;
+        case 0b0100100:
+            return r_type.func3 == 0b001 ? Op::bclr : r_type.func3 == 0b101 ? Op::bext : Op::fallback;
+        case 0b0110100:
+            return r_type.func3 == 0b001 ? Op::binv : Op::fallback;
+        case 0b0010100:
+            return r_type.func3 == 0b001 ? Op::bset : Op::fallback;
+    }
+    return Op::fallback;
+}
+
+static DecodedInstruction decode_op_imm(uint32_t inst)
+{
+    const Itype i_type = Itype::from(inst);
+    DecodedInstruction decoded{.rd = i_type.rd, .rs1 = i_type.rs1, .imm = i_type.imm};
+    const uint8_t func7 = inst >> 25;
+
+    switch (i_type.func3)
+    {
+        case 0b000:
+            decoded.op = Op::addi;
+            break;
+        case 0b010:
+            decoded.op = Op::slti;
+            break;
+        case 0b011:
+            decoded.op = Op::sltiu;
+            break;
+        case 0b100:
+            decoded.op = Op::xori;
+            break;
+        case 0b110:
+            decoded.op = Op::ori;
+            break;
+        case 0b111:
+            decoded.op = Op::andi;
+            break;
+        case 0b001:
+            decoded.imm &= 0b11111;
+            decoded.op = func7 == 0 ? Op::slli : decode_bitmanip_imm(func7, i_type.func3, decoded.imm);
+            break;
+        case 0b101:
+            decoded.imm &= 0b11111;
+            decoded.op = func7 == 0           ? Op::srli
+                         : func7 == 0b0100000 ? Op::srai
+                                              : decode_bitmanip_imm(func7, i_type.func3, decoded.imm);
+            break;
+    }
+
+    return decoded;
+}
+
+static DecodedInstruction decode_op(uint32_t inst)
+{
+    const Rtype r_type = Rtype::from(inst);
+    DecodedInstruction decoded{.op = Op::fallback, .rd = r_type.rd, .rs1 = r_type.rs1, .rs2 = r_type.rs2};
+
+    if (r_type.func7 == 0)
+    {
+        static const Op ops[] = {Op::add, Op::sll, Op::slt, Op::sltu, Op::xor_, Op::srl, Op::or_, Op::and_};
+        decoded.op = ops[r_type.func3];
+    }
+    else
+    {
+        decoded.op = decode_bitmanip(r_type);
+    }
+
+    return decoded;
+}
+
+DecodedInstruction decode(uint32_t inst, uint32_t pc)
+{
+    const uint8_t opcode = inst & 0b1111111;
+
+    switch (opcode)
+    {
+        case 0b0110111:
+        {
+            const Utype u_type = Utype::from(inst);
+            return DecodedInstruction{.op = Op::lui, .rd = u_type.rd, .imm = (int32_t)(u_type.imm << 12)};
+        }
+        case 0b0010111:
+        {
+            const Utype u_type = Utype::from(inst);
+            return DecodedInstruction{.op = Op::auipc, .rd = u_type.rd, .imm = (int32_t)(pc + (u_type.imm << 12))};
+        }
+        case 0b1101111:
+        {
+            const Jtype j_type = Jtype::from(inst);
+            return DecodedInstruction{.op = Op::jal, .rd = j_type.rd, .imm = (int32_t)(pc + j_type.imm)};
+        }
+        case 0b1100111:
+        {
+            const Itype i_type = Itype::from(inst);
+            if (i_type.func3 != 0)
+            {
+                break;
+            }
+            return DecodedInstruction{.op = Op::jalr, .rd = i_type.rd, .rs1 = i_type.rs1, .imm = i_type.imm};
+        }
+        case 0b1100011:
+        {
+            static const Op ops[] = {Op::beq, Op::bne, Op::fallback, Op::fallback, Op::blt, Op::bge, Op::bltu, Op::bgeu};
+            const Btype b_type = Btype::from(inst);
+            return DecodedInstruction{
+                .op = ops[b_type.func3],
+                .rs1 = b_type.rs1,
+                .rs2 = b_type.rs2,
+                .cond = b_type.func3,
+                .imm = (int32_t)(pc + b_type.imm)};
+        }
+        case 0b0000011:
+        {
+            static const Op ops[] = {Op::lb, Op::lh, Op::lw, Op::fallback, Op::lbu, Op::lhu, Op::fallback, Op::fallback};
+            const Itype i_type = Itype::from(inst);
+            return DecodedInstruction{.op = ops[i_type.func3], .rd = i_type.rd, .rs1 = i_type.rs1, .imm = i_type.imm};
+        }
+        case 0b0100011:
+        {
+            static const Op ops[] = {Op::sb, Op::sh, Op::sw, Op::fallback, Op::fallback, Op::fallback, Op::fallback, Op::fallback};
+            const Stype s_type = Stype::from(inst);
+            return DecodedInstruction{.op = ops[s_type.func3], .rs1 = s_type.rs1, .rs2 = s_type.rs2, .imm = s_type.imm};
+        }
+        case 0b0010011:
+            return decode_op_imm(inst);
+        case 0b0110011:
+            return decode_op(inst);
+        case 0b0001111:
+            return DecodedInstruction{.op = Op::fence};
+    }
+
+    return DecodedInstruction{.op = Op::fallback};
+}
+
+static bool is_branch(Op op)
+{
+    return op >= Op::beq && op <= Op::bgeu;
+}
+
+DecodedInstruction fuse(const DecodedInstruction &first, const DecodedInstruction &second)
+{
+    // every pattern feeds the first result into the second instruction, so first.rd must be a real register
+    if (first.rd == 0)
+    {
+        return DecodedInstruction{};
+    }
+
+    if ((first.op == Op::lui || first.op == Op::auipc) && second.op == Op::addi && second.rs1 == first.rd &&
+        second.rd == first.rd)
+    {
+        return DecodedInstruction{
+            .op = first.op == Op::lui ? Op::lui_addi : Op::auipc_addi,
+            .rd = first.rd,
+            .imm = first.imm + second.imm};
+    }
+
+    if (first.op == Op::auipc && (second.op == Op::lw || second.op == Op::jalr) && second.rs1 == first.rd)
+    {
+        return DecodedInstruction{
+            .op = second.op == Op::lw ? Op::auipc_lw : Op::auipc_jalr,
+            .rd = first.rd,
+            .rd2 = second.rd,
+            .imm = first.imm,
+            .imm2 = second.imm};
+    }
+
+    if (first.op == Op::slli && second.op == Op::srli && second.rs1 == first.rd && second.rd == first.rd)
+    {
+        return DecodedInstruction{
+            .op = Op::slli_srli,
+            .rd = first.rd,
+            .rs1 = first.rs1,
+            .imm = first.imm,
+            .imm2 = second.imm};
+    }
+
+    if (first.op == Op::addi && is_branch(second.op))
+    {
+        DecodedInstruction fused{
+            .op = Op::addi_branch,
+            .rd = first.rd,
+            .rs1 = first.rs1,
+            .rs2 = second.rs2,
+            .cond = second.cond,
+            .imm = first.imm,
+            .imm2 = second.imm};
+
+        if (second.rs1 == first.rd)
+        {
+            return fused;
+        }
+
+        // beq/bne are symmetric, so the counter may also be the second operand
+        if (second.rs2 == first.rd && (second.op == Op::beq || second.op == Op::bne))
+        {
+            fused.rs2 = second.rs1;
+            return fused;
+        }
+    }
+
+    return DecodedInstruction{};
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+/*
+    Internal operations of the decoded fast path. Every canonical RV32I, Zba, Zbb and Zbs encoding maps to one Op,
+    anything else (ECALL, EBREAK, unknown encodings) is left to the reference interpreter through Op::fallback.
+    The ops after the first fused one are superinstructions covering two consecutive guest instructions.
+*/
+enum class Op : uint8_t
+{
+    none,
+    fallback,
+    lui,
+    auipc,
+    jal,
+    jalr,
+    beq,
+    bne,
+    blt,
+    bge,
+    bltu,
+    bgeu,
+    lb,
+    lh,
+    lw,
+    lbu,
+    lhu,
+    sb,
+    sh,
+    sw,
+    addi,
+    slti,
+    sltiu,
+    xori,
+    ori,
+    andi,
+    slli,
+    srli,
+    srai,
+    add,
+    sub,
+    sll,
+    slt,
+    sltu,
+    xor_,
+    srl,
+    sra,
+    or_,
+    and_,
+
+    // Zba, Zbb and Zbs, immediate forms carry the shift amount or bit index in imm
+    sh1add,
+    sh2add,
+    sh3add,
+    andn,
+    orn,
+    xnor,
+    clz,
+    ctz,
+    cpop,
+    max,
+    maxu,
+    min,
+    minu,
+    sext_b,
+    sext_h,
+    zext_h,
+    rol,
+    ror,
+    rori,
+    orc_b,
+    rev8,
+    bclr,
+    bclri,
+    bext,
+    bexti,
+    binv,
+    binvi,
+    bset,
+    bseti,
+
+    fence,
+    host_call, // entry point of a libc routine implemented on the host, see LibcIntercepts
+
+    // fused pairs
+    lui_addi,    // lui rd, hi; addi rd, rd, lo           -> rd = constant
+    auipc_addi,  // auipc rd, hi; addi rd, rd, lo         -> rd = pc relative constant
+    auipc_lw,    // auipc rd, hi; lw rd2, lo(rd)          -> pc relative load
+    auipc_jalr,  // auipc rd, hi; jalr rd2, lo(rd)        -> far call or tail call
+    slli_srli,   // slli rd, rs1, n; srli rd, rd, m       -> zero extension / bit field extract
+    addi_branch, // addi rd, rs1, imm; bxx rd, rs2, label -> counted loop latch
+};
+
+const char *op_name(Op op);
+
+struct DecodedInstruction
+{
+    Op op = Op::none;
+    uint8_t rd = 0;
+    uint8_t rs1 = 0;
+    uint8_t rs2 = 0;
+    uint8_t rd2 = 0;   // second destination of a fused pair
+    uint8_t cond = 0;  // branch condition (func3) of addi_branch
+    int32_t imm = 0;   // immediate, absolute address for pc relative ops
+    int32_t imm2 = 0;  // second immediate of a fused pair, absolute branch target for addi_branch
+
+    bool is_fused() const
+    {
+        return op >= Op::lui_addi;
+    }
+};
+
+// Decodes one instruction located at pc, pc relative immediates are resolved to absolute values
+DecodedInstruction decode(uint32_t inst, uint32_t pc);
+
+// Returns the superinstruction equivalent to executing first then second, or an Op::none instruction
+DecodedInstruction fuse(const DecodedInstruction &first, const DecodedInstruction &second);
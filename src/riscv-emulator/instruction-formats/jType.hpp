@@ -6,7 +6,7 @@
 
 struct Jtype
 {
-    int32_t imm : 20;
+    int32_t imm : 21;
     uint8_t rd : 5;
 
     static Jtype from(uint32_t inst)
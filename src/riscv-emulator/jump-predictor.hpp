@@ -0,0 +1,126 @@
+#pragma once
+
+#include "decode-cache.hpp"
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+/*
+    Target prediction for the indirect jumps of the decoded fast path.
+
+    Calls push their return address, together with the decode cache entry of the return site, on a
+    shadow return address stack, and returns pop it. Every other JALR, e.g. switch tables and virtual
+    calls, goes through a small direct mapped cache of the last target seen at each jump site. A
+    correct prediction hands the next step its entry directly, so calls and returns chain without a
+    lookup. Predictions are hints, the entry is still checked against the pc and the instruction word
+    before it is used, so a wrong or stale one only costs the ordinary lookup.
+
+    Link registers follow the hints of the RISC-V unprivileged spec: x1 and x5.
+*/
+class JumpPredictor
+{
+  public:
+    struct Stats
+    {
+        uint64_t return_hits = 0;
+        uint64_t return_misses = 0;
+        uint64_t indirect_hits = 0;
+        uint64_t indirect_misses = 0;
+    };
+
+    static bool is_link(uint8_t reg)
+    {
+        return reg == 1 || reg == 5;
+    }
+
+    void push_return(uint32_t return_pc, const DecodeCache::Entry *entry)
+    {
+        top = (top + 1) % return_stack.size();
+        return_stack[top] = Prediction{return_pc, entry};
+    }
+
+    // Forgets the newest return address, for calls that come back without a JALR
+    void drop_return()
+    {
+        return_stack[top] = Prediction{};
+        top = (top + return_stack.size() - 1) % return_stack.size();
+    }
+
+    // A return to target, remembers the entry of the predicted return site when it matches
+    void predict_return(uint32_t target)
+    {
+        const Prediction prediction = return_stack[top];
+        drop_return();
+        if (prediction.target == target)
+        {
+            ++stats.return_hits;
+            predicted = prediction.entry;
+        }
+        else
+        {
+            ++stats.return_misses;
+        }
+    }
+
+    // An indirect jump from site to target, returns true when the cached target matched, otherwise
+    // the caller looks the target entry up and passes it to remember_indirect
+    bool predict_indirect(uint32_t site, uint32_t target)
+    {
+        const IndirectTarget &cached = indirect_targets[(site >> 2) & (indirect_targets.size() - 1)];
+        if (cached.site == site && cached.prediction.target == target)
+        {
+            ++stats.indirect_hits;
+            predicted = cached.prediction.entry;
+            return true;
+        }
+
+        ++stats.indirect_misses;
+        return false;
+    }
+
+    void remember_indirect(uint32_t site, uint32_t target, const DecodeCache::Entry *entry)
+    {
+        indirect_targets[(site >> 2) & (indirect_targets.size() - 1)] = IndirectTarget{site, Prediction{target, entry}};
+        predicted = entry;
+    }
+
+    // The entry predicted for the instruction after the last jump, nullptr if there is none
+    const DecodeCache::Entry *take_prediction()
+    {
+        const DecodeCache::Entry *entry = predicted;
+        predicted = nullptr;
+        return entry;
+    }
+
+    // Must be called whenever the entries predictions point at are freed
+    void clear()
+    {
+        return_stack = {};
+        indirect_targets = {};
+        predicted = nullptr;
+    }
+
+    const Stats &get_stats() const
+    {
+        return stats;
+    }
+
+  private:
+    struct Prediction
+    {
+        uint32_t target = 1; // never a valid pc
+        const DecodeCache::Entry *entry = nullptr;
+    };
+
+    struct IndirectTarget
+    {
+        uint32_t site = 1;
+        Prediction prediction;
+    };
+
+    std::array<Prediction, 16> return_stack = {};
+    uint32_t top = 0;
+    std::array<IndirectTarget, 256> indirect_targets = {};
+    const DecodeCache::Entry *predicted = nullptr;
+    Stats stats;
+};
@@ -1,5 +1,6 @@
 #include "riscv-emulator.hpp"
 #include "../elf-loader/elf-loader.hpp"
+#include "bitmanip.hpp"
 
 #include "instruction-formats/bType.hpp"
 #include "instruction-formats/iType.hpp"
@@ -7,59 +8,717 @@
 #include "instruction-formats/rType.hpp"
 #include "instruction-formats/sType.hpp"
 #include "instruction-formats/uType.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+RiscvEmulator::RiscvEmulator(const RiscvEmulator &parent, Mmu &mmu)
+    : skip_pc_update(parent.skip_pc_update), mmu(mmu), linux_emulator(parent.linux_emulator, mmu),
+      vector_unit(parent.vector_unit), running(parent.running),
+      instructions_retired(parent.instructions_retired), decode_cache(parent.decode_cache),
+      aot_image(parent.aot_image), decode_cache_enabled(parent.decode_cache_enabled), fusion_enabled(parent.fusion_enabled)
+{
+    std::copy(std::begin(parent.registers), std::end(parent.registers), std::begin(registers));
+}
+
+void RiscvEmulator::restore(const RiscvEmulator &snapshot)
+{
+    std::copy(std::begin(snapshot.registers), std::end(snapshot.registers), std::begin(registers));
+    skip_pc_update = snapshot.skip_pc_update;
+    running = snapshot.running;
+    instructions_retired = snapshot.instructions_retired;
+    vector_unit = snapshot.vector_unit;
+    linux_emulator.restore(snapshot.linux_emulator);
+}
+
+void RiscvEmulator::save_state(CheckpointWriter &writer) const
+{
+    for (uint32_t value : registers)
+    {
+        writer.write(value);
+    }
+    writer.write(running);
+    writer.write(skip_pc_update);
+    writer.write(instructions_retired);
+    vector_unit.save_state(writer);
+    linux_emulator.save_state(writer);
+}
+
+void RiscvEmulator::load_state(CheckpointReader &reader)
+{
+    for (uint32_t &value : registers)
+    {
+        value = reader.read<uint32_t>();
+    }
+    running = reader.read<bool>();
+    skip_pc_update = reader.read<bool>();
+    instructions_retired = reader.read<uint64_t>();
+    published_retired = instructions_retired;
+    vector_unit.load_state(reader);
+    linux_emulator.load_state(reader);
+
+    // decoded for whatever ran before, which is gone now
+    decode_cache.clear();
+    jump_predictor.clear();
+}
 
 void RiscvEmulator::run(uint32_t entry_point)
+{
+    start(entry_point);
+    run_for(UINT64_MAX);
+}
+
+void RiscvEmulator::start(uint32_t entry_point, const InitialStack &initial_stack, uint32_t stack_size)
 {
     set_pc(entry_point);
 
-    const uint32_t stack_size = 1024 * 1024 * 2; // 2MB
-    uint32_t stack_addr = mmu.get_first_alloc() - 1;
-    
-    if(stack_addr < stack_size)
+    // page 0 stays unmapped to catch null pointers
+    uint32_t stack_top = mmu.get_first_alloc() & ~(Mmu::page_size - 1);
+    if (stack_top < (uint64_t)stack_size + Mmu::page_size)
+    {
+        const uint32_t stack_addr = mmu.allocate(stack_size);
+        if (stack_addr == 0)
+        {
+            throw std::invalid_argument("Guest memory has no room for a stack of " + std::to_string(stack_size) + " bytes");
+        }
+        stack_top = stack_addr + stack_size;
+    }
+
+    set_register(RegisterName::sp, initial_stack.write(mmu, stack_top - stack_size, stack_top));
+    running = true;
+}
+
+uint64_t RiscvEmulator::run_for(uint64_t max_instructions)
+{
+    const uint64_t retired_before = instructions_retired;
+    if (linux_emulator.is_blocked())
+    {
+        running = true;
+    }
+
+    try
+    {
+        while (running && instructions_retired - retired_before < max_instructions)
+        {
+            // with metrics attached the guest runs in slices, so live exports see the retired count move
+            const uint64_t remaining = max_instructions - (instructions_retired - retired_before);
+            run_slice(metrics != nullptr ? std::min(remaining, metrics_slice) : remaining);
+            publish_retired();
+        }
+    }
+    catch (GuestFault &fault)
+    {
+        // the faulting instruction did not retire and the pc still points at it
+        fault.set_pc(get_pc());
+        running = false;
+        publish_retired();
+        throw;
+    }
+
+    return instructions_retired - retired_before;
+}
+
+void RiscvEmulator::run_slice(uint64_t max_instructions)
+{
+    const uint64_t retired_before = instructions_retired;
+    if (fast_path_available())
+    {
+        while (running && instructions_retired - retired_before < max_instructions)
+        {
+            step_decoded(max_instructions - (instructions_retired - retired_before));
+        }
+    }
+
+    while (running && instructions_retired - retired_before < max_instructions)
+    {
+        step();
+    }
+}
+
+void RiscvEmulator::publish_retired()
+{
+    if (metrics != nullptr)
+    {
+        metrics->instructions_retired.add(instructions_retired - published_retired);
+        published_retired = instructions_retired;
+    }
+}
+
+bool RiscvEmulator::fast_path_available() const
+{
+#ifdef RISCV_EMULATOR_PERF_MODEL
+    if (perf_model != nullptr)
+    {
+        return false;
+    }
+#endif
+
+    if (heap_profiler != nullptr)
+    {
+        return false;
+    }
+
+    // verification watches every return address, which only the reference interpreter does
+    if (libc_intercepts != nullptr && libc_intercepts->get_mode() == LibcIntercepts::Mode::verify)
+    {
+        return false;
+    }
+
+    return decode_cache_enabled && trace_writer == nullptr && timing_model == nullptr;
+}
+
+bool RiscvEmulator::intercept_libc(uint32_t pc)
+{
+    const uint32_t return_addr = get_register(RegisterName::ra) & ~1u;
+    const uint32_t sp = get_register(RegisterName::sp);
+    if (libc_intercepts->verify_pending())
+    {
+        libc_intercepts->check_return(mmu, pc, sp, get_register(RegisterName::a0));
+    }
+
+    const LibcRoutine *routine = libc_intercepts->find(pc);
+    if (routine == nullptr)
+    {
+        return false;
+    }
+
+    const LibcIntercepts::Arguments args{
+        .a0 = get_register(RegisterName::a0), .a1 = get_register(RegisterName::a1), .a2 = get_register(RegisterName::a2)};
+    if (libc_intercepts->get_mode() == LibcIntercepts::Mode::verify)
     {
-        stack_addr = mmu.allocate(stack_size) + stack_size - 1;
+        libc_intercepts->begin_verify(*routine, mmu, args, return_addr, sp);
+        return false;
     }
 
-    set_register(RegisterName::sp, stack_addr);
-    while (true)
+    uint32_t result = 0;
+    if (!libc_intercepts->call(*routine, mmu, args, result))
+    {
+        return false;
+    }
+
+    set_register(RegisterName::a0, result);
+    set_pc(return_addr);
+    return true;
+}
+
+uint32_t RiscvEmulator::step_decoded(uint64_t budget)
+{
+    const uint32_t pc = get_pc();
+    const uint32_t inst = mmu.read<uint32_t>(pc);
+
+    const DecodeCache::Entry *entry = jump_predictor.take_prediction();
+    if (entry == nullptr || entry->pc != pc)
     {
-        const uint32_t inst = fetch_instruction();
-   
-        execute_instruction(inst);
+        entry = aot_image != nullptr ? aot_image->find(pc) : nullptr;
+    }
+
+    bool hit = entry != nullptr && entry->inst == inst;
+    if (!hit)
+    {
+        // outside the translated text, or code the guest rewrote
+        DecodeCache::Entry &cached = decode_cache.lookup(pc);
+        hit = cached.pc == pc && cached.inst == inst;
+        if (!hit)
+        {
+            if (pc % sizeof(uint32_t) != 0)
+            {
+                throw GuestFault(GuestFault::Kind::misaligned_fetch, pc);
+            }
+
+            cached.pc = pc;
+            cached.inst = inst;
+            cached.single = decode(inst, pc);
+            cached.fused = DecodedInstruction{};
+
+            if (libc_intercepts != nullptr && libc_intercepts->find(pc) != nullptr)
+            {
+                cached.single.op = Op::host_call;
+            }
+            else if (pc + 2 * sizeof(uint32_t) < mmu.size())
+            {
+                cached.next_inst = mmu.read<uint32_t>(pc + sizeof(uint32_t));
+                cached.fused = fuse(cached.single, decode(cached.next_inst, pc + sizeof(uint32_t)));
+            }
+        }
+        entry = &cached;
+    }
+
+    if (metrics != nullptr)
+    {
+        (hit ? metrics->decode_cache_hits : metrics->decode_cache_misses).add();
+    }
+
+    if (fusion_enabled && entry->fused.op != Op::none && budget >= 2 &&
+        entry->next_inst == mmu.read<uint32_t>(pc + sizeof(uint32_t)))
+    {
+        ++fusion_counts[(size_t)entry->fused.op - (size_t)Op::lui_addi];
+        if (metrics != nullptr)
+        {
+            metrics->count_instruction(inst);
+            metrics->count_instruction(entry->next_inst);
+            metrics->fused_pairs.add();
+        }
+        execute_decoded(entry->fused, inst);
+        instructions_retired += 2;
+        return 2;
+    }
+
+    if (metrics != nullptr)
+    {
+        metrics->count_instruction(inst);
+    }
+    execute_decoded(entry->single, inst);
+    ++instructions_retired;
+    return 1;
+}
+
+void RiscvEmulator::execute_decoded(const DecodedInstruction &decoded, uint32_t inst)
+{
+    const uint32_t pc = get_pc();
+    const uint32_t rs1 = registers[decoded.rs1];
+    const uint32_t rs2 = registers[decoded.rs2];
+    const uint32_t imm = decoded.imm;
+    uint32_t next = pc + sizeof(uint32_t);
+
+    switch (decoded.op)
+    {
+        case Op::host_call:
+            // a fork inherits decoded entries but not the intercepts
+            if (libc_intercepts != nullptr && intercept_libc(pc))
+            {
+                // the call came back without a return instruction
+                jump_predictor.drop_return();
+                return;
+            }
+            [[fallthrough]];
+        case Op::none:
+        case Op::fallback:
+        {
+            execute_instruction(inst);
+            if (skip_pc_update)
+            {
+                skip_pc_update = false;
+                return;
+            }
+            break;
+        }
+        case Op::lui:
+        case Op::auipc:
+            set_register(decoded.rd, imm);
+            break;
+        case Op::jal:
+            set_register(decoded.rd, next);
+            if (JumpPredictor::is_link(decoded.rd))
+            {
+                jump_predictor.push_return(next, entry_for(next));
+            }
+            next = imm;
+            cover_edge(next);
+            break;
+        case Op::jalr:
+        {
+            const uint32_t target = (rs1 + imm) & ~1u;
+            set_register(decoded.rd, next);
+            predict_jalr(pc, decoded, next, target);
+            next = target;
+            cover_edge(next);
+            break;
+        }
+        case Op::beq:
+            next = rs1 == rs2 ? imm : next;
+            cover_edge(next);
+            break;
+        case Op::bne:
+            next = rs1 != rs2 ? imm : next;
+            cover_edge(next);
+            break;
+        case Op::blt:
+            next = (int32_t)rs1 < (int32_t)rs2 ? imm : next;
+            cover_edge(next);
+            break;
+        case Op::bge:
+            next = (int32_t)rs1 >= (int32_t)rs2 ? imm : next;
+            cover_edge(next);
+            break;
+        case Op::bltu:
+            next = rs1 < rs2 ? imm : next;
+            cover_edge(next);
+            break;
+        case Op::bgeu:
+            next = rs1 >= rs2 ? imm : next;
+            cover_edge(next);
+            break;
+        case Op::lb:
+            set_register(decoded.rd, (int32_t)(int8_t)mmu.read<uint8_t>(rs1 + imm));
+            break;
+        case Op::lh:
+            set_register(decoded.rd, (int32_t)(int16_t)mmu.read<uint16_t>(rs1 + imm));
+            break;
+        case Op::lw:
+            set_register(decoded.rd, mmu.read<uint32_t>(rs1 + imm));
+            break;
+        case Op::lbu:
+            set_register(decoded.rd, mmu.read<uint8_t>(rs1 + imm));
+            break;
+        case Op::lhu:
+            set_register(decoded.rd, mmu.read<uint16_t>(rs1 + imm));
+            break;
+        case Op::sb:
+            mmu.write<uint8_t>(rs1 + imm, rs2);
+            break;
+        case Op::sh:
+            mmu.write<uint16_t>(rs1 + imm, rs2);
+            break;
+        case Op::sw:
+            mmu.write<uint32_t>(rs1 + imm, rs2);
+            break;
+        case Op::addi:
+            set_register(decoded.rd, rs1 + imm);
+            break;
+        case Op::slti:
+            set_register(decoded.rd, (int32_t)rs1 < (int32_t)imm);
+            break;
+        case Op::sltiu:
+            set_register(decoded.rd, rs1 < imm);
+            break;
+        case Op::xori:
+            set_register(decoded.rd, rs1 ^ imm);
+            break;
+        case Op::ori:
+            set_register(decoded.rd, rs1 | imm);
+            break;
+        case Op::andi:
+            set_register(decoded.rd, rs1 & imm);
+            break;
+        case Op::slli:
+            set_register(decoded.rd, rs1 << imm);
+            break;
+        case Op::srli:
+            set_register(decoded.rd, rs1 >> imm);
+            break;
+        case Op::srai:
+            set_register(decoded.rd, (int32_t)rs1 >> imm);
+            break;
+        case Op::add:
+            set_register(decoded.rd, rs1 + rs2);
+            break;
+        case Op::sub:
+            set_register(decoded.rd, rs1 - rs2);
+            break;
+        case Op::sll:
+            set_register(decoded.rd, rs1 << (rs2 & 0b11111));
+            break;
+        case Op::slt:
+            set_register(decoded.rd, (int32_t)rs1 < (int32_t)rs2);
+            break;
+        case Op::sltu:
+            set_register(decoded.rd, rs1 < rs2);
+            break;
+        case Op::xor_:
+            set_register(decoded.rd, rs1 ^ rs2);
+            break;
+        case Op::srl:
+            set_register(decoded.rd, rs1 >> (rs2 & 0b11111));
+            break;
+        case Op::sra:
+            set_register(decoded.rd, (int32_t)rs1 >> (rs2 & 0b11111));
+            break;
+        case Op::or_:
+            set_register(decoded.rd, rs1 | rs2);
+            break;
+        case Op::and_:
+            set_register(decoded.rd, rs1 & rs2);
+            break;
+        case Op::sh1add:
+        case Op::sh2add:
+        case Op::sh3add:
+        case Op::andn:
+        case Op::orn:
+        case Op::xnor:
+        case Op::clz:
+        case Op::ctz:
+        case Op::cpop:
+        case Op::max:
+        case Op::maxu:
+        case Op::min:
+        case Op::minu:
+        case Op::sext_b:
+        case Op::sext_h:
+        case Op::zext_h:
+        case Op::rol:
+        case Op::ror:
+        case Op::orc_b:
+        case Op::rev8:
+        case Op::bclr:
+        case Op::bext:
+        case Op::binv:
+        case Op::bset:
+            set_register(decoded.rd, execute_bitmanip(decoded.op, rs1, rs2));
+            break;
+        case Op::rori:
+        case Op::bclri:
+        case Op::bexti:
+        case Op::binvi:
+        case Op::bseti:
+            set_register(decoded.rd, execute_bitmanip(decoded.op, rs1, imm));
+            break;
+        case Op::fence:
+            break;
 
-        if (!running)
+        // fused pairs, the second instruction ends at pc + 8
+        case Op::lui_addi:
+        case Op::auipc_addi:
+            set_register(decoded.rd, imm);
+            next += sizeof(uint32_t);
+            break;
+        case Op::auipc_lw:
         {
+            // a load fault retires the auipc first, so it is reported at the lw like without fusion
+            uint32_t value;
+            try
+            {
+                value = mmu.read<uint32_t>(imm + decoded.imm2);
+            }
+            catch (const GuestFault &)
+            {
+                set_register(decoded.rd, imm);
+                set_pc(next);
+                ++instructions_retired;
+                throw;
+            }
+            set_register(decoded.rd, imm);
+            set_register(decoded.rd2, value);
+            next += sizeof(uint32_t);
             break;
         }
-        if (!skip_pc_update)
+        case Op::auipc_jalr:
+            set_register(decoded.rd, imm);
+            set_register(decoded.rd2, next + sizeof(uint32_t));
+            if (JumpPredictor::is_link(decoded.rd2))
+            {
+                jump_predictor.push_return(next + sizeof(uint32_t), entry_for(next + sizeof(uint32_t)));
+            }
+            next = (imm + decoded.imm2) & ~1u;
+            cover_edge(next);
+            break;
+        case Op::slli_srli:
+            set_register(decoded.rd, (rs1 << imm) >> decoded.imm2);
+            next += sizeof(uint32_t);
+            break;
+        case Op::addi_branch:
+        {
+            const uint32_t counter = rs1 + imm;
+            set_register(decoded.rd, counter);
+
+            const uint32_t other = registers[decoded.rs2];
+            bool taken = false;
+            switch (decoded.cond)
+            {
+                case 0b000:
+                    taken = counter == other;
+                    break;
+                case 0b001:
+                    taken = counter != other;
+                    break;
+                case 0b100:
+                    taken = (int32_t)counter < (int32_t)other;
+                    break;
+                case 0b101:
+                    taken = (int32_t)counter >= (int32_t)other;
+                    break;
+                case 0b110:
+                    taken = counter < other;
+                    break;
+                case 0b111:
+                    taken = counter >= other;
+                    break;
+            }
+            next = taken ? decoded.imm2 : next + sizeof(uint32_t);
+            cover_edge(next);
+            break;
+        }
+    }
+
+    if (running)
+    {
+        set_pc(next);
+    }
+}
+
+const DecodeCache::Entry *RiscvEmulator::entry_for(uint32_t pc)
+{
+    const DecodeCache::Entry *entry = aot_image != nullptr ? aot_image->find(pc) : nullptr;
+    return entry != nullptr ? entry : &decode_cache.lookup(pc);
+}
+
+void RiscvEmulator::predict_jalr(uint32_t pc, const DecodedInstruction &decoded, uint32_t return_pc, uint32_t target)
+{
+    // push and pop as hinted by the link registers, jalr x1, 0(x1) is a call through ra and only pushes
+    const bool links = JumpPredictor::is_link(decoded.rd);
+    if (JumpPredictor::is_link(decoded.rs1) && (!links || decoded.rd != decoded.rs1))
+    {
+        jump_predictor.predict_return(target);
+    }
+    else if (!jump_predictor.predict_indirect(pc, target))
+    {
+        jump_predictor.remember_indirect(pc, target, entry_for(target));
+    }
+
+    if (links)
+    {
+        jump_predictor.push_return(return_pc, entry_for(return_pc));
+    }
+}
+
+void RiscvEmulator::report_jump_stats(std::ostream &out) const
+{
+    const JumpPredictor::Stats &stats = jump_predictor.get_stats();
+    const auto rate = [](uint64_t hits, uint64_t misses) { return hits + misses == 0 ? 0.0 : 100.0 * hits / (hits + misses); };
+    out << "Jump prediction\n"
+        << "  returns " << std::dec << stats.return_hits << " hits " << stats.return_misses << " misses ("
+        << rate(stats.return_hits, stats.return_misses) << "%)\n"
+        << "  indirect jumps " << stats.indirect_hits << " hits " << stats.indirect_misses << " misses ("
+        << rate(stats.indirect_hits, stats.indirect_misses) << "%)\n";
+}
+
+void RiscvEmulator::report_fusion_stats(std::ostream &out) const
+{
+    uint64_t fused = 0;
+    for (uint64_t count : fusion_counts)
+    {
+        fused += count;
+    }
+
+    const uint64_t dispatches = instructions_retired - fused;
+    out << "Fusion statistics\n"
+        << "Instructions " << std::dec << instructions_retired << " dispatches " << dispatches << " fused pairs " << fused
+        << " (" << (instructions_retired == 0 ? 0.0 : 200.0 * fused / instructions_retired) << "% of instructions)\n";
+
+    for (size_t i = 0; i < fusion_counts.size(); ++i)
+    {
+        out << "  " << op_name((Op)((size_t)Op::lui_addi + i)) << ' ' << fusion_counts[i] << '\n';
+    }
+}
+
+void RiscvEmulator::step()
+{
+    const uint32_t pc = get_pc();
+    if (libc_intercepts != nullptr && intercept_libc(pc))
+    {
+        ++instructions_retired;
+        return;
+    }
+
+    if (heap_profiler != nullptr)
+    {
+        heap_profiler->on_instruction(HeapProfiler::CallState{
+            .pc = pc,
+            .ra = get_register(RegisterName::ra),
+            .sp = get_register(RegisterName::sp),
+            .a0 = get_register(RegisterName::a0),
+            .a1 = get_register(RegisterName::a1),
+            .a2 = get_register(RegisterName::a2)});
+    }
+
+    const uint32_t inst = fetch_instruction();
+    if (metrics != nullptr)
+    {
+        metrics->count_instruction(inst);
+    }
+
+    mem_accessed = false;
+    execute_instruction(inst);
+    ++instructions_retired;
+
+    if (trace_writer != nullptr)
+    {
+        trace_instruction(pc, inst);
+    }
+
+    if (!running)
+    {
+        skip_pc_update = false;
+        return;
+    }
+    if (!skip_pc_update)
+    {
+        next_pc();
+    }
+    else
+    {
+        skip_pc_update = false;
+    }
+
+    const uint8_t opcode = inst & 0b1111111;
+    if (opcode == 0b1100011 || opcode == 0b1101111 || opcode == 0b1100111) // BRANCH, JAL, JALR
+    {
+        cover_edge(get_pc());
+    }
+
+    if (timing_model != nullptr)
+    {
+        timing_model->retire(pc, inst, get_pc());
+    }
+}
+
+void RiscvEmulator::trace_instruction(uint32_t pc, uint32_t inst)
+{
+    const uint8_t opcode = inst & 0b1111111;
+    const uint8_t rd = (inst >> 7) & 0b11111;
+    bool writes_rd = false;
+
+    switch (opcode)
+    {
+        case 0b0110111: // LUI
+        case 0b0010111: // AUIPC
+        case 0b1101111: // JAL
+        case 0b1100111: // JALR
+        case 0b0000011: // LOAD
+        case 0b0010011: // OP-IMM
+        case 0b0110011: // OP
         {
-            next_pc();
+            writes_rd = rd != (uint8_t)RegisterName::zero;
+            break;
         }
-        else
+        case 0b1110011: // SYSTEM
         {
-            skip_pc_update = false;
+            // the syscall result, unless the guest exited or the syscall blocked and is issued again
+            writes_rd = inst == TraceFormat::ecall && running && !linux_emulator.is_blocked();
+            break;
         }
     }
+
+    trace_writer->push(TraceRecord{
+        .pc = pc,
+        .inst = inst,
+        .rd_value = writes_rd ? get_register(TraceFormat::rd_of(inst)) : 0,
+        .mem_addr = last_mem_addr,
+        .mem_value = last_mem_value,
+        .has_rd = writes_rd,
+        .has_mem = mem_accessed});
 }
 
 uint32_t RiscvEmulator::fetch_instruction() const
 {
     const uint32_t pc = get_pc();
-    const uint32_t inst = mmu.read<uint32_t>(pc);
-
-    if(pc == 0x10160){
-        std::cout << "break";
+    if (pc % sizeof(uint32_t) != 0)
+    {
+        throw GuestFault(GuestFault::Kind::misaligned_fetch, pc);
     }
-    std::cerr << "fetch from 0x" << std::hex << pc << " inst = 0x" << inst << '\n';
+
+    const uint32_t inst = mmu.read<uint32_t>(pc);
+    model_fetch(pc);
+    debug_log << "fetch from 0x" << std::hex << pc << " inst = 0x" << inst << '\n';
     return inst;
 }
 
 void RiscvEmulator::execute_instruction(uint32_t inst)
 {
     uint8_t opcode = inst & 0b1111111;
-    std::cerr << "decoded opcode = " << std::bitset<7>(opcode) << '\n';
+    debug_log << "decoded opcode = " << std::bitset<7>(opcode) << '\n';
 
     switch (opcode)
     {
@@ -74,7 +733,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             const Utype u_type = Utype::from(inst);
             const uint32_t value = u_type.imm << 12;
 
-            std::cerr << "LUI " << u_type << '\n';
+            debug_log << "LUI " << u_type << '\n';
             set_register(u_type.rd, value);
             break;
         }
@@ -90,7 +749,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             const Utype u_type = Utype::from(inst);
             const uint32_t offset = u_type.imm << 12;
 
-            std::cerr << "AUIPC " << u_type << '\n';
+            debug_log << "AUIPC " << u_type << '\n';
             set_register(u_type.rd, get_pc() + offset);
             break;
         }
@@ -115,7 +774,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             }
             set_pc(target);
             skip_pc_update = true;
-            std::cerr << "JAL " << j_type << '\n';
+            debug_log << "JAL " << j_type << '\n';
             break;
         }
         case 0b1100111:
@@ -129,7 +788,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             */
 
             const Itype i_type = Itype::from(inst);
-            const uint32_t target = i_type.imm + get_register(i_type.rs1);
+            const uint32_t target = (i_type.imm + get_register(i_type.rs1)) & ~1u;
             const uint32_t ret = get_pc() + sizeof(uint32_t);
 
             if (i_type.rd != (uint8_t)RegisterName::zero)
@@ -138,7 +797,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             }
             set_pc(target);
             skip_pc_update = true;
-            std::cerr << "JALR " << i_type << '\n';
+            debug_log << "JALR " << i_type << '\n';
             break;
         }
         case 0b1100011:
@@ -162,7 +821,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     // BEQ take the branch if registers rs1 and rs2 are equal
 
                     should_take_branch = rs1 == rs2;
-                    std::cerr << "BEQ ";
+                    debug_log << "BEQ ";
                     break;
                 }
                 case 0b001:
@@ -170,7 +829,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     // BNE take the branch if registers rs1 and rs2 are unequal
 
                     should_take_branch = rs1 != rs2;
-                    std::cerr << "BNE ";
+                    debug_log << "BNE ";
                     break;
                 }
                 case 0b100:
@@ -178,7 +837,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     // BLT take the branch if rs1 is less than rs2, using signed comparison
 
                     should_take_branch = (int32_t)rs1 < (int32_t)rs2;
-                    std::cerr << "BLT ";
+                    debug_log << "BLT ";
                     break;
                 }
                 case 0b101:
@@ -186,7 +845,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     // BGE take the branch if rs1 is greater than or equal to rs2, using signed comparison
 
                     should_take_branch = (int32_t)rs1 >= (int32_t)rs2;
-                    std::cerr << "BGE ";
+                    debug_log << "BGE ";
                     break;
                 }
                 case 0b110:
@@ -194,7 +853,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     // BLTU take the branch if rs1 is less than rs2, using unsigned comparison
 
                     should_take_branch = rs1 < rs2;
-                    std::cerr << "BLTU ";
+                    debug_log << "BLTU ";
                     break;
                 }
                 case 0b111:
@@ -202,17 +861,18 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     // BGEU take the branch if rs1 is greater than or equal to rs2, using unsigned comparison
 
                     should_take_branch = rs1 >= rs2;
-                    std::cerr << "BGEU ";
+                    debug_log << "BGEU ";
                     break;
                 }
             }
 
+            model_branch(should_take_branch);
             if (should_take_branch)
             {
                 set_pc(target);
                 skip_pc_update = true;
             }
-            std::cerr << b_type << '\n';
+            debug_log << b_type << '\n';
             break;
         }
         case 0b0000011:
@@ -230,37 +890,47 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             const Itype i_type = Itype::from(inst);
             const uint32_t load_address = get_register(i_type.rs1) + i_type.imm;
 
-            std::cerr << i_type << '\n';
+            debug_log << i_type << '\n';
             switch (i_type.func3)
             {
                 case 0b000:
                 {
-                    set_register(i_type.rd, (int32_t)mmu.read<uint8_t>(load_address));
-                    std::cerr << "LB ";
+                    const uint8_t value = mmu.read<uint8_t>(load_address);
+                    record_mem_access(load_address, value);
+                    set_register(i_type.rd, (int32_t)(int8_t)value);
+                    debug_log << "LB ";
                     break;
                 }
                 case 0b001:
                 {
-                    set_register(i_type.rd, (int32_t)mmu.read<uint16_t>(load_address));
-                    std::cerr << "LH ";
+                    const uint16_t value = mmu.read<uint16_t>(load_address);
+                    record_mem_access(load_address, value);
+                    set_register(i_type.rd, (int32_t)(int16_t)value);
+                    debug_log << "LH ";
                     break;
                 }
                 case 0b010:
                 {
-                    set_register(i_type.rd, mmu.read<uint32_t>(load_address));
-                    std::cerr << "LW ";
+                    const uint32_t value = mmu.read<uint32_t>(load_address);
+                    record_mem_access(load_address, value);
+                    set_register(i_type.rd, value);
+                    debug_log << "LW ";
                     break;
                 }
                 case 0b100:
                 {
-                    set_register(i_type.rd, mmu.read<uint8_t>(load_address));
-                    std::cerr << "LBU ";
+                    const uint8_t value = mmu.read<uint8_t>(load_address);
+                    record_mem_access(load_address, value);
+                    set_register(i_type.rd, value);
+                    debug_log << "LBU ";
                     break;
                 }
                 case 0b101:
                 {
-                    std::cerr << "LHU ";
-                    set_register(i_type.rd, mmu.read<uint16_t>(load_address));
+                    debug_log << "LHU ";
+                    const uint16_t value = mmu.read<uint16_t>(load_address);
+                    record_mem_access(load_address, value);
+                    set_register(i_type.rd, value);
                     break;
                 }
             }
@@ -284,24 +954,27 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             {
                 case 0b000:
                 {
-                    std::cerr << "SB ";
+                    debug_log << "SB ";
                     mmu.write<uint8_t>(store_address, rs2);
+                    record_mem_access(store_address, (uint8_t)rs2);
                     break;
                 }
                 case 0b001:
                 {
-                    std::cerr << "SH ";
+                    debug_log << "SH ";
                     mmu.write<uint16_t>(store_address, rs2);
+                    record_mem_access(store_address, (uint16_t)rs2);
                     break;
                 }
                 case 0b010:
                 {
-                    std::cerr << "SW ";
+                    debug_log << "SW ";
                     mmu.write<uint32_t>(store_address, rs2);
+                    record_mem_access(store_address, rs2);
                     break;
                 }
             }
-            std::cerr << s_type << '\n';
+            debug_log << s_type << '\n';
             break;
         }
         case 0b0010011:
@@ -309,6 +982,12 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             const Itype i_type = Itype::from(inst);
             const uint32_t rs1 = get_register(i_type.rs1);
 
+            if (const std::optional<uint32_t> result = execute_bitmanip(inst, rs1, 0))
+            {
+                set_register(i_type.rd, *result);
+                break;
+            }
+
             switch (i_type.func3)
             {
                 case 0b000:
@@ -324,11 +1003,11 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                             The NOP instruction does not change any architecturally visible state, except for advancing the
                             pc and incrementing any applicable performance counters. NOP is encoded as ADDI x0, x0, 0
                         */
-                        std::cerr << "NOP ";
+                        debug_log << "NOP ";
                         break;
                     }
                     set_register(i_type.rd, i_type.imm + rs1);
-                    std::cerr << "ADDI ";
+                    debug_log << "ADDI ";
                     break;
                 }
                 case 0b010:
@@ -338,8 +1017,8 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                         else 0 is written to rd.
                     */
 
-                    set_register(i_type.rd, rs1 < i_type.imm);
-                    std::cerr << "SLTI ";
+                    set_register(i_type.rd, (int32_t)rs1 < i_type.imm);
+                    debug_log << "SLTI ";
                     break;
                 }
                 case 0b011:
@@ -351,7 +1030,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     */
 
                     set_register(i_type.rd, rs1 < (uint32_t)i_type.imm);
-                    std::cerr << "SLTIU ";
+                    debug_log << "SLTIU ";
                     break;
                 }
                 case 0b100:
@@ -362,26 +1041,26 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                         a bitwise logical inversion of register rs1 (assembler pseudoinstruction NOT rd, rs).
                     */
 
-                    std::cerr << "XORI ";
+                    debug_log << "XORI ";
                     set_register(i_type.rd, rs1 ^ i_type.imm);
                     break;
                 }
                 case 0b110:
                 {
-                    std::cerr << "ORI ";
+                    debug_log << "ORI ";
                     set_register(i_type.rd, rs1 | i_type.imm);
                     break;
                 }
                 case 0b111:
                 {
-                    std::cerr << "ANDI ";
+                    debug_log << "ANDI ";
                     set_register(i_type.rd, rs1 & i_type.imm);
                     break;
                 }
                 case 0b001:
                 {
                     const uint8_t shamt = i_type.imm & 0b11111;
-                    std::cerr << "SLLI ";
+                    debug_log << "SLLI ";
                     set_register(i_type.rd, rs1 << shamt);
                     break;
                 }
@@ -404,13 +1083,13 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     {
                         case 0b0000000:
                         {
-                            std::cerr << "SRLI";
+                            debug_log << "SRLI";
                             set_register(i_type.rd, rs1 >> shamt);
                             break;
                         }
                         case 0b0100000:
                         {
-                            std::cerr << "SRAI";
+                            debug_log << "SRAI";
                             set_register(i_type.rd, (int32_t)rs1 >> shamt);
                             break;
                         }
@@ -419,7 +1098,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                 }
             }
 
-            std::cerr << i_type << '\n';
+            debug_log << i_type << '\n';
             break;
         }
 
@@ -429,6 +1108,12 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             const uint32_t rs1 = get_register(r_type.rs1);
             const int32_t rs2 = get_register(r_type.rs2);
 
+            if (const std::optional<uint32_t> result = execute_bitmanip(inst, rs1, rs2))
+            {
+                set_register(r_type.rd, *result);
+                break;
+            }
+
             switch (r_type.func3)
             {
                 case 0b000:
@@ -442,13 +1127,13 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     {
                         case 0b0000000:
                         {
-                            std::cerr << "ADD ";
+                            debug_log << "ADD ";
                             set_register(r_type.rd, rs1 + rs2);
                             break;
                         }
                         case 0b0100000:
                         {
-                            std::cerr << "SUB ";
+                            debug_log << "SUB ";
                             set_register(r_type.rd, rs1 - rs2);
                             break;
                         }
@@ -468,7 +1153,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                         */
                         default:
                         {
-                            assert(false);
+                            throw GuestFault(GuestFault::Kind::illegal_instruction, inst);
                         }
                     }
 
@@ -483,7 +1168,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     const uint8_t shamt = rs2 & 0b11111;
                     set_register(r_type.rd, rs1 << shamt);
 
-                    std::cerr << "SLL ";
+                    debug_log << "SLL ";
                     break;
                 }
                 case 0b010:
@@ -495,7 +1180,7 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     */
 
                     set_register(r_type.rd, (int32_t)rs1 < (int32_t)rs2);
-                    std::cerr << "SLT ";
+                    debug_log << "SLT ";
                     break;
                 }
                 case 0b011:
@@ -507,12 +1192,12 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     */
 
                     set_register(r_type.rd, rs1 < rs2);
-                    std::cerr << "SLTU ";
+                    debug_log << "SLTU ";
                     break;
                 }
                 case 0b100:
                 {
-                    std::cerr << "XOR ";
+                    debug_log << "XOR ";
                     set_register(r_type.rd, rs1 ^ rs2);
                     break;
                 }
@@ -524,13 +1209,13 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                     {
                         case 0b0000000:
                         {
-                            std::cerr << "SRL ";
+                            debug_log << "SRL ";
                             set_register(r_type.rd, rs1 >> shamt);
                             break;
                         }
                         case 0b0100000:
                         {
-                            std::cerr << "SRA ";
+                            debug_log << "SRA ";
                             set_register(r_type.rd, (int32_t)rs1 >> shamt);
                             break;
                         }
@@ -539,26 +1224,40 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                 }
                 case 0b110:
                 {
-                    std::cerr << "OR ";
+                    debug_log << "OR ";
                     set_register(r_type.rd, rs1 | rs2);
                     break;
                 }
                 case 0b111:
                 {
-                    std::cerr << "AND ";
+                    debug_log << "AND ";
                     set_register(r_type.rd, rs1 & rs2);
                     break;
                 }
             }
 
-            std::cerr << r_type << '\n';
+            debug_log << r_type << '\n';
             break;
         }
 
         case 0b0001111:
         {
-            std::cerr << "FENCE\n";
-            throw std::invalid_argument("Unsupported FENCE");
+            /*
+                FENCE orders memory accesses between harts and devices. With a single hart executing
+                in program order it has no observable effect.
+            */
+            debug_log << "FENCE\n";
+            break;
+        }
+        case 0b1010111: // OP-V
+        case 0b0000111: // LOAD-FP, the vector loads
+        case 0b0100111: // STORE-FP, the vector stores
+        {
+            const std::optional<uint32_t> rd_value = vector_unit.execute(inst, registers, mmu);
+            if (rd_value)
+            {
+                set_register((inst >> 7) & 0b11111, *rd_value);
+            }
             break;
         }
         case 0b1110011:
@@ -566,6 +1265,26 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
             const Itype i_type = Itype::from(inst);
             const uint32_t funct12 = i_type.imm;
 
+            if (i_type.func3 != 0)
+            {
+                /*
+                    Zicsr. The vector unit's CSRs are the only ones and they are read only: csrrw
+                    and a set or clear with a source other than x0 / 0 are illegal on them.
+                    Accesses to any other CSR are ignored and leave rd alone.
+                */
+                uint32_t value;
+                const bool writes = (i_type.func3 & 0b011) == 0b001 || i_type.rs1 != 0;
+                if (vector_unit.read_csr(funct12 & 0xfff, value))
+                {
+                    if (writes)
+                    {
+                        throw GuestFault(GuestFault::Kind::illegal_instruction, inst);
+                    }
+                    set_register(i_type.rd, value);
+                }
+                break;
+            }
+
             switch (funct12)
             {
                 case 0b000000000000:
@@ -576,31 +1295,48 @@ void RiscvEmulator::execute_instruction(uint32_t inst)
                         .arg2 = get_register(RegisterName::a1),
                         .arg3 = get_register(RegisterName::a2),
                         .arg4 = get_register(RegisterName::a3),
-                        .arg5 = get_register(RegisterName::a4)};
+                        .arg5 = get_register(RegisterName::a4),
+                        .arg6 = get_register(RegisterName::a5)};
 
-                    std::cerr << "ECALL " << std::dec << syscall.call_num << std::endl;
+                    debug_log << "ECALL " << std::dec << syscall.call_num << std::endl;
+                    linux_emulator.get_clock().set_instructions_retired(instructions_retired);
                     auto [ret, exit] = linux_emulator.handle_syscall(syscall);
                     if (exit)
                     {
                         running = false;
                         break;
                     }
+                    if (linux_emulator.is_blocked())
+                    {
+                        // not retired, the pc stays on the ECALL and run_for issues it again
+                        running = false;
+                        skip_pc_update = true;
+                        --instructions_retired;
+                        break;
+                    }
 
                     set_register(RegisterName::a0, ret);
+                    if (heap_profiler != nullptr && syscall.call_num == 214) // brk
+                    {
+                        heap_profiler->on_brk(instructions_retired, mmu.get_brk_alloc());
+                    }
+                    if (heap_profiler != nullptr && syscall.call_num == 222) // mmap
+                    {
+                        heap_profiler->on_mmap(instructions_retired, mmu.get_mapping_floor(), mmu.size());
+                    }
                     break;
                 }
                 case 000000000001:
                 {
-                    std::cout << "EBREAK\n";
-                    throw std::invalid_argument("Unsupported EBREAK");
-                    break;
+                    debug_log << "EBREAK\n";
+                    throw GuestFault(GuestFault::Kind::breakpoint, inst);
                 }
             }
             break;
         }
         default:
         {
-            throw std::invalid_argument("Unknown opcode");
+            throw GuestFault(GuestFault::Kind::illegal_instruction, inst);
         }
     }
 }
@@ -1,20 +1,164 @@
 #pragma once
 
+#include "../aot/aot-image.hpp"
+#include "../checkpoint/checkpoint-stream.hpp"
+#include "../debug-log.hpp"
+#include "../fuzzer/coverage-map.hpp"
+#include "../guest-fault.hpp"
+#include "../heap-profiler/heap-profiler.hpp"
+#include "../libc-intercepts/libc-intercepts.hpp"
+#include "../linux-emulator/initial-stack.hpp"
 #include "../linux-emulator/linux-emulator.hpp"
+#include "../metrics/metrics.hpp"
 #include "../mmu/mmu.hpp"
+#include "../perf-model/timing-model.hpp"
+#include "../trace/trace-writer.hpp"
+#include "decode-cache.hpp"
+#include "decoder.hpp"
+#include "jump-predictor.hpp"
+#include "vector-unit.hpp"
+#include <array>
+#include <cassert>
 #include <cstdint>
+#include <memory>
+#include <ostream>
+
+#ifdef RISCV_EMULATOR_PERF_MODEL
+#include "../perf-model/perf-model.hpp"
+#endif
 
 class RiscvEmulator
 {
   public:
     RiscvEmulator(Mmu &mmu) : mmu(mmu), registers(), linux_emulator(mmu) {}
 
+    /*
+        Continues from the architectural state of parent on mmu, usually parent's Mmu::fork().
+        Observers, the syscall log and libc intercepts are per instance and start detached,
+        so the two emulators can run on different threads.
+    */
+    RiscvEmulator(const RiscvEmulator &parent, Mmu &mmu);
+
+    // Takes over the architectural state of snapshot, typically the emulator this one was forked from
+    void restore(const RiscvEmulator &snapshot);
+
+    // Registers, pc, the retired instruction count, the vector unit, a pending syscall and the Linux
+    // emulator's state, memory is saved by the Mmu
+    void save_state(CheckpointWriter &writer) const;
+
+    void load_state(CheckpointReader &reader);
+
+    static constexpr uint32_t default_stack_size = 1024 * 1024 * 2;
+
+    // Sets up pc and stack, then runs until the guest exits
     void run(uint32_t entry_point);
 
-  private:
-    uint32_t fetch_instruction() const;
+    // Places a stack of stack_size bytes below the loaded image when it fits there, above it
+    // otherwise, and builds the initial process stack on it. Throws std::invalid_argument when
+    // guest memory is too small.
+    void start(uint32_t entry_point, const InitialStack &initial_stack = {}, uint32_t stack_size = default_stack_size);
 
-    void execute_instruction(uint32_t inst);
+    // Continues a stopped guest at pc, registers and stack are left as they are
+    void resume(uint32_t pc)
+    {
+        set_pc(pc);
+        running = true;
+    }
+
+    // Executes a single instruction on the reference interpreter
+    void step();
+
+    // Executes at most max_instructions, returns how many were executed.
+    // A GuestFault stops the guest and is rethrown with the pc of the faulting instruction.
+    uint64_t run_for(uint64_t max_instructions);
+
+    bool is_running() const
+    {
+        return running;
+    }
+
+    uint64_t get_instructions_retired() const
+    {
+        return instructions_retired;
+    }
+
+    LinuxEmulator &get_linux_emulator()
+    {
+        return linux_emulator;
+    }
+
+    // Replaces the vector unit by an empty one of vlen bits per register, see VectorUnit
+    void set_vlen(uint32_t vlen)
+    {
+        vector_unit = VectorUnit(vlen);
+    }
+
+    void set_trace_writer(TraceWriter *writer)
+    {
+        trace_writer = writer;
+    }
+
+    void set_timing_model(TimingModel *model)
+    {
+        timing_model = model;
+    }
+
+    // Edges are recorded by control transfer instructions only, straight line code is not instrumented
+    void set_coverage_map(CoverageMap *map)
+    {
+        coverage_map = map;
+    }
+
+    // The fast path takes decoded instructions inside the translated text from image, the decode cache serves the rest
+    void set_aot_image(std::shared_ptr<const AotImage> image)
+    {
+        aot_image = std::move(image);
+    }
+
+    // Counts into slot on either interpreter, the syscall counters come from the Linux emulator
+    void set_metrics(MetricsSlot *slot)
+    {
+        metrics = slot;
+        published_retired = instructions_retired;
+        linux_emulator.set_metrics(slot);
+    }
+
+    // Watches allocator entry points and returns, which keeps execution on the reference interpreter
+    void set_heap_profiler(HeapProfiler *profiler)
+    {
+        heap_profiler = profiler;
+    }
+
+    // The decode cache fast path is used by run_for whenever no per-instruction observer is attached
+    void set_decode_cache_enabled(bool enabled)
+    {
+        decode_cache_enabled = enabled;
+    }
+
+    void set_fusion_enabled(bool enabled)
+    {
+        fusion_enabled = enabled;
+    }
+
+    void report_fusion_stats(std::ostream &out) const;
+
+    // Hit rates of the return address stack and the indirect jump target cache of the fast path
+    void report_jump_stats(std::ostream &out) const;
+
+    // Intercepted entry points are resolved while decoding, so previously decoded instructions are dropped
+    void set_libc_intercepts(LibcIntercepts *intercepts)
+    {
+        libc_intercepts = intercepts;
+        decode_cache.clear();
+        jump_predictor.clear();
+    }
+
+#ifdef RISCV_EMULATOR_PERF_MODEL
+    void set_perf_model(PerfModel *model)
+    {
+        perf_model = model;
+    }
+#endif
 
     enum class RegisterName
     {
@@ -52,16 +196,21 @@ class RiscvEmulator
         t6    // x31 t6 Temporary
     };
 
+    // Any value is accepted, a pc outside guest memory faults on the next fetch
     void set_pc(uint32_t virt_addr)
     {
-        assert(virt_addr < mmu.size());
         registers[32] = virt_addr;
     }
 
     void set_register(uint8_t index, uint32_t value)
     {
-        assert(index > 0 && index <= 32);
-        std::cerr << "Setting register x" << std::dec << (uint16_t)index << " = " << value << '\n';
+        assert(index < 32);
+        if (index == (uint8_t)RegisterName::zero)
+        {
+            // x0 is hard-wired to zero, writes to it are discarded
+            return;
+        }
+        debug_log << "Setting register x" << std::dec << (uint16_t)index << " = " << value << '\n';
         registers[index] = value;
     }
 
@@ -86,15 +235,118 @@ class RiscvEmulator
         return registers[32];
     }
 
+  private:
+    uint32_t fetch_instruction() const;
+
+    void execute_instruction(uint32_t inst);
+
+    bool fast_path_available() const;
+
+    // The translated or cached entry for pc, its tag may belong to another pc
+    const DecodeCache::Entry *entry_for(uint32_t pc);
+
+    void predict_jalr(uint32_t pc, const DecodedInstruction &decoded, uint32_t return_pc, uint32_t target);
+
+    // Runs up to max_instructions on the fastest interpreter the attached observers allow
+    void run_slice(uint64_t max_instructions);
+
+    void publish_retired();
+
+    // Executes one decode cache entry, a fused pair only when budget allows two instructions, returns how many retired
+    uint32_t step_decoded(uint64_t budget);
+
+    void execute_decoded(const DecodedInstruction &decoded, uint32_t inst);
+
+    // Returns true when the routine starting at pc ran on the host and pc is already back at the caller
+    bool intercept_libc(uint32_t pc);
+
+    void trace_instruction(uint32_t pc, uint32_t inst);
+
+    void cover_edge(uint32_t target)
+    {
+        if (coverage_map != nullptr)
+        {
+            coverage_map->edge(target);
+        }
+    }
+
+    void record_mem_access(uint32_t addr, uint32_t value)
+    {
+        mem_accessed = true;
+        last_mem_addr = addr;
+        last_mem_value = value;
+        model_data_access(addr);
+    }
+
+    // Performance model hooks, they compile to nothing without RISCV_EMULATOR_PERF_MODEL
+
+    void model_fetch(uint32_t pc) const
+    {
+#ifdef RISCV_EMULATOR_PERF_MODEL
+        if (perf_model != nullptr)
+        {
+            perf_model->fetch(pc);
+        }
+#endif
+    }
+
+    void model_data_access(uint32_t addr) const
+    {
+#ifdef RISCV_EMULATOR_PERF_MODEL
+        if (perf_model != nullptr)
+        {
+            perf_model->data_access(get_pc(), addr);
+        }
+#endif
+    }
+
+    void model_branch(bool taken) const
+    {
+#ifdef RISCV_EMULATOR_PERF_MODEL
+        if (perf_model != nullptr)
+        {
+            perf_model->branch(get_pc(), taken);
+        }
+#endif
+    }
+
     void next_pc()
     {
         registers[32] += sizeof(uint32_t);
     }
 
   private:
+    static constexpr uint64_t metrics_slice = 1 << 20;
+
     bool skip_pc_update = false;
     Mmu &mmu;
     uint32_t registers[33];
     LinuxEmulator linux_emulator;
+    VectorUnit vector_unit;
     bool running = true;
+    uint64_t instructions_retired = 0;
+
+    DecodeCache decode_cache;
+    std::shared_ptr<const AotImage> aot_image;
+    JumpPredictor jump_predictor; // points into decode_cache, so it is neither copied nor kept across clears
+    bool decode_cache_enabled = true;
+    bool fusion_enabled = true;
+    std::array<uint64_t, (size_t)Op::addi_branch - (size_t)Op::lui_addi + 1> fusion_counts = {};
+
+    LibcIntercepts *libc_intercepts = nullptr;
+    CoverageMap *coverage_map = nullptr;
+    HeapProfiler *heap_profiler = nullptr;
+    MetricsSlot *metrics = nullptr;
+    uint64_t published_retired = 0; // instructions_retired when it was last added to metrics
+
+    TraceWriter *trace_writer = nullptr;
+    bool mem_accessed = false;
+    uint32_t last_mem_addr = 0;
+    uint32_t last_mem_value = 0;
+
+    TimingModel *timing_model = nullptr;
+
+#ifdef RISCV_EMULATOR_PERF_MODEL
+    PerfModel *perf_model = nullptr;
+#endif
 };
\ No newline at end of file
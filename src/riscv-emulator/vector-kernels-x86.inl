@@ -0,0 +1,432 @@
+// The SIMD kernels, included by vector-kernels.cpp once per instruction set inside a namespace that is
+// compiled for it. The namespace provides Vec, load, store, movemask16, movemask32 and the macros
+// V(name), which names an intrinsic over lanes, and VSI(name), which names one over the whole register.
+
+template <typename T>
+Vec splat(T value)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(set1_epi8)((char)value);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(set1_epi16)((short)value);
+    }
+    else
+    {
+        return V(set1_epi32)((int)value);
+    }
+}
+
+template <typename T>
+Vec add(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(add_epi8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(add_epi16)(a, b);
+    }
+    else
+    {
+        return V(add_epi32)(a, b);
+    }
+}
+
+template <typename T>
+Vec sub(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(sub_epi8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(sub_epi16)(a, b);
+    }
+    else
+    {
+        return V(sub_epi32)(a, b);
+    }
+}
+
+template <typename T>
+Vec mul(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        // no byte multiply, the even and odd bytes are multiplied as words
+        const Vec even = V(mullo_epi16)(a, b);
+        const Vec odd = V(mullo_epi16)(V(srli_epi16)(a, 8), V(srli_epi16)(b, 8));
+        return VSI(or)(VSI(and)(even, V(set1_epi16)(0xff)), V(slli_epi16)(odd, 8));
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(mullo_epi16)(a, b);
+    }
+    else
+    {
+        return V(mullo_epi32)(a, b);
+    }
+}
+
+template <typename T>
+Vec min(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(min_epi8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(min_epi16)(a, b);
+    }
+    else
+    {
+        return V(min_epi32)(a, b);
+    }
+}
+
+template <typename T>
+Vec minu(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(min_epu8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(min_epu16)(a, b);
+    }
+    else
+    {
+        return V(min_epu32)(a, b);
+    }
+}
+
+template <typename T>
+Vec max(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(max_epi8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(max_epi16)(a, b);
+    }
+    else
+    {
+        return V(max_epi32)(a, b);
+    }
+}
+
+template <typename T>
+Vec maxu(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(max_epu8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(max_epu16)(a, b);
+    }
+    else
+    {
+        return V(max_epu32)(a, b);
+    }
+}
+
+template <typename T>
+Vec cmpeq(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(cmpeq_epi8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(cmpeq_epi16)(a, b);
+    }
+    else
+    {
+        return V(cmpeq_epi32)(a, b);
+    }
+}
+
+template <typename T>
+Vec cmpgt(Vec a, Vec b)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return V(cmpgt_epi8)(a, b);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return V(cmpgt_epi16)(a, b);
+    }
+    else
+    {
+        return V(cmpgt_epi32)(a, b);
+    }
+}
+
+// One bit per element of a compare result
+template <typename T>
+uint32_t movemask(Vec lanes)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return (uint32_t)V(movemask_epi8)(lanes);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        return movemask16(lanes);
+    }
+    else
+    {
+        return movemask32(lanes);
+    }
+}
+
+// Runs f over the elements that fill whole host registers, returns how many that were
+template <typename T, typename F>
+uint32_t lanes2(uint8_t *vd, const uint8_t *vs2, const uint8_t *vs1, uint32_t count, F f)
+{
+    constexpr uint32_t per_vec = sizeof(Vec) / sizeof(T);
+    uint32_t i = 0;
+    for (; i + per_vec <= count; i += per_vec)
+    {
+        const uint32_t offset = i * sizeof(T);
+        store(vd + offset, f(load(vs2 + offset), load(vs1 + offset)));
+    }
+    return i;
+}
+
+// Like lanes2, f also gets the old destination
+template <typename T, typename F>
+uint32_t lanes3(uint8_t *vd, const uint8_t *vs2, const uint8_t *vs1, uint32_t count, F f)
+{
+    constexpr uint32_t per_vec = sizeof(Vec) / sizeof(T);
+    uint32_t i = 0;
+    for (; i + per_vec <= count; i += per_vec)
+    {
+        const uint32_t offset = i * sizeof(T);
+        store(vd + offset, f(load(vs2 + offset), load(vs1 + offset), load(vd + offset)));
+    }
+    return i;
+}
+
+template <typename T>
+void alu_elements(VectorAlu op, uint8_t *vd, const uint8_t *vs2, const uint8_t *vs1, uint32_t count)
+{
+    uint32_t done = 0;
+    switch (op)
+    {
+        case VectorAlu::add:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return add<T>(a, b); });
+            break;
+        case VectorAlu::sub:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return sub<T>(a, b); });
+            break;
+        case VectorAlu::rsub:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return sub<T>(b, a); });
+            break;
+        case VectorAlu::minu:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return minu<T>(a, b); });
+            break;
+        case VectorAlu::min:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return min<T>(a, b); });
+            break;
+        case VectorAlu::maxu:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return maxu<T>(a, b); });
+            break;
+        case VectorAlu::max:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return max<T>(a, b); });
+            break;
+        case VectorAlu::and_:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return VSI(and)(a, b); });
+            break;
+        case VectorAlu::or_:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return VSI(or)(a, b); });
+            break;
+        case VectorAlu::xor_:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return VSI(xor)(a, b); });
+            break;
+        case VectorAlu::mul:
+            done = lanes2<T>(vd, vs2, vs1, count, [](Vec a, Vec b) { return mul<T>(a, b); });
+            break;
+        case VectorAlu::macc:
+            done = lanes3<T>(vd, vs2, vs1, count, [](Vec a, Vec b, Vec d) { return add<T>(d, mul<T>(b, a)); });
+            break;
+        case VectorAlu::nmsac:
+            done = lanes3<T>(vd, vs2, vs1, count, [](Vec a, Vec b, Vec d) { return sub<T>(d, mul<T>(b, a)); });
+            break;
+        case VectorAlu::madd:
+            done = lanes3<T>(vd, vs2, vs1, count, [](Vec a, Vec b, Vec d) { return add<T>(mul<T>(b, d), a); });
+            break;
+        case VectorAlu::nmsub:
+            done = lanes3<T>(vd, vs2, vs1, count, [](Vec a, Vec b, Vec d) { return sub<T>(a, mul<T>(b, d)); });
+            break;
+        default:
+            break;
+    }
+
+    for (uint32_t i = done; i < count; ++i)
+    {
+        store_element(vd, i, vector_alu<T>(op, load_element<T>(vs2, i), load_element<T>(vs1, i), load_element<T>(vd, i)));
+    }
+}
+
+// Writes count bits of a host register's compare to the mask, first is a multiple of count
+inline void write_mask_bits(uint8_t *mask, uint32_t first, uint32_t bits, uint32_t count)
+{
+    if (count < 8)
+    {
+        uint8_t &byte = mask[first / 8];
+        const uint32_t shift = first % 8;
+        const uint32_t field = ((1u << count) - 1) << shift;
+        byte = (uint8_t)((byte & ~field) | (bits << shift));
+        return;
+    }
+    memcpy(mask + first / 8, &bits, count / 8);
+}
+
+template <typename T>
+void compare_elements(VectorCompare op, uint8_t *mask, const uint8_t *vs2, const uint8_t *vs1, uint32_t count)
+{
+    // unsigned compares are signed ones with the sign bits flipped, le is not gt
+    constexpr uint32_t per_vec = sizeof(Vec) / sizeof(T);
+    constexpr uint32_t all_bits = per_vec == 32 ? UINT32_MAX : (1u << per_vec) - 1;
+    const bool is_unsigned = op == VectorCompare::ltu || op == VectorCompare::leu || op == VectorCompare::gtu;
+    const Vec bias = is_unsigned ? splat<T>((T)((T)1 << (sizeof(T) * 8 - 1))) : VSI(setzero)();
+    const bool swap = op == VectorCompare::lt || op == VectorCompare::ltu;
+    const uint32_t invert = op == VectorCompare::ne || op == VectorCompare::le || op == VectorCompare::leu ? all_bits : 0;
+    const bool equality = op == VectorCompare::eq || op == VectorCompare::ne;
+
+    uint32_t i = 0;
+    for (; i + per_vec <= count; i += per_vec)
+    {
+        const uint32_t offset = i * sizeof(T);
+        Vec a = VSI(xor)(load(vs2 + offset), bias);
+        Vec b = VSI(xor)(load(vs1 + offset), bias);
+        if (swap)
+        {
+            std::swap(a, b);
+        }
+        const Vec result = equality ? cmpeq<T>(a, b) : cmpgt<T>(a, b);
+        write_mask_bits(mask, i, movemask<T>(result) ^ invert, per_vec);
+    }
+
+    for (; i < count; ++i)
+    {
+        const uint8_t bit = 1 << (i % 8);
+        if (vector_compare<T>(op, load_element<T>(vs2, i), load_element<T>(vs1, i)))
+        {
+            mask[i / 8] |= bit;
+        }
+        else
+        {
+            mask[i / 8] &= ~bit;
+        }
+    }
+}
+
+template <typename T>
+T reduce_elements(VectorReduction op, const uint8_t *vs2, uint32_t count, T accumulator)
+{
+    constexpr uint32_t per_vec = sizeof(Vec) / sizeof(T);
+    uint32_t i = 0;
+    if (count >= per_vec)
+    {
+        Vec folded = load(vs2);
+        for (i = per_vec; i + per_vec <= count; i += per_vec)
+        {
+            const Vec next = load(vs2 + i * sizeof(T));
+            switch (op)
+            {
+                case VectorReduction::sum:
+                    folded = add<T>(folded, next);
+                    break;
+                case VectorReduction::and_:
+                    folded = VSI(and)(folded, next);
+                    break;
+                case VectorReduction::or_:
+                    folded = VSI(or)(folded, next);
+                    break;
+                case VectorReduction::xor_:
+                    folded = VSI(xor)(folded, next);
+                    break;
+                case VectorReduction::minu:
+                    folded = minu<T>(folded, next);
+                    break;
+                case VectorReduction::min:
+                    folded = min<T>(folded, next);
+                    break;
+                case VectorReduction::maxu:
+                    folded = maxu<T>(folded, next);
+                    break;
+                case VectorReduction::max:
+                    folded = max<T>(folded, next);
+                    break;
+            }
+        }
+
+        uint8_t lanes[sizeof(Vec)];
+        store(lanes, folded);
+        for (uint32_t lane = 0; lane < per_vec; ++lane)
+        {
+            accumulator = vector_reduce<T>(op, accumulator, load_element<T>(lanes, lane));
+        }
+    }
+
+    for (; i < count; ++i)
+    {
+        accumulator = vector_reduce<T>(op, accumulator, load_element<T>(vs2, i));
+    }
+    return accumulator;
+}
+
+void alu(VectorAlu op, uint32_t sew_bytes, uint8_t *vd, const uint8_t *vs2, const uint8_t *vs1, uint32_t count)
+{
+    switch (sew_bytes)
+    {
+        case 1:
+            return alu_elements<uint8_t>(op, vd, vs2, vs1, count);
+        case 2:
+            return alu_elements<uint16_t>(op, vd, vs2, vs1, count);
+        default:
+            return alu_elements<uint32_t>(op, vd, vs2, vs1, count);
+    }
+}
+
+void compare(VectorCompare op, uint32_t sew_bytes, uint8_t *mask, const uint8_t *vs2, const uint8_t *vs1,
+             uint32_t count)
+{
+    switch (sew_bytes)
+    {
+        case 1:
+            return compare_elements<uint8_t>(op, mask, vs2, vs1, count);
+        case 2:
+            return compare_elements<uint16_t>(op, mask, vs2, vs1, count);
+        default:
+            return compare_elements<uint32_t>(op, mask, vs2, vs1, count);
+    }
+}
+
+uint32_t reduce(VectorReduction op, uint32_t sew_bytes, const uint8_t *vs2, uint32_t count, uint32_t accumulator)
+{
+    switch (sew_bytes)
+    {
+        case 1:
+            return reduce_elements<uint8_t>(op, vs2, count, (uint8_t)accumulator);
+        case 2:
+            return reduce_elements<uint16_t>(op, vs2, count, (uint16_t)accumulator);
+        default:
+            return reduce_elements<uint32_t>(op, vs2, count, accumulator);
+    }
+}
@@ -0,0 +1,207 @@
+#include "vector-kernels.hpp"
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+template <typename T>
+static void portable_alu_elements(VectorAlu op, uint8_t *vd, const uint8_t *vs2, const uint8_t *vs1, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        store_element(vd, i, vector_alu<T>(op, load_element<T>(vs2, i), load_element<T>(vs1, i), load_element<T>(vd, i)));
+    }
+}
+
+static void portable_alu(VectorAlu op, uint32_t sew_bytes, uint8_t *vd, const uint8_t *vs2, const uint8_t *vs1,
+                         uint32_t count)
+{
+    switch (sew_bytes)
+    {
+        case 1:
+            return portable_alu_elements<uint8_t>(op, vd, vs2, vs1, count);
+        case 2:
+            return portable_alu_elements<uint16_t>(op, vd, vs2, vs1, count);
+        default:
+            return portable_alu_elements<uint32_t>(op, vd, vs2, vs1, count);
+    }
+}
+
+template <typename T>
+static void portable_compare_elements(VectorCompare op, uint8_t *mask, const uint8_t *vs2, const uint8_t *vs1,
+                                      uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const uint8_t bit = 1 << (i % 8);
+        if (vector_compare<T>(op, load_element<T>(vs2, i), load_element<T>(vs1, i)))
+        {
+            mask[i / 8] |= bit;
+        }
+        else
+        {
+            mask[i / 8] &= ~bit;
+        }
+    }
+}
+
+static void portable_compare(VectorCompare op, uint32_t sew_bytes, uint8_t *mask, const uint8_t *vs2,
+                             const uint8_t *vs1, uint32_t count)
+{
+    switch (sew_bytes)
+    {
+        case 1:
+            return portable_compare_elements<uint8_t>(op, mask, vs2, vs1, count);
+        case 2:
+            return portable_compare_elements<uint16_t>(op, mask, vs2, vs1, count);
+        default:
+            return portable_compare_elements<uint32_t>(op, mask, vs2, vs1, count);
+    }
+}
+
+template <typename T>
+static T portable_reduce_elements(VectorReduction op, const uint8_t *vs2, uint32_t count, T accumulator)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        accumulator = vector_reduce<T>(op, accumulator, load_element<T>(vs2, i));
+    }
+    return accumulator;
+}
+
+static uint32_t portable_reduce(VectorReduction op, uint32_t sew_bytes, const uint8_t *vs2, uint32_t count,
+                                uint32_t accumulator)
+{
+    switch (sew_bytes)
+    {
+        case 1:
+            return portable_reduce_elements<uint8_t>(op, vs2, count, (uint8_t)accumulator);
+        case 2:
+            return portable_reduce_elements<uint16_t>(op, vs2, count, (uint16_t)accumulator);
+        default:
+            return portable_reduce_elements<uint32_t>(op, vs2, count, accumulator);
+    }
+}
+
+static const VectorKernels portable_kernels{"portable", portable_alu, portable_compare, portable_reduce};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Each instruction set is a namespace compiled with its target, the CPU is checked before it runs
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+namespace sse41
+{
+using Vec = __m128i;
+#define V(name) _mm_##name
+#define VSI(name) _mm_##name##_si128
+
+inline Vec load(const uint8_t *bytes)
+{
+    return _mm_loadu_si128((const Vec *)bytes);
+}
+
+inline void store(uint8_t *bytes, Vec value)
+{
+    _mm_storeu_si128((Vec *)bytes, value);
+}
+
+inline uint32_t movemask16(Vec lanes)
+{
+    return _mm_movemask_epi8(_mm_packs_epi16(lanes, _mm_setzero_si128()));
+}
+
+inline uint32_t movemask32(Vec lanes)
+{
+    return _mm_movemask_ps(_mm_castsi128_ps(lanes));
+}
+
+#include "vector-kernels-x86.inl"
+
+#undef V
+#undef VSI
+
+const VectorKernels kernels{"sse4.1", alu, compare, reduce};
+} // namespace sse41
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+// __m256i arguments only pass between functions of this namespace, all compiled for AVX2
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+namespace avx2
+{
+using Vec = __m256i;
+#define V(name) _mm256_##name
+#define VSI(name) _mm256_##name##_si256
+
+inline Vec load(const uint8_t *bytes)
+{
+    return _mm256_loadu_si256((const Vec *)bytes);
+}
+
+inline void store(uint8_t *bytes, Vec value)
+{
+    _mm256_storeu_si256((Vec *)bytes, value);
+}
+
+// packs works within 128-bit lanes, elements 8 to 15 come out in bits 16 to 23
+inline uint32_t movemask16(Vec lanes)
+{
+    const uint32_t bits = _mm256_movemask_epi8(_mm256_packs_epi16(lanes, _mm256_setzero_si256()));
+    return (bits & 0xff) | ((bits >> 8) & 0xff00);
+}
+
+inline uint32_t movemask32(Vec lanes)
+{
+    return _mm256_movemask_ps(_mm256_castsi256_ps(lanes));
+}
+
+#include "vector-kernels-x86.inl"
+
+#undef V
+#undef VSI
+
+const VectorKernels kernels{"avx2", alu, compare, reduce};
+} // namespace avx2
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+#endif
+
+const VectorKernels &VectorKernels::host()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const VectorKernels &best = __builtin_cpu_supports("avx2")     ? avx2::kernels
+                                       : __builtin_cpu_supports("sse4.1") ? sse41::kernels
+                                                                          : portable_kernels;
+    return best;
+#else
+    return portable_kernels;
+#endif
+}
+
+const VectorKernels &VectorKernels::portable()
+{
+    return portable_kernels;
+}
+
+std::vector<const VectorKernels *> VectorKernels::supported()
+{
+    std::vector<const VectorKernels *> tables{&portable_kernels};
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        tables.push_back(&sse41::kernels);
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        tables.push_back(&avx2::kernels);
+    }
+#endif
+    return tables;
+}
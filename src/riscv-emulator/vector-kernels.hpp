@@ -0,0 +1,237 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Element wise operations, b is vs1, rs1 or the immediate and d the old destination element
+enum class VectorAlu : uint8_t
+{
+    add,
+    sub,
+    rsub,
+    minu,
+    min,
+    maxu,
+    max,
+    and_,
+    or_,
+    xor_,
+    sll,
+    srl,
+    sra,
+    mul,
+    mulh,
+    mulhu,
+    mulhsu,
+    divu,
+    div,
+    remu,
+    rem,
+    macc,
+    nmsac,
+    madd,
+    nmsub
+};
+
+// Compares of vs2 against b that produce a mask
+enum class VectorCompare : uint8_t
+{
+    eq,
+    ne,
+    ltu,
+    lt,
+    leu,
+    le,
+    gtu,
+    gt
+};
+
+enum class VectorReduction : uint8_t
+{
+    sum,
+    and_,
+    or_,
+    xor_,
+    minu,
+    min,
+    maxu,
+    max
+};
+
+// Elements live in the register file as raw bytes, they are accessed through memcpy
+template <typename T>
+T load_element(const uint8_t *base, uint32_t index)
+{
+    T value;
+    memcpy(&value, base + index * sizeof(T), sizeof(T));
+    return value;
+}
+
+template <typename T>
+void store_element(uint8_t *base, uint32_t index, T value)
+{
+    memcpy(base + index * sizeof(T), &value, sizeof(T));
+}
+
+// One element of an element wise operation, T is the unsigned type of SEW bits
+template <typename T>
+T vector_alu(VectorAlu op, T a, T b, T d)
+{
+    using S = std::make_signed_t<T>;
+    constexpr uint32_t bits = sizeof(T) * 8;
+    constexpr S min_signed = (S)((T)1 << (bits - 1));
+    const S sa = (S)a;
+    const S sb = (S)b;
+
+    // products are formed in uint32_t, uint16_t operands would promote to a signed int and overflow
+    switch (op)
+    {
+        case VectorAlu::add:
+            return a + b;
+        case VectorAlu::sub:
+            return a - b;
+        case VectorAlu::rsub:
+            return b - a;
+        case VectorAlu::minu:
+            return a < b ? a : b;
+        case VectorAlu::min:
+            return sa < sb ? a : b;
+        case VectorAlu::maxu:
+            return a > b ? a : b;
+        case VectorAlu::max:
+            return sa > sb ? a : b;
+        case VectorAlu::and_:
+            return a & b;
+        case VectorAlu::or_:
+            return a | b;
+        case VectorAlu::xor_:
+            return a ^ b;
+        case VectorAlu::sll:
+            return (T)((uint32_t)a << (b & (bits - 1)));
+        case VectorAlu::srl:
+            return a >> (b & (bits - 1));
+        case VectorAlu::sra:
+            return (T)(sa >> (b & (bits - 1)));
+        case VectorAlu::mul:
+            return (T)((uint32_t)a * b);
+        case VectorAlu::mulh:
+            return (T)(((int64_t)sa * sb) >> bits);
+        case VectorAlu::mulhu:
+            return (T)(((uint64_t)a * b) >> bits);
+        case VectorAlu::mulhsu:
+            return (T)(((int64_t)sa * (int64_t)b) >> bits);
+        case VectorAlu::divu:
+            return b == 0 ? (T)~(T)0 : a / b;
+        case VectorAlu::div:
+            if (b == 0)
+            {
+                return (T)~(T)0;
+            }
+            return sa == min_signed && sb == -1 ? a : (T)(sa / sb);
+        case VectorAlu::remu:
+            return b == 0 ? a : a % b;
+        case VectorAlu::rem:
+            if (b == 0)
+            {
+                return a;
+            }
+            return sa == min_signed && sb == -1 ? 0 : (T)(sa % sb);
+        case VectorAlu::macc:
+            return (T)(d + (uint32_t)b * a);
+        case VectorAlu::nmsac:
+            return (T)(d - (uint32_t)b * a);
+        case VectorAlu::madd:
+            return (T)((uint32_t)b * d + a);
+        case VectorAlu::nmsub:
+            return (T)(a - (uint32_t)b * d);
+    }
+    return 0;
+}
+
+template <typename T>
+bool vector_compare(VectorCompare op, T a, T b)
+{
+    using S = std::make_signed_t<T>;
+    switch (op)
+    {
+        case VectorCompare::eq:
+            return a == b;
+        case VectorCompare::ne:
+            return a != b;
+        case VectorCompare::ltu:
+            return a < b;
+        case VectorCompare::lt:
+            return (S)a < (S)b;
+        case VectorCompare::leu:
+            return a <= b;
+        case VectorCompare::le:
+            return (S)a <= (S)b;
+        case VectorCompare::gtu:
+            return a > b;
+        case VectorCompare::gt:
+            return (S)a > (S)b;
+    }
+    return false;
+}
+
+template <typename T>
+T vector_reduce(VectorReduction op, T accumulator, T value)
+{
+    using S = std::make_signed_t<T>;
+    switch (op)
+    {
+        case VectorReduction::sum:
+            return accumulator + value;
+        case VectorReduction::and_:
+            return accumulator & value;
+        case VectorReduction::or_:
+            return accumulator | value;
+        case VectorReduction::xor_:
+            return accumulator ^ value;
+        case VectorReduction::minu:
+            return value < accumulator ? value : accumulator;
+        case VectorReduction::min:
+            return (S)value < (S)accumulator ? value : accumulator;
+        case VectorReduction::maxu:
+            return value > accumulator ? value : accumulator;
+        case VectorReduction::max:
+            return (S)value > (S)accumulator ? value : accumulator;
+    }
+    return accumulator;
+}
+
+/*
+    The loops behind the vector unit's unmasked instructions, over whole register groups.
+
+    host() picks once per process between AVX2, SSE4.1 and portable C++, by what the CPU supports.
+    The SIMD variants map each operation to the matching host instruction at full host register width
+    and finish the elements that do not fill a host register, and the operations without a host
+    instruction (shifts by element, division, the high half of products), with the portable loop.
+    Element widths are 1, 2 or 4 bytes, the emulated unit has no 64-bit elements.
+*/
+struct VectorKernels
+{
+    const char *name;
+
+    // vd[i] = op(vs2[i], vs1[i], vd[i]) for i < count
+    void (*alu)(VectorAlu op, uint32_t sew_bytes, uint8_t *vd, const uint8_t *vs2, const uint8_t *vs1,
+                uint32_t count);
+
+    // Sets bit i of mask to op(vs2[i], vs1[i]) for i < count, the rest of the last byte is clobbered
+    void (*compare)(VectorCompare op, uint32_t sew_bytes, uint8_t *mask, const uint8_t *vs2, const uint8_t *vs1,
+                    uint32_t count);
+
+    // Folds vs2[0] to vs2[count - 1] into accumulator
+    uint32_t (*reduce)(VectorReduction op, uint32_t sew_bytes, const uint8_t *vs2, uint32_t count,
+                       uint32_t accumulator);
+
+    static const VectorKernels &host();
+
+    // The reference the SIMD tables are tested against
+    static const VectorKernels &portable();
+
+    // Every table this CPU can run, portable first
+    static std::vector<const VectorKernels *> supported();
+};
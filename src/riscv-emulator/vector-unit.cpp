@@ -0,0 +1,866 @@
+#include "vector-unit.hpp"
+#include "../guest-fault.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+// OP-V funct3, the operand categories
+static constexpr uint32_t opivv = 0b000;
+static constexpr uint32_t opmvv = 0b010;
+static constexpr uint32_t opivi = 0b011;
+static constexpr uint32_t opivx = 0b100;
+static constexpr uint32_t opmvx = 0b110;
+static constexpr uint32_t opcfg = 0b111;
+
+static constexpr uint32_t csr_vstart = 0x008;
+static constexpr uint32_t csr_vl = 0xc20;
+static constexpr uint32_t csr_vtype = 0xc21;
+static constexpr uint32_t csr_vlenb = 0xc22;
+
+static bool mask_bit(const uint8_t *mask, uint32_t i)
+{
+    return (mask[i / 8] >> (i % 8)) & 1;
+}
+
+static void set_mask_bit(uint8_t *mask, uint32_t i, bool value)
+{
+    const uint8_t bit = 1 << (i % 8);
+    mask[i / 8] = value ? mask[i / 8] | bit : mask[i / 8] & ~bit;
+}
+
+// Moves size bytes between guest memory at address and a register group
+static void transfer(Mmu &mmu, uint32_t address, uint8_t *bytes, uint32_t size, bool is_store)
+{
+    if (is_store)
+    {
+        mmu.copy_from_host(address, std::span((const uint8_t *)bytes, size));
+    }
+    else
+    {
+        mmu.copy_to_host(address, std::span(bytes, size));
+    }
+}
+
+VectorUnit::VectorUnit(uint32_t vlen) : vlenb(vlen / 8), kernels(&VectorKernels::host())
+{
+    if (vlen < 32 || vlen > 4096 || !std::has_single_bit(vlen))
+    {
+        throw std::invalid_argument("VLEN must be a power of two from 32 to 4096");
+    }
+}
+
+void VectorUnit::illegal(uint32_t inst)
+{
+    throw GuestFault(GuestFault::Kind::illegal_instruction, inst);
+}
+
+std::optional<uint32_t> VectorUnit::execute(uint32_t inst, const uint32_t *x, Mmu &mmu)
+{
+    if (registers.empty())
+    {
+        // allocated on first use, guests that never touch the vector unit do not pay for it
+        registers.resize(32 * vlenb);
+        scratch.resize(16 * vlenb);
+    }
+
+    switch (inst & 0b1111111)
+    {
+        case 0b1010111:
+            return arithmetic(inst, x);
+        case 0b0000111:
+            load_store(inst, x, mmu, false);
+            return std::nullopt;
+        case 0b0100111:
+            load_store(inst, x, mmu, true);
+            return std::nullopt;
+        default:
+            illegal(inst);
+    }
+}
+
+bool VectorUnit::read_csr(uint32_t csr, uint32_t &value) const
+{
+    switch (csr)
+    {
+        case csr_vstart:
+            value = 0;
+            return true;
+        case csr_vl:
+            value = vl;
+            return true;
+        case csr_vtype:
+            value = vtype;
+            return true;
+        case csr_vlenb:
+            value = vlenb;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void VectorUnit::save_state(CheckpointWriter &writer) const
+{
+    writer.write(vlenb);
+    writer.write(vl);
+    writer.write(vtype);
+    writer.write_bytes(registers);
+}
+
+void VectorUnit::load_state(CheckpointReader &reader)
+{
+    const uint32_t saved_vlenb = reader.read<uint32_t>();
+    if (saved_vlenb != vlenb)
+    {
+        throw std::invalid_argument("Checkpoint needs VLEN " + std::to_string(saved_vlenb * 8));
+    }
+
+    vl = reader.read<uint32_t>();
+    vtype = reader.read<uint32_t>();
+    registers = reader.read_bytes();
+    if ((!registers.empty() && registers.size() != 32 * vlenb) || vl > (vtype & vill ? 0 : vlmax_of(vtype)))
+    {
+        throw std::runtime_error("Checkpoint has a corrupt vector state");
+    }
+    scratch.assign(registers.empty() ? 0 : 16 * vlenb, 0);
+}
+
+uint32_t VectorUnit::vlmax_of(uint32_t new_vtype) const
+{
+    // vta and vma are the only flags, the vill bit and anything above them is reserved
+    const uint32_t vsew = (new_vtype >> 3) & 0b111;
+    const uint32_t vlmul = new_vtype & 0b111;
+    if ((new_vtype & ~0xffu) != 0 || vsew > 2 || vlmul == 4)
+    {
+        return 0;
+    }
+
+    // fractional LMUL must leave room for one element of ELEN = 32 bits
+    const uint32_t sew = 8u << vsew;
+    const int lmul = vlmul >= 4 ? (int)vlmul - 8 : (int)vlmul;
+    if (lmul < 0 && (sew << -lmul) > 32)
+    {
+        return 0;
+    }
+
+    const uint32_t per_register = vlenb * 8 / sew;
+    return lmul >= 0 ? per_register << lmul : per_register >> -lmul;
+}
+
+uint32_t VectorUnit::set_vl(uint32_t inst, const uint32_t *x)
+{
+    const uint32_t rd = (inst >> 7) & 0b11111;
+    const uint32_t rs1 = (inst >> 15) & 0b11111;
+    uint32_t new_vtype;
+    uint32_t avl;
+    bool keep_vl = false;
+    if ((inst >> 31) == 0)
+    {
+        // vsetvli
+        new_vtype = (inst >> 20) & 0x7ff;
+    }
+    else if ((inst >> 30) == 0b11)
+    {
+        // vsetivli, rs1 is the AVL itself
+        new_vtype = (inst >> 20) & 0x3ff;
+    }
+    else if ((inst >> 25) == 0b1000000)
+    {
+        // vsetvl
+        new_vtype = x[(inst >> 20) & 0b11111];
+    }
+    else
+    {
+        illegal(inst);
+    }
+
+    if ((inst >> 30) == 0b11)
+    {
+        avl = rs1;
+    }
+    else if (rs1 != 0)
+    {
+        avl = x[rs1];
+    }
+    else
+    {
+        // rs1 = x0 asks for VLMAX, unless rd is x0 as well, which keeps vl under the new vtype
+        avl = UINT32_MAX;
+        keep_vl = rd == 0;
+    }
+
+    const uint32_t vlmax = vlmax_of(new_vtype);
+    if (vlmax == 0)
+    {
+        vtype = vill;
+        vl = 0;
+        return vl;
+    }
+
+    vtype = new_vtype;
+    vl = std::min(keep_vl ? vl : avl, vlmax);
+    return vl;
+}
+
+void VectorUnit::check_group(uint32_t inst, uint32_t reg, int emul_log2) const
+{
+    if ((vtype & vill) != 0 || (emul_log2 > 0 && reg % (1u << emul_log2) != 0))
+    {
+        illegal(inst);
+    }
+}
+
+void VectorUnit::load_store(uint32_t inst, const uint32_t *x, Mmu &mmu, bool is_store)
+{
+    const uint32_t width = (inst >> 12) & 0b111;
+    const uint32_t eew = width == 0b000 ? 1 : width == 0b101 ? 2 : width == 0b110 ? 4 : 0;
+    const uint32_t vd = (inst >> 7) & 0b11111;
+    const uint32_t lumop = (inst >> 20) & 0b11111;
+    const bool masked = ((inst >> 25) & 1) == 0;
+    const uint32_t mop = (inst >> 26) & 0b11;
+    const uint32_t mew = (inst >> 28) & 1;
+    const uint32_t nf = inst >> 29;
+    if (eew == 0 || mew != 0)
+    {
+        // 64-bit elements, or a scalar floating point load or store
+        illegal(inst);
+    }
+    const uint32_t address = x[(inst >> 15) & 0b11111];
+
+    if (mop == 0b00 && lumop == 0b01000)
+    {
+        // vl<nf>r / vs<nf>r move whole registers, whatever vtype and vl are
+        const uint32_t count = nf + 1;
+        if (masked || !std::has_single_bit(count) || vd % count != 0)
+        {
+            illegal(inst);
+        }
+        transfer(mmu, address, reg(vd), count * vlenb, is_store);
+        return;
+    }
+
+    check_group(inst, 0, 0);
+    if (mop == 0b00 && lumop == 0b01011)
+    {
+        // vlm.v / vsm.v, one bit per element
+        if (masked || eew != 1 || nf != 0)
+        {
+            illegal(inst);
+        }
+        if (vl != 0)
+        {
+            transfer(mmu, address, reg(vd), (vl + 7) / 8, is_store);
+        }
+        return;
+    }
+
+    // fault only first loads are plain ones, a fault is raised instead of trimming vl
+    const bool unit_stride = mop == 0b00 && (lumop == 0 || (lumop == 0b10000 && !is_store));
+    if (nf != 0 || (!unit_stride && mop != 0b10))
+    {
+        // segments, indexed accesses
+        illegal(inst);
+    }
+
+    const int emul_log2 = std::countr_zero(eew) - std::countr_zero(sew_bytes()) + lmul_log2();
+    if (emul_log2 < -3 || emul_log2 > 3 || (masked && vd == 0 && !is_store))
+    {
+        illegal(inst);
+    }
+    check_group(inst, vd, emul_log2);
+    if (vl == 0)
+    {
+        return;
+    }
+
+    uint8_t *elements = reg(vd);
+    if (unit_stride && !masked)
+    {
+        transfer(mmu, address, elements, vl * eew, is_store);
+        return;
+    }
+
+    const uint32_t stride = unit_stride ? eew : x[(inst >> 20) & 0b11111];
+    for (uint32_t i = 0; i < vl; ++i)
+    {
+        if (!masked || active(i))
+        {
+            transfer(mmu, address + i * stride, elements + i * eew, eew, is_store);
+        }
+    }
+}
+
+std::optional<uint32_t> VectorUnit::arithmetic(uint32_t inst, const uint32_t *x)
+{
+    const uint32_t funct3 = (inst >> 12) & 0b111;
+    const uint32_t funct6 = inst >> 26;
+    const uint32_t vs1 = (inst >> 15) & 0b11111;
+    switch (funct3)
+    {
+        case opcfg:
+            return set_vl(inst, x);
+        case opivv:
+            return integer_op(inst, funct6, Operand{.is_vector = true, .reg = vs1, .scalar = 0});
+        case opivi:
+            return integer_op(inst, funct6,
+                              Operand{.is_vector = false, .reg = 0, .scalar = (uint32_t)((int32_t)(inst << 12) >> 27)});
+        case opivx:
+            return integer_op(inst, funct6, Operand{.is_vector = false, .reg = 0, .scalar = x[vs1]});
+        case opmvv:
+            return multiply_op(inst, funct6, Operand{.is_vector = true, .reg = vs1, .scalar = 0});
+        case opmvx:
+            return multiply_op(inst, funct6, Operand{.is_vector = false, .reg = 0, .scalar = x[vs1]});
+        default:
+            // floating point
+            illegal(inst);
+    }
+}
+
+std::optional<uint32_t> VectorUnit::integer_op(uint32_t inst, uint32_t funct6, const Operand &b)
+{
+    const uint32_t funct3 = (inst >> 12) & 0b111;
+    const uint32_t vd = (inst >> 7) & 0b11111;
+    const uint32_t vs2 = (inst >> 20) & 0b11111;
+    const bool masked = ((inst >> 25) & 1) == 0;
+    const bool is_vv = funct3 == opivv;
+    const bool is_vi = funct3 == opivi;
+
+    if (funct6 == 0b100111)
+    {
+        // vmv<nr>r.v copies whole registers, whatever vtype and vl are
+        const uint32_t count = ((inst >> 15) & 0b11111) + 1;
+        if (!is_vi || masked || !std::has_single_bit(count) || count > 8 || vd % count != 0 || vs2 % count != 0)
+        {
+            illegal(inst);
+        }
+        memmove(reg(vd), reg(vs2), count * vlenb);
+        return std::nullopt;
+    }
+
+    const int lmul = lmul_log2();
+    check_group(inst, vs2, lmul);
+    if (b.is_vector)
+    {
+        check_group(inst, b.reg, lmul);
+    }
+
+    // compares write a mask register, everything else a register group that must not be the mask
+    if (funct6 >= 0b011000 && funct6 <= 0b011111)
+    {
+        static constexpr VectorCompare compares[] = {VectorCompare::eq,  VectorCompare::ne,  VectorCompare::ltu,
+                                                     VectorCompare::lt,  VectorCompare::leu, VectorCompare::le,
+                                                     VectorCompare::gtu, VectorCompare::gt};
+        const VectorCompare op = compares[funct6 - 0b011000];
+        const bool has_form = is_vv ? op != VectorCompare::gtu && op != VectorCompare::gt
+                                    : !is_vi || (op != VectorCompare::ltu && op != VectorCompare::lt);
+        if (!has_form)
+        {
+            illegal(inst);
+        }
+        compare(op, vd, vs2, b, masked);
+        return std::nullopt;
+    }
+
+    check_group(inst, vd, lmul);
+    if (masked && vd == 0)
+    {
+        illegal(inst);
+    }
+
+    switch (funct6)
+    {
+        case 0b000000:
+            elementwise(VectorAlu::add, vd, vs2, b, masked);
+            break;
+        case 0b000010:
+        case 0b000100:
+        case 0b000101:
+        case 0b000110:
+        case 0b000111:
+        {
+            if (is_vi)
+            {
+                illegal(inst);
+            }
+            static constexpr VectorAlu ops[] = {VectorAlu::sub, VectorAlu::rsub, VectorAlu::minu,
+                                                VectorAlu::min, VectorAlu::maxu, VectorAlu::max};
+            elementwise(ops[funct6 - 0b000010], vd, vs2, b, masked);
+            break;
+        }
+        case 0b000011:
+            if (is_vv)
+            {
+                illegal(inst);
+            }
+            elementwise(VectorAlu::rsub, vd, vs2, b, masked);
+            break;
+        case 0b001001:
+            elementwise(VectorAlu::and_, vd, vs2, b, masked);
+            break;
+        case 0b001010:
+            elementwise(VectorAlu::or_, vd, vs2, b, masked);
+            break;
+        case 0b001011:
+            elementwise(VectorAlu::xor_, vd, vs2, b, masked);
+            break;
+        case 0b100101:
+            elementwise(VectorAlu::sll, vd, vs2, b, masked);
+            break;
+        case 0b101000:
+            elementwise(VectorAlu::srl, vd, vs2, b, masked);
+            break;
+        case 0b101001:
+            elementwise(VectorAlu::sra, vd, vs2, b, masked);
+            break;
+        case 0b001110:
+        case 0b001111:
+        {
+            if (is_vv)
+            {
+                illegal(inst);
+            }
+            // the immediate of slides is unsigned
+            const Operand offset{.is_vector = false, .reg = 0, .scalar = is_vi ? (inst >> 15) & 0b11111 : b.scalar};
+            slide(funct6, false, vd, vs2, offset, masked);
+            break;
+        }
+        case 0b010111:
+            // vmerge with a mask, vmv.v.* without one
+            if (!masked && vs2 != 0)
+            {
+                illegal(inst);
+            }
+            merge(vd, vs2, b, masked);
+            break;
+        default:
+            illegal(inst);
+    }
+    return std::nullopt;
+}
+
+std::optional<uint32_t> VectorUnit::multiply_op(uint32_t inst, uint32_t funct6, const Operand &b)
+{
+    const uint32_t vd = (inst >> 7) & 0b11111;
+    const uint32_t vs2 = (inst >> 20) & 0b11111;
+    const uint32_t vs1 = (inst >> 15) & 0b11111;
+    const bool masked = ((inst >> 25) & 1) == 0;
+    const int lmul = lmul_log2();
+
+    if (funct6 <= 0b000111)
+    {
+        // reductions, vd and vs1 are single registers holding the scalar in element 0
+        static constexpr VectorReduction reductions[] = {
+            VectorReduction::sum,  VectorReduction::and_, VectorReduction::or_,  VectorReduction::xor_,
+            VectorReduction::minu, VectorReduction::min,  VectorReduction::maxu, VectorReduction::max};
+        if (!b.is_vector)
+        {
+            illegal(inst);
+        }
+        check_group(inst, vs2, lmul);
+        reduce(reductions[funct6], vd, vs2, vs1, masked);
+        return std::nullopt;
+    }
+    if (funct6 == 0b010000 || funct6 == 0b010100)
+    {
+        return mask_unary(inst, funct6, vd, vs2, b.is_vector ? vs1 : b.scalar, masked);
+    }
+    if (funct6 >= 0b011000 && funct6 <= 0b011111)
+    {
+        if (!b.is_vector || masked)
+        {
+            illegal(inst);
+        }
+        check_group(inst, 0, 0);
+        mask_logical(funct6, vd, vs2, vs1);
+        return std::nullopt;
+    }
+
+    check_group(inst, vd, lmul);
+    check_group(inst, vs2, lmul);
+    if (b.is_vector)
+    {
+        check_group(inst, vs1, lmul);
+    }
+    if (masked && vd == 0)
+    {
+        illegal(inst);
+    }
+
+    switch (funct6)
+    {
+        case 0b001110:
+        case 0b001111:
+            if (b.is_vector)
+            {
+                illegal(inst);
+            }
+            slide(funct6, true, vd, vs2, b, masked);
+            break;
+        case 0b100000:
+        case 0b100001:
+        case 0b100010:
+        case 0b100011:
+        case 0b100100:
+        case 0b100101:
+        case 0b100110:
+        case 0b100111:
+        {
+            static constexpr VectorAlu ops[] = {VectorAlu::divu,  VectorAlu::div, VectorAlu::remu,   VectorAlu::rem,
+                                                VectorAlu::mulhu, VectorAlu::mul, VectorAlu::mulhsu, VectorAlu::mulh};
+            elementwise(ops[funct6 - 0b100000], vd, vs2, b, masked);
+            break;
+        }
+        case 0b101001:
+            elementwise(VectorAlu::madd, vd, vs2, b, masked);
+            break;
+        case 0b101011:
+            elementwise(VectorAlu::nmsub, vd, vs2, b, masked);
+            break;
+        case 0b101101:
+            elementwise(VectorAlu::macc, vd, vs2, b, masked);
+            break;
+        case 0b101111:
+            elementwise(VectorAlu::nmsac, vd, vs2, b, masked);
+            break;
+        default:
+            illegal(inst);
+    }
+    return std::nullopt;
+}
+
+const uint8_t *VectorUnit::operand_elements(const Operand &b)
+{
+    if (b.is_vector)
+    {
+        return reg(b.reg);
+    }
+
+    // little endian host, the low SEW bits of the scalar are its first bytes
+    const uint32_t sew = sew_bytes();
+    uint8_t *splat = scratch.data() + 8 * vlenb;
+    for (uint32_t i = 0; i < vl; ++i)
+    {
+        memcpy(splat + i * sew, &b.scalar, sew);
+    }
+    return splat;
+}
+
+void VectorUnit::elementwise(VectorAlu op, uint32_t vd, uint32_t vs2, const Operand &b, bool masked)
+{
+    const uint32_t sew = sew_bytes();
+    const uint8_t *b_elements = operand_elements(b);
+    if (!masked)
+    {
+        kernels->alu(op, sew, reg(vd), reg(vs2), b_elements, vl);
+        return;
+    }
+
+    // the multiply-adds read the destination, so the scratch starts as a copy of it
+    uint8_t *result = scratch.data();
+    memcpy(result, reg(vd), vl * sew);
+    kernels->alu(op, sew, result, reg(vs2), b_elements, vl);
+    for (uint32_t i = 0; i < vl; ++i)
+    {
+        if (active(i))
+        {
+            memcpy(reg(vd) + i * sew, result + i * sew, sew);
+        }
+    }
+}
+
+void VectorUnit::write_mask(uint32_t vd, const uint8_t *result, bool masked)
+{
+    uint8_t *mask = reg(vd);
+    if (!masked)
+    {
+        memcpy(mask, result, vl / 8);
+        for (uint32_t i = vl & ~7u; i < vl; ++i)
+        {
+            set_mask_bit(mask, i, mask_bit(result, i));
+        }
+        return;
+    }
+
+    // vd may be v0 itself, each bit of it is read before it is written
+    for (uint32_t i = 0; i < vl; ++i)
+    {
+        if (active(i))
+        {
+            set_mask_bit(mask, i, mask_bit(result, i));
+        }
+    }
+}
+
+void VectorUnit::compare(VectorCompare op, uint32_t vd, uint32_t vs2, const Operand &b, bool masked)
+{
+    uint8_t *result = scratch.data();
+    kernels->compare(op, sew_bytes(), result, reg(vs2), operand_elements(b), vl);
+    write_mask(vd, result, masked);
+}
+
+void VectorUnit::reduce(VectorReduction op, uint32_t vd, uint32_t vs2, uint32_t vs1, bool masked)
+{
+    if (vl == 0)
+    {
+        return;
+    }
+
+    // inactive elements are left out by packing the active ones into the scratch group first
+    const uint32_t sew = sew_bytes();
+    const uint8_t *elements = reg(vs2);
+    uint32_t count = vl;
+    if (masked)
+    {
+        count = 0;
+        for (uint32_t i = 0; i < vl; ++i)
+        {
+            if (active(i))
+            {
+                memcpy(scratch.data() + count++ * sew, elements + i * sew, sew);
+            }
+        }
+        elements = scratch.data();
+    }
+
+    uint32_t accumulator = 0;
+    memcpy(&accumulator, reg(vs1), sew);
+    accumulator = kernels->reduce(op, sew, elements, count, accumulator);
+    memcpy(reg(vd), &accumulator, sew);
+}
+
+void VectorUnit::merge(uint32_t vd, uint32_t vs2, const Operand &b, bool masked)
+{
+    const uint32_t sew = sew_bytes();
+    const uint8_t *elements = operand_elements(b);
+    if (!masked)
+    {
+        memmove(reg(vd), elements, vl * sew);
+        return;
+    }
+
+    for (uint32_t i = 0; i < vl; ++i)
+    {
+        memmove(reg(vd) + i * sew, (active(i) ? elements : reg(vs2)) + i * sew, sew);
+    }
+}
+
+void VectorUnit::slide(uint32_t funct6, bool is_opm, uint32_t vd, uint32_t vs2, const Operand &b, bool masked)
+{
+    // slides read other elements than the one they write, the source is copied so vd may overlap it
+    const uint32_t sew = sew_bytes();
+    const uint32_t vlmax = vlmax_of(vtype);
+    uint8_t *source = scratch.data() + 8 * vlenb;
+    memcpy(source, reg(vs2), group_registers() * vlenb);
+    uint8_t *destination = reg(vd);
+    const uint8_t zero[sizeof(uint32_t)] = {};
+
+    const auto write = [&](uint32_t i, const uint8_t *element)
+    {
+        if (!masked || active(i))
+        {
+            memcpy(destination + i * sew, element, sew);
+        }
+    };
+
+    const bool up = funct6 == 0b001110;
+    if (!is_opm)
+    {
+        const uint32_t offset = b.scalar;
+        for (uint32_t i = up ? std::min(offset, vl) : 0; i < vl; ++i)
+        {
+            if (up)
+            {
+                write(i, source + (i - offset) * sew);
+                continue;
+            }
+            const uint64_t from = (uint64_t)i + offset;
+            write(i, from < vlmax ? source + from * sew : zero);
+        }
+        return;
+    }
+
+    // vslide1up and vslide1down shift in the scalar
+    if (vl == 0)
+    {
+        return;
+    }
+    const uint8_t *scalar = (const uint8_t *)&b.scalar;
+    for (uint32_t i = 0; i < vl; ++i)
+    {
+        if (up)
+        {
+            write(i, i == 0 ? scalar : source + (i - 1) * sew);
+        }
+        else
+        {
+            write(i, i == vl - 1 ? scalar : source + (i + 1) * sew);
+        }
+    }
+}
+
+void VectorUnit::mask_logical(uint32_t funct6, uint32_t vd, uint32_t vs2, uint32_t vs1)
+{
+    const uint8_t *a = reg(vs2);
+    const uint8_t *b = reg(vs1);
+    uint8_t *mask = reg(vd);
+    for (uint32_t byte = 0; byte * 8 < vl; ++byte)
+    {
+        const uint8_t x = a[byte];
+        const uint8_t y = b[byte];
+        uint8_t result = 0;
+        switch (funct6)
+        {
+            case 0b011000: // vmandn
+                result = x & ~y;
+                break;
+            case 0b011001: // vmand
+                result = x & y;
+                break;
+            case 0b011010: // vmor
+                result = x | y;
+                break;
+            case 0b011011: // vmxor
+                result = x ^ y;
+                break;
+            case 0b011100: // vmorn
+                result = x | ~y;
+                break;
+            case 0b011101: // vmnand
+                result = ~(x & y);
+                break;
+            case 0b011110: // vmnor
+                result = ~(x | y);
+                break;
+            case 0b011111: // vmxnor
+                result = ~(x ^ y);
+                break;
+        }
+
+        // bits from vl on are the tail
+        const uint32_t bits = std::min<uint32_t>(vl - byte * 8, 8);
+        const uint8_t tail = bits == 8 ? 0 : (uint8_t)(0xff << bits);
+        mask[byte] = (mask[byte] & tail) | (result & ~tail);
+    }
+}
+
+std::optional<uint32_t> VectorUnit::mask_unary(uint32_t inst, uint32_t funct6, uint32_t vd, uint32_t vs2,
+                                               uint32_t vs1, bool masked)
+{
+    const bool is_vv = ((inst >> 12) & 0b111) == opmvv;
+    const uint32_t sew = sew_bytes();
+    check_group(inst, 0, 0);
+
+    if (funct6 == 0b010000 && !is_vv)
+    {
+        // vmv.s.x writes element 0 only, vs1 holds the scalar here
+        if (masked || vs2 != 0)
+        {
+            illegal(inst);
+        }
+        if (vl != 0)
+        {
+            memcpy(reg(vd), &vs1, sew);
+        }
+        return std::nullopt;
+    }
+    if (!is_vv)
+    {
+        illegal(inst);
+    }
+
+    const uint8_t *source = reg(vs2);
+    const auto counts = [&](uint32_t i) { return mask_bit(source, i) && (!masked || active(i)); };
+
+    if (funct6 == 0b010000)
+    {
+        switch (vs1)
+        {
+            case 0b00000:
+            {
+                // vmv.x.s, sign extended from SEW bits
+                if (masked)
+                {
+                    illegal(inst);
+                }
+                uint32_t value = 0;
+                memcpy(&value, source, sew);
+                const uint32_t shift = 32 - 8 * sew;
+                return (uint32_t)((int32_t)(value << shift) >> shift);
+            }
+            case 0b10000:
+            {
+                // vcpop.m
+                uint32_t count = 0;
+                for (uint32_t i = 0; i < vl; ++i)
+                {
+                    count += counts(i);
+                }
+                return count;
+            }
+            case 0b10001:
+            {
+                // vfirst.m
+                for (uint32_t i = 0; i < vl; ++i)
+                {
+                    if (counts(i))
+                    {
+                        return i;
+                    }
+                }
+                return UINT32_MAX;
+            }
+            default:
+                illegal(inst);
+        }
+    }
+
+    switch (vs1)
+    {
+        case 0b00001: // vmsbf.m
+        case 0b00010: // vmsof.m
+        case 0b00011: // vmsif.m
+        {
+            uint8_t *result = scratch.data();
+            bool found = false;
+            for (uint32_t i = 0; i < vl; ++i)
+            {
+                const bool bit = counts(i);
+                const bool value = vs1 == 0b00001 ? !found && !bit : vs1 == 0b00010 ? !found && bit : !found;
+                set_mask_bit(result, i, value);
+                found = found || bit;
+            }
+            write_mask(vd, result, masked);
+            return std::nullopt;
+        }
+        case 0b10000: // viota.m
+        case 0b10001: // vid.v
+        {
+            const int lmul = lmul_log2();
+            check_group(inst, vd, lmul);
+            const bool is_iota = vs1 == 0b10000;
+            const uint32_t group = group_registers();
+            if ((masked && vd == 0) || (!is_iota && vs2 != 0) || (is_iota && vs2 >= vd && vs2 < vd + group))
+            {
+                illegal(inst);
+            }
+
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < vl; ++i)
+            {
+                if (masked && !active(i))
+                {
+                    continue;
+                }
+                const uint32_t value = is_iota ? count : i;
+                memcpy(reg(vd) + i * sew, &value, sew);
+                count += is_iota && mask_bit(source, i);
+            }
+            return std::nullopt;
+        }
+        default:
+            illegal(inst);
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "../checkpoint/checkpoint-stream.hpp"
+#include "../mmu/mmu.hpp"
+#include "vector-kernels.hpp"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+/*
+    The vector extension of RVV 1.0 for a hart without floating point and 32-bit elements at most,
+    roughly the Zve32x profile: vsetvli/vsetivli/vsetvl, unit stride, strided, mask and whole
+    register loads and stores, integer arithmetic, compares, slides, reductions and the mask
+    instructions. Widening, narrowing, fixed point, segment and indexed accesses are not there and
+    raise an illegal instruction, like 64-bit elements, which make vsetvli set vill.
+
+    The register file is VLEN/8 bytes per register, a register group with LMUL > 1 is the
+    consecutive registers, so every operand of an instruction is one contiguous run of elements and
+    unmasked instructions run as single VectorKernels calls over the whole group. Masked ones
+    compute every element into a scratch group and copy the active ones. Tail and inactive elements
+    are always left undisturbed, which the agnostic policies allow as well. vstart stays 0, an
+    access that faults leaves the elements before it written.
+*/
+class VectorUnit
+{
+  public:
+    static constexpr uint32_t default_vlen = 128;
+
+    // Throws std::invalid_argument unless vlen is a power of two from 32 to 4096 bits
+    explicit VectorUnit(uint32_t vlen = default_vlen);
+
+    // Executes an OP-V, LOAD-FP or STORE-FP instruction, x are the scalar registers. Returns the new
+    // value of the scalar rd for the instructions that write one. Raises GuestFault for instructions
+    // outside the subset, with vill set, and for accesses outside guest memory.
+    std::optional<uint32_t> execute(uint32_t inst, const uint32_t *x, Mmu &mmu);
+
+    // The read only CSRs vl, vtype and vlenb and vstart, false for any other csr
+    bool read_csr(uint32_t csr, uint32_t &value) const;
+
+    uint32_t get_vlen() const
+    {
+        return vlenb * 8;
+    }
+
+    uint32_t get_vl() const
+    {
+        return vl;
+    }
+
+    // vtype, vl and the register file, a checkpoint only restores into a unit of the same VLEN
+    void save_state(CheckpointWriter &writer) const;
+
+    void load_state(CheckpointReader &reader);
+
+  private:
+    // Where an operand that is not a vector register comes from
+    struct Operand
+    {
+        bool is_vector;
+        uint32_t reg;    // vs1
+        uint32_t scalar; // rs1 or the immediate
+    };
+
+    static constexpr uint32_t vill = 0x80000000;
+
+    // 0 for a vtype this unit does not support
+    uint32_t vlmax_of(uint32_t new_vtype) const;
+
+    uint32_t sew_bytes() const
+    {
+        return 1u << ((vtype >> 3) & 0b111);
+    }
+
+    // log2 of LMUL, -3 to 3
+    int lmul_log2() const
+    {
+        const int vlmul = vtype & 0b111;
+        return vlmul >= 4 ? vlmul - 8 : vlmul;
+    }
+
+    uint32_t group_registers() const
+    {
+        return lmul_log2() > 0 ? 1u << lmul_log2() : 1;
+    }
+
+    uint8_t *reg(uint32_t index)
+    {
+        return registers.data() + index * vlenb;
+    }
+
+    // Bit i of v0
+    bool active(uint32_t i) const
+    {
+        return (registers[i / 8] >> (i % 8)) & 1;
+    }
+
+    uint32_t set_vl(uint32_t inst, const uint32_t *x);
+
+    void load_store(uint32_t inst, const uint32_t *x, Mmu &mmu, bool is_store);
+
+    std::optional<uint32_t> arithmetic(uint32_t inst, const uint32_t *x);
+
+    std::optional<uint32_t> integer_op(uint32_t inst, uint32_t funct6, const Operand &b);
+
+    std::optional<uint32_t> multiply_op(uint32_t inst, uint32_t funct6, const Operand &b);
+
+    // vs1 as it is or b broadcast to all elements in the scratch group
+    const uint8_t *operand_elements(const Operand &b);
+
+    void elementwise(VectorAlu op, uint32_t vd, uint32_t vs2, const Operand &b, bool masked);
+
+    void compare(VectorCompare op, uint32_t vd, uint32_t vs2, const Operand &b, bool masked);
+
+    void reduce(VectorReduction op, uint32_t vd, uint32_t vs2, uint32_t vs1, bool masked);
+
+    void merge(uint32_t vd, uint32_t vs2, const Operand &b, bool masked);
+
+    void slide(uint32_t funct6, bool is_opm, uint32_t vd, uint32_t vs2, const Operand &b, bool masked);
+
+    void mask_logical(uint32_t funct6, uint32_t vd, uint32_t vs2, uint32_t vs1);
+
+    std::optional<uint32_t> mask_unary(uint32_t inst, uint32_t funct6, uint32_t vd, uint32_t vs2, uint32_t vs1,
+                                       bool masked);
+
+    // Writes bits [0, vl) of result to mask register vd, only the active ones when masked
+    void write_mask(uint32_t vd, const uint8_t *result, bool masked);
+
+    // Throws unless the current vtype is valid and reg starts a group of 2^emul_log2 registers
+    void check_group(uint32_t inst, uint32_t reg, int emul_log2) const;
+
+    [[noreturn]] static void illegal(uint32_t inst);
+
+  private:
+    uint32_t vlenb;
+    uint32_t vl = 0;
+    uint32_t vtype = vill;
+    const VectorKernels *kernels;
+
+    std::vector<uint8_t> registers; // 32 registers of vlenb bytes, allocated by the first vector instruction
+    std::vector<uint8_t> scratch;   // two groups of 8 registers: results of masked instructions, splats
+};
@@ -0,0 +1,69 @@
+#include "riscvemu/scheduler.hpp"
+#include "worker.hpp"
+#include <algorithm>
+#include <thread>
+
+namespace riscvemu
+{
+
+struct Scheduler::Impl
+{
+    std::atomic<size_t> unfinished = 0;
+    std::atomic<size_t> next_worker = 0;
+    std::vector<std::unique_ptr<Worker>> workers;
+};
+
+Scheduler::Scheduler(unsigned threads, std::chrono::milliseconds compress_after) : impl(std::make_unique<Impl>())
+{
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i)
+    {
+        impl->workers.push_back(std::make_unique<Worker>(impl->unfinished, [this] {
+            for (const std::unique_ptr<Worker> &worker : impl->workers)
+            {
+                worker->wake();
+            }
+        }, compress_after));
+    }
+}
+
+Scheduler::~Scheduler() = default;
+
+void Scheduler::spawn(Machine machine, ExitHandler on_exit)
+{
+    // children the guest starts run here too, they do not report to on_exit
+    machine.set_spawner([this](Machine child) { spawn(std::move(child)); });
+
+    ++impl->unfinished;
+    const size_t index = impl->next_worker++ % impl->workers.size();
+    impl->workers[index]->spawn(std::move(machine), std::move(on_exit));
+}
+
+void Scheduler::run()
+{
+    if (impl->unfinished == 0)
+    {
+        return;
+    }
+
+    std::vector<std::exception_ptr> exceptions(impl->workers.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < impl->workers.size(); ++i)
+    {
+        threads.emplace_back([this, &exceptions, i] { exceptions[i] = impl->workers[i]->run(); });
+    }
+    exceptions[0] = impl->workers[0]->run();
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    for (const std::exception_ptr &exception : exceptions)
+    {
+        if (exception != nullptr)
+        {
+            std::rethrow_exception(exception);
+        }
+    }
+}
+
+} // namespace riscvemu
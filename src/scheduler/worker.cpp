@@ -0,0 +1,256 @@
+#include "worker.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using riscvemu::BlockedOn;
+using riscvemu::Machine;
+using riscvemu::Scheduler;
+using riscvemu::StopReason;
+
+static int64_t monotonic_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Worker::Worker(std::atomic<size_t> &unfinished, std::function<void()> on_all_finished, std::chrono::milliseconds compress_after)
+    : unfinished(unfinished), on_all_finished(std::move(on_all_finished)),
+      compress_after_ns(std::chrono::duration_cast<std::chrono::nanoseconds>(compress_after).count())
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    epoll_event event{.events = EPOLLIN, .data = {.fd = wake_fd}};
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0)
+    {
+        const std::string error = strerror(errno);
+        if (epoll_fd >= 0)
+        {
+            close(epoll_fd);
+        }
+        if (wake_fd >= 0)
+        {
+            close(wake_fd);
+        }
+        throw std::runtime_error("Cannot create the scheduler's epoll set: " + error);
+    }
+}
+
+Worker::~Worker()
+{
+    // guests still suspended when run threw
+    for (Handle handle : ready)
+    {
+        handle.destroy();
+    }
+    for (auto &[fd, waiters] : waiting)
+    {
+        for (Handle handle : waiters.handles)
+        {
+            handle.destroy();
+        }
+    }
+    while (!timers.empty())
+    {
+        timers.top().second.destroy();
+        timers.pop();
+    }
+
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void Worker::spawn(Machine machine, Scheduler::ExitHandler on_exit)
+{
+    {
+        std::lock_guard lock(inbox_mutex);
+        inbox.emplace_back(std::move(machine), std::move(on_exit));
+    }
+    wake();
+}
+
+void Worker::wake()
+{
+    const uint64_t one = 1;
+    [[maybe_unused]] const ssize_t ignored = write(wake_fd, &one, sizeof(one));
+}
+
+std::exception_ptr Worker::run()
+{
+    std::exception_ptr first_exception;
+    while (true)
+    {
+        {
+            std::lock_guard lock(inbox_mutex);
+            for (auto &[machine, on_exit] : inbox)
+            {
+                ready.push_back(run_guest(std::move(machine), std::move(on_exit)).handle);
+            }
+            inbox.clear();
+        }
+
+        while (!ready.empty())
+        {
+            const Handle handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+            if (!handle.done())
+            {
+                continue;
+            }
+
+            if (handle.promise().exception != nullptr && first_exception == nullptr)
+            {
+                first_exception = handle.promise().exception;
+            }
+            handle.destroy();
+            if (--unfinished == 0)
+            {
+                on_all_finished();
+            }
+        }
+
+        const int timeout_ms = expire_timers();
+        if (!ready.empty())
+        {
+            continue;
+        }
+        if (unfinished == 0)
+        {
+            return first_exception;
+        }
+
+        poll_events(timeout_ms);
+    }
+}
+
+Worker::Task Worker::run_guest(Machine machine, Scheduler::ExitHandler on_exit)
+{
+    while (true)
+    {
+        const StopReason reason = machine.run(time_slice);
+        if (reason == StopReason::budget_exhausted)
+        {
+            co_await Reschedule{*this};
+        }
+        else if (reason == StopReason::blocked)
+        {
+            if (compress_after_ns > 0)
+            {
+                const int64_t deadline = monotonic_ns() + compress_after_ns;
+                idle.emplace_back(deadline, &machine);
+                idle_deadlines[&machine] = deadline;
+            }
+            co_await WaitFor{*this, machine.get_blocked_on()};
+            idle_deadlines.erase(&machine);
+        }
+        else
+        {
+            if (on_exit)
+            {
+                on_exit(machine, reason);
+            }
+            co_return;
+        }
+    }
+}
+
+void Worker::park(Handle handle, const BlockedOn &blocked_on)
+{
+    if (blocked_on.fd < 0)
+    {
+        timers.emplace(blocked_on.deadline_ns, handle);
+        return;
+    }
+
+    Waiters &waiters = waiting[blocked_on.fd];
+    const bool registered = !waiters.handles.empty();
+    const uint32_t registered_events = waiters.events;
+    waiters.events |= blocked_on.writable ? EPOLLOUT : EPOLLIN;
+    waiters.handles.push_back(handle);
+
+    epoll_event event{.events = waiters.events, .data = {.fd = blocked_on.fd}};
+    if (epoll_ctl(epoll_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, blocked_on.fd, &event) != 0)
+    {
+        // e.g. a regular file, which epoll does not take and which never blocks anyway. Guests parked
+        // on the fd before stay registered for what they wait for.
+        waiters.handles.pop_back();
+        waiters.events = registered_events;
+        if (waiters.handles.empty())
+        {
+            waiting.erase(blocked_on.fd);
+        }
+        ready.push_back(handle);
+    }
+}
+
+int Worker::expire_timers()
+{
+    const int64_t now = monotonic_ns();
+    while (!timers.empty() && timers.top().first <= now)
+    {
+        ready.push_back(timers.top().second);
+        timers.pop();
+    }
+
+    while (!idle.empty() && idle.front().first <= now)
+    {
+        const auto [deadline, machine] = idle.front();
+        idle.pop_front();
+
+        // a guest that woke up in the meantime has no entry, or one for a later park
+        auto found = idle_deadlines.find(machine);
+        if (found != idle_deadlines.end() && found->second == deadline)
+        {
+            idle_deadlines.erase(found);
+            machine->compress_memory();
+        }
+    }
+
+    int64_t next = INT64_MAX;
+    if (!timers.empty())
+    {
+        next = timers.top().first;
+    }
+    if (!idle.empty())
+    {
+        next = std::min(next, idle.front().first);
+    }
+    if (next == INT64_MAX)
+    {
+        return -1;
+    }
+
+    // rounded up, waking early would only spin
+    return (int)std::min<int64_t>((next - now + 999999) / 1000000, INT32_MAX);
+}
+
+void Worker::poll_events(int timeout_ms)
+{
+    epoll_event events[64];
+    const int count = epoll_wait(epoll_fd, events, 64, timeout_ms);
+    for (int i = 0; i < count; ++i)
+    {
+        const int fd = events[i].data.fd;
+        if (fd == wake_fd)
+        {
+            uint64_t value = 0;
+            [[maybe_unused]] const ssize_t ignored = read(wake_fd, &value, sizeof(value));
+            continue;
+        }
+
+        // every guest on the fd retries, those it is not ready for block again
+        auto found = waiting.find(fd);
+        if (found == waiting.end())
+        {
+            continue;
+        }
+        ready.insert(ready.end(), found->second.handles.begin(), found->second.handles.end());
+        waiting.erase(found);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "riscvemu/scheduler.hpp"
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+    One host thread of a Scheduler.
+
+    Each guest is a coroutine looping over Machine::run with a time slice. After a slice it goes to the
+    back of the ready queue, after a blocked syscall it is parked until epoll reports its fd ready or
+    its deadline passes, and then the same syscall is issued again. Only the owning thread touches the
+    queues, other threads hand guests over through the inbox and an eventfd.
+
+    Every park also queues an idle deadline. A guest still parked under the same park when it passes
+    has its memory compressed. The threshold is the same for all guests, so the queue stays sorted.
+*/
+class Worker
+{
+  public:
+    static constexpr uint64_t time_slice = 1 << 18; // instructions, a few milliseconds
+
+    // unfinished counts the guests of all workers, on_all_finished runs when it drops to 0
+    // A compress_after of zero never compresses
+    Worker(std::atomic<size_t> &unfinished, std::function<void()> on_all_finished, std::chrono::milliseconds compress_after);
+    ~Worker();
+
+    Worker(const Worker &) = delete;
+    Worker &operator=(const Worker &) = delete;
+
+    // Thread safe, the caller has already counted the guest in unfinished
+    void spawn(riscvemu::Machine machine, riscvemu::Scheduler::ExitHandler on_exit);
+
+    // Runs guests until unfinished drops to 0, returns the first exception a guest threw
+    std::exception_ptr run();
+
+    // Thread safe, interrupts the epoll wait
+    void wake();
+
+  private:
+    struct Task
+    {
+        struct promise_type
+        {
+            std::exception_ptr exception;
+
+            Task get_return_object()
+            {
+                return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+            std::suspend_always final_suspend() noexcept
+            {
+                return {};
+            }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept
+            {
+                exception = std::current_exception();
+            }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    using Handle = std::coroutine_handle<Task::promise_type>;
+
+    // Suspends the guest to the back of the ready queue
+    struct Reschedule
+    {
+        Worker &worker;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(Handle handle)
+        {
+            worker.ready.push_back(handle);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // Suspends the guest until what it blocked on is ready
+    struct WaitFor
+    {
+        Worker &worker;
+        riscvemu::BlockedOn blocked_on;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        void await_suspend(Handle handle)
+        {
+            worker.park(handle, blocked_on);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct Waiters
+    {
+        uint32_t events = 0;
+        std::vector<Handle> handles;
+    };
+
+    using Timer = std::pair<int64_t, Handle>; // deadline, guest
+
+    Task run_guest(riscvemu::Machine machine, riscvemu::Scheduler::ExitHandler on_exit);
+
+    void park(Handle handle, const riscvemu::BlockedOn &blocked_on);
+
+    // Moves the guests whose deadline passed to the ready queue and compresses the guests idle for
+    // long enough, returns the epoll timeout until the next deadline of either
+    int expire_timers();
+
+    // Blocks in epoll until an fd or the eventfd is ready or timeout_ms passed
+    void poll_events(int timeout_ms);
+
+  private:
+    std::atomic<size_t> &unfinished;
+    std::function<void()> on_all_finished;
+    int64_t compress_after_ns;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+
+    std::mutex inbox_mutex;
+    std::vector<std::pair<riscvemu::Machine, riscvemu::Scheduler::ExitHandler>> inbox;
+
+    std::deque<Handle> ready;
+    std::unordered_map<int, Waiters> waiting; // by fd
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    std::deque<std::pair<int64_t, riscvemu::Machine *>> idle;        // compression deadline, guest
+    std::unordered_map<riscvemu::Machine *, int64_t> idle_deadlines; // of the guests parked right now
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/*
+    Lock-free single producer / single consumer ring buffer.
+    Capacity must be a power of two, one slot is never used so head == tail means empty.
+*/
+template <typename T>
+class RingBuffer
+{
+  public:
+    RingBuffer(size_t capacity) : slots(capacity), mask(capacity - 1) {}
+
+    bool try_push(const T &value)
+    {
+        const size_t head_pos = head.load(std::memory_order_relaxed);
+        const size_t next = (head_pos + 1) & mask;
+        if (next == cached_tail)
+        {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (next == cached_tail)
+            {
+                return false;
+            }
+        }
+
+        slots[head_pos] = value;
+        head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // For the consumer, the producer may push right after it returned true
+    bool empty() const
+    {
+        return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
+    // Hands every currently available element to consume, returns how many were consumed
+    template <typename F>
+    size_t drain(F &&consume)
+    {
+        size_t tail_pos = tail.load(std::memory_order_relaxed);
+        const size_t head_pos = head.load(std::memory_order_acquire);
+        size_t count = 0;
+
+        while (tail_pos != head_pos)
+        {
+            consume(slots[tail_pos]);
+            tail_pos = (tail_pos + 1) & mask;
+            ++count;
+        }
+
+        tail.store(tail_pos, std::memory_order_release);
+        return count;
+    }
+
+  private:
+    std::vector<T> slots;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> head = 0;
+    size_t cached_tail = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "trace-record.hpp"
+#include <cstddef>
+#include <cstdint>
+
+/*
+    Delta-compressed execution trace format.
+
+    File layout: "RVTR" magic, u32 version, then one record per retired instruction:
+
+        flags   u8   sequential_pc | cached_inst | has_rd | has_mem
+        pc      zigzag varint of (pc - prev_pc - 4), only when !sequential_pc
+        inst    raw u32, only when !cached_inst
+        rd      zigzag varint of (rd_value - previous value of the same rd), only when has_rd. An
+                ECALL that returned writes a0, the result of the syscall.
+        mem     zigzag varint of (mem_addr - prev_mem_addr) then varint mem_value, only when has_mem
+
+    Encoder and decoder keep identical TraceCodecState, so a loop body usually costs 2-3 bytes
+    per instruction: the flags byte plus a small register delta.
+*/
+struct TraceFormat
+{
+    static constexpr uint32_t magic = 0x52545652; // "RVTR"
+    static constexpr uint32_t version = 2;
+
+    static constexpr uint8_t sequential_pc = 1 << 0;
+    static constexpr uint8_t cached_inst = 1 << 1;
+    static constexpr uint8_t has_rd = 1 << 2;
+    static constexpr uint8_t has_mem = 1 << 3;
+
+    static constexpr size_t inst_cache_size = 4096;
+
+    static uint32_t zigzag_encode(uint32_t value)
+    {
+        return (value << 1) ^ (uint32_t)((int32_t)value >> 31);
+    }
+
+    static uint32_t zigzag_decode(uint32_t value)
+    {
+        return (value >> 1) ^ -(value & 1);
+    }
+
+    static constexpr uint32_t ecall = 0x00000073;
+    static constexpr uint8_t a0 = 10;
+
+    // The register a record's rd_value belongs to
+    static uint8_t rd_of(uint32_t inst)
+    {
+        return inst == ecall ? a0 : (inst >> 7) & 0b11111;
+    }
+};
+
+struct TraceCodecState
+{
+    uint32_t prev_pc = 0;
+    uint32_t prev_mem_addr = 0;
+    uint32_t registers[32] = {};
+    uint32_t inst_cache[TraceFormat::inst_cache_size] = {};
+
+    uint32_t &cached_inst(uint32_t pc)
+    {
+        return inst_cache[(pc >> 2) & (TraceFormat::inst_cache_size - 1)];
+    }
+};
@@ -0,0 +1,121 @@
+#include "trace-reader.hpp"
+#include <cstring>
+#include <stdexcept>
+
+TraceReader::TraceReader(const std::string &file_path) : buffer(buffer_size)
+{
+    file = fopen(file_path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        throw std::invalid_argument("Cannot open trace file " + file_path);
+    }
+
+    uint32_t file_magic = 0;
+    uint32_t file_version = 0;
+    if (fread(&file_magic, sizeof(file_magic), 1, file) != 1 || fread(&file_version, sizeof(file_version), 1, file) != 1 ||
+        file_magic != TraceFormat::magic || file_version != TraceFormat::version)
+    {
+        fclose(file);
+        throw std::invalid_argument("Unsupported trace format in " + file_path);
+    }
+}
+
+TraceReader::~TraceReader()
+{
+    fclose(file);
+}
+
+bool TraceReader::next(TraceRecord &record)
+{
+    if (end - pos < max_record_size && !eof)
+    {
+        refill();
+    }
+
+    if (pos == end)
+    {
+        return false;
+    }
+
+    const uint8_t flags = read_byte();
+
+    record.pc = state.prev_pc + sizeof(uint32_t);
+    if (!(flags & TraceFormat::sequential_pc))
+    {
+        record.pc += TraceFormat::zigzag_decode(read_varint());
+    }
+    state.prev_pc = record.pc;
+
+    uint32_t &cached = state.cached_inst(record.pc);
+    if (!(flags & TraceFormat::cached_inst))
+    {
+        uint32_t inst = 0;
+        for (uint8_t i = 0; i < sizeof(inst); ++i)
+        {
+            inst |= (uint32_t)read_byte() << (i * 8);
+        }
+        cached = inst;
+    }
+    record.inst = cached;
+
+    record.has_rd = flags & TraceFormat::has_rd;
+    record.rd_value = 0;
+    if (record.has_rd)
+    {
+        uint32_t &reg = state.registers[TraceFormat::rd_of(record.inst)];
+        reg += TraceFormat::zigzag_decode(read_varint());
+        record.rd_value = reg;
+    }
+
+    record.has_mem = flags & TraceFormat::has_mem;
+    record.mem_addr = 0;
+    record.mem_value = 0;
+    if (record.has_mem)
+    {
+        state.prev_mem_addr += TraceFormat::zigzag_decode(read_varint());
+        record.mem_addr = state.prev_mem_addr;
+        record.mem_value = read_varint();
+    }
+
+    return true;
+}
+
+void TraceReader::refill()
+{
+    memmove(buffer.data(), buffer.data() + pos, end - pos);
+    end -= pos;
+    pos = 0;
+
+    const size_t read_count = fread(buffer.data() + end, 1, buffer.size() - end, file);
+    end += read_count;
+    if (read_count == 0)
+    {
+        eof = true;
+    }
+}
+
+uint8_t TraceReader::read_byte()
+{
+    if (pos == end)
+    {
+        throw std::runtime_error("Trace is truncated");
+    }
+
+    return buffer[pos++];
+}
+
+uint32_t TraceReader::read_varint()
+{
+    uint32_t value = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7)
+    {
+        const uint8_t byte = read_byte();
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+
+    throw std::runtime_error("Malformed varint in trace");
+}
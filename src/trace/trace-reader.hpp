@@ -0,0 +1,43 @@
+#pragma once
+
+#include "trace-format.hpp"
+#include "trace-record.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*
+    Streaming decoder for traces produced by TraceWriter.
+    Only a fixed size window of the file is kept in memory, so arbitrarily long traces can be consumed.
+*/
+class TraceReader
+{
+  public:
+    TraceReader(const std::string &file_path);
+    ~TraceReader();
+
+    TraceReader(const TraceReader &) = delete;
+    TraceReader &operator=(const TraceReader &) = delete;
+
+    // Returns false once the end of the trace is reached
+    bool next(TraceRecord &record);
+
+  private:
+    void refill();
+
+    uint8_t read_byte();
+
+    uint32_t read_varint();
+
+  private:
+    static constexpr size_t buffer_size = 1 << 16;
+    static constexpr size_t max_record_size = 32;
+
+    FILE *file = nullptr;
+    std::vector<uint8_t> buffer;
+    size_t pos = 0;
+    size_t end = 0;
+    bool eof = false;
+    TraceCodecState state;
+};
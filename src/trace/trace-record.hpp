@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+struct TraceRecord
+{
+    uint32_t pc;
+    uint32_t inst;
+    uint32_t rd_value;
+    uint32_t mem_addr;
+    uint32_t mem_value;
+    bool has_rd;
+    bool has_mem;
+};
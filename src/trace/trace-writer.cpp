@@ -0,0 +1,149 @@
+#include "trace-writer.hpp"
+#include <cstring>
+#include <stdexcept>
+
+TraceWriter::TraceWriter(const std::string &file_path) : ring(ring_capacity)
+{
+    file = fopen(file_path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        throw std::invalid_argument("Cannot open trace file " + file_path);
+    }
+
+    out.reserve(flush_threshold * 2);
+    out.resize(sizeof(TraceFormat::magic) + sizeof(TraceFormat::version));
+    memcpy(out.data(), &TraceFormat::magic, sizeof(TraceFormat::magic));
+    memcpy(out.data() + sizeof(TraceFormat::magic), &TraceFormat::version, sizeof(TraceFormat::version));
+
+    writer_thread = std::thread(&TraceWriter::writer_loop, this);
+}
+
+TraceWriter::~TraceWriter()
+{
+    close();
+}
+
+void TraceWriter::close()
+{
+    if (!writer_thread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        done.store(true, std::memory_order_release);
+    }
+    wake.notify_one();
+    writer_thread.join();
+    flush();
+    fclose(file);
+    file = nullptr;
+}
+
+void TraceWriter::writer_loop()
+{
+    auto consume = [this](const TraceRecord &record) { encode(record); };
+
+    while (true)
+    {
+        // done has to be observed before the final drain, otherwise records pushed in between are lost
+        const bool finishing = done.load(std::memory_order_acquire);
+        const size_t consumed = ring.drain(consume);
+
+        if (out.size() >= flush_threshold)
+        {
+            flush();
+        }
+
+        if (finishing)
+        {
+            ring.drain(consume);
+            return;
+        }
+
+        if (consumed == 0)
+        {
+            wait_for_records();
+        }
+    }
+}
+
+void TraceWriter::wake_writer()
+{
+    {
+        std::lock_guard lock(mutex);
+        writer_idle.store(false, std::memory_order_relaxed);
+    }
+    wake.notify_one();
+}
+
+void TraceWriter::wait_for_records()
+{
+    std::unique_lock lock(mutex);
+    writer_idle.store(true, std::memory_order_relaxed);
+    wake.wait_for(lock, idle_timeout, [this] {
+        return !writer_idle.load(std::memory_order_relaxed) || !ring.empty() || done.load(std::memory_order_acquire);
+    });
+    writer_idle.store(false, std::memory_order_relaxed);
+}
+
+void TraceWriter::encode(const TraceRecord &record)
+{
+    uint8_t flags = 0;
+    const bool sequential = record.pc == state.prev_pc + sizeof(uint32_t);
+    uint32_t &cached = state.cached_inst(record.pc);
+    const bool inst_hit = cached == record.inst;
+    const uint8_t rd = TraceFormat::rd_of(record.inst);
+
+    flags |= sequential ? TraceFormat::sequential_pc : 0;
+    flags |= inst_hit ? TraceFormat::cached_inst : 0;
+    flags |= record.has_rd ? TraceFormat::has_rd : 0;
+    flags |= record.has_mem ? TraceFormat::has_mem : 0;
+    out.push_back(flags);
+
+    if (!sequential)
+    {
+        write_varint(TraceFormat::zigzag_encode(record.pc - state.prev_pc - sizeof(uint32_t)));
+    }
+    state.prev_pc = record.pc;
+
+    if (!inst_hit)
+    {
+        const uint8_t *inst_bytes = (const uint8_t *)&record.inst;
+        out.insert(out.end(), inst_bytes, inst_bytes + sizeof(record.inst));
+        cached = record.inst;
+    }
+
+    if (record.has_rd)
+    {
+        write_varint(TraceFormat::zigzag_encode(record.rd_value - state.registers[rd]));
+        state.registers[rd] = record.rd_value;
+    }
+
+    if (record.has_mem)
+    {
+        write_varint(TraceFormat::zigzag_encode(record.mem_addr - state.prev_mem_addr));
+        write_varint(record.mem_value);
+        state.prev_mem_addr = record.mem_addr;
+    }
+}
+
+void TraceWriter::write_varint(uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+void TraceWriter::flush()
+{
+    if (!out.empty())
+    {
+        fwrite(out.data(), 1, out.size(), file);
+        out.clear();
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ring-buffer.hpp"
+#include "trace-format.hpp"
+#include "trace-record.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    Streams TraceRecords to a file. The emulator thread only pushes into a lock-free ring buffer,
+    encoding and file I/O happen on a dedicated writer thread. The writer sleeps on a condition
+    variable while the ring is empty, and a push only takes the lock when it finds it asleep.
+*/
+class TraceWriter
+{
+  public:
+    TraceWriter(const std::string &file_path);
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    void push(const TraceRecord &record)
+    {
+        while (!ring.try_push(record))
+        {
+            std::this_thread::yield();
+        }
+        if (writer_idle.load(std::memory_order_relaxed))
+        {
+            wake_writer();
+        }
+    }
+
+    // Drains the ring buffer, flushes the file and stops the writer thread
+    void close();
+
+  private:
+    void writer_loop();
+
+    void wake_writer();
+
+    // Sleeps until a push or close wakes the writer
+    void wait_for_records();
+
+    void encode(const TraceRecord &record);
+
+    void write_varint(uint32_t value);
+
+    void flush();
+
+  private:
+    static constexpr size_t ring_capacity = 1 << 16;
+    static constexpr size_t flush_threshold = 1 << 16;
+    // A push racing with the writer going to sleep may miss the flag, this bounds its delay
+    static constexpr std::chrono::milliseconds idle_timeout{10};
+
+    RingBuffer<TraceRecord> ring;
+    FILE *file = nullptr;
+    std::vector<uint8_t> out;
+    TraceCodecState state;
+    std::atomic<bool> done = false;
+    std::atomic<bool> writer_idle = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread writer_thread;
+};
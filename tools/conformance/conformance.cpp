@@ -0,0 +1,423 @@
+#include "riscvemu/machine.hpp"
+#include "encoding.hpp"
+#include "process-conformance.hpp"
+#include "spec-model.hpp"
+#include "vector-conformance.hpp"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+    Conformance harness for the instruction engine.
+
+    conformance fuzz [--seed <n>] [--iterations <n>] [--length <n>] [--block <n>]
+        Generates random RV32I, Zba, Zbb and Zbs instruction sequences, executes each on the naive SpecModel and on
+        every engine configuration of riscvemu::Machine, and compares pc, registers and the data
+        window after every block of instructions.
+
+    conformance elf <executable>...
+        Runs riscv-tests style executables that report success through exit(0).
+
+    conformance processes
+        Runs guests that fork, connect children through pipes, execve and wait for them, see
+        process-conformance.cpp.
+
+    conformance vector [--seed <n>]
+        Compares every SIMD vector kernel table the CPU supports with the portable one, and runs
+        strip mined vector programs on the engines at VLEN 128 and 256.
+*/
+
+static constexpr uint32_t memory_size = 1024 * 1024;
+static constexpr uint32_t code_base = 0x1000;
+static constexpr uint32_t data_base = 0x10000;
+static constexpr uint32_t data_size = 0x1000;
+static constexpr uint8_t data_reg = 31; // holds data_base, never written by generated code
+static constexpr uint8_t syscall_reg = 17;
+
+struct Engine
+{
+    const char *name;
+    riscvemu::MachineConfig config;
+};
+
+static std::vector<Engine> engines()
+{
+    return {
+        Engine{.name = "interpreter", .config = {.memory_size = memory_size, .decode_cache = false, .fusion = false}},
+        Engine{.name = "decode-cache", .config = {.memory_size = memory_size, .decode_cache = true, .fusion = false}},
+        Engine{.name = "fusion", .config = {.memory_size = memory_size, .decode_cache = true, .fusion = true}},
+    };
+}
+
+class ProgramGenerator
+{
+  public:
+    ProgramGenerator(uint64_t seed) : rng(seed) {}
+
+    std::vector<uint32_t> generate(uint32_t length)
+    {
+        std::vector<uint32_t> program;
+        jump_targets.assign(length + 1, false);
+        while (program.size() < length)
+        {
+            const uint32_t remaining = length - program.size();
+            // a jump into the middle of a pair would run its second half without the first one
+            if (remaining >= 2 && random(0, 4) == 0 && !jump_targets[program.size() + 1])
+            {
+                append_idiom(program, remaining);
+            }
+            else
+            {
+                program.push_back(next_instruction(program.size(), remaining));
+            }
+        }
+
+        // exit(a0)
+        program.push_back(encode_i(93, 0, 0b000, syscall_reg, 0x13));
+        program.push_back(0x00000073);
+        return program;
+    }
+
+  private:
+    uint32_t next_instruction(uint32_t index, uint32_t remaining)
+    {
+        const uint32_t rd = pick_rd();
+        const uint32_t rs1 = random(0, 31);
+        const uint32_t rs2 = random(0, 31);
+
+        switch (random(0, 10))
+        {
+            case 0:
+            case 1:
+            {
+                const uint32_t funct3 = random(0, 7);
+                if (funct3 == 0b001)
+                {
+                    return encode_r(0, random(0, 31), rs1, funct3, rd, 0x13);
+                }
+                if (funct3 == 0b101)
+                {
+                    return encode_r(random(0, 1) ? 0x20 : 0, random(0, 31), rs1, funct3, rd, 0x13);
+                }
+                return encode_i(random_imm12(), rs1, funct3, rd, 0x13);
+            }
+            case 2:
+            case 3:
+            {
+                const uint32_t funct3 = random(0, 7);
+                const bool alternate = (funct3 == 0b000 || funct3 == 0b101) && random(0, 1);
+                return encode_r(alternate ? 0x20 : 0, rs2, rs1, funct3, rd, 0x33);
+            }
+            case 4:
+                return (random(0, 0xfffff) << 12) | (rd << 7) | (random(0, 1) ? 0x37 : 0x17);
+            case 5:
+            {
+                static const uint32_t funct3s[] = {0b000, 0b001, 0b010, 0b100, 0b101};
+                return encode_i(random(0, data_size - 4), data_reg, funct3s[random(0, 4)], rd, 0x03);
+            }
+            case 6:
+                return encode_s(random(0, data_size - 4), rs2, data_reg, random(0, 2), 0x23);
+            case 7:
+            case 8:
+            {
+                // forward only, so every program terminates
+                static const uint32_t funct3s[] = {0b000, 0b001, 0b100, 0b101, 0b110, 0b111};
+                const int32_t offset = forward_offset(index, 1, std::min<uint32_t>(remaining, 16));
+                return encode_b(offset, rs2, rs1, funct3s[random(0, 5)]);
+            }
+            case 9:
+            {
+                // Zba, Zbb and Zbs as funct7, funct3, opcode and the rs2 field, any_rs2 where it is a register or shamt
+                static constexpr uint32_t any_rs2 = 32;
+                static const uint32_t ops[][4] = {
+                    {0x10, 0b010, 0x33, any_rs2}, {0x10, 0b100, 0x33, any_rs2}, {0x10, 0b110, 0x33, any_rs2},
+                    {0x20, 0b111, 0x33, any_rs2}, {0x20, 0b110, 0x33, any_rs2}, {0x20, 0b100, 0x33, any_rs2},
+                    {0x05, 0b100, 0x33, any_rs2}, {0x05, 0b101, 0x33, any_rs2}, {0x05, 0b110, 0x33, any_rs2},
+                    {0x05, 0b111, 0x33, any_rs2}, {0x30, 0b001, 0x33, any_rs2}, {0x30, 0b101, 0x33, any_rs2},
+                    {0x04, 0b100, 0x33, 0},       {0x24, 0b001, 0x33, any_rs2}, {0x24, 0b101, 0x33, any_rs2},
+                    {0x34, 0b001, 0x33, any_rs2}, {0x14, 0b001, 0x33, any_rs2}, {0x30, 0b001, 0x13, 0},
+                    {0x30, 0b001, 0x13, 1},       {0x30, 0b001, 0x13, 2},       {0x30, 0b001, 0x13, 4},
+                    {0x30, 0b001, 0x13, 5},       {0x30, 0b101, 0x13, any_rs2}, {0x14, 0b101, 0x13, 7},
+                    {0x34, 0b101, 0x13, 24},      {0x24, 0b001, 0x13, any_rs2}, {0x24, 0b101, 0x13, any_rs2},
+                    {0x34, 0b001, 0x13, any_rs2}, {0x14, 0b001, 0x13, any_rs2},
+                };
+                const uint32_t *op = ops[random(0, std::size(ops) - 1)];
+                return encode_r(op[0], op[3] == any_rs2 ? rs2 : op[3], rs1, op[1], rd, op[2]);
+            }
+            default:
+            {
+                if (random(0, 3) == 0)
+                {
+                    return 0x0ff0000f; // fence
+                }
+                return encode_j(forward_offset(index, 1, std::min<uint32_t>(remaining, 16)), rd);
+            }
+        }
+    }
+
+    // Instruction pairs the decoder fuses into superinstructions
+    void append_idiom(std::vector<uint32_t> &program, uint32_t remaining)
+    {
+        const uint32_t index = program.size();
+        const uint32_t pc = code_base + index * sizeof(uint32_t);
+        const uint32_t rd = std::max<uint32_t>(pick_rd(), 1);
+        const uint32_t rs = random(0, 31);
+
+        switch (random(0, 5))
+        {
+            case 0: // lui + addi
+            case 1: // auipc + addi
+                program.push_back((random(0, 0xfffff) << 12) | (rd << 7) | (random(0, 1) ? 0x37 : 0x17));
+                program.push_back(encode_i(random_imm12(), rd, 0b000, rd, 0x13));
+                break;
+            case 2: // auipc + lw from the data window
+            {
+                const uint32_t target = data_base + random(0, data_size / 4 - 1) * 4;
+                const uint32_t offset = target - pc;
+                const uint32_t hi = (offset + 0x800) & 0xfffff000;
+                program.push_back(hi | (rd << 7) | 0x17);
+                program.push_back(encode_i(offset - hi, rd, 0b010, pick_rd(), 0x03));
+                break;
+            }
+            case 3: // auipc + jalr forward
+            {
+                const int32_t offset = forward_offset(index, 2, remaining);
+                program.push_back((rd << 7) | 0x17);
+                program.push_back(encode_i(offset, rd, 0b000, pick_rd(), 0x67));
+                break;
+            }
+            case 4: // slli + srli
+            {
+                const uint32_t shift = random(0, 31);
+                program.push_back(encode_i(shift, rs, 0b001, rd, 0x13));
+                program.push_back(encode_i(random(0, 1) ? shift : random(0, 31), rd, 0b101, rd, 0x13));
+                break;
+            }
+            default: // addi + branch forward
+            {
+                static const uint32_t funct3s[] = {0b000, 0b001, 0b100, 0b101, 0b110, 0b111};
+                const int32_t offset = forward_offset(index + 1, 1, remaining - 1);
+                const bool swapped = random(0, 1);
+                program.push_back(encode_i(random_imm12(), rs, 0b000, rd, 0x13));
+                program.push_back(encode_b(offset, swapped ? rs : rd, swapped ? rd : rs, funct3s[random(0, 5)]));
+                break;
+            }
+        }
+    }
+
+    // Picks a forward jump of low to high instructions from index and remembers its target
+    int32_t forward_offset(uint32_t index, uint32_t low, uint32_t high)
+    {
+        const uint32_t distance = random(low, std::max(low, high));
+        jump_targets[index + distance] = true;
+        return 4 * distance;
+    }
+
+    uint32_t pick_rd()
+    {
+        const uint32_t rd = random(0, 30);
+        return rd == syscall_reg ? 0 : rd;
+    }
+
+    int32_t random_imm12()
+    {
+        return (int32_t)random(0, 4095) - 2048;
+    }
+
+    uint32_t random(uint32_t low, uint32_t high)
+    {
+        return std::uniform_int_distribution<uint32_t>(low, high)(rng);
+    }
+
+  private:
+    std::mt19937_64 rng;
+    std::vector<bool> jump_targets;
+};
+
+static bool compare(const char *engine, uint64_t seed, uint32_t executed, const SpecModel &spec, riscvemu::Machine &machine)
+{
+    bool equal = spec.pc == machine.get_pc() && spec.exited == machine.has_exited();
+    for (uint8_t i = 0; i < 32; ++i)
+    {
+        equal = equal && spec.regs[i] == machine.get_register(i);
+    }
+
+    std::vector<uint8_t> data(data_size);
+    machine.read_memory(data_base, data);
+    const bool memory_equal = memcmp(data.data(), spec.memory.data() + data_base, data_size) == 0;
+
+    if (equal && memory_equal)
+    {
+        return true;
+    }
+
+    fprintf(stderr, "MISMATCH engine %s seed %" PRIu64 " after %u instructions\n", engine, seed, executed);
+    fprintf(stderr, "  pc spec %08x engine %08x\n", spec.pc, machine.get_pc());
+    for (uint8_t i = 0; i < 32; ++i)
+    {
+        if (spec.regs[i] != machine.get_register(i))
+        {
+            fprintf(stderr, "  x%u spec %08x engine %08x\n", i, spec.regs[i], machine.get_register(i));
+        }
+    }
+    for (uint32_t i = 0; i < data_size; ++i)
+    {
+        if (data[i] != spec.memory[data_base + i])
+        {
+            fprintf(stderr, "  [%08x] spec %02x engine %02x\n", data_base + i, spec.memory[data_base + i], data[i]);
+        }
+    }
+
+    return false;
+}
+
+static bool fuzz_one(uint64_t seed, uint32_t length, uint32_t block)
+{
+    ProgramGenerator generator(seed);
+    const std::vector<uint32_t> program = generator.generate(length);
+
+    std::mt19937_64 rng(seed ^ 0x5bd1e995);
+    uint32_t initial_regs[32] = {};
+    for (uint8_t i = 1; i < 32; ++i)
+    {
+        initial_regs[i] = rng();
+    }
+    initial_regs[data_reg] = data_base;
+
+    std::vector<uint8_t> initial_data(data_size);
+    for (uint8_t &byte : initial_data)
+    {
+        byte = rng();
+    }
+
+    for (const Engine &engine : engines())
+    {
+        SpecModel spec(memory_size);
+        riscvemu::Machine machine(engine.config);
+
+        memcpy(spec.memory.data() + code_base, program.data(), program.size() * sizeof(uint32_t));
+        memcpy(spec.memory.data() + data_base, initial_data.data(), data_size);
+        memcpy(spec.regs, initial_regs, sizeof(initial_regs));
+        spec.pc = code_base;
+
+        machine.write_memory(code_base, std::span((const uint8_t *)program.data(), program.size() * sizeof(uint32_t)));
+        machine.write_memory(data_base, initial_data);
+        for (uint8_t i = 1; i < 32; ++i)
+        {
+            machine.set_register(i, initial_regs[i]);
+        }
+        machine.set_pc(code_base);
+
+        uint32_t executed = 0;
+        while (!spec.exited)
+        {
+            for (uint32_t i = 0; i < block && !spec.exited; ++i)
+            {
+                spec.step();
+                ++executed;
+            }
+            machine.run(block);
+
+            if (!compare(engine.name, seed, executed, spec, machine))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static int fuzz(int argc, char **argv)
+{
+    uint64_t seed = std::random_device()();
+    uint64_t iterations = 10000;
+    uint32_t length = 64;
+    uint32_t block = 8;
+
+    for (int i = 0; i + 1 < argc; i += 2)
+    {
+        const std::string arg = argv[i];
+        const uint64_t value = std::stoull(argv[i + 1]);
+        if (arg == "--seed")
+        {
+            seed = value;
+        }
+        else if (arg == "--iterations")
+        {
+            iterations = value;
+        }
+        else if (arg == "--length")
+        {
+            length = value;
+        }
+        else if (arg == "--block")
+        {
+            block = value;
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    printf("fuzzing with seed %" PRIu64 "\n", seed);
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        if (!fuzz_one(seed + i, length, block))
+        {
+            return 1;
+        }
+    }
+
+    printf("%" PRIu64 " programs passed\n", iterations);
+    return 0;
+}
+
+static int run_elfs(int argc, char **argv)
+{
+    int failures = 0;
+    for (int i = 0; i < argc; ++i)
+    {
+        riscvemu::Machine machine;
+        machine.load_elf(argv[i]);
+        machine.run();
+
+        const bool passed = machine.get_exit_code() == 0;
+        printf("%s %s\n", passed ? "PASS" : "FAIL", argv[i]);
+        failures += !passed;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "fuzz") == 0)
+    {
+        return fuzz(argc - 2, argv + 2);
+    }
+    if (argc >= 3 && strcmp(argv[1], "elf") == 0)
+    {
+        return run_elfs(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "processes") == 0)
+    {
+        return process_conformance(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "vector") == 0)
+    {
+        return vector_conformance(argc - 2, argv + 2);
+    }
+
+    fprintf(stderr, "usage: %s fuzz [--seed <n>] [--iterations <n>] [--length <n>] [--block <n>]\n", argv[0]);
+    fprintf(stderr, "       %s elf <executable>...\n", argv[0]);
+    fprintf(stderr, "       %s processes\n", argv[0]);
+    fprintf(stderr, "       %s vector [--seed <n>]\n", argv[0]);
+    return 1;
+}
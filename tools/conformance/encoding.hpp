@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+// Instruction formats of the base ISA, for programs the conformance tests write into guest memory
+
+inline uint32_t encode_r(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+inline uint32_t encode_i(int32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+    return ((uint32_t)imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+inline uint32_t encode_s(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t opcode)
+{
+    return (((uint32_t)imm >> 5 & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (((uint32_t)imm & 0x1f) << 7) |
+           opcode;
+}
+
+inline uint32_t encode_b(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3)
+{
+    const uint32_t u = imm;
+    return ((u >> 12 & 1) << 31) | ((u >> 5 & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((u >> 1 & 0xf) << 8) |
+           ((u >> 11 & 1) << 7) | 0x63;
+}
+
+inline uint32_t encode_j(int32_t imm, uint32_t rd)
+{
+    const uint32_t u = imm;
+    return ((u >> 20 & 1) << 31) | ((u >> 1 & 0x3ff) << 21) | ((u >> 11 & 1) << 20) | ((u >> 12 & 0xff) << 12) | (rd << 7) |
+           0x6f;
+}
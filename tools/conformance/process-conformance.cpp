@@ -0,0 +1,527 @@
+#include "process-conformance.hpp"
+#include "encoding.hpp"
+#include "riscvemu/scheduler.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+    A parent guest forks the way glibc does, with signals blocked, clone3 tried first and the
+    child tid words, and connects two children through pipe2, dup3 and fcntl. The children execve
+    a writer and a reader from a temporary sysroot: the writer checks that its close on exec fds
+    are gone and writes more than PIPE_BUF in one blocking write, the reader counts bytes up to end
+    of file. The parent collects them with wait4 and waitid, then writes to a pipe without readers
+    once from a child that SIGPIPE kills and once with SIGPIPE ignored. Each failed check exits
+    its guest with its own code. Several parents run at once on a Scheduler.
+*/
+
+static constexpr uint32_t load_address = 0x10000;
+static constexpr uint32_t headers_size = sizeof(Elf32_Ehdr) + sizeof(Elf32_Phdr);
+static constexpr uint32_t segment_size = 0x40000; // code and strings, then scratch words and the buffer
+static constexpr uint32_t scratch = 0x30000;
+static constexpr uint32_t buffer = 0x31000;
+static constexpr uint32_t transfer_size = 100000; // in one write, well beyond PIPE_BUF
+static constexpr uint32_t parents = 8;
+
+struct Reg
+{
+    uint32_t index;
+};
+
+static constexpr Reg zero{0}, t0{5}, t1{6}, s0{8}, a0{10}, s2{18}, s3{19}, s4{20}, s5{21}, s6{22}, s7{23}, s9{25},
+    t6{31};
+
+// A syscall argument, either a register or a constant
+struct Operand
+{
+    Operand(int32_t value) : value(value) {}
+    Operand(uint32_t value) : value(value) {}
+    Operand(Reg reg) : value(reg.index), from_register(true) {}
+
+    int32_t value;
+    bool from_register = false;
+};
+
+class GuestProgram
+{
+  public:
+    void emit(uint32_t instruction)
+    {
+        code.push_back(instruction);
+    }
+
+    void li(Reg rd, int32_t value)
+    {
+        const int32_t low = (int32_t)((uint32_t)value << 20) >> 20;
+        const uint32_t high = (uint32_t)value - (uint32_t)low;
+        if (high != 0)
+        {
+            emit(high | (rd.index << 7) | 0x37);
+            emit(encode_i(low, rd.index, 0b000, rd.index, 0x13));
+        }
+        else
+        {
+            emit(encode_i(low, 0, 0b000, rd.index, 0x13));
+        }
+    }
+
+    // Address of a string placed after the code
+    void la(Reg rd, const std::string &text)
+    {
+        fixups.push_back({code.size(), text, Fixup::Kind::address});
+        strings.try_emplace(text, 0);
+        emit(0x37 | (rd.index << 7));
+        emit(encode_i(0, rd.index, 0b000, rd.index, 0x13));
+    }
+
+    void mv(Reg rd, Reg rs)
+    {
+        emit(encode_i(0, rs.index, 0b000, rd.index, 0x13));
+    }
+
+    void addi(Reg rd, Reg rs, int32_t imm)
+    {
+        emit(encode_i(imm, rs.index, 0b000, rd.index, 0x13));
+    }
+
+    void andi(Reg rd, Reg rs, int32_t imm)
+    {
+        emit(encode_i(imm, rs.index, 0b111, rd.index, 0x13));
+    }
+
+    void add(Reg rd, Reg rs1, Reg rs2)
+    {
+        emit(encode_r(0, rs2.index, rs1.index, 0b000, rd.index, 0x33));
+    }
+
+    void lw(Reg rd, uint32_t addr)
+    {
+        li(t6, addr);
+        emit(encode_i(0, t6.index, 0b010, rd.index, 0x03));
+    }
+
+    void lbu(Reg rd, uint32_t addr)
+    {
+        li(t6, addr);
+        emit(encode_i(0, t6.index, 0b100, rd.index, 0x03));
+    }
+
+    void sw(Reg rs, uint32_t addr)
+    {
+        li(t6, addr);
+        emit(encode_s(0, rs.index, t6.index, 0b010, 0x23));
+    }
+
+    void label(const std::string &name)
+    {
+        labels[name] = code.size();
+    }
+
+    std::string unique_label()
+    {
+        return "l" + std::to_string(next_label++);
+    }
+
+    void branch(uint32_t funct3, Reg rs1, Reg rs2, const std::string &target)
+    {
+        fixups.push_back({code.size(), target, Fixup::Kind::branch});
+        emit(encode_b(0, rs2.index, rs1.index, funct3));
+    }
+
+    void beq(Reg rs1, Reg rs2, const std::string &target)
+    {
+        branch(0b000, rs1, rs2, target);
+    }
+
+    void bne(Reg rs1, Reg rs2, const std::string &target)
+    {
+        branch(0b001, rs1, rs2, target);
+    }
+
+    void blt(Reg rs1, Reg rs2, const std::string &target)
+    {
+        branch(0b100, rs1, rs2, target);
+    }
+
+    void j(const std::string &target)
+    {
+        fixups.push_back({code.size(), target, Fixup::Kind::jump});
+        emit(encode_j(0, 0));
+    }
+
+    // Result in a0
+    void syscall(uint32_t number, std::initializer_list<Operand> args)
+    {
+        uint32_t index = a0.index;
+        for (const Operand &arg : args)
+        {
+            if (arg.from_register)
+            {
+                mv(Reg{index}, Reg{(uint32_t)arg.value});
+            }
+            else
+            {
+                li(Reg{index}, arg.value);
+            }
+            ++index;
+        }
+        li(Reg{17}, number);
+        emit(0x00000073);
+    }
+
+    void exit(uint32_t code)
+    {
+        syscall(93, {code});
+    }
+
+    // Exits with code unless reg holds value
+    void expect(Reg reg, Operand value, uint32_t code)
+    {
+        const std::string passed = unique_label();
+        if (value.from_register)
+        {
+            beq(reg, Reg{(uint32_t)value.value}, passed);
+        }
+        else
+        {
+            li(t6, value.value);
+            beq(reg, t6, passed);
+        }
+        exit(code);
+        label(passed);
+    }
+
+    // An executable with one segment that holds the code, the strings and the scratch area
+    std::vector<uint8_t> elf()
+    {
+        std::vector<uint8_t> data;
+        for (auto &[text, offset] : strings)
+        {
+            offset = code.size() * sizeof(uint32_t) + data.size();
+            data.insert(data.end(), text.begin(), text.end());
+            data.push_back(0);
+        }
+
+        for (const Fixup &fixup : fixups)
+        {
+            uint32_t &instruction = code[fixup.index];
+            switch (fixup.kind)
+            {
+                case Fixup::Kind::branch:
+                    instruction |= encode_b(offset_to(fixup), 0, 0, 0) & ~0x7fu;
+                    break;
+                case Fixup::Kind::jump:
+                    instruction |= encode_j(offset_to(fixup), 0) & ~0x7fu;
+                    break;
+                case Fixup::Kind::address:
+                {
+                    const int32_t addr = load_address + headers_size + strings.at(fixup.target);
+                    const int32_t low = (int32_t)((uint32_t)addr << 20) >> 20;
+                    instruction |= (uint32_t)addr - (uint32_t)low;
+                    code[fixup.index + 1] |= (uint32_t)low << 20;
+                    break;
+                }
+            }
+        }
+
+        const uint32_t file_size = headers_size + code.size() * sizeof(uint32_t) + data.size();
+        Elf32_Ehdr header = {};
+        memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = ELFCLASS32;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_type = ET_EXEC;
+        header.e_machine = EM_RISCV;
+        header.e_version = EV_CURRENT;
+        header.e_entry = load_address + headers_size;
+        header.e_phoff = sizeof(Elf32_Ehdr);
+        header.e_ehsize = sizeof(Elf32_Ehdr);
+        header.e_phentsize = sizeof(Elf32_Phdr);
+        header.e_phnum = 1;
+
+        const Elf32_Phdr segment = {.p_type = PT_LOAD,
+                                    .p_offset = 0,
+                                    .p_vaddr = load_address,
+                                    .p_paddr = load_address,
+                                    .p_filesz = file_size,
+                                    .p_memsz = segment_size,
+                                    .p_flags = PF_R | PF_W | PF_X,
+                                    .p_align = 0x1000};
+
+        std::vector<uint8_t> image(file_size);
+        memcpy(image.data(), &header, sizeof(header));
+        memcpy(image.data() + sizeof(header), &segment, sizeof(segment));
+        memcpy(image.data() + headers_size, code.data(), code.size() * sizeof(uint32_t));
+        memcpy(image.data() + headers_size + code.size() * sizeof(uint32_t), data.data(), data.size());
+        return image;
+    }
+
+  private:
+    struct Fixup
+    {
+        enum class Kind
+        {
+            branch,
+            jump,
+            address // lui and addi
+        };
+
+        size_t index;
+        std::string target;
+        Kind kind;
+    };
+
+    int32_t offset_to(const Fixup &fixup) const
+    {
+        return ((int32_t)labels.at(fixup.target) - (int32_t)fixup.index) * 4;
+    }
+
+    std::vector<uint32_t> code;
+    std::map<std::string, uint32_t> labels;
+    std::map<std::string, uint32_t> strings; // offset after the code
+    std::vector<Fixup> fixups;
+    uint32_t next_label = 0;
+};
+
+// Scratch words of the parent
+static constexpr uint32_t fds = scratch;                 // two pipes of two fds
+static constexpr uint32_t status = scratch + 0x10;       // wait4
+static constexpr uint32_t info = scratch + 0x20;         // waitid, 128 bytes
+static constexpr uint32_t signal_set = scratch + 0xa0;   // blocked set and the old one
+static constexpr uint32_t child_tid = scratch + 0xb0;
+static constexpr uint32_t action = scratch + 0xc0;       // two k_sigaction of 16 bytes
+static constexpr uint32_t clone_args = scratch + 0x100;
+
+static constexpr int32_t ebadf = -9, echild = -10, epipe = -32, enosys = -38;
+
+// fork like glibc: signals blocked around clone3, which fails, and clone with the tid words.
+// Returns the child pid in a0, or 0 in the child, which checks its tid word first.
+static void emit_fork(GuestProgram &program)
+{
+    program.syscall(135, {0, signal_set, signal_set + 8, 8}); // rt_sigprocmask(SIG_BLOCK)
+    program.expect(a0, 0, 70);
+    program.syscall(435, {clone_args, 88});
+    program.expect(a0, enosys, 71);
+    program.syscall(220, {0x01000000 | 0x00200000 | 17, 0, 0, child_tid, 0}); // CHILD_SETTID | CHILD_CLEARTID
+    program.mv(s9, a0);
+    program.blt(a0, zero, "fork failed");
+    const std::string parent = program.unique_label();
+    program.bne(a0, zero, parent);
+    program.syscall(172, {});
+    program.lw(t0, child_tid);
+    program.expect(a0, t0, 72);
+    program.label(parent);
+    program.syscall(135, {2, signal_set + 8, 0, 8}); // rt_sigprocmask(SIG_SETMASK)
+    program.mv(a0, s9);
+}
+
+static std::vector<uint8_t> parent_program()
+{
+    GuestProgram program;
+
+    // s2 and s3 connect writer and reader, s4 and s5 are close on exec
+    program.syscall(59, {fds, 0});
+    program.expect(a0, 0, 1);
+    program.syscall(59, {fds + 8, 02000000});
+    program.expect(a0, 0, 2);
+    program.lw(s2, fds);
+    program.lw(s3, fds + 4);
+    program.lw(s4, fds + 8);
+    program.lw(s5, fds + 12);
+    program.expect(s2, 3, 3);
+    program.expect(s5, 6, 4);
+
+    emit_fork(program);
+    program.beq(a0, zero, "writer");
+    program.mv(s6, a0);
+    emit_fork(program);
+    program.beq(a0, zero, "reader");
+    program.mv(s7, a0);
+    for (Reg fd : {s2, s3, s4, s5})
+    {
+        program.syscall(57, {fd});
+    }
+
+    program.syscall(260, {s6, status, 0});
+    program.expect(a0, s6, 5);
+    program.lw(t0, status);
+    program.expect(t0, 3 << 8, 6);
+
+    program.syscall(95, {1, s7, info, 4}); // waitid(P_PID, WEXITED)
+    program.expect(a0, 0, 7);
+    program.lw(t0, info);
+    program.expect(t0, 17, 8); // SIGCHLD
+    program.lw(t0, info + 8);
+    program.expect(t0, 1, 9); // CLD_EXITED
+    program.lw(t0, info + 12);
+    program.expect(t0, s7, 10);
+    program.lw(t0, info + 20);
+    program.expect(t0, 4, 11);
+
+    program.syscall(260, {-1, 0, 0});
+    program.expect(a0, echild, 12);
+
+    // a pipe without readers, SIGPIPE kills a child that writes to it
+    program.syscall(59, {fds, 0});
+    program.lw(s2, fds);
+    program.lw(s3, fds + 4);
+    program.syscall(57, {s2});
+    emit_fork(program);
+    program.beq(a0, zero, "killed writer");
+    program.mv(s6, a0);
+    program.syscall(260, {s6, status, 0});
+    program.expect(a0, s6, 13);
+    program.lw(t0, status);
+    program.expect(t0, 13, 14);
+
+    // with SIG_IGN the write fails
+    program.li(t0, 1);
+    program.sw(t0, action);
+    program.syscall(134, {13, action, 0, 8}); // rt_sigaction(SIGPIPE)
+    program.expect(a0, 0, 15);
+    program.syscall(64, {s3, buffer, 1});
+    program.expect(a0, epipe, 16);
+    program.syscall(134, {13, 0, action + 16, 8});
+    program.lw(t0, action + 16);
+    program.expect(t0, 1, 17);
+    program.exit(0);
+
+    program.label("writer");
+    program.syscall(24, {s3, 1, 0}); // dup3
+    program.expect(a0, 1, 40);
+    program.syscall(25, {s2, 2, 1}); // fcntl(F_SETFD, FD_CLOEXEC)
+    program.expect(a0, 0, 41);
+    program.syscall(57, {s3});
+    program.la(a0, "/writer");
+    program.syscall(221, {a0, 0, 0});
+    program.exit(42);
+
+    program.label("reader");
+    program.syscall(24, {s2, 0, 0});
+    program.expect(a0, 0, 43);
+    program.syscall(57, {s2});
+    program.syscall(57, {s3});
+    program.la(a0, "/reader");
+    program.syscall(221, {a0, 0, 0});
+    program.exit(44);
+
+    program.label("killed writer");
+    program.syscall(64, {s3, buffer, 1});
+    program.exit(45);
+
+    program.label("fork failed");
+    program.exit(46);
+
+    return program.elf();
+}
+
+// The fds the parent had, bar stdin or stdout, are closed after execve
+static void expect_closed(GuestProgram &program, std::initializer_list<int32_t> closed, uint32_t code)
+{
+    for (int32_t fd : closed)
+    {
+        program.syscall(25, {fd, 1, 0}); // fcntl(F_GETFD)
+        program.expect(a0, ebadf, code);
+    }
+}
+
+static std::vector<uint8_t> writer_program()
+{
+    GuestProgram program;
+    expect_closed(program, {3, 4, 5, 6}, 20);
+
+    // byte i of the stream is i & 0xff
+    program.li(t0, 0);
+    program.li(s2, transfer_size);
+    program.li(t1, buffer);
+    program.label("fill");
+    program.emit(encode_s(0, t0.index, t1.index, 0b000, 0x23));
+    program.addi(t0, t0, 1);
+    program.addi(t1, t1, 1);
+    program.bne(t0, s2, "fill");
+
+    program.syscall(64, {1, buffer, transfer_size});
+    program.expect(a0, transfer_size, 21);
+    program.exit(3);
+    return program.elf();
+}
+
+static std::vector<uint8_t> reader_program()
+{
+    GuestProgram program;
+    expect_closed(program, {3, 4, 5, 6}, 30);
+
+    program.li(s0, 0);
+    program.label("read");
+    program.syscall(63, {0, buffer, 4096});
+    program.beq(a0, zero, "end of file");
+    program.blt(a0, zero, "read failed");
+    program.lbu(t0, buffer); // each chunk continues the stream
+    program.andi(t1, s0, 0xff);
+    program.expect(t0, t1, 31);
+    program.add(s0, s0, a0);
+    program.j("read");
+
+    program.label("read failed");
+    program.exit(32);
+
+    program.label("end of file");
+    program.expect(s0, transfer_size, 33);
+    program.exit(4);
+    return program.elf();
+}
+
+int process_conformance(int argc, char **argv)
+{
+    if (argc != 0)
+    {
+        fprintf(stderr, "unknown option %s\n", argv[0]);
+        return 1;
+    }
+
+    std::string sysroot_template = (std::filesystem::temp_directory_path() / "conformance-XXXXXX").string();
+    if (mkdtemp(sysroot_template.data()) == nullptr)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    const std::filesystem::path sysroot = sysroot_template;
+    for (const auto &[name, image] : {std::pair{"writer", writer_program()}, std::pair{"reader", reader_program()}})
+    {
+        std::ofstream(sysroot / name, std::ios::binary).write((const char *)image.data(), image.size());
+    }
+
+    const std::vector<uint8_t> parent = parent_program();
+    std::atomic<uint32_t> passed = 0;
+    {
+        riscvemu::Scheduler scheduler(2);
+        for (uint32_t i = 0; i < parents; ++i)
+        {
+            riscvemu::Machine machine({.memory_size = 1024 * 1024,
+                                       .stack_size = 64 * 1024,
+                                       .sysroot = sysroot.string(),
+                                       .cooperative = true});
+            machine.load_elf(parent);
+            scheduler.spawn(std::move(machine), [&](riscvemu::Machine &machine, riscvemu::StopReason reason) {
+                if (reason == riscvemu::StopReason::exited && machine.get_exit_code() == 0)
+                {
+                    ++passed;
+                    return;
+                }
+                fprintf(stderr, "FAIL parent exit code %u %s\n", machine.get_exit_code(), machine.get_fault().c_str());
+            });
+        }
+        scheduler.run();
+    }
+    std::filesystem::remove_all(sysroot);
+
+    printf("%u of %u process trees passed\n", passed.load(), parents);
+    return passed == parents ? 0 : 1;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// conformance processes, see conformance.cpp
+int process_conformance(int argc, char **argv);
@@ -0,0 +1,286 @@
+#include "spec-model.hpp"
+#include <stdexcept>
+
+static int32_t sign_extend(uint32_t value, uint32_t bits)
+{
+    const uint32_t shift = 32 - bits;
+    return (int32_t)(value << shift) >> shift;
+}
+
+uint32_t SpecModel::load(uint32_t addr, uint32_t size) const
+{
+    if ((uint64_t)addr + size > memory.size())
+    {
+        throw std::out_of_range("Spec model load out of range");
+    }
+
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        value |= (uint32_t)memory[addr + i] << (8 * i);
+    }
+    return value;
+}
+
+void SpecModel::store(uint32_t addr, uint32_t size, uint32_t value)
+{
+    if ((uint64_t)addr + size > memory.size())
+    {
+        throw std::out_of_range("Spec model store out of range");
+    }
+
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        memory[addr + i] = value >> (8 * i);
+    }
+}
+
+bool SpecModel::step_bitmanip(uint32_t inst, uint32_t a, uint32_t b)
+{
+    const uint32_t opcode = inst & 0x7f;
+    const uint32_t rd = (inst >> 7) & 0x1f;
+    const uint32_t funct3 = (inst >> 12) & 0x7;
+    const uint32_t field = (inst >> 20) & 0x1f;
+    const uint32_t funct7 = inst >> 25;
+    const uint32_t index = (opcode == 0x13 ? field : b) & 0x1f;
+
+    uint32_t result = 0;
+    if (opcode == 0x33 && funct7 == 0x10 && (funct3 == 2 || funct3 == 4 || funct3 == 6))
+    {
+        result = b + a * (1u << (funct3 / 2)); // sh1add, sh2add, sh3add
+    }
+    else if (opcode == 0x33 && funct7 == 0x20 && funct3 == 7)
+    {
+        result = a & ~b; // andn
+    }
+    else if (opcode == 0x33 && funct7 == 0x20 && funct3 == 6)
+    {
+        result = a | ~b; // orn
+    }
+    else if (opcode == 0x33 && funct7 == 0x20 && funct3 == 4)
+    {
+        result = ~(a ^ b); // xnor
+    }
+    else if (opcode == 0x33 && funct7 == 0x05 && funct3 >= 4)
+    {
+        const bool is_signed = funct3 == 4 || funct3 == 6;
+        const bool a_less = is_signed ? (int32_t)a < (int32_t)b : a < b;
+        const bool take_min = funct3 == 4 || funct3 == 5;
+        result = a_less == take_min ? a : b; // min, minu, max, maxu
+    }
+    else if (opcode == 0x33 && funct7 == 0x04 && funct3 == 4 && field == 0)
+    {
+        result = a & 0xffff; // zext.h
+    }
+    else if (funct7 == 0x30 && (funct3 == 5 || (opcode == 0x33 && funct3 == 1)))
+    {
+        // ror, rori, rol one bit at a time
+        result = a;
+        for (uint32_t i = 0; i < index; ++i)
+        {
+            result = funct3 == 5 ? (result >> 1) | (result << 31) : (result << 1) | (result >> 31);
+        }
+    }
+    else if (opcode == 0x13 && funct7 == 0x30 && funct3 == 1 && (field <= 2 || field == 4 || field == 5))
+    {
+        uint32_t leading = 0;
+        uint32_t trailing = 0;
+        uint32_t population = 0;
+        for (int bit = 31; bit >= 0 && !((a >> bit) & 1); --bit)
+        {
+            ++leading;
+        }
+        for (uint32_t bit = 0; bit < 32 && !((a >> bit) & 1); ++bit)
+        {
+            ++trailing;
+        }
+        for (uint32_t bit = 0; bit < 32; ++bit)
+        {
+            population += (a >> bit) & 1;
+        }
+        const uint32_t results[] = {leading, trailing, population, 0, (uint32_t)sign_extend(a, 8),
+                                    (uint32_t)sign_extend(a, 16)};
+        result = results[field];
+    }
+    else if (opcode == 0x13 && funct7 == 0x14 && funct3 == 5 && field == 7)
+    {
+        for (uint32_t byte = 0; byte < 4; ++byte)
+        {
+            if ((a >> (8 * byte)) & 0xff)
+            {
+                result |= 0xffu << (8 * byte); // orc.b
+            }
+        }
+    }
+    else if (opcode == 0x13 && funct7 == 0x34 && funct3 == 5 && field == 24)
+    {
+        for (uint32_t byte = 0; byte < 4; ++byte)
+        {
+            result |= ((a >> (8 * byte)) & 0xff) << (8 * (3 - byte)); // rev8
+        }
+    }
+    else if (funct7 == 0x24 && funct3 == 1)
+    {
+        result = a & ~(1u << index); // bclr, bclri
+    }
+    else if (funct7 == 0x24 && funct3 == 5)
+    {
+        result = (a >> index) & 1; // bext, bexti
+    }
+    else if (funct7 == 0x34 && funct3 == 1)
+    {
+        result = a ^ (1u << index); // binv, binvi
+    }
+    else if (funct7 == 0x14 && funct3 == 1)
+    {
+        result = a | (1u << index); // bset, bseti
+    }
+    else
+    {
+        return false;
+    }
+
+    write_rd(rd, result);
+    return true;
+}
+
+void SpecModel::step()
+{
+    const uint32_t inst = load(pc, 4);
+    const uint32_t opcode = inst & 0x7f;
+    const uint32_t rd = (inst >> 7) & 0x1f;
+    const uint32_t funct3 = (inst >> 12) & 0x7;
+    const uint32_t rs1 = (inst >> 15) & 0x1f;
+    const uint32_t rs2 = (inst >> 20) & 0x1f;
+    const uint32_t funct7 = inst >> 25;
+
+    const int32_t imm_i = sign_extend(inst >> 20, 12);
+    const int32_t imm_s = sign_extend(((inst >> 25) << 5) | ((inst >> 7) & 0x1f), 12);
+    const int32_t imm_b = sign_extend(((inst >> 31) << 12) | (((inst >> 7) & 1) << 11) | (((inst >> 25) & 0x3f) << 5) |
+                                          (((inst >> 8) & 0xf) << 1),
+                                      13);
+    const uint32_t imm_u = inst & 0xfffff000;
+    const int32_t imm_j = sign_extend(((inst >> 31) << 20) | (((inst >> 12) & 0xff) << 12) | (((inst >> 20) & 1) << 11) |
+                                          (((inst >> 21) & 0x3ff) << 1),
+                                      21);
+
+    const uint32_t a = regs[rs1];
+    const uint32_t b = regs[rs2];
+    uint32_t next_pc = pc + 4;
+
+    switch (opcode)
+    {
+        case 0x37: // LUI
+            write_rd(rd, imm_u);
+            break;
+        case 0x17: // AUIPC
+            write_rd(rd, pc + imm_u);
+            break;
+        case 0x6f: // JAL
+            write_rd(rd, pc + 4);
+            next_pc = pc + imm_j;
+            break;
+        case 0x67: // JALR
+            next_pc = (a + imm_i) & ~1u;
+            write_rd(rd, pc + 4);
+            break;
+        case 0x63: // BRANCH
+        {
+            bool taken = false;
+            switch (funct3)
+            {
+                case 0: taken = a == b; break;
+                case 1: taken = a != b; break;
+                case 4: taken = (int32_t)a < (int32_t)b; break;
+                case 5: taken = (int32_t)a >= (int32_t)b; break;
+                case 6: taken = a < b; break;
+                case 7: taken = a >= b; break;
+                default: throw std::invalid_argument("Spec model: illegal branch");
+            }
+            if (taken)
+            {
+                next_pc = pc + imm_b;
+            }
+            break;
+        }
+        case 0x03: // LOAD
+        {
+            const uint32_t addr = a + imm_i;
+            switch (funct3)
+            {
+                case 0: write_rd(rd, sign_extend(load(addr, 1), 8)); break;
+                case 1: write_rd(rd, sign_extend(load(addr, 2), 16)); break;
+                case 2: write_rd(rd, load(addr, 4)); break;
+                case 4: write_rd(rd, load(addr, 1)); break;
+                case 5: write_rd(rd, load(addr, 2)); break;
+                default: throw std::invalid_argument("Spec model: illegal load");
+            }
+            break;
+        }
+        case 0x23: // STORE
+        {
+            const uint32_t addr = a + imm_s;
+            switch (funct3)
+            {
+                case 0: store(addr, 1, b); break;
+                case 1: store(addr, 2, b); break;
+                case 2: store(addr, 4, b); break;
+                default: throw std::invalid_argument("Spec model: illegal store");
+            }
+            break;
+        }
+        case 0x13: // OP-IMM
+        {
+            if (step_bitmanip(inst, a, b))
+            {
+                break;
+            }
+            const uint32_t shamt = (inst >> 20) & 0x1f;
+            switch (funct3)
+            {
+                case 0: write_rd(rd, a + imm_i); break;
+                case 2: write_rd(rd, (int32_t)a < imm_i); break;
+                case 3: write_rd(rd, a < (uint32_t)imm_i); break;
+                case 4: write_rd(rd, a ^ imm_i); break;
+                case 6: write_rd(rd, a | imm_i); break;
+                case 7: write_rd(rd, a & imm_i); break;
+                case 1: write_rd(rd, a << shamt); break;
+                case 5: write_rd(rd, funct7 == 0x20 ? (uint32_t)((int32_t)a >> shamt) : a >> shamt); break;
+            }
+            break;
+        }
+        case 0x33: // OP
+        {
+            if (step_bitmanip(inst, a, b))
+            {
+                break;
+            }
+            const uint32_t shamt = b & 0x1f;
+            switch (funct3)
+            {
+                case 0: write_rd(rd, funct7 == 0x20 ? a - b : a + b); break;
+                case 1: write_rd(rd, a << shamt); break;
+                case 2: write_rd(rd, (int32_t)a < (int32_t)b); break;
+                case 3: write_rd(rd, a < b); break;
+                case 4: write_rd(rd, a ^ b); break;
+                case 5: write_rd(rd, funct7 == 0x20 ? (uint32_t)((int32_t)a >> shamt) : a >> shamt); break;
+                case 6: write_rd(rd, a | b); break;
+                case 7: write_rd(rd, a & b); break;
+            }
+            break;
+        }
+        case 0x0f: // FENCE
+            break;
+        case 0x73: // ECALL, only exit is modelled
+            if (regs[17] != 93)
+            {
+                throw std::invalid_argument("Spec model: unsupported syscall");
+            }
+            exited = true;
+            return;
+        default:
+            throw std::invalid_argument("Spec model: illegal instruction");
+    }
+
+    pc = next_pc;
+}
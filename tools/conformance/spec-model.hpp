@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/*
+    Deliberately naive RV32I model with Zba, Zbb and Zbs written straight from the ISA manuals.
+    It shares no code with the emulator and serves as the oracle for differential testing,
+    speed is irrelevant here.
+*/
+class SpecModel
+{
+  public:
+    SpecModel(uint32_t memory_size) : memory(memory_size, 0) {}
+
+    void step();
+
+    uint32_t regs[32] = {};
+    uint32_t pc = 0;
+    bool exited = false;
+    std::vector<uint8_t> memory;
+
+  private:
+    uint32_t load(uint32_t addr, uint32_t size) const;
+
+    void store(uint32_t addr, uint32_t size, uint32_t value);
+
+    // Executes inst if it is a Zba, Zbb or Zbs instruction, a and b are the rs1 and rs2 values
+    bool step_bitmanip(uint32_t inst, uint32_t a, uint32_t b);
+
+    void write_rd(uint32_t rd, uint32_t value)
+    {
+        if (rd != 0)
+        {
+            regs[rd] = value;
+        }
+    }
+};
@@ -0,0 +1,365 @@
+#include "vector-conformance.hpp"
+#include "../../src/riscv-emulator/vector-kernels.hpp"
+#include "encoding.hpp"
+#include "riscvemu/machine.hpp"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+    Two halves: every SIMD kernel table this CPU supports runs random operands through each
+    operation and element width next to the portable table and must produce the same bytes,
+    then short strip mined guest programs run on the engines at two VLENs and their output is
+    compared with the same computation in C++.
+*/
+
+static constexpr uint32_t memory_size = 1024 * 1024;
+static constexpr uint32_t code_base = 0x1000;
+static constexpr uint32_t src1_base = 0x10000;
+static constexpr uint32_t src2_base = 0x20000;
+static constexpr uint32_t dst_base = 0x30000;
+static constexpr uint32_t guard = 64; // bytes after the last element that no kernel may touch
+
+static constexpr uint32_t counts[] = {0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 257};
+
+// Half the operands are values where the operations have edge cases, the others are random
+static void fill(std::mt19937_64 &rng, std::vector<uint8_t> &bytes, uint32_t sew_bytes)
+{
+    const uint32_t top = 1u << (sew_bytes * 8 - 1);
+    const uint32_t special[] = {0, 1, 2, top - 1, top, top + 1, 0xffffffff, 0xfffffffe, 31, 32};
+    for (uint32_t i = 0; i + sew_bytes <= bytes.size(); i += sew_bytes)
+    {
+        const uint32_t value = rng() % 2 ? special[rng() % std::size(special)] : (uint32_t)rng();
+        memcpy(bytes.data() + i, &value, sew_bytes);
+    }
+}
+
+static bool report(const VectorKernels &kernels, const char *kind, uint32_t op, uint32_t sew_bytes, uint32_t count)
+{
+    fprintf(stderr, "MISMATCH %s %s op %u sew %u count %u\n", kernels.name, kind, op, sew_bytes * 8, count);
+    return false;
+}
+
+static bool test_kernels(const VectorKernels &kernels, std::mt19937_64 &rng)
+{
+    const VectorKernels &reference = VectorKernels::portable();
+
+    for (uint32_t sew_bytes : {1u, 2u, 4u})
+    {
+        for (uint32_t count : counts)
+        {
+            const uint32_t bytes = count * sew_bytes + guard;
+            std::vector<uint8_t> vs2(bytes), vs1(bytes), vd(bytes);
+            fill(rng, vs2, sew_bytes);
+            fill(rng, vs1, sew_bytes);
+            fill(rng, vd, sew_bytes);
+
+            for (uint32_t op = 0; op <= (uint32_t)VectorAlu::nmsub; ++op)
+            {
+                std::vector<uint8_t> expected = vd;
+                std::vector<uint8_t> actual = vd;
+                reference.alu((VectorAlu)op, sew_bytes, expected.data(), vs2.data(), vs1.data(), count);
+                kernels.alu((VectorAlu)op, sew_bytes, actual.data(), vs2.data(), vs1.data(), count);
+                if (expected != actual)
+                {
+                    return report(kernels, "alu", op, sew_bytes, count);
+                }
+            }
+
+            for (uint32_t op = 0; op <= (uint32_t)VectorCompare::gt; ++op)
+            {
+                std::vector<uint8_t> expected(count / 8 + 1 + guard);
+                std::vector<uint8_t> actual(expected.size());
+                reference.compare((VectorCompare)op, sew_bytes, expected.data(), vs2.data(), vs1.data(), count);
+                kernels.compare((VectorCompare)op, sew_bytes, actual.data(), vs2.data(), vs1.data(), count);
+
+                // bits past count in the last byte are unspecified
+                bool equal = memcmp(expected.data(), actual.data(), count / 8) == 0;
+                const uint8_t tail = (1u << (count % 8)) - 1;
+                equal = equal && (expected[count / 8] & tail) == (actual[count / 8] & tail);
+                equal = equal && std::equal(expected.begin() + count / 8 + 1, expected.end(),
+                                            actual.begin() + count / 8 + 1);
+                if (!equal)
+                {
+                    return report(kernels, "compare", op, sew_bytes, count);
+                }
+            }
+
+            for (uint32_t op = 0; op <= (uint32_t)VectorReduction::max; ++op)
+            {
+                const uint32_t mask = sew_bytes == 4 ? 0xffffffff : (1u << (sew_bytes * 8)) - 1;
+                const uint32_t accumulator = rng() & mask;
+                const uint32_t expected = reference.reduce((VectorReduction)op, sew_bytes, vs2.data(), count, accumulator);
+                const uint32_t actual = kernels.reduce((VectorReduction)op, sew_bytes, vs2.data(), count, accumulator);
+                if ((expected & mask) != (actual & mask))
+                {
+                    return report(kernels, "reduce", op, sew_bytes, count);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// Vector instruction formats, vm = 1 is unmasked
+static uint32_t encode_vsetvli(uint32_t vtype, uint32_t rs1, uint32_t rd)
+{
+    return (vtype << 20) | (rs1 << 15) | (0b111 << 12) | (rd << 7) | 0x57;
+}
+
+static uint32_t encode_v(uint32_t funct6, uint32_t vm, uint32_t vs2, uint32_t vs1, uint32_t funct3, uint32_t vd)
+{
+    return (funct6 << 26) | (vm << 25) | (vs2 << 20) | (vs1 << 15) | (funct3 << 12) | (vd << 7) | 0x57;
+}
+
+// Unit stride, width 0 for 8-bit, 5 for 16-bit and 6 for 32-bit elements
+static uint32_t encode_vle(uint32_t width, uint32_t rs1, uint32_t vd)
+{
+    return (1 << 25) | (rs1 << 15) | (width << 12) | (vd << 7) | 0x07;
+}
+
+static uint32_t encode_vse(uint32_t width, uint32_t rs1, uint32_t vs3)
+{
+    return (1 << 25) | (rs1 << 15) | (width << 12) | (vs3 << 7) | 0x27;
+}
+
+static constexpr uint32_t opivv = 0b000, opmvv = 0b010, opivx = 0b100, opmvx = 0b110;
+static constexpr uint32_t a0 = 10, a1 = 11, a2 = 12, a3 = 13, t0 = 5, t1 = 6, t2 = 7, t3 = 28, t4 = 29;
+
+static uint32_t add(uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    return encode_r(0, rs2, rs1, 0b000, rd, 0x33);
+}
+
+static uint32_t sub(uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    return encode_r(0b0100000, rs2, rs1, 0b000, rd, 0x33);
+}
+
+static uint32_t addi(uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    return encode_i(imm, rs1, 0b000, rd, 0x13);
+}
+
+static uint32_t sw(uint32_t rs2, uint32_t rs1, int32_t imm)
+{
+    return encode_s(imm, rs2, rs1, 0b010, 0x23);
+}
+
+struct GuestCase
+{
+    const char *name;
+    std::vector<uint32_t> code; // runs with a0 = elements, a1 and a2 sources, a3 the destination
+    uint32_t elements;
+    uint32_t sew_bytes;
+    uint32_t output_bytes;
+    std::function<std::vector<uint8_t>(const std::vector<uint8_t> &src1, const std::vector<uint8_t> &src2,
+                                       uint32_t vlen)>
+        expected;
+};
+
+// Appends the loop tail shared by the strip mined cases: count down a0 and branch back to loop_start
+static void close_loop(std::vector<uint32_t> &code, size_t loop_start)
+{
+    code.push_back(sub(a0, a0, t0));
+    code.push_back(encode_b(((int32_t)loop_start - (int32_t)code.size()) * 4, 0, a0, 0b001));
+}
+
+static void exit_guest(std::vector<uint32_t> &code)
+{
+    code.push_back(addi(17, 0, 93));
+    code.push_back(0x00000073);
+}
+
+static std::vector<GuestCase> guest_cases()
+{
+    std::vector<GuestCase> cases;
+
+    // vadd.vv over e32 with LMUL 2
+    {
+        std::vector<uint32_t> code;
+        const size_t loop = code.size();
+        code.push_back(encode_vsetvli(0b010 << 3 | 0b001, a0, t0));
+        code.push_back(encode_vle(6, a1, 2));
+        code.push_back(encode_vle(6, a2, 4));
+        code.push_back(encode_v(0b000000, 1, 2, 4, opivv, 6));
+        code.push_back(encode_vse(6, a3, 6));
+        code.push_back(encode_i(2, t0, 0b001, t1, 0x13)); // slli t1, t0, 2
+        code.push_back(add(a1, a1, t1));
+        code.push_back(add(a2, a2, t1));
+        code.push_back(add(a3, a3, t1));
+        close_loop(code, loop);
+        exit_guest(code);
+        cases.push_back({"vadd.vv e32 m2", code, 37, 4, 37 * 4, [](auto &src1, auto &src2, uint32_t) {
+                             std::vector<uint8_t> out(37 * 4);
+                             for (uint32_t i = 0; i < 37; ++i)
+                             {
+                                 store_element<uint32_t>(out.data(), i, load_element<uint32_t>(src1.data(), i) +
+                                                                            load_element<uint32_t>(src2.data(), i));
+                             }
+                             return out;
+                         }});
+    }
+
+    // vmsltu.vx into v0, then vadd.vx masked by it over e8
+    {
+        std::vector<uint32_t> code;
+        code.push_back(addi(t2, 0, 128));
+        code.push_back(addi(t3, 0, 1));
+        const size_t loop = code.size();
+        code.push_back(encode_vsetvli(0b000 << 3 | 0b000, a0, t0));
+        code.push_back(encode_vle(0, a1, 1));
+        code.push_back(encode_v(0b011010, 1, 1, t2, opivx, 0));
+        code.push_back(encode_v(0b000000, 0, 1, t3, opivx, 1));
+        code.push_back(encode_vse(0, a3, 1));
+        code.push_back(add(a1, a1, t0));
+        code.push_back(add(a3, a3, t0));
+        close_loop(code, loop);
+        exit_guest(code);
+        cases.push_back({"masked vadd.vx e8", code, 50, 1, 50, [](auto &src1, auto &, uint32_t) {
+                             std::vector<uint8_t> out(50);
+                             for (uint32_t i = 0; i < 50; ++i)
+                             {
+                                 out[i] = src1[i] < 128 ? src1[i] + 1 : src1[i];
+                             }
+                             return out;
+                         }});
+    }
+
+    // vmul.vx and vredsum.vs over e16 with LMUL 4, the sum carried in v8 element 0
+    {
+        std::vector<uint32_t> code;
+        code.push_back(addi(t3, 0, 3));
+        code.push_back(encode_vsetvli(0b001 << 3 | 0b000, a0, t0));
+        code.push_back(encode_v(0b010000, 1, 0, 0, opmvx, 8)); // vmv.s.x v8, zero
+        const size_t loop = code.size();
+        code.push_back(encode_vsetvli(0b001 << 3 | 0b010, a0, t0));
+        code.push_back(encode_vle(5, a1, 4));
+        code.push_back(encode_v(0b100101, 1, 4, t3, opmvx, 4));
+        code.push_back(encode_v(0b000000, 1, 4, 8, opmvv, 8));
+        code.push_back(encode_i(1, t0, 0b001, t1, 0x13)); // slli t1, t0, 1
+        code.push_back(add(a1, a1, t1));
+        close_loop(code, loop);
+        code.push_back(encode_v(0b010000, 1, 8, 0, opmvv, t4)); // vmv.x.s t4, v8
+        code.push_back(sw(t4, a3, 0));
+        exit_guest(code);
+        cases.push_back({"vredsum.vs e16 m4", code, 29, 2, 4, [](auto &src1, auto &, uint32_t) {
+                             uint16_t sum = 0;
+                             for (uint32_t i = 0; i < 29; ++i)
+                             {
+                                 sum += load_element<uint16_t>(src1.data(), i) * 3;
+                             }
+                             std::vector<uint8_t> out(4);
+                             store_element<uint32_t>(out.data(), 0, (uint32_t)(int32_t)(int16_t)sum);
+                             return out;
+                         }});
+    }
+
+    // vlenb and the vl vsetvli grants for an oversized request at several SEW and LMUL
+    {
+        std::vector<uint32_t> code;
+        code.push_back(encode_i(0xc22, 0, 0b010, t4, 0x73)); // csrr t4, vlenb
+        code.push_back(sw(t4, a3, 0));
+        code.push_back(addi(a0, 0, 1000));
+        code.push_back(encode_vsetvli(0b000 << 3 | 0b000, a0, t0));
+        code.push_back(sw(t0, a3, 4));
+        code.push_back(encode_vsetvli(0b010 << 3 | 0b011, a0, t0));
+        code.push_back(sw(t0, a3, 8));
+        code.push_back(encode_vsetvli(0b001 << 3 | 0b111, a0, t0));
+        code.push_back(sw(t0, a3, 12));
+        exit_guest(code);
+        cases.push_back({"vsetvli vlmax", code, 0, 1, 16, [](auto &, auto &, uint32_t vlen) {
+                             std::vector<uint8_t> out(16);
+                             store_element<uint32_t>(out.data(), 0, vlen / 8);
+                             store_element<uint32_t>(out.data(), 1, vlen / 8);
+                             store_element<uint32_t>(out.data(), 2, vlen / 32 * 8);
+                             store_element<uint32_t>(out.data(), 3, vlen / 16 / 2);
+                             return out;
+                         }});
+    }
+
+    return cases;
+}
+
+static bool run_guest_case(const GuestCase &test, std::mt19937_64 &rng)
+{
+    std::vector<uint8_t> src1(test.elements * test.sew_bytes), src2(src1.size());
+    fill(rng, src1, test.sew_bytes);
+    fill(rng, src2, test.sew_bytes);
+
+    for (uint32_t vlen : {128u, 256u})
+    {
+        const std::vector<uint8_t> expected = test.expected(src1, src2, vlen);
+        for (bool decode_cache : {false, true})
+        {
+            riscvemu::Machine machine(
+                {.memory_size = memory_size, .decode_cache = decode_cache, .fusion = decode_cache, .vlen = vlen});
+            machine.write_memory(code_base,
+                                 std::span((const uint8_t *)test.code.data(), test.code.size() * sizeof(uint32_t)));
+            machine.write_memory(src1_base, src1);
+            machine.write_memory(src2_base, src2);
+            machine.set_register(a0, test.elements);
+            machine.set_register(a1, src1_base);
+            machine.set_register(a2, src2_base);
+            machine.set_register(a3, dst_base);
+            machine.set_pc(code_base);
+
+            const riscvemu::StopReason reason = machine.run(1000000);
+            std::vector<uint8_t> actual(test.output_bytes);
+            machine.read_memory(dst_base, actual);
+            if (reason != riscvemu::StopReason::exited || actual != expected)
+            {
+                fprintf(stderr, "MISMATCH %s vlen %u %s %s\n", test.name, vlen,
+                        decode_cache ? "decode-cache" : "interpreter", machine.get_fault().c_str());
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+int vector_conformance(int argc, char **argv)
+{
+    uint64_t seed = std::random_device()();
+    if (argc == 2 && strcmp(argv[0], "--seed") == 0)
+    {
+        seed = std::stoull(argv[1]);
+    }
+    else if (argc != 0)
+    {
+        fprintf(stderr, "unknown option %s\n", argv[0]);
+        return 1;
+    }
+
+    printf("testing vector kernels with seed %" PRIu64 "\n", seed);
+    std::mt19937_64 rng(seed);
+    for (const VectorKernels *kernels : VectorKernels::supported())
+    {
+        if (kernels == &VectorKernels::portable())
+        {
+            continue;
+        }
+        if (!test_kernels(*kernels, rng))
+        {
+            return 1;
+        }
+        printf("%s kernels match portable\n", kernels->name);
+    }
+
+    for (const GuestCase &test : guest_cases())
+    {
+        if (!run_guest_case(test, rng))
+        {
+            return 1;
+        }
+        printf("%s passed\n", test.name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// conformance vector, see conformance.cpp
+int vector_conformance(int argc, char **argv);
@@ -0,0 +1,32 @@
+#include "trace-reader.hpp"
+#include <cinttypes>
+#include <cstdio>
+
+// Converts a binary execution trace into one text line per instruction
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+
+    TraceReader reader(argv[1]);
+    TraceRecord record;
+
+    while (reader.next(record))
+    {
+        printf("%08" PRIx32 " %08" PRIx32, record.pc, record.inst);
+        if (record.has_rd)
+        {
+            printf(" x%u=%08" PRIx32, TraceFormat::rd_of(record.inst), record.rd_value);
+        }
+        if (record.has_mem)
+        {
+            printf(" [%08" PRIx32 "]=%08" PRIx32, record.mem_addr, record.mem_value);
+        }
+        putchar('\n');
+    }
+
+    return 0;
+}